@@ -0,0 +1,188 @@
+// alloc_bench.c: heap allocations on the server's request path. Each kind of
+// request is unmarshalled, dispatched and its reply marshalled in a loop, the
+// way a server handles it. Needs no servers. The build wraps malloc() and its
+// relatives at link time (-Wl,--wrap), so every call made by the rpc_core
+// objects is counted. Prints, per request, those calls, the allocations served
+// by the request arena and the slabs instead (mem_pool.h), and the time taken.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rpc_core/rpc_protocol.h"
+#include "rpc_core/rpc_dispatch.h"
+#include "rpc_core/vector_ops.h"
+#include "rpc_core/expr_eval.h"
+#include "rpc_core/mem_pool.h"
+
+#define BENCH_MIN_SECONDS 0.2 // Each request kind repeats until it has run this long
+#define BENCH_REQUEST_STATE 65000 // A UDP threads server's per-datagram state, request included
+
+static unsigned long heap_calls;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* p, size_t size);
+void* __real_aligned_alloc(size_t alignment, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* p, size_t size) {
+    __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+    return __real_realloc(p, size);
+}
+
+void* __wrap_aligned_alloc(size_t alignment, size_t size) {
+    __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+    return __real_aligned_alloc(alignment, size);
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    unsigned long heap_calls;
+    MemPoolStats pool;
+} Counts;
+
+static Counts counts_now(void) {
+    Counts c = { __atomic_load_n(&heap_calls, __ATOMIC_RELAXED), mem_pool_stats() };
+    return c;
+}
+
+static void print_row(const char* name, const Counts* before, int rounds, double elapsed) {
+    Counts after = counts_now();
+    printf("%-14s %10.2f %10.2f %10.2f %10.0f\n", name, (double)(after.heap_calls - before->heap_calls) / rounds,
+           (double)(after.pool.arena_allocs - before->pool.arena_allocs) / rounds,
+           (double)(after.pool.slab_allocs - before->pool.slab_allocs) / rounds, elapsed / rounds * 1e9);
+}
+
+// One request as a server handles it, from its bytes to the bytes of its reply
+static int handle(const char* request, char* reply) {
+    RpcRequest req;
+    RpcResponse resp;
+    if (unmarshal_request(request, &req) != 0) return -1;
+    strcpy(resp.server_type, "alloc_bench");
+    dispatch_request(&req, &resp);
+    return marshal_response(&resp, reply, RPC_BUFFER_SIZE);
+}
+
+static void bench_request(const char* name, RpcRequest* req) {
+    size_t size = rpc_request_size(req->operation, req->vec_len);
+    char* request = malloc(size);
+    char reply[RPC_BUFFER_SIZE];
+    if (!request || marshal_request(req, request, size) != 0 || handle(request, reply) != 0) {
+        fprintf(stderr, "%s: request failed\n", name);
+        exit(EXIT_FAILURE);
+    }
+    // The first round above grew the arena; what is counted is the steady state
+    Counts before = counts_now();
+    int rounds = 0;
+    double start = now_s(), elapsed;
+    do {
+        handle(request, reply);
+        rounds++;
+    } while ((elapsed = now_s() - start) < BENCH_MIN_SECONDS);
+    print_row(name, &before, rounds, elapsed);
+    free(request);
+}
+
+static void bench_arrays(const char* name, OperationType op, OperationType batch_op, size_t n, int codec) {
+    double* x = malloc(n * sizeof(double));
+    double* y = malloc(n * sizeof(double));
+    if (!x || !y) {
+        fprintf(stderr, "Out of memory for %zu values\n", n);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < n; i++) {
+        x[i] = (double)(i % 100);
+        y[i] = (double)(i % 7 + 1);
+    }
+    RpcRequest req = {0};
+    req.operation = op;
+    req.batch_op = batch_op;
+    req.vec = x;
+    req.vec2 = y;
+    req.vec_len = n;
+    req.vec_codec = codec;
+    bench_request(name, &req);
+    free(x);
+    free(y);
+}
+
+// The per-datagram state of the UDP threads server, taken and given back
+static void bench_request_state(void) {
+    Slab* slab = slab_create(BENCH_REQUEST_STATE);
+    if (!slab) {
+        perror("Failed to create slab");
+        exit(EXIT_FAILURE);
+    }
+    slab_free(slab_alloc(slab));
+    Counts before = counts_now();
+    int rounds = 0;
+    double start = now_s(), elapsed;
+    do {
+        char* state = slab_alloc(slab);
+        state[0] = '\0';
+        slab_free(state);
+        rounds++;
+    } while ((elapsed = now_s() - start) < BENCH_MIN_SECONDS);
+    print_row("request_state", &before, rounds, elapsed);
+}
+
+int main(int argc, char* argv[]) {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--threads N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    dispatch_init();
+    vector_ops_set_threads(threads); // Large reductions run on the task pool, as in the servers
+
+    printf("Per request, after the first; reductions may use %d threads\n", threads);
+    printf("%-14s %10s %10s %10s %10s\n", "request", "mallocs", "arena", "slab", "ns");
+
+    RpcRequest req = {0};
+    req.operation = OP_ADD;
+    req.op1 = 3;
+    req.op2 = 4;
+    bench_request("add", &req);
+    req.operation = OP_DIVIDE;
+    req.op2 = 0;
+    bench_request("div_by_zero", &req);
+
+    const char* expression = "((a+b)*c)/d";
+    memset(&req, 0, sizeof(req));
+    req.operation = OP_EXPR;
+    req.expr_hash = expr_hash(expression);
+    strcpy(req.expr_text, expression);
+    strcpy(req.expr_bindings, "a=1,b=2,c=3,d=4");
+    bench_request("expr", &req);
+
+    bench_arrays("sum_1k", OP_SUM, OP_ADD, 1000, RPC_VEC_RAW);
+    bench_arrays("dot_1k", OP_DOT, OP_ADD, 1000, RPC_VEC_RAW);
+    bench_arrays("sum_1k_xor", OP_SUM, OP_ADD, 1000, RPC_VEC_XOR);
+    bench_arrays("dot_1k_xor", OP_DOT, OP_ADD, 1000, RPC_VEC_XOR);
+    bench_arrays("sum_100k", OP_SUM, OP_ADD, 100000, RPC_VEC_RAW);
+    bench_arrays("batch_64", OP_BATCH, OP_MULTIPLY, RPC_BATCH_MAX_CALLS, RPC_VEC_RAW);
+    bench_request_state();
+    return 0;
+}
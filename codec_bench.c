@@ -0,0 +1,174 @@
+// codec_bench.c: size and speed of the XOR/delta array compression
+// (rpc_core/float_codec.h) on generated data shaped like real payloads.
+// Needs no servers. For each data set it prints the compressed bytes per value,
+// the bytes per value an array costs on the wire in a request (base64 text,
+// raw "VEC" versus compressed "VECZ"), and the encode and decode cost.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "rpc_core/float_codec.h"
+#include "rpc_core/rpc_protocol.h"
+
+#define BENCH_DEFAULT_VALUES 1000000
+#define BENCH_MIN_SECONDS 0.2 // Each timing repeats until it has run this long
+
+typedef void (*Generator)(double* v, size_t n);
+
+// Temperature-like readings: a random walk reported to two decimal places
+static void gen_sensor(double* v, size_t n) {
+    double x = 21.5;
+    for (size_t i = 0; i < n; i++) {
+        x += (rand() % 7 - 3) * 0.01;
+        v[i] = round(x * 100) / 100;
+    }
+}
+
+// A computed signal at full precision, such as a smoothed load average
+static void gen_smooth(double* v, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        v[i] = 50 + 20 * sin(i * 0.001) + (rand() % 1000) * 1e-6;
+    }
+}
+
+// A byte counter sampled at intervals, growing by uneven amounts
+static void gen_counter(double* v, size_t n) {
+    double x = 1e9;
+    for (size_t i = 0; i < n; i++) {
+        x += 1400 + rand() % 200;
+        v[i] = x;
+    }
+}
+
+// Unix timestamps of a 10 s scrape interval, with an occasional late sample
+static void gen_timestamps(double* v, size_t n) {
+    double t = 1.7e9;
+    for (size_t i = 0; i < n; i++) {
+        t += rand() % 100 == 0 ? 11 : 10;
+        v[i] = t;
+    }
+}
+
+// A gauge that mostly holds still, such as a configured limit or a queue at rest
+static void gen_gauge(double* v, size_t n) {
+    double x = 64;
+    for (size_t i = 0; i < n; i++) {
+        if (rand() % 500 == 0) x = 16 * (1 + rand() % 8);
+        v[i] = x;
+    }
+}
+
+// Uniform noise, the worst case: nothing to compress
+static void gen_random(double* v, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        v[i] = (double)rand() / RAND_MAX * 2000 - 1000;
+    }
+}
+
+typedef struct {
+    const char* name;
+    Generator generate;
+} DataSet;
+
+static const DataSet data_sets[] = {
+    {"sensor_2dp", gen_sensor},
+    {"smooth", gen_smooth},
+    {"counter", gen_counter},
+    {"timestamps", gen_timestamps},
+    {"gauge", gen_gauge},
+    {"random", gen_random},
+};
+static const int num_data_sets = sizeof(data_sets) / sizeof(data_sets[0]);
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Bytes of the request that carries v, marshalled with the given encoding
+static size_t wire_bytes(const double* v, size_t n, int codec) {
+    RpcRequest req = {0};
+    req.operation = OP_SUM;
+    req.vec = v;
+    req.vec_len = n;
+    req.vec_codec = codec;
+    size_t size = rpc_request_size(OP_SUM, n);
+    char* buffer = malloc(size);
+    size_t len = buffer && marshal_request(&req, buffer, size) == 0 ? strlen(buffer) : 0;
+    free(buffer);
+    return len;
+}
+
+static void bench_data_set(const DataSet* ds, size_t n) {
+    double* values = malloc(n * sizeof(double));
+    double* decoded = malloc(n * sizeof(double));
+    unsigned char* packed = malloc(float_codec_bound(n));
+    if (!values || !decoded || !packed) {
+        fprintf(stderr, "Out of memory for %zu values\n", n);
+        exit(EXIT_FAILURE);
+    }
+    srand(42);
+    ds->generate(values, n);
+
+    size_t bytes = 0;
+    int rounds = 0;
+    double start = now_s(), elapsed;
+    do {
+        bytes = float_codec_encode(values, n, packed);
+        rounds++;
+    } while ((elapsed = now_s() - start) < BENCH_MIN_SECONDS);
+    double encode_ns = elapsed / rounds / n * 1e9;
+
+    rounds = 0;
+    start = now_s();
+    do {
+        if (float_codec_decode(packed, bytes, decoded, n) != 0) {
+            fprintf(stderr, "%s: decode failed\n", ds->name);
+            exit(EXIT_FAILURE);
+        }
+        rounds++;
+    } while ((elapsed = now_s() - start) < BENCH_MIN_SECONDS);
+    double decode_ns = elapsed / rounds / n * 1e9;
+
+    if (memcmp(values, decoded, n * sizeof(double)) != 0) {
+        fprintf(stderr, "%s: decoded values differ\n", ds->name);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-12s %9.2f %7.1fx %9.2f %9.2f %9.2f %9.2f %9.0f\n", ds->name, (double)bytes / n,
+           n * sizeof(double) / (double)bytes, (double)wire_bytes(values, n, RPC_VEC_RAW) / n,
+           (double)wire_bytes(values, n, RPC_VEC_XOR) / n, encode_ns, decode_ns,
+           sizeof(double) / decode_ns * 1e3);
+    free(values);
+    free(decoded);
+    free(packed);
+}
+
+int main(int argc, char* argv[]) {
+    size_t n = BENCH_DEFAULT_VALUES;
+    const char* only = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--values") == 0 && i + 1 < argc) {
+            n = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--data") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--values N] [--data NAME]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n == 0) n = BENCH_DEFAULT_VALUES;
+
+    printf("%zu values per data set; raw doubles are 8 bytes per value\n", n);
+    printf("%-12s %9s %8s %9s %9s %9s %9s %9s\n", "data", "bytes/val", "ratio", "wire_raw", "wire_xor",
+           "enc_ns", "dec_ns", "dec_MB/s");
+    for (int i = 0; i < num_data_sets; i++) {
+        if (only && strcmp(only, data_sets[i].name) != 0) continue;
+        bench_data_set(&data_sets[i], n);
+    }
+    return 0;
+}
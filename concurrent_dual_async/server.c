@@ -0,0 +1,292 @@
+// concurrent_dual_async/server.c
+// TCP and UDP on the same port, served by one coroutine scheduler
+// (rpc_core/coroutine.h) per core. Every loop waits on the same listening and
+// datagram sockets, so whichever loop is idle takes the next connection or
+// datagram. Connections are handled by the coroutine server's handler
+// (rpc_core/coro_connection.h) and datagrams like the async UDP server's,
+// through the same dispatch and admission code.
+// Clients using RPC_PROTO_AUTO (client_stubs.h) send small requests over UDP
+// and large ones over TCP.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // For intptr_t
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h> // For the descriptor limit
+#include <netinet/in.h>
+
+#include "rpc_protocol.h" // Headers from root (using -I../)
+#include "rpc_dispatch.h" // Headers from root (using -I../)
+#include "vector_ops.h"
+#include "response_cache.h"
+#include "coroutine.h"
+#include "coro_connection.h"
+#include "unix_socket.h"
+#include "admission.h"
+#include "hot_restart.h"
+#include "socket_profile.h"
+#include "cpu_affinity.h"
+#include "server_main.h"
+
+#define PORT 9010
+#define BUF_SIZE RPC_BUFFER_SIZE
+#define REQUEST_BUF_SIZE RPC_MAX_DATAGRAM_SIZE // Datagram requests may carry operand arrays
+#define SERVER_TYPE "concurrent_dual_async"
+#define MAX_LOOPS 64
+
+// Handed over in this order on a hot restart; the Unix socket is optional
+enum { TCP_SOCKET, UDP_SOCKET, UNIX_SOCKET, NUM_SOCKETS };
+
+static Admission admission; // Caps the open connections, across all loops
+static __thread Admission codel; // Each loop sheds by how long its own requests queued
+static ResponseCache* response_cache; // Replies to datagrams, for retransmissions
+static int sockets[NUM_SOCKETS];
+static int socket_count;
+static int handed_over; // Set once a successor has the sockets, read by every loop
+
+static int socket_type(int fd) {
+    int type = -1;
+    socklen_t len = sizeof(type);
+    return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 ? type : -1;
+}
+
+static int stopping(void) {
+    return __atomic_load_n(&handed_over, __ATOMIC_ACQUIRE);
+}
+
+// One per loop; answers datagrams one at a time, parking while none is queued
+static void serve_datagrams(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    char* request_buf = malloc(REQUEST_BUF_SIZE); // Too large for a coroutine stack
+    char response_buf[BUF_SIZE];
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len;
+    RpcRequest req;
+    RpcResponse resp;
+
+    if (!request_buf) {
+        perror("Failed to allocate datagram buffer");
+        return;
+    }
+    while (!stopping()) {
+        client_addr_len = sizeof(client_addr);
+        long long arrival_us;
+        ssize_t bytes_received = rpc_recv_stamped(fd, request_buf, REQUEST_BUF_SIZE - 1, MSG_DONTWAIT,
+                                                  (struct sockaddr *)&client_addr, &client_addr_len, &arrival_us);
+        if (bytes_received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                coro_wait_fd(fd, POLLIN);
+            } else if (errno != EINTR) {
+                perror("recvfrom error");
+            }
+            continue;
+        }
+        request_buf[bytes_received] = '\0';
+        if (admission_codel_shed(&codel, arrival_us)) {
+            // Not cached: a retransmission may find the queue shorter
+            rpc_send_busy(fd, request_buf, (size_t)bytes_received, SERVER_TYPE,
+                          (struct sockaddr *)&client_addr, client_addr_len);
+            continue;
+        }
+
+        strcpy(resp.server_type, SERVER_TYPE);
+        int cached = 0, claim;
+        if (unmarshal_request(request_buf, &req) != 0) {
+            fprintf(stderr, "Failed to unmarshal datagram: %.200s\n", request_buf);
+            strcpy(resp.error, "Server error: Bad request format");
+            resp.result = 0;
+            resp.request_id = 0;
+        } else if ((claim = response_cache_claim(response_cache, (struct sockaddr *)&client_addr, client_addr_len,
+                                                 req.request_id, response_buf, BUF_SIZE)) == RESPONSE_CACHE_HIT) {
+            cached = 1; // Retransmission of a request we already answered: resend the stored reply
+        } else if (claim == RESPONSE_CACHE_PENDING) {
+            continue; // Retransmission of a request another coroutine is computing: its reply answers both
+        } else {
+            dispatch_request(&req, &resp);
+        }
+
+        if (!cached) {
+            memset(response_buf, 0, BUF_SIZE);
+            if (marshal_response(&resp, response_buf, BUF_SIZE) != 0) {
+                fprintf(stderr, "Failed to marshal response.\n");
+                response_cache_release(response_cache, (struct sockaddr *)&client_addr, client_addr_len, resp.request_id);
+                continue;
+            }
+            response_cache_store(response_cache, (struct sockaddr *)&client_addr, client_addr_len, resp.request_id,
+                                 response_buf);
+        }
+
+        if (sendto(fd, response_buf, strlen(response_buf), 0, (struct sockaddr *)&client_addr, client_addr_len) < 0) {
+            perror("sendto error");
+        }
+    }
+    free(request_buf);
+}
+
+// One thread per core, each with its own scheduler
+static void* run_loop(void* arg) {
+    (void)arg;
+    CoroListener accepting[NUM_SOCKETS]; // Per stream socket; the loop outlives its coroutines
+    admission_init(&codel);
+    if (coro_init() != 0) {
+        perror("Coroutine scheduler setup failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < socket_count; i++) {
+        accepting[i] = (CoroListener){ sockets[i], SERVER_TYPE, &admission, &codel, &handed_over };
+        int spawned = i == UDP_SOCKET ? coro_spawn(serve_datagrams, (void*)(intptr_t)sockets[i])
+                                      : coro_spawn(coro_accept_connections, &accepting[i]);
+        if (spawned != 0) {
+            perror("Failed to create coroutine");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Ends once the sockets are handed over and its connections are answered
+    int alive;
+    while ((alive = coro_run(-1)) != 0) {
+        if (alive < 0) perror("Coroutine scheduler failed");
+    }
+    return NULL;
+}
+
+static int open_inet_socket(int port, int type) {
+    int fd = socket(AF_INET, type, 0);
+    if (fd < 0) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+        perror("setsockopt SO_REUSEADDR failed");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((type == SOCK_STREAM && listen(fd, SOMAXCONN) < 0) || coro_set_nonblocking(fd) < 0) {
+        perror("Listen failed");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+int concurrent_dual_async_main(int argc, char* argv[]) {
+    int port = rpc_server_port(argc, argv, PORT);
+
+    // With --hot-restart, the sockets are taken over from the server running now
+    socket_count = hot_restart_requested(argc, argv) ? hot_restart_inherit(port, sockets, NUM_SOCKETS) : 0;
+    if (socket_count < 0) perror("No server to take over from, starting fresh");
+    if (socket_count > 0 && (socket_count <= UDP_SOCKET || socket_type(sockets[UDP_SOCKET]) != SOCK_DGRAM)) {
+        fprintf(stderr, "The running server on port %d does not serve UDP.\n", port);
+        exit(EXIT_FAILURE);
+    }
+    if (socket_count <= 0) {
+        sockets[TCP_SOCKET] = open_inet_socket(port, SOCK_STREAM);
+        sockets[UDP_SOCKET] = open_inet_socket(port, SOCK_DGRAM);
+
+        // Local clients can skip the TCP/IP stack through a Unix socket. Only a
+        // stream one: a path takes one socket type, and streams carry any size.
+        sockets[UNIX_SOCKET] = rpc_unix_listen(port, SOCK_STREAM);
+        if (sockets[UNIX_SOCKET] >= 0 && coro_set_nonblocking(sockets[UNIX_SOCKET]) < 0) {
+            close(sockets[UNIX_SOCKET]);
+            sockets[UNIX_SOCKET] = -1;
+        }
+        socket_count = sockets[UNIX_SOCKET] >= 0 ? NUM_SOCKETS : UNIX_SOCKET;
+        if (sockets[UNIX_SOCKET] < 0) perror("Unix socket listener unavailable");
+    }
+
+    // Options from RPC_SOCKET_PROFILE (socket_profile.h), for inherited sockets too
+    if (rpc_tune_server_socket(sockets[TCP_SOCKET], SOCK_STREAM) < 0 ||
+        rpc_tune_server_socket(sockets[UDP_SOCKET], SOCK_DGRAM) < 0) {
+        perror("Socket profile not fully applied");
+    }
+
+    // Requests wait in the kernel until a loop gets to them; stamps tell how long
+    admission_init(&admission);
+    rpc_enable_arrival_time(sockets[TCP_SOCKET]);
+    rpc_enable_arrival_time(sockets[UDP_SOCKET]);
+    response_cache = response_cache_create(0);
+    dispatch_init();
+
+    // One loop per CPU of RPC_CPU_LIST / RPC_CPU_NIC (cpu_affinity.h), or per
+    // online CPU without a set. Workers for large reductions are started
+    // before the loops are pinned, so they may use the whole set.
+    CpuAffinity affinity;
+    if (cpu_affinity_init(&affinity) != 0) perror("CPU affinity ignored");
+    if (cpu_affinity_confine(&affinity) != 0) perror("CPU affinity not applied");
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    vector_ops_set_threads(cores); // Large reductions may use every core
+    int loops = affinity.count > 0 ? affinity.count : cores;
+    if (loops < 1) loops = 1;
+    if (loops > MAX_LOOPS) loops = MAX_LOOPS;
+
+    // Every connection holds a descriptor; allow as many as the hard limit does
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    pthread_t threads[MAX_LOOPS];
+    for (int i = 0; i < loops; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        cpu_affinity_pin_attr(&attr, cpu_affinity_pick(&affinity, -1));
+        int rc = pthread_create(&threads[i], &attr, run_loop, NULL);
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
+            errno = rc;
+            perror("Failed to create loop thread");
+            if (i == 0) exit(EXIT_FAILURE);
+            loops = i;
+            break;
+        }
+    }
+
+    printf("Dual TCP+UDP RPC Server (%d coroutine loops) listening on port %d...\n", loops, port);
+
+    // A successor asks for the sockets through the control socket
+    int control_fd = hot_restart_listen(port);
+    if (control_fd < 0) {
+        for (int i = 0; i < loops; i++) pthread_join(threads[i], NULL);
+        return 0;
+    }
+    while (!stopping()) {
+        struct pollfd pfd = { .fd = control_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno != EINTR) perror("poll failed");
+        } else if (hot_restart_handoff(control_fd, sockets, socket_count) == 0) {
+            // Queued connections and datagrams are the successor's to take
+            printf("Handed the sockets over to the new server, draining.\n");
+            __atomic_store_n(&handed_over, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    // Loops stop taking requests as they wake; the open connections are answered first
+    admission_drain(&admission);
+    for (int i = 0; i < socket_count; i++) close(sockets[i]);
+    return 0;
+}
+
+#ifndef RPC_SERVER_BUNDLE
+int main(int argc, char* argv[]) {
+    return concurrent_dual_async_main(argc, argv);
+}
+#endif
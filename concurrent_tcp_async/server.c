@@ -11,13 +11,24 @@
 // #include <time.h> // Keep if log_with_timestamp is used extensively
 
 #include "rpc_protocol.h" // Headers from root (using -I../)
-#include "calculator_ops.h" // Headers from root (using -I../)
+#include "rpc_dispatch.h" // Headers from root (using -I../)
+#include "vector_ops.h"
+#include "micro_batch.h"
+#include "shm_transport.h"
+#include "unix_socket.h"
+#include "admission.h"
+#include "hot_restart.h"
+#include "socket_profile.h"
+#include "cpu_affinity.h"
+#include "server_main.h"
+#include "mem_pool.h"
+#include "timer_wheel.h"
 
 #define PORT 9004 // Changed port
 #define MAX_EVENTS 64 // Increased max events slightly
 #define BUF_SIZE RPC_BUFFER_SIZE
 
-void set_nonblocking(int sockfd) {
+static void set_nonblocking(int sockfd) {
     int flags = fcntl(sockfd, F_GETFL, 0);
     if (flags == -1) {
         perror("fcntl F_GETFL");
@@ -36,56 +47,410 @@ void set_nonblocking(int sockfd) {
 }
 
 // Simplified logging
-void log_msg(const char *msg) {
+static void log_msg(const char *msg) {
     printf("%s\n", msg);
 }
 
+// Requests with operand arrays can span many segments, so bytes are collected
+// per connection until rpc_request_length() finds a whole request. A client
+// may also send its next requests before the first is answered; they stay
+// buffered and are answered in order. A connection stays open for the
+// client's next request; its timer closes it once it has been idle for
+// idle_timeout_ms, or when a request has not arrived whole
+// request_timeout_ms after its first bytes (timer_wheel.h).
+typedef struct {
+    int fd;
+    char* buf;
+    size_t len;
+    size_t cap;
+    long long arrival_us; // When the request's first bytes arrived, for CoDel
+    int batched;          // Its request waits in the batch; the connection is off epoll meanwhile
+    int unread;           // The buffer filled up before the socket was drained
+    Timer timer;
+} Connection;
 
-int main() {
-    int server_fd, client_fd, epoll_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    struct epoll_event event, events[MAX_EVENTS];
+static Admission admission; // Caps the open connections
+static int epoll_fd;
+static int handed_over; // Set once a successor has the sockets; connections close after their reply
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+static Connection** connections; // By descriptor
+static int connection_slots;
+static Slab* connection_slab;
+static Slab* buffer_slab; // Every connection's first BUF_SIZE bytes; larger requests move to malloc()
+
+// Scalar requests decoded close together are computed as one batch (micro_batch.h)
+static MicroBatch batch;
+static int batch_fds[MICRO_BATCH_MAX]; // The connection each request in the batch came on
+
+static TimerWheel timers; // Connection timeouts and the statistics
+static long long idle_timeout_ms;
+static long long request_timeout_ms;
+static long long stats_interval_ms;
+static Timer stats_timer;
+static unsigned long long requests_served;
+static unsigned long long idle_closed;
+static unsigned long long request_timeouts;
+
+static long long env_ms(const char* name, long long fallback) {
+    const char* env = getenv(name);
+    return env && env[0] != '\0' ? atoll(env) : fallback;
+}
+
+static Connection* connection_for(int fd) {
+    return fd >= 0 && fd < connection_slots ? connections[fd] : NULL;
+}
+
+// Done with a connection: on EOF, OP_EXIT, an error or a timeout
+static void close_client(int fd) {
+    Connection* c = connection_for(fd);
+    if (c) {
+        timer_cancel(&timers, &c->timer);
+        if (c->cap == BUF_SIZE) slab_free(c->buf);
+        else free(c->buf);
+        slab_free(c);
+        connections[fd] = NULL;
     }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL); // Ignore error for DEL
+    close(fd);
+    admission_leave(&admission);
+}
 
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt SO_REUSEADDR failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+static void connection_timeout(Timer* t, void* arg) {
+    (void)t;
+    Connection* c = arg;
+    if (c->len > 0) request_timeouts++; // Slow, or a slowloris client trickling its request
+    else idle_closed++;
+    close_client(c->fd);
+}
+
+static Connection* open_connection(int fd) {
+    if (fd >= connection_slots) {
+        int slots = connection_slots ? connection_slots : 64;
+        while (slots <= fd) slots *= 2;
+        Connection** grown = realloc(connections, slots * sizeof(Connection*));
+        if (!grown) return NULL;
+        memset(grown + connection_slots, 0, (slots - connection_slots) * sizeof(Connection*));
+        connections = grown;
+        connection_slots = slots;
+    }
+    Connection* c = slab_alloc(connection_slab);
+    if (!c) return NULL;
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    timer_init(&c->timer, connection_timeout, c);
+    connections[fd] = c;
+    return c;
+}
+
+// The connection waits for its next request, for idle_timeout_ms at most
+static void await_request(Connection* c) {
+    mem_release_idle_buffer(&c->buf, &c->cap); // Bounded-memory mode: only a slab buffer stays
+    if (idle_timeout_ms > 0) timer_schedule(&timers, &c->timer, timer_now_ms() + idle_timeout_ms);
+    else timer_cancel(&timers, &c->timer);
+}
+
+// Drops the n bytes of a handled request; those of the requests after it move to the front
+static void consume_request(Connection* c, size_t n) {
+    c->len -= n;
+    memmove(c->buf, c->buf + n, c->len);
+}
+
+// Doubles the connection's buffer, up to RPC_MAX_MESSAGE_SIZE. Returns 0, or -1 when out of memory.
+static int grow_buffer(Connection* c) {
+    size_t cap = c->cap ? c->cap * 2 : BUF_SIZE;
+    if (cap > RPC_MAX_MESSAGE_SIZE) cap = RPC_MAX_MESSAGE_SIZE;
+    char* grown;
+    if (c->cap == 0) {
+        grown = slab_alloc(buffer_slab);
+    } else if (c->cap == BUF_SIZE) {
+        grown = malloc(cap);
+        if (grown) {
+            memcpy(grown, c->buf, c->len);
+            slab_free(c->buf);
+        }
+    } else {
+        grown = realloc(c->buf, cap);
+    }
+    if (!grown) return -1;
+    c->buf = grown;
+    c->cap = cap;
+    return 0;
+}
+
+// Length of the first whole request in the buffer, 0 if there is none yet. A
+// full buffer without one is taken whole; it will fail to unmarshal.
+static size_t buffered_request(const Connection* c) {
+    size_t n = rpc_request_length(c->buf, c->len);
+    if (n == 0 && c->cap >= RPC_MAX_MESSAGE_SIZE && c->len + 1 >= c->cap) n = c->len;
+    return n;
+}
+
+// Reads what the socket holds into the connection's buffer, until it is
+// drained or the buffer holds a whole request and is full.
+// Returns 1 once a whole request is buffered, 0 if more data is needed, -1 if the connection is done.
+static int read_request(int fd, Connection* c) {
+    c->unread = 0;
+    while (1) {
+        if (c->len + 1 >= c->cap) {
+            if (c->cap >= RPC_MAX_MESSAGE_SIZE || rpc_request_length(c->buf, c->len) != 0) {
+                c->unread = 1; // The rest is read once the buffered requests are answered
+                break;
+            }
+            if (grow_buffer(c) != 0) return -1;
+        }
+        long long stamp;
+        ssize_t n = rpc_recv_stamped(fd, c->buf + c->len, c->cap - 1 - c->len, 0, NULL, NULL, &stamp);
+        if (n > 0 && c->len == 0) c->arrival_us = stamp;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            return -1; // The client sends its requests whole, so EOF means it is gone
+        }
+        c->len += (size_t)n;
+    }
+    c->buf[c->len] = '\0';
+    return buffered_request(c) != 0;
+}
+
+// Sends a marshalled reply. Replies fit the socket buffer, so one send()
+// takes all of it or fails. Returns 0, or -1 once the connection is closed.
+static int send_reply(int fd, const char* reply) {
+    size_t len = strlen(reply);
+    if (send(fd, reply, len, MSG_NOSIGNAL) == (ssize_t)len) return 0;
+    close_client(fd);
+    return -1;
+}
+
+static void serve_connection(int fd);
+
+// Computes the open batch, then answers its connections and puts them back on epoll
+static void run_batch(void) {
+    char response_buf[BUF_SIZE];
+    struct epoll_event event;
+    int fds[MICRO_BATCH_MAX];
+    int n = micro_batch_run(&batch);
+    memcpy(fds, batch_fds, n * sizeof(int)); // Requests answered below may start the next batch
+    for (int i = 0; i < n; i++) {
+        int fd = fds[i];
+        Connection* c = connection_for(fd);
+        if (c) c->batched = 0;
+        memset(response_buf, 0, BUF_SIZE);
+        if (marshal_response(&batch.responses[i], response_buf, BUF_SIZE) != 0) {
+            fprintf(stderr, "Failed to marshal batched response.\n");
+            close_client(fd);
+            fds[i] = -1;
+            continue;
+        }
+        // Data that came in meanwhile is reported as soon as the connection is back
+        event.data.fd = fd;
+        event.events = EPOLLIN | EPOLLET;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror("epoll_ctl ADD client_fd failed");
+            close_client(fd);
+            fds[i] = -1;
+            continue;
+        }
+        if (send_reply(fd, response_buf) != 0) fds[i] = -1;
     }
+    // Then the requests their clients sent behind the batched ones
+    for (int i = 0; i < n; i++) {
+        if (fds[i] >= 0) serve_connection(fds[i]);
+    }
+}
+
+// Answers the first buffered request, whole in c->buf. Returns 0 once it is
+// answered or waits in the batch, -1 once the connection is closed.
+static int serve_request(int fd, Connection* c) {
+    char response_buf[BUF_SIZE];
+    RpcRequest req;
+    RpcResponse resp;
+    strcpy(resp.server_type, "concurrent_tcp_async");
+
+    size_t n = buffered_request(c);
+    char* request_buf = c->buf;
+    char next = request_buf[n];
+    request_buf[n] = '\0'; // Optional fields are looked up to the end of the string
+    timer_cancel(&timers, &c->timer);
 
-    set_nonblocking(server_fd);
-    // Check if server_fd was closed by set_nonblocking on error
-    if (fcntl(server_fd, F_GETFD) == -1 && errno == EBADF) {
-         log_msg("Server socket closed due to fcntl error in set_nonblocking. Exiting.");
-         exit(EXIT_FAILURE);
+    if (admission_codel_shed(&admission, c->arrival_us)) {
+        rpc_send_busy(fd, request_buf, n, "concurrent_tcp_async", NULL, 0);
+        close_client(fd);
+        return -1;
     }
 
+    if (unmarshal_request(request_buf, &req) != 0) {
+        fprintf(stderr, "Failed to unmarshal request: %.200s\n", request_buf);
+        strcpy(resp.error, "Server error: Bad request format");
+        resp.result = 0;
+        resp.request_id = 0;
+    } else {
+        if (req.operation == OP_EXIT) {
+            // log_msg("Client requested exit. Closing connection.");
+            close_client(fd);
+            return -1;
+        }
+        requests_served++;
+        if (micro_batch_accepts(&batch, &req)) {
+            // Answered when the batch runs, after this iteration or a little later
+            request_buf[n] = next;
+            consume_request(c, n); // The batch holds the operands
+            int slot = micro_batch_add(&batch, &req);
+            if (slot < 0) {
+                run_batch();
+                slot = micro_batch_add(&batch, &req);
+            }
+            batch_fds[slot] = fd;
+            // Off epoll until answered; a hangup now must not close it under the batch
+            c->batched = 1;
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            return 0;
+        }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+        dispatch_request(&req, &resp); // Arrays are decoded from the buffer here
+    }
+    request_buf[n] = next;
+    consume_request(c, n);
 
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+    memset(response_buf, 0, BUF_SIZE);
+    if (marshal_response(&resp, response_buf, BUF_SIZE) != 0) {
+        fprintf(stderr, "Failed to marshal response.\n");
+        close_client(fd);
+        return -1;
     }
+    return send_reply(fd, response_buf);
+}
 
-    if (listen(server_fd, SOMAXCONN) < 0) {
-        perror("Listen failed");
-        close(server_fd);
+// Reads what the client has sent and answers its whole requests in order,
+// until one waits in the batch, the rest has not arrived, or the connection closes
+static void serve_connection(int fd) {
+    Connection* c;
+    while ((c = connection_for(fd)) && !c->batched) {
+        size_t had = c->len;
+        int ready = buffered_request(c) != 0 && !c->unread ? 1 : read_request(fd, c);
+        if (ready < 0) {
+            // log_msg("Client disconnected.");
+            close_client(fd);
+            return;
+        }
+        if (ready == 0) {
+            if (c->len == 0) {
+                // Every request answered: kept for the next one, unless the server is draining
+                if (handed_over) close_client(fd);
+                else await_request(c);
+            } else if (had == 0 || !timer_pending(&c->timer)) {
+                // The rest of the request has not arrived yet. It has request_timeout_ms from
+                // its first bytes, however slowly the rest trickles in.
+                if (request_timeout_ms > 0) timer_schedule(&timers, &c->timer, timer_now_ms() + request_timeout_ms);
+                else timer_cancel(&timers, &c->timer);
+            }
+            return;
+        }
+        if (serve_request(fd, c) != 0) return;
+    }
+}
+
+// Prints the connection counts and the batch sizes every stats_interval_ms
+static void print_stats(Timer* t, void* arg) {
+    (void)arg;
+    fprintf(stderr, "concurrent_tcp_async: %d connections, %llu requests, %llu closed idle, %llu request timeouts\n",
+            admission.inflight, requests_served, idle_closed, request_timeouts);
+    micro_batch_report(&batch, stderr);
+    timer_schedule(&timers, t, timer_now_ms() + stats_interval_ms);
+}
+
+int concurrent_tcp_async_main(int argc, char* argv[]) {
+    int port = rpc_server_port(argc, argv, PORT);
+    int server_fd, unix_fd, client_fd;
+    struct sockaddr_in server_addr;
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len;
+    struct epoll_event event, events[MAX_EVENTS];
+
+    // With --hot-restart, the sockets are taken over from the server running now
+    int inherited[2];
+    int inherited_count = hot_restart_requested(argc, argv) ? hot_restart_inherit(port, inherited, 2) : 0;
+    if (inherited_count < 0) perror("No server to take over from, starting fresh");
+    if (inherited_count > 0) {
+        server_fd = inherited[0]; // Already listening and non-blocking
+    } else {
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_fd < 0) {
+            perror("Socket creation failed");
+            exit(EXIT_FAILURE);
+        }
+
+        int opt = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+            perror("setsockopt SO_REUSEADDR failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+
+        set_nonblocking(server_fd);
+        // Check if server_fd was closed by set_nonblocking on error
+        if (fcntl(server_fd, F_GETFD) == -1 && errno == EBADF) {
+             log_msg("Server socket closed due to fcntl error in set_nonblocking. Exiting.");
+             exit(EXIT_FAILURE);
+        }
+
+
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+
+        if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("Bind failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+
+        if (listen(server_fd, SOMAXCONN) < 0) {
+            perror("Listen failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Options from RPC_SOCKET_PROFILE (socket_profile.h), for inherited sockets too
+    if (rpc_tune_server_socket(server_fd, SOCK_STREAM) < 0) perror("Socket profile not fully applied");
+
+    // Requests wait in the kernel until the loop gets to them; stamps tell how long
+    admission_init(&admission);
+    rpc_enable_arrival_time(server_fd);
+
+    dispatch_init();
+    micro_batch_init(&batch, "concurrent_tcp_async");
+    // Owned by this thread, which runs the event loop
+    buffer_slab = slab_create(BUF_SIZE);
+    connection_slab = slab_create(sizeof(Connection));
+    if (!buffer_slab || !connection_slab) {
+        perror("Failed to create connection slabs");
         exit(EXIT_FAILURE);
     }
+
+    timer_wheel_init(&timers);
+    idle_timeout_ms = env_ms(RPC_IDLE_TIMEOUT_ENV, DEFAULT_IDLE_TIMEOUT_MS);
+    request_timeout_ms = env_ms(RPC_REQUEST_TIMEOUT_ENV, DEFAULT_REQUEST_TIMEOUT_MS);
+    stats_interval_ms = env_ms(RPC_STATS_INTERVAL_ENV, DEFAULT_STATS_INTERVAL_MS);
+    timer_init(&stats_timer, print_stats, NULL);
+    if (stats_interval_ms > 0) timer_schedule(&timers, &stats_timer, timer_now_ms() + stats_interval_ms);
+
+    // The loop stays on one CPU from RPC_CPU_LIST / RPC_CPU_NIC (cpu_affinity.h).
+    // Workers for large reductions are started first, so they may use the whole set.
+    CpuAffinity affinity;
+    if (cpu_affinity_init(&affinity) != 0) perror("CPU affinity ignored");
+    if (cpu_affinity_confine(&affinity) != 0) perror("CPU affinity not applied");
+    vector_ops_set_threads((int)sysconf(_SC_NPROCESSORS_ONLN)); // Large reductions may use every core
+    if (cpu_affinity_pin_self(cpu_affinity_pick(&affinity, -1)) != 0) perror("CPU affinity not applied");
+    // Shared-memory clients are served by a single thread beside the event loop,
+    // since a futex cannot be waited on through epoll
+    if (shm_server_start(port, 1, "concurrent_tcp_async") != 0) {
+        perror("Shared-memory transport unavailable");
+    }
+
     char log_buf[100];
-    snprintf(log_buf, sizeof(log_buf), "Async TCP RPC Server listening on port %d...", PORT);
+    snprintf(log_buf, sizeof(log_buf), "Async TCP RPC Server listening on port %d...", port);
     log_msg(log_buf);
 
     epoll_fd = epoll_create1(0);
@@ -104,8 +469,36 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    while (1) {
-        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    // Local clients can skip the TCP/IP stack through a Unix socket
+    unix_fd = inherited_count > 1 ? inherited[1] : rpc_unix_listen(port, SOCK_STREAM);
+    if (unix_fd < 0) {
+        perror("Unix socket listener unavailable");
+    } else {
+        set_nonblocking(unix_fd);
+        event.data.fd = unix_fd;
+        event.events = EPOLLIN | EPOLLET;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, unix_fd, &event) == -1) {
+            perror("epoll_ctl ADD unix_fd failed");
+            close(unix_fd);
+            unix_fd = -1;
+        }
+    }
+
+    // A successor asks for the sockets through the control socket
+    int control_fd = hot_restart_listen(port);
+    if (control_fd >= 0) {
+        event.data.fd = control_fd;
+        event.events = EPOLLIN;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, control_fd, &event) == -1) {
+            perror("epoll_ctl ADD control_fd failed");
+        }
+    }
+
+    // After a handoff, the loop runs on until the open connections are answered
+    while (!handed_over || admission.inflight > 0) {
+        // Wakes early when a batch that waits for more requests is due, or a timer
+        long long timer_ms = timer_wheel_next_ms(&timers);
+        int n = micro_batch_epoll_wait(&batch, epoll_fd, events, MAX_EVENTS, timer_ms < 0 ? -1 : timer_ms * 1000);
         if (n == -1) {
             if (errno == EINTR) continue;
             perror("epoll_wait failed");
@@ -113,9 +506,28 @@ int main() {
         }
 
         for (int i = 0; i < n; i++) {
-            if (events[i].data.fd == server_fd) {
+            if (events[i].data.fd == control_fd) {
+                int listeners[2] = { server_fd, unix_fd };
+                if (!handed_over && hot_restart_handoff(control_fd, listeners, unix_fd >= 0 ? 2 : 1) == 0) {
+                    // Queued connections are the successor's to accept
+                    log_msg("Handed the sockets over to the new server, draining.");
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, control_fd, NULL);
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_fd, NULL);
+                    if (unix_fd >= 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, unix_fd, NULL);
+                    shm_server_retire();
+                    handed_over = 1;
+                    // Idle connections are closed now; the others after their reply
+                    for (int fd = 0; fd < connection_slots; fd++) {
+                        Connection* c = connections[fd];
+                        if (c && c->len == 0 && !c->batched) close_client(fd);
+                    }
+                }
+            } else if (events[i].data.fd == server_fd || events[i].data.fd == unix_fd) {
+                int listen_fd = events[i].data.fd;
+                if (handed_over) continue; // Reported in the same batch as the handoff
                 while(1) {
-                    client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
+                    client_addr_len = sizeof(client_addr);
+                    client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_addr_len);
                     if (client_fd < 0) {
                         if (errno == EAGAIN || errno == EWOULDBLOCK) {
                             break;
@@ -124,97 +536,52 @@ int main() {
                             break;
                         }
                     }
+                    if (!admission_enter(&admission)) {
+                        rpc_reject_connection(client_fd, "concurrent_tcp_async");
+                        continue;
+                    }
                     set_nonblocking(client_fd);
                     if (fcntl(client_fd, F_GETFD) == -1 && errno == EBADF) { // Check if closed by set_nonblocking
                         log_msg("Client socket closed due to fcntl error in set_nonblocking. Skipping add to epoll.");
+                        admission_leave(&admission);
                         continue; // Don't add this fd to epoll
                     }
 
+                    Connection* c = open_connection(client_fd);
+                    if (!c) {
+                        perror("Failed to allocate connection state");
+                        close(client_fd);
+                        admission_leave(&admission);
+                        continue;
+                    }
+                    await_request(c);
+
                     event.data.fd = client_fd;
                     event.events = EPOLLIN | EPOLLET;
                     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
                         perror("epoll_ctl ADD client_fd failed");
-                        close(client_fd);
+                        close_client(client_fd);
                     } else {
                         // log_msg("New client connected.");
                     }
                 }
             } else {
-                int current_client_fd = events[i].data.fd;
-                char request_buf[BUF_SIZE];
-                char response_buf[BUF_SIZE];
-                RpcRequest req;
-                RpcResponse resp;
-                CalcResult calc_res;
-
-                strcpy(resp.server_type, "concurrent_tcp_async");
-
-                ssize_t bytes_received = recv(current_client_fd, request_buf, BUF_SIZE - 1, 0);
-
-                if (bytes_received <= 0) {
-                    if (bytes_received == 0) {
-                        // log_msg("Client disconnected.");
-                    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                        // perror("recv error");
-                    }
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, current_client_fd, NULL); // Ignore error for DEL
-                    close(current_client_fd);
-                } else {
-                    request_buf[bytes_received] = '\0';
-
-                    if (unmarshal_request(request_buf, &req) != 0) {
-                        fprintf(stderr, "Failed to unmarshal request: %s\n", request_buf);
-                        strcpy(resp.error, "Server error: Bad request format");
-                        resp.result = 0;
-                    } else {
-                        if (req.operation == OP_EXIT) {
-                            // log_msg("Client requested exit. Closing connection.");
-                            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, current_client_fd, NULL);
-                            close(current_client_fd);
-                            continue;
-                        }
-
-                        switch (req.operation) {
-                            case OP_ADD:      calc_res = add(req.op1, req.op2); break;
-                            case OP_SUBTRACT: calc_res = subtract(req.op1, req.op2); break;
-                            case OP_MULTIPLY: calc_res = multiply(req.op1, req.op2); break;
-                            case OP_DIVIDE:   calc_res = divide(req.op1, req.op2); break;
-                            default:
-                                snprintf(calc_res.error, sizeof(calc_res.error), "Invalid operation: %d", req.operation);
-                                calc_res.value = 0;
-                                break;
-                        }
-                        resp.result = calc_res.value;
-                        strcpy(resp.error, calc_res.error);
-                    }
-
-                    memset(response_buf, 0, BUF_SIZE);
-                    if (marshal_response(&resp, response_buf, BUF_SIZE) != 0) {
-                        fprintf(stderr, "Failed to marshal response.\n");
-                    } else {
-                        ssize_t bytes_sent = send(current_client_fd, response_buf, strlen(response_buf), 0);
-                        if (bytes_sent < 0) {
-                            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                                // perror("send error");
-                            }
-                            // For full ET, if send returns EAGAIN/EWOULDBLOCK,
-                            // need to arm EPOLLOUT and send later.
-                            // Current client disconnects, so this might not be hit often.
-                        } else {
-                             // log_msg("Sent response to client.");
-                        }
-                    }
-                    // Client disconnects after one RPC, so we can close here.
-                    // If persistent connections were expected for multiple RPCs,
-                    // we would not DEL and close here unless OP_EXIT.
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, current_client_fd, NULL);
-                    close(current_client_fd);
-                }
+                Connection* c = connection_for(events[i].data.fd);
+                if (!c || c->batched) continue; // Closed earlier in this pass, or already answered for
+                serve_connection(events[i].data.fd);
             }
         }
+        if (micro_batch_due(&batch)) run_batch();
+        timer_wheel_run(&timers);
     }
 
     close(server_fd);
     close(epoll_fd);
     return 0;
 }
+
+#ifndef RPC_SERVER_BUNDLE
+int main(int argc, char* argv[]) {
+    return concurrent_tcp_async_main(argc, argv);
+}
+#endif
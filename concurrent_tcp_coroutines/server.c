@@ -0,0 +1,158 @@
+// concurrent_tcp_coroutines/server.c
+// One coroutine per connection (rpc_core/coroutine.h, handler in
+// rpc_core/coro_connection.c): the handler reads like the threads server's,
+// but all connections share one thread and one epoll instance, as in the
+// async server.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h> // For intptr_t
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/resource.h> // For the descriptor limit
+#include <netinet/in.h>
+
+#include "rpc_protocol.h" // Headers from root (using -I../)
+#include "rpc_dispatch.h" // Headers from root (using -I../)
+#include "vector_ops.h"
+#include "coroutine.h"
+#include "coro_connection.h"
+#include "unix_socket.h"
+#include "admission.h"
+#include "hot_restart.h"
+#include "socket_profile.h"
+#include "cpu_affinity.h"
+#include "server_main.h"
+
+#define PORT 9009
+#define SERVER_TYPE "concurrent_tcp_coroutines"
+
+static Admission admission; // Caps the open connections
+static int listeners[2];
+static int listener_count;
+static int handed_over;     // Set once a successor has the listening sockets
+static CoroListener accepting[2]; // One per listening socket
+
+// Hands the listening sockets to a successor that connects to the control socket
+static void await_successor(void* arg) {
+    int control_fd = (int)(intptr_t)arg;
+    while (!handed_over) {
+        coro_wait_fd(control_fd, POLLIN);
+        if (hot_restart_handoff(control_fd, listeners, listener_count) == 0) {
+            // Queued connections are the successor's to accept
+            printf("Handed the sockets over to the new server, draining.\n");
+            handed_over = 1;
+        }
+    }
+}
+
+int concurrent_tcp_coroutines_main(int argc, char* argv[]) {
+    int port = rpc_server_port(argc, argv, PORT);
+    int server_fd;
+    struct sockaddr_in server_addr;
+
+    // With --hot-restart, the sockets are taken over from the server running now
+    listener_count = hot_restart_requested(argc, argv) ? hot_restart_inherit(port, listeners, 2) : 0;
+    if (listener_count < 0) perror("No server to take over from, starting fresh");
+    if (listener_count > 0) {
+        server_fd = listeners[0]; // Already listening and non-blocking
+    } else {
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_fd < 0) {
+            perror("Socket creation failed");
+            exit(EXIT_FAILURE);
+        }
+
+        int opt = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+            perror("setsockopt SO_REUSEADDR failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+
+        if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("Bind failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+
+        if (listen(server_fd, SOMAXCONN) < 0 || coro_set_nonblocking(server_fd) < 0) {
+            perror("Listen failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+
+        // Local clients can skip the TCP/IP stack through a Unix socket
+        listeners[0] = server_fd;
+        listeners[1] = rpc_unix_listen(port, SOCK_STREAM);
+        if (listeners[1] >= 0 && coro_set_nonblocking(listeners[1]) < 0) {
+            close(listeners[1]);
+            listeners[1] = -1;
+        }
+        listener_count = listeners[1] >= 0 ? 2 : 1;
+        if (listeners[1] < 0) perror("Unix socket listener unavailable");
+    }
+
+    // Options from RPC_SOCKET_PROFILE (socket_profile.h), for inherited sockets too
+    if (rpc_tune_server_socket(server_fd, SOCK_STREAM) < 0) perror("Socket profile not fully applied");
+
+    // Requests wait in the kernel until their coroutine runs; stamps tell how long
+    admission_init(&admission);
+    rpc_enable_arrival_time(server_fd);
+    dispatch_init();
+
+    // The loop stays on one CPU from RPC_CPU_LIST / RPC_CPU_NIC (cpu_affinity.h).
+    // Workers for large reductions are started first, so they may use the whole set.
+    CpuAffinity affinity;
+    if (cpu_affinity_init(&affinity) != 0) perror("CPU affinity ignored");
+    if (cpu_affinity_confine(&affinity) != 0) perror("CPU affinity not applied");
+    vector_ops_set_threads((int)sysconf(_SC_NPROCESSORS_ONLN)); // Large reductions may use every core
+    if (cpu_affinity_pin_self(cpu_affinity_pick(&affinity, -1)) != 0) perror("CPU affinity not applied");
+
+    // Every connection holds a descriptor; allow as many as the hard limit does
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    if (coro_init() != 0) {
+        perror("Coroutine scheduler setup failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < listener_count; i++) {
+        accepting[i] = (CoroListener){ listeners[i], SERVER_TYPE, &admission, &admission, &handed_over };
+        if (coro_spawn(coro_accept_connections, &accepting[i]) != 0) {
+            perror("Failed to create coroutine");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // A successor asks for the sockets through the control socket
+    int control_fd = hot_restart_listen(port);
+    if (control_fd >= 0 && coro_spawn(await_successor, (void*)(intptr_t)control_fd) != 0) {
+        perror("Failed to create coroutine");
+    }
+
+    printf("Coroutine TCP RPC Server listening on port %d...\n", port);
+
+    // After a handoff, the scheduler runs on until the open connections are answered
+    while (!handed_over || admission.inflight > 0) {
+        if (coro_run(-1) < 0) perror("Coroutine scheduler failed");
+    }
+
+    close(server_fd);
+    return 0;
+}
+
+#ifndef RPC_SERVER_BUNDLE
+int main(int argc, char* argv[]) {
+    return concurrent_tcp_coroutines_main(argc, argv);
+}
+#endif
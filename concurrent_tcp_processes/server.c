@@ -11,94 +11,108 @@
 #include <errno.h>    // For errno and EINTR
 
 #include "rpc_protocol.h" // Will be found via CFLAGS -I../
-#include "calculator_ops.h" // Will be found via CFLAGS -I../
+#include "rpc_dispatch.h" // Will be found via CFLAGS -I../
+#include "rpc_stream.h"
+#include "unix_socket.h"
+#include "admission.h"
+#include "hot_restart.h"
+#include "socket_profile.h"
+#include "cpu_affinity.h"
+#include "server_main.h"
+#include "mem_pool.h"
+#include "priority_sched.h"
 
 #define PORT 9003 // Changed port
 #define BUF_SIZE RPC_BUFFER_SIZE
 
-void handle_client_connection(int client_sock, struct sockaddr_in client_addr) {
+// Lives in shared memory so the connection processes share its slots
+static PrioritySched* sched;
+
+static void handle_client_connection(int client_sock, const char* client) {
     char buffer[BUF_SIZE];
+    char* request_buf = NULL; // Grows with the requests; arrays can make them large
+    size_t request_cap = 0;
     RpcRequest req;
     RpcResponse resp;
-    CalcResult calc_res;
 
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-    printf("Child process %d: Handling client %s:%d\n", getpid(), client_ip, ntohs(client_addr.sin_port));
+    printf("Child process %d: Handling client %s\n", getpid(), client);
 
     strcpy(resp.server_type, "concurrent_tcp_processes");
 
     // Loop to handle multiple requests on the same connection
     while(1) {
-        memset(buffer, 0, BUF_SIZE);
-        ssize_t bytes_received = recv(client_sock, buffer, BUF_SIZE - 1, 0);
+        long long arrival_us;
+        ssize_t bytes_received = rpc_recv_request_grow(client_sock, &request_buf, &request_cap, &arrival_us);
 
         if (bytes_received <= 0) {
             if (bytes_received == 0) {
-                printf("Child process %d: Client %s:%d disconnected.\n", getpid(), client_ip, ntohs(client_addr.sin_port));
+                printf("Child process %d: Client %s disconnected.\n", getpid(), client);
             } else {
                 perror("Recv error in child");
             }
             break;
         }
-        buffer[bytes_received] = '\0';
-
-        if (unmarshal_request(buffer, &req) != 0) {
-            fprintf(stderr, "Child process %d: Failed to unmarshal request from %s:%d: %s\n", getpid(), client_ip, ntohs(client_addr.sin_port), buffer);
+        if (unmarshal_request(request_buf, &req) != 0) {
+            fprintf(stderr, "Child process %d: Failed to unmarshal request from %s: %.200s\n", getpid(), client, request_buf);
             strcpy(resp.error, "Server error: Bad request format");
             resp.result = 0;
+            resp.request_id = 0;
         } else {
             if (req.operation == OP_EXIT) {
-                printf("Child process %d: Client %s:%d requested exit.\n", getpid(), client_ip, ntohs(client_addr.sin_port));
+                printf("Child process %d: Client %s requested exit.\n", getpid(), client);
                 break;
             }
-            printf("Child process %d: Op %d, op1 %.2f, op2 %.2f from %s:%d\n", getpid(), req.operation, req.op1, req.op2, client_ip, ntohs(client_addr.sin_port));
-
-            switch (req.operation) {
-                case OP_ADD:      calc_res = add(req.op1, req.op2); break;
-                case OP_SUBTRACT: calc_res = subtract(req.op1, req.op2); break;
-                case OP_MULTIPLY: calc_res = multiply(req.op1, req.op2); break;
-                case OP_DIVIDE:   calc_res = divide(req.op1, req.op2); break;
-                default:
-                    snprintf(calc_res.error, sizeof(calc_res.error), "Invalid operation: %d", req.operation);
-                    calc_res.value = 0;
-                    break;
+            if (req.operation == OP_STREAM) {
+                // The stream runs to completion here, replies included
+                if (rpc_stream_serve(client_sock, &req, &resp) != 0) break;
+                continue;
             }
-            resp.result = calc_res.value;
-            strcpy(resp.error, calc_res.error);
+            printf("Child process %d: Op %d, op1 %.2f, op2 %.2f from %s\n", getpid(), req.operation, req.op1, req.op2, client);
+
+            priority_sched_dispatch(sched, &req, &resp);
         }
 
         memset(buffer, 0, BUF_SIZE);
         if (marshal_response(&resp, buffer, BUF_SIZE) != 0) {
-            fprintf(stderr, "Child process %d: Failed to marshal response for %s:%d.\n", getpid(), client_ip, ntohs(client_addr.sin_port));
+            fprintf(stderr, "Child process %d: Failed to marshal response for %s.\n", getpid(), client);
         } else {
             ssize_t bytes_sent = send(client_sock, buffer, strlen(buffer), 0);
             if (bytes_sent < 0) {
                 perror("Send error in child");
             } else {
-                printf("Child process %d: Sent response to %s:%d: %s\n", getpid(), client_ip, ntohs(client_addr.sin_port), buffer);
+                printf("Child process %d: Sent response to %s: %s\n", getpid(), client, buffer);
             }
         }
+        mem_release_idle_buffer(&request_buf, &request_cap); // Bounded-memory mode: idle connections hold no large buffer
+        if (mem_low_memory()) arena_trim(); // Nor scratch memory: this arena serves only this connection
     }
 
     close(client_sock);
-    printf("Child process %d: Client connection %s:%d closed, exiting.\n", getpid(), client_ip, ntohs(client_addr.sin_port));
+    free(request_buf);
+    printf("Child process %d: Client connection %s closed, exiting.\n", getpid(), client);
     exit(EXIT_SUCCESS); // Child process exits after handling client
 }
 
+static Admission admission; // Caps the connection processes alive at once
+
 // Basic SIGCHLD handler to prevent zombie processes
-void sigchld_handler(int sig) {
+static void sigchld_handler(int sig) {
     (void)sig; // Unused parameter
-    // Reap all terminated children without blocking
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    // Reap all terminated children without blocking, each one a connection done
+    while (waitpid(-1, NULL, WNOHANG) > 0) admission_leave(&admission);
 }
 
-int main() {
+int concurrent_tcp_processes_main(int argc, char* argv[]) {
+    int port = rpc_server_port(argc, argv, PORT);
     int server_fd, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+    struct sockaddr_in server_addr;
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len;
+    char client[RPC_PEER_STRLEN];
     pid_t pid;
 
+    admission_init(&admission);
+
     // Setup SIGCHLD handler
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa)); // Initialize sa structure
@@ -110,40 +124,80 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
+    // With --hot-restart, the sockets are taken over from the server running now
+    int listeners[2];
+    int listener_count = hot_restart_requested(argc, argv) ? hot_restart_inherit(port, listeners, 2) : 0;
+    if (listener_count < 0) perror("No server to take over from, starting fresh");
+    if (listener_count > 0) {
+        server_fd = listeners[0];
+    } else {
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_fd < 0) {
+            perror("Socket creation failed");
+            exit(EXIT_FAILURE);
+        }
 
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt SO_REUSEADDR failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
-    }
+        int opt = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+            perror("setsockopt SO_REUSEADDR failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port);
 
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
-    }
+        if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("Bind failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
 
-    if (listen(server_fd, 10) < 0) { // Using a common backlog value
-        perror("Listen failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+        if (listen(server_fd, 10) < 0) { // Using a common backlog value
+            perror("Listen failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+
+        // Local clients can skip the TCP/IP stack through a Unix socket
+        listeners[0] = server_fd;
+        listeners[1] = rpc_unix_listen(port, SOCK_STREAM);
+        listener_count = listeners[1] >= 0 ? 2 : 1;
+        if (listeners[1] < 0) perror("Unix socket listener unavailable");
     }
 
-    printf("Concurrent TCP Processes RPC Server listening on port %d...\n", PORT);
+    // Options from RPC_SOCKET_PROFILE (socket_profile.h), for inherited sockets too
+    if (rpc_tune_server_socket(server_fd, SOCK_STREAM) < 0) perror("Socket profile not fully applied");
+
+    sched = priority_sched_create(1);
+    dispatch_init();
+
+    // Workers stay on the CPUs from RPC_CPU_LIST / RPC_CPU_NIC (cpu_affinity.h), each on one
+    CpuAffinity affinity;
+    if (cpu_affinity_init(&affinity) != 0) perror("CPU affinity ignored");
+    if (cpu_affinity_confine(&affinity) != 0) perror("CPU affinity not applied");
+
+    // A successor asks for the sockets through the control socket
+    int control_fd = hot_restart_listen(port);
+    int watched[3];
+    memcpy(watched, listeners, listener_count * sizeof(int));
+    watched[listener_count] = control_fd;
+    int watched_count = listener_count + (control_fd >= 0);
+
+    printf("Concurrent TCP Processes RPC Server listening on port %d...\n", port);
 
     while (1) {
-        client_sock = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
+        int ready_fd = rpc_wait_readable(watched, watched_count);
+        if (ready_fd < 0) continue;
+        if (ready_fd == control_fd) {
+            // Queued connections are the successor's to accept; open ones are finished here
+            if (hot_restart_handoff(control_fd, listeners, listener_count) == 0) break;
+            continue;
+        } // Also interrupted by SIGCHLD
+        client_addr_len = sizeof(client_addr);
+        client_sock = accept(ready_fd, (struct sockaddr *)&client_addr, &client_addr_len);
         if (client_sock < 0) {
             // Check if accept was interrupted by SIGCHLD, and continue if so
             if (errno == EINTR) {
@@ -152,23 +206,40 @@ int main() {
             perror("Accept failed");
             continue;
         }
+        if (!admission_enter(&admission)) {
+            rpc_reject_connection(client_sock, "concurrent_tcp_processes");
+            continue;
+        }
 
+        // Where its packets arrive, else the next CPU in turn; the turns are counted here, not in the child
+        int cpu = cpu_affinity_pick(&affinity, client_sock);
         pid = fork();
         if (pid < 0) {
             perror("Fork failed");
             close(client_sock);
+            admission_leave(&admission);
             continue;
         }
 
         if (pid == 0) { // Child process
-            close(server_fd);
-            handle_client_connection(client_sock, client_addr);
+            cpu_affinity_pin_self(cpu);
+            for (int i = 0; i < listener_count; i++) close(listeners[i]);
+            rpc_peer_string((struct sockaddr *)&client_addr, client_addr_len, client, sizeof(client));
+            handle_client_connection(client_sock, client);
             // handle_client_connection calls exit()
         } else { // Parent process
             close(client_sock);
         }
     }
 
+    printf("Handed the sockets over to the new server, draining.\n");
+    admission_drain(&admission); // SIGCHLD counts the children out
     close(server_fd);
     return 0;
 }
+
+#ifndef RPC_SERVER_BUNDLE
+int main(int argc, char* argv[]) {
+    return concurrent_tcp_processes_main(argc, argv);
+}
+#endif
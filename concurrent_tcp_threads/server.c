@@ -8,7 +8,18 @@
 #include <time.h> // For logging if kept
 
 #include "rpc_protocol.h" // Paths for root dir (using -I../../)
-#include "calculator_ops.h" // Paths for root dir (using -I../../)
+#include "rpc_dispatch.h" // Paths for root dir (using -I../../)
+#include "vector_ops.h"
+#include "rpc_stream.h"
+#include "shm_transport.h"
+#include "unix_socket.h"
+#include "admission.h"
+#include "hot_restart.h"
+#include "socket_profile.h"
+#include "cpu_affinity.h"
+#include "server_main.h"
+#include "mem_pool.h"
+#include "priority_sched.h"
 
 #define PORT 9002 // Changed port
 #define BUF_SIZE RPC_BUFFER_SIZE
@@ -23,139 +34,198 @@
 typedef struct {
     int client_sock;
     // int client_id; // Optional, can be simplified
-    struct sockaddr_in client_addr;
+    char peer[RPC_PEER_STRLEN]; // Client address for logging, from rpc_peer_string()
 } ClientData;
 
-void *handle_client(void *arg) {
+static Admission admission; // Caps the connection threads alive at once
+static Slab* client_slab;   // ClientData, allocated by the accept loop, freed by the connection's thread
+static PrioritySched* sched; // Slots for the compute of all connection threads
+
+static void *handle_client(void *arg) {
     ClientData *data = (ClientData *)arg;
     char buffer[BUF_SIZE];
+    char* request_buf = NULL; // Grows with the requests; arrays can make them large
+    size_t request_cap = 0;
     RpcRequest req;
     RpcResponse resp;
-    CalcResult calc_res;
 
     // Optional: logging client connection
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(data->client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-    printf("Thread %lu: Connection from %s:%d\n", pthread_self(), client_ip, ntohs(data->client_addr.sin_port));
+    const char* client = data->peer;
+    printf("Thread %lu: Connection from %s\n", pthread_self(), client);
 
     strcpy(resp.server_type, "concurrent_tcp_threads");
 
     // Loop to handle multiple requests on the same connection if client supports it
     // (current rpc_client makes a new connection per call)
     while(1) {
-        memset(buffer, 0, BUF_SIZE);
-        ssize_t bytes_received = recv(data->client_sock, buffer, BUF_SIZE - 1, 0);
+        long long arrival_us;
+        ssize_t bytes_received = rpc_recv_request_grow(data->client_sock, &request_buf, &request_cap, &arrival_us);
 
         if (bytes_received <= 0) {
             if (bytes_received == 0) {
-                printf("Thread %lu: Client %s:%d disconnected.\n", pthread_self(), client_ip, ntohs(data->client_addr.sin_port));
+                printf("Thread %lu: Client %s disconnected.\n", pthread_self(), client);
             } else {
                 perror("Recv error");
             }
             break; // Exit loop, thread will terminate
         }
-        buffer[bytes_received] = '\0';
-
-        if (unmarshal_request(buffer, &req) != 0) {
-            fprintf(stderr, "Thread %lu: Failed to unmarshal request: %s\n", pthread_self(), buffer);
+        if (unmarshal_request(request_buf, &req) != 0) {
+            fprintf(stderr, "Thread %lu: Failed to unmarshal request: %.200s\n", pthread_self(), request_buf);
             strcpy(resp.error, "Server error: Bad request format");
             resp.result = 0;
+            resp.request_id = 0;
         } else {
             if (req.operation == OP_EXIT) {
-                printf("Thread %lu: Client %s:%d requested exit.\n", pthread_self(), client_ip, ntohs(data->client_addr.sin_port));
+                printf("Thread %lu: Client %s requested exit.\n", pthread_self(), client);
                 // Optionally send a confirmation, then break.
                 break;
             }
-            printf("Thread %lu: Op %d, op1 %.2f, op2 %.2f from %s:%d\n", pthread_self(), req.operation, req.op1, req.op2, client_ip, ntohs(data->client_addr.sin_port));
-
-            switch (req.operation) {
-                case OP_ADD:      calc_res = add(req.op1, req.op2); break;
-                case OP_SUBTRACT: calc_res = subtract(req.op1, req.op2); break;
-                case OP_MULTIPLY: calc_res = multiply(req.op1, req.op2); break;
-                case OP_DIVIDE:   calc_res = divide(req.op1, req.op2); break;
-                default:
-                    snprintf(calc_res.error, sizeof(calc_res.error), "Invalid operation: %d", req.operation);
-                    calc_res.value = 0;
-                    break;
+            if (req.operation == OP_STREAM) {
+                // The stream runs to completion here, replies included
+                if (rpc_stream_serve(data->client_sock, &req, &resp) != 0) break;
+                continue;
             }
-            resp.result = calc_res.value;
-            strcpy(resp.error, calc_res.error);
+            printf("Thread %lu: Op %d, op1 %.2f, op2 %.2f from %s\n", pthread_self(), req.operation, req.op1, req.op2, client);
+
+            priority_sched_dispatch(sched, &req, &resp);
         }
 
         memset(buffer, 0, BUF_SIZE);
         if (marshal_response(&resp, buffer, BUF_SIZE) != 0) {
-            fprintf(stderr, "Thread %lu: Failed to marshal response for %s:%d.\n", pthread_self(), client_ip, ntohs(data->client_addr.sin_port));
+            fprintf(stderr, "Thread %lu: Failed to marshal response for %s.\n", pthread_self(), client);
             // If marshalling fails, we can't send a useful error to client here
         } else {
             ssize_t bytes_sent = send(data->client_sock, buffer, strlen(buffer), 0);
             if (bytes_sent < 0) {
                 perror("Send error");
             } else {
-                printf("Thread %lu: Sent response to %s:%d: %s\n", pthread_self(), client_ip, ntohs(data->client_addr.sin_port), buffer);
+                printf("Thread %lu: Sent response to %s: %s\n", pthread_self(), client, buffer);
             }
         }
+        mem_release_idle_buffer(&request_buf, &request_cap); // Bounded-memory mode: idle connections hold no large buffer
+        if (mem_low_memory()) arena_trim(); // Nor scratch memory: this arena serves only this connection
     }
 
     close(data->client_sock);
-    printf("Thread %lu: Client connection %s:%d closed.\n", pthread_self(), client_ip, ntohs(data->client_addr.sin_port));
-    free(data);
+    free(request_buf);
+    printf("Thread %lu: Client connection %s closed.\n", pthread_self(), client);
+    slab_free(data);
+    admission_leave(&admission);
     pthread_exit(NULL);
 }
 
-int main() {
+int concurrent_tcp_threads_main(int argc, char* argv[]) {
+    int port = rpc_server_port(argc, argv, PORT);
     int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+    struct sockaddr_in server_addr;
+    struct sockaddr_storage client_addr;
+    socklen_t addr_len;
     // pthread_mutex_init(&lock, NULL); // If session_counter and lock are used
 
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
+    // With --hot-restart, the sockets are taken over from the server running now
+    int listeners[2];
+    int listener_count = hot_restart_requested(argc, argv) ? hot_restart_inherit(port, listeners, 2) : 0;
+    if (listener_count < 0) perror("No server to take over from, starting fresh");
+    if (listener_count > 0) {
+        server_sock = listeners[0];
+    } else {
+        server_sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_sock < 0) {
+            perror("Socket creation failed");
+            exit(EXIT_FAILURE);
+        }
 
-    int opt = 1;
-    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt SO_REUSEADDR failed");
-        close(server_sock);
-        exit(EXIT_FAILURE);
+        int opt = 1;
+        if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+            perror("setsockopt SO_REUSEADDR failed");
+            close(server_sock);
+            exit(EXIT_FAILURE);
+        }
+
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+
+        if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("Bind failed");
+            close(server_sock);
+            exit(EXIT_FAILURE);
+        }
+
+        if (listen(server_sock, 10) < 0) { // Original listen backlog was 10
+            perror("Listen failed");
+            close(server_sock);
+            exit(EXIT_FAILURE);
+        }
+
+        // Local clients can skip the TCP/IP stack through a Unix socket
+        listeners[0] = server_sock;
+        listeners[1] = rpc_unix_listen(port, SOCK_STREAM);
+        listener_count = listeners[1] >= 0 ? 2 : 1;
+        if (listeners[1] < 0) perror("Unix socket listener unavailable");
     }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+    // Options from RPC_SOCKET_PROFILE (socket_profile.h), for inherited sockets too
+    if (rpc_tune_server_socket(server_sock, SOCK_STREAM) < 0) perror("Socket profile not fully applied");
 
-    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(server_sock);
+    admission_init(&admission);
+    sched = priority_sched_create(0);
+    dispatch_init();
+    client_slab = slab_create(sizeof(ClientData)); // Owned by this thread, which runs the accept loop
+    if (!client_slab) {
+        perror("Failed to create ClientData slab");
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_sock, 10) < 0) { // Original listen backlog was 10
-        perror("Listen failed");
-        close(server_sock);
-        exit(EXIT_FAILURE);
+    // Workers stay on the CPUs from RPC_CPU_LIST / RPC_CPU_NIC (cpu_affinity.h), each on one
+    CpuAffinity affinity;
+    if (cpu_affinity_init(&affinity) != 0) perror("CPU affinity ignored");
+    if (cpu_affinity_confine(&affinity) != 0) perror("CPU affinity not applied");
+    vector_ops_set_threads((int)sysconf(_SC_NPROCESSORS_ONLN)); // Large reductions may use every core
+    // Local clients can also call through shared memory, answered by one service thread per core
+    if (shm_server_start(port, (int)sysconf(_SC_NPROCESSORS_ONLN), "concurrent_tcp_threads") != 0) {
+        perror("Shared-memory transport unavailable");
     }
 
-    printf("Concurrent TCP Threads RPC Server listening on port %d...\n", PORT);
+    // A successor asks for the sockets through the control socket
+    int control_fd = hot_restart_listen(port);
+    int watched[3];
+    memcpy(watched, listeners, listener_count * sizeof(int));
+    watched[listener_count] = control_fd;
+    int watched_count = listener_count + (control_fd >= 0);
+
+    printf("Concurrent TCP Threads RPC Server listening on port %d...\n", port);
     // log_message("Server started and listening..."); // If logging kept
 
     while (1) {
-        client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &addr_len);
+        int ready_fd = rpc_wait_readable(watched, watched_count);
+        if (ready_fd < 0) continue;
+        if (ready_fd == control_fd) {
+            // Queued connections are the successor's to accept; open ones are finished here
+            if (hot_restart_handoff(control_fd, listeners, listener_count) == 0) break;
+            continue;
+        }
+        addr_len = sizeof(client_addr);
+        client_sock = accept(ready_fd, (struct sockaddr *)&client_addr, &addr_len);
         if (client_sock < 0) {
             perror("Accept failed"); // Log or print, then continue
             continue;
         }
+        if (!admission_enter(&admission)) {
+            rpc_reject_connection(client_sock, "concurrent_tcp_threads");
+            continue;
+        }
 
-        ClientData *data = malloc(sizeof(ClientData));
+        ClientData *data = slab_alloc(client_slab);
         if (!data) {
             perror("Failed to allocate memory for client data");
             close(client_sock);
+            admission_leave(&admission);
             continue;
         }
         data->client_sock = client_sock;
-        data->client_addr = client_addr; // Store client address if needed for logging
+        rpc_peer_string((struct sockaddr *)&client_addr, addr_len, data->peer, sizeof(data->peer)); // Client address for logging
 
         // If using session_counter for client_id
         // pthread_mutex_lock(&lock);
@@ -165,16 +235,31 @@ int main() {
 
 
         pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_client, data) != 0) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        mem_thread_stack(&attr); // A small stack in bounded-memory mode
+        cpu_affinity_pin_attr(&attr, cpu_affinity_pick(&affinity, client_sock)); // Where its packets arrive
+        if (pthread_create(&tid, &attr, handle_client, data) != 0) {
             perror("Failed to create thread");
-            free(data); // Free data if thread creation failed
+            slab_free(data); // Free data if thread creation failed
             close(client_sock); // Close client socket
+            admission_leave(&admission);
         } else {
             pthread_detach(tid); // Detach thread so resources are freed on exit
         }
+        pthread_attr_destroy(&attr);
     }
 
+    printf("Handed the sockets over to the new server, draining.\n");
+    shm_server_retire();
+    admission_drain(&admission);
     close(server_sock);
     // pthread_mutex_destroy(&lock); // If lock is used
     return 0;
 }
+
+#ifndef RPC_SERVER_BUNDLE
+int main(int argc, char* argv[]) {
+    return concurrent_tcp_threads_main(argc, argv);
+}
+#endif
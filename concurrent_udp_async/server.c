@@ -9,18 +9,59 @@
 #include <errno.h>     // For errno
 
 #include "rpc_protocol.h" // Headers from root via -I../
-#include "calculator_ops.h" // Headers from root via -I../
+#include "rpc_dispatch.h" // Headers from root via -I../
+#include "response_cache.h"
+#include "micro_batch.h"
+#include "unix_socket.h"
+#include "admission.h"
+#include "hot_restart.h"
+#include "socket_profile.h"
+#include "cpu_affinity.h"
+#include "server_main.h"
 
 #define PORT 9008 // Changed port
 #define BUF_SIZE RPC_BUFFER_SIZE
+#define REQUEST_BUF_SIZE RPC_MAX_DATAGRAM_SIZE // Requests may carry operand arrays, replies never do
 #define MAX_EVENTS 10
 
+// Scalar requests decoded close together are computed as one batch (micro_batch.h)
+static MicroBatch batch;
+
+// Where the reply to each request in the batch goes
+typedef struct {
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+} BatchedPeer;
+static BatchedPeer batch_peers[MICRO_BATCH_MAX];
+
+// Computes the open batch and sends its replies, caching them like the others
+static void run_batch(ResponseCache* response_cache) {
+    char response_buf[BUF_SIZE];
+    int n = micro_batch_run(&batch);
+    for (int i = 0; i < n; i++) {
+        BatchedPeer* peer = &batch_peers[i];
+        memset(response_buf, 0, BUF_SIZE);
+        if (marshal_response(&batch.responses[i], response_buf, BUF_SIZE) != 0) {
+            fprintf(stderr, "Failed to marshal batched response.\n");
+            response_cache_release(response_cache, (struct sockaddr *)&peer->addr, peer->addr_len,
+                                   batch.responses[i].request_id);
+            continue;
+        }
+        response_cache_store(response_cache, (struct sockaddr *)&peer->addr, peer->addr_len,
+                             batch.responses[i].request_id, response_buf);
+        if (sendto(peer->fd, response_buf, strlen(response_buf), 0, (struct sockaddr *)&peer->addr, peer->addr_len) < 0) {
+            perror("sendto error");
+        }
+    }
+}
+
 // Simplified logging
 void server_log(const char *msg) {
     printf("%s\n", msg);
 }
 
-int make_socket_non_blocking(int sockfd) {
+static int make_socket_non_blocking(int sockfd) {
     int flags = fcntl(sockfd, F_GETFL, 0);
     if (flags == -1) {
         perror("fcntl(F_GETFL)");
@@ -33,45 +74,59 @@ int make_socket_non_blocking(int sockfd) {
     return 0;
 }
 
-int main() {
-    int sockfd, epfd;
-    struct sockaddr_in server_addr, client_addr;
+int concurrent_udp_async_main(int argc, char* argv[]) {
+    int port = rpc_server_port(argc, argv, PORT);
+    int sockfd, unix_fd, epfd;
+    struct sockaddr_in server_addr;
+    struct sockaddr_storage client_addr;
     socklen_t client_addr_len;
-    char request_buf[BUF_SIZE];
+    char request_buf[REQUEST_BUF_SIZE];
     char response_buf[BUF_SIZE];
     RpcRequest req;
     RpcResponse resp;
-    CalcResult calc_res;
+    ResponseCache* response_cache;
+    Admission admission;
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
+    // With --hot-restart, the sockets are taken over from the server running now
+    int inherited[2];
+    int inherited_count = hot_restart_requested(argc, argv) ? hot_restart_inherit(port, inherited, 2) : 0;
+    if (inherited_count < 0) perror("No server to take over from, starting fresh");
+    if (inherited_count > 0) {
+        sockfd = inherited[0]; // Already bound and non-blocking
+    } else {
+        sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sockfd < 0) {
+            perror("Socket creation failed");
+            exit(EXIT_FAILURE);
+        }
 
-    if (make_socket_non_blocking(sockfd) == -1) {
-        close(sockfd);
-        exit(EXIT_FAILURE);
-    }
+        if (make_socket_non_blocking(sockfd) == -1) {
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
 
-    int opt = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt SO_REUSEADDR failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
-    }
+        int opt = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+            perror("setsockopt SO_REUSEADDR failed");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port);
 
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+        if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("Bind failed");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
     }
 
+    // Options from RPC_SOCKET_PROFILE (socket_profile.h), for inherited sockets too
+    if (rpc_tune_server_socket(sockfd, SOCK_DGRAM) < 0) perror("Socket profile not fully applied");
+
     epfd = epoll_create1(0);
     if (epfd == -1) {
         perror("epoll_create1 failed");
@@ -89,10 +144,50 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    printf("Async UDP RPC Server (epoll) listening on port %d...\n", PORT);
+    // Local clients can skip the UDP/IP stack through a Unix datagram socket
+    unix_fd = inherited_count > 1 ? inherited[1] : rpc_unix_listen(port, SOCK_DGRAM);
+    if (unix_fd < 0) {
+        perror("Unix socket listener unavailable");
+    } else {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = unix_fd;
+        if (make_socket_non_blocking(unix_fd) == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, unix_fd, &ev) == -1) {
+            perror("epoll_ctl ADD unix_fd failed");
+            close(unix_fd);
+            unix_fd = -1;
+        }
+    }
+
+    // Datagrams queue in the socket buffer until the loop gets to them; stamps tell how long
+    admission_init(&admission);
+    rpc_enable_arrival_time(sockfd);
+    if (unix_fd >= 0) rpc_enable_arrival_time(unix_fd);
+
+    response_cache = response_cache_create(0);
+    dispatch_init();
+    micro_batch_init(&batch, "concurrent_udp_async");
+
+    // The one worker stays on one CPU from RPC_CPU_LIST / RPC_CPU_NIC (cpu_affinity.h)
+    CpuAffinity affinity;
+    if (cpu_affinity_init(&affinity) != 0) perror("CPU affinity ignored");
+    if (cpu_affinity_pin_self(cpu_affinity_pick(&affinity, -1)) != 0) perror("CPU affinity not applied");
+
+    // A successor asks for the sockets through the control socket
+    int control_fd = hot_restart_listen(port);
+    if (control_fd >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.fd = control_fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, control_fd, &ev) == -1) {
+            perror("epoll_ctl ADD control_fd failed");
+        }
+    }
+
+    printf("Async UDP RPC Server (epoll) listening on port %d...\n", port);
 
-    while (1) {
-        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    int handed_over = 0;
+    while (!handed_over) {
+        // Wakes early when a batch that waits for more requests is due
+        int n = micro_batch_epoll_wait(&batch, epfd, events, MAX_EVENTS, -1);
         if (n == -1) {
             if (errno == EINTR) continue;
             perror("epoll_wait failed");
@@ -100,14 +195,22 @@ int main() {
         }
 
         for (int i = 0; i < n; ++i) {
-            if (events[i].data.fd == sockfd) {
+            if (events[i].data.fd == control_fd) {
+                // Datagrams still queued are the successor's to read
+                int listeners[2] = { sockfd, unix_fd };
+                if (hot_restart_handoff(control_fd, listeners, unix_fd >= 0 ? 2 : 1) == 0) {
+                    handed_over = 1;
+                    break;
+                }
+            } else if (events[i].data.fd == sockfd || events[i].data.fd == unix_fd) {
+                int ready_fd = events[i].data.fd;
                 while(1) {
                     client_addr_len = sizeof(client_addr);
                     memset(&client_addr, 0, sizeof(client_addr));
-                    memset(request_buf, 0, BUF_SIZE);
 
-                    ssize_t bytes_received = recvfrom(sockfd, request_buf, BUF_SIZE - 1, 0,
-                                                     (struct sockaddr *)&client_addr, &client_addr_len);
+                    long long arrival_us;
+                    ssize_t bytes_received = rpc_recv_stamped(ready_fd, request_buf, REQUEST_BUF_SIZE - 1, 0,
+                                                              (struct sockaddr *)&client_addr, &client_addr_len, &arrival_us);
 
                     if (bytes_received < 0) {
                         if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -117,40 +220,56 @@ int main() {
                         break;
                     }
                     request_buf[bytes_received] = '\0';
+                    if (admission_codel_shed(&admission, arrival_us)) {
+                        // Not cached: a retransmission may find the queue shorter
+                        rpc_send_busy(ready_fd, request_buf, bytes_received, "concurrent_udp_async",
+                                      (struct sockaddr *)&client_addr, client_addr_len);
+                        continue;
+                    }
 
-                    char client_ip_str[INET_ADDRSTRLEN];
-                    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip_str, INET_ADDRSTRLEN);
-                    // printf("Request from %s:%d, data: %s\n", client_ip_str, ntohs(client_addr.sin_port), request_buf);
+                    char client[RPC_PEER_STRLEN];
+                    rpc_peer_string((struct sockaddr *)&client_addr, client_addr_len, client, sizeof(client));
+                    // printf("Request from %s, data: %s\n", client, request_buf);
 
                     strcpy(resp.server_type, "concurrent_udp_async");
+                    int cached = 0, claim;
 
                     if (unmarshal_request(request_buf, &req) != 0) {
-                        fprintf(stderr, "Failed to unmarshal request from %s:%d : %s\n", client_ip_str, ntohs(client_addr.sin_port), request_buf);
+                        fprintf(stderr, "Failed to unmarshal request from %s : %.200s\n", client, request_buf);
                         strcpy(resp.error, "Server error: Bad request format");
                         resp.result = 0;
-                    } else {
-                        // printf("Op %d, op1 %.2f, op2 %.2f from %s:%d\n", req.operation, req.op1, req.op2, client_ip_str, ntohs(client_addr.sin_port));
-                        switch (req.operation) {
-                            case OP_ADD:      calc_res = add(req.op1, req.op2); break;
-                            case OP_SUBTRACT: calc_res = subtract(req.op1, req.op2); break;
-                            case OP_MULTIPLY: calc_res = multiply(req.op1, req.op2); break;
-                            case OP_DIVIDE:   calc_res = divide(req.op1, req.op2); break;
-                            default:
-                                snprintf(calc_res.error, sizeof(calc_res.error), "Invalid operation: %d", req.operation);
-                                calc_res.value = 0;
-                                break;
+                        resp.request_id = 0;
+                    } else if ((claim = response_cache_claim(response_cache, (struct sockaddr *)&client_addr, client_addr_len, req.request_id, response_buf, BUF_SIZE)) == RESPONSE_CACHE_HIT) {
+                        cached = 1; // Retransmission of a request we already answered: resend the stored reply
+                    } else if (claim == RESPONSE_CACHE_PENDING) {
+                        continue; // Retransmission of a request waiting in the batch: its reply answers both
+                    } else if (micro_batch_accepts(&batch, &req)) {
+                        // Answered when the batch runs, after this burst or a little later
+                        int slot = micro_batch_add(&batch, &req);
+                        if (slot < 0) {
+                            run_batch(response_cache);
+                            slot = micro_batch_add(&batch, &req);
                         }
-                        resp.result = calc_res.value;
-                        strcpy(resp.error, calc_res.error);
+                        batch_peers[slot].fd = ready_fd;
+                        batch_peers[slot].addr = client_addr;
+                        batch_peers[slot].addr_len = client_addr_len;
+                        continue;
+                    } else {
+                        // printf("Op %d, op1 %.2f, op2 %.2f from %s\n", req.operation, req.op1, req.op2, client);
+                        dispatch_request(&req, &resp);
                     }
 
-                    memset(response_buf, 0, BUF_SIZE);
-                    if (marshal_response(&resp, response_buf, BUF_SIZE) != 0) {
-                        fprintf(stderr, "Failed to marshal response for %s:%d.\n", client_ip_str, ntohs(client_addr.sin_port));
-                        continue;
+                    if (!cached) {
+                        memset(response_buf, 0, BUF_SIZE);
+                        if (marshal_response(&resp, response_buf, BUF_SIZE) != 0) {
+                            fprintf(stderr, "Failed to marshal response for %s.\n", client);
+                            response_cache_release(response_cache, (struct sockaddr *)&client_addr, client_addr_len, resp.request_id);
+                            continue;
+                        }
+                        response_cache_store(response_cache, (struct sockaddr *)&client_addr, client_addr_len, resp.request_id, response_buf);
                     }
 
-                    ssize_t bytes_sent = sendto(sockfd, response_buf, strlen(response_buf), 0,
+                    ssize_t bytes_sent = sendto(ready_fd, response_buf, strlen(response_buf), 0,
                                                (struct sockaddr *)&client_addr, client_addr_len);
                     if (bytes_sent < 0) {
                         perror("sendto error");
@@ -160,9 +279,18 @@ int main() {
                 }
             }
         }
+        if (micro_batch_due(&batch)) run_batch(response_cache);
     }
 
+    run_batch(response_cache); // Requests taken before the handoff are still ours to answer
+    printf("Handed the sockets over to the new server, exiting.\n");
     close(sockfd);
     close(epfd);
     return 0;
 }
+
+#ifndef RPC_SERVER_BUNDLE
+int main(int argc, char* argv[]) {
+    return concurrent_udp_async_main(argc, argv);
+}
+#endif
@@ -11,75 +11,95 @@
 #include <errno.h>     // For errno, EINTR
 
 #include "rpc_protocol.h" // Headers from root via -I../
-#include "calculator_ops.h" // Headers from root via -I../
+#include "rpc_dispatch.h" // Headers from root via -I../
+#include "response_cache.h"
+#include "unix_socket.h"
+#include "admission.h"
+#include "hot_restart.h"
+#include "socket_profile.h"
+#include "cpu_affinity.h"
+#include "server_main.h"
+#include "priority_sched.h"
 
 #define PORT 9007 // Changed port
 #define BUF_SIZE RPC_BUFFER_SIZE
+#define REQUEST_BUF_SIZE RPC_MAX_DATAGRAM_SIZE // Requests may carry operand arrays, replies never do
+
+// Lives in shared memory so replies computed by one child are visible to the next
+static ResponseCache* response_cache;
+static PrioritySched* sched; // Shared memory too, so the request processes share its slots
+static Admission admission; // Caps the request processes alive at once
 
 // Basic SIGCHLD handler to prevent zombie processes
-void sigchld_handler(int sig) {
+static void sigchld_handler(int sig) {
     (void)sig; // Unused parameter
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    while (waitpid(-1, NULL, WNOHANG) > 0) admission_leave(&admission);
 }
 
-void process_client_request(int server_sockfd, const char* request_buf, ssize_t data_len, struct sockaddr_in client_addr, socklen_t client_addr_len) {
+static void process_client_request(int server_sockfd, const char* request_buf, ssize_t data_len, struct sockaddr_storage client_addr, socklen_t client_addr_len) {
     char response_buf[BUF_SIZE];
     RpcRequest req;
     RpcResponse resp;
-    CalcResult calc_res;
 
-    char current_request_copy[BUF_SIZE + 1];
+    char current_request_copy[REQUEST_BUF_SIZE + 1];
     memcpy(current_request_copy, request_buf, data_len);
     current_request_copy[data_len] = '\0';
 
-    char client_ip_str[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip_str, INET_ADDRSTRLEN);
-    // printf("Child PID %d: Handling request from %s:%d. Data: %s\n", getpid(), client_ip_str, ntohs(client_addr.sin_port), current_request_copy);
+    char client[RPC_PEER_STRLEN];
+    rpc_peer_string((struct sockaddr *)&client_addr, client_addr_len, client, sizeof(client));
+    // printf("Child PID %d: Handling request from %s. Data: %s\n", getpid(), client, current_request_copy);
 
 
     strcpy(resp.server_type, "concurrent_udp_processes");
+    int cached = 0, pending = 0, claim;
 
     if (unmarshal_request(current_request_copy, &req) != 0) {
-        fprintf(stderr, "Child PID %d: Failed to unmarshal request from %s:%d: %s\n", getpid(), client_ip_str, ntohs(client_addr.sin_port), current_request_copy);
+        fprintf(stderr, "Child PID %d: Failed to unmarshal request from %s: %.200s\n", getpid(), client, current_request_copy);
         strcpy(resp.error, "Server error: Bad request format");
         resp.result = 0;
+        resp.request_id = 0;
+    } else if ((claim = response_cache_claim(response_cache, (struct sockaddr *)&client_addr, client_addr_len, req.request_id, response_buf, BUF_SIZE)) == RESPONSE_CACHE_HIT) {
+        cached = 1; // Retransmission of a request we already answered: resend the stored reply
+    } else if (claim == RESPONSE_CACHE_PENDING) {
+        pending = 1; // Retransmission of a request another child is computing: its reply answers both
     } else {
-        // printf("Child PID %d: Op %d, op1 %.2f, op2 %.2f from %s:%d\n", getpid(), req.operation, req.op1, req.op2, client_ip_str, ntohs(client_addr.sin_port));
-        switch (req.operation) {
-            case OP_ADD:      calc_res = add(req.op1, req.op2); break;
-            case OP_SUBTRACT: calc_res = subtract(req.op1, req.op2); break;
-            case OP_MULTIPLY: calc_res = multiply(req.op1, req.op2); break;
-            case OP_DIVIDE:   calc_res = divide(req.op1, req.op2); break;
-            default:
-                snprintf(calc_res.error, sizeof(calc_res.error), "Invalid operation: %d", req.operation);
-                calc_res.value = 0;
-                break;
-        }
-        resp.result = calc_res.value;
-        strcpy(resp.error, calc_res.error);
+        // printf("Child PID %d: Op %d, op1 %.2f, op2 %.2f from %s\n", getpid(), req.operation, req.op1, req.op2, client);
+        priority_sched_dispatch(sched, &req, &resp);
     }
 
-    memset(response_buf, 0, BUF_SIZE);
-    if (marshal_response(&resp, response_buf, BUF_SIZE) != 0) {
-        fprintf(stderr, "Child PID %d: Failed to marshal response for %s:%d.\n", getpid(), client_ip_str, ntohs(client_addr.sin_port));
+    if (!cached) {
+        memset(response_buf, 0, BUF_SIZE);
+    }
+    if (pending) {
+        // Nothing to send
+    } else if (!cached && marshal_response(&resp, response_buf, BUF_SIZE) != 0) {
+        fprintf(stderr, "Child PID %d: Failed to marshal response for %s.\n", getpid(), client);
+        response_cache_release(response_cache, (struct sockaddr *)&client_addr, client_addr_len, resp.request_id);
     } else {
+        if (!cached) {
+            response_cache_store(response_cache, (struct sockaddr *)&client_addr, client_addr_len, resp.request_id, response_buf);
+        }
         ssize_t bytes_sent = sendto(server_sockfd, response_buf, strlen(response_buf), 0,
                                     (struct sockaddr *)&client_addr, client_addr_len);
         if (bytes_sent < 0) {
             perror("sendto error in child process");
         } else {
-            // printf("Child PID %d: Sent response: %s to %s:%d\n", getpid(), response_buf, client_ip_str, ntohs(client_addr.sin_port));
+            // printf("Child PID %d: Sent response: %s to %s\n", getpid(), response_buf, client);
         }
     }
     exit(EXIT_SUCCESS);
 }
 
 
-int main() {
+int concurrent_udp_processes_main(int argc, char* argv[]) {
+    int port = rpc_server_port(argc, argv, PORT);
     int sockfd;
-    struct sockaddr_in server_addr, client_addr;
+    struct sockaddr_in server_addr;
+    struct sockaddr_storage client_addr;
     socklen_t client_addr_len;
-    char request_buf[BUF_SIZE];
+    char request_buf[REQUEST_BUF_SIZE];
+
+    admission_init(&admission);
 
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
@@ -91,41 +111,83 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
+    // With --hot-restart, the sockets are taken over from the server running now
+    int listeners[2];
+    int listener_count = hot_restart_requested(argc, argv) ? hot_restart_inherit(port, listeners, 2) : 0;
+    if (listener_count < 0) perror("No server to take over from, starting fresh");
+    if (listener_count > 0) {
+        sockfd = listeners[0];
+    } else {
+        sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sockfd < 0) {
+            perror("Socket creation failed");
+            exit(EXIT_FAILURE);
+        }
 
-    int opt = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt SO_REUSEADDR failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
-    }
+        int opt = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+            perror("setsockopt SO_REUSEADDR failed");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port);
 
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+        if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("Bind failed");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
+
+        // Local clients can skip the UDP/IP stack through a Unix datagram socket
+        listeners[0] = sockfd;
+        listeners[1] = rpc_unix_listen(port, SOCK_DGRAM);
+        listener_count = listeners[1] >= 0 ? 2 : 1;
+        if (listeners[1] < 0) perror("Unix socket listener unavailable");
     }
 
-    printf("Concurrent UDP Processes RPC Server listening on port %d...\n", PORT);
+    // Options from RPC_SOCKET_PROFILE (socket_profile.h), for inherited sockets too
+    if (rpc_tune_server_socket(sockfd, SOCK_DGRAM) < 0) perror("Socket profile not fully applied");
+
+    for (int i = 0; i < listener_count; i++) rpc_enable_arrival_time(listeners[i]);
+
+    response_cache = response_cache_create(1);
+    sched = priority_sched_create(1);
+    dispatch_init();
+
+    // Workers stay on the CPUs from RPC_CPU_LIST / RPC_CPU_NIC (cpu_affinity.h), each on one
+    CpuAffinity affinity;
+    if (cpu_affinity_init(&affinity) != 0) perror("CPU affinity ignored");
+    if (cpu_affinity_confine(&affinity) != 0) perror("CPU affinity not applied");
+
+    // A successor asks for the sockets through the control socket
+    int control_fd = hot_restart_listen(port);
+    int watched[3];
+    memcpy(watched, listeners, listener_count * sizeof(int));
+    watched[listener_count] = control_fd;
+    int watched_count = listener_count + (control_fd >= 0);
+
+    printf("Concurrent UDP Processes RPC Server listening on port %d...\n", port);
 
     while (1) {
         client_addr_len = sizeof(client_addr);
         memset(&client_addr, 0, sizeof(client_addr));
-        memset(request_buf, 0, BUF_SIZE);
 
         // Read into request_buf, ensuring space for null termination if needed by child processing
         // The child process_client_request now creates a local copy and null terminates.
-        ssize_t bytes_received = recvfrom(sockfd, request_buf, BUF_SIZE, 0,
-                                          (struct sockaddr *)&client_addr, &client_addr_len);
+        int ready_fd = rpc_wait_readable(watched, watched_count);
+        if (ready_fd < 0) continue;
+        if (ready_fd == control_fd) {
+            // Datagrams still queued are the successor's to read; running children still reply
+            if (hot_restart_handoff(control_fd, listeners, listener_count) == 0) break;
+            continue;
+        } // Also interrupted by SIGCHLD
+        long long arrival_us;
+        ssize_t bytes_received = rpc_recv_stamped(ready_fd, request_buf, REQUEST_BUF_SIZE, 0,
+                                                  (struct sockaddr *)&client_addr, &client_addr_len, &arrival_us);
 
         if (bytes_received < 0) {
             if (errno == EINTR) continue;
@@ -133,23 +195,42 @@ int main() {
             continue;
         }
 
+        // Overloaded: answer BUSY from here rather than fork another child
+        if (admission_codel_shed(&admission, arrival_us) || !admission_enter(&admission)) {
+            rpc_send_busy(ready_fd, request_buf, bytes_received, "concurrent_udp_processes",
+                          (struct sockaddr *)&client_addr, client_addr_len);
+            continue;
+        }
+
+        // Where the datagram arrived, else the next CPU in turn; the turns are counted here, not in the child
+        int cpu = cpu_affinity_pick(&affinity, ready_fd);
         pid_t pid = fork();
 
         if (pid < 0) {
             perror("Fork failed");
+            admission_leave(&admission);
             continue;
         }
 
         if (pid == 0) { // Child process
+            cpu_affinity_pin_self(cpu);
             // Note: Child does not need to close sockfd as it's a datagram socket and not connection-oriented.
             // It uses the inherited sockfd to send the reply.
-            process_client_request(sockfd, request_buf, bytes_received, client_addr, client_addr_len);
+            process_client_request(ready_fd, request_buf, bytes_received, client_addr, client_addr_len);
             // process_client_request calls exit()
         } else { // Parent process
             // Parent continues to listen for new requests
         }
     }
 
+    printf("Handed the sockets over to the new server, draining.\n");
+    admission_drain(&admission); // SIGCHLD counts the children out
     close(sockfd);
     return 0;
 }
+
+#ifndef RPC_SERVER_BUNDLE
+int main(int argc, char* argv[]) {
+    return concurrent_udp_processes_main(argc, argv);
+}
+#endif
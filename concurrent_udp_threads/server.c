@@ -9,140 +9,230 @@
 #include <pthread.h>
 
 #include "rpc_protocol.h" // Headers from root via -I../
-#include "calculator_ops.h" // Headers from root via -I../
+#include "rpc_dispatch.h" // Headers from root via -I../
+#include "response_cache.h"
+#include "vector_ops.h"
+#include "unix_socket.h"
+#include "admission.h"
+#include "hot_restart.h"
+#include "socket_profile.h"
+#include "cpu_affinity.h"
+#include "server_main.h"
+#include "mem_pool.h"
+#include "priority_sched.h"
 
 #define PORT 9006 // Changed port
 #define BUF_SIZE RPC_BUFFER_SIZE
-#define MAX_REQUEST_DATA_SIZE BUF_SIZE
+#define MAX_REQUEST_DATA_SIZE RPC_MAX_DATAGRAM_SIZE // Requests may carry operand arrays, replies never do
 
 typedef struct {
-    int server_sockfd;
-    struct sockaddr_in client_addr;
+    int server_sockfd; // The socket the request came in on, IPv4 or Unix
+    struct sockaddr_storage client_addr;
     socklen_t client_addr_len;
-    char request_data[MAX_REQUEST_DATA_SIZE];
+    char request_data[MAX_REQUEST_DATA_SIZE + 1]; // Null-terminated in place for unmarshalling
     ssize_t data_len;
 } ThreadData;
 
-void *handle_request_thread(void *arg) {
+static ResponseCache* response_cache; // Shared by all request threads, internally locked
+static Admission admission; // Caps the request threads alive at once
+static Slab* thread_data_slab; // ThreadData, allocated by the receive loop, freed by the request's thread
+static PrioritySched* sched; // Slots for the compute of all request threads
+
+static void *handle_request_thread(void *arg) {
     ThreadData *td = (ThreadData *)arg;
     char response_buf[BUF_SIZE];
     RpcRequest req;
     RpcResponse resp;
-    CalcResult calc_res;
 
-    char client_ip_str[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &td->client_addr.sin_addr, client_ip_str, INET_ADDRSTRLEN);
-    // printf("Thread %lu: Handling request from %s:%d. Data len: %zd\n", pthread_self(), client_ip_str, ntohs(td->client_addr.sin_port), td->data_len);
+    char client[RPC_PEER_STRLEN];
+    rpc_peer_string((struct sockaddr *)&td->client_addr, td->client_addr_len, client, sizeof(client));
+    // printf("Thread %lu: Handling request from %s. Data len: %zd\n", pthread_self(), client, td->data_len);
 
-    // Copy request data to a local buffer and null-terminate it for sscanf-based unmarshalling
-    char current_request_buffer[MAX_REQUEST_DATA_SIZE + 1];
-    memcpy(current_request_buffer, td->request_data, td->data_len);
+    // Null-terminate in place for the unmarshalling; a copy would need a 64 KB stack
+    char* current_request_buffer = td->request_data;
     current_request_buffer[td->data_len] = '\0';
-    // printf("Thread %lu: Request buffer: \"%s\"\n", pthread_self(), current_request_buffer);
 
 
     strcpy(resp.server_type, "concurrent_udp_threads");
+    int cached = 0, pending = 0, claim;
 
     if (unmarshal_request(current_request_buffer, &req) != 0) {
-        fprintf(stderr, "Thread %lu: Failed to unmarshal request from %s:%d: %s\n", pthread_self(), client_ip_str, ntohs(td->client_addr.sin_port), current_request_buffer);
+        fprintf(stderr, "Thread %lu: Failed to unmarshal request from %s: %.200s\n", pthread_self(), client, current_request_buffer);
         strcpy(resp.error, "Server error: Bad request format");
         resp.result = 0;
+        resp.request_id = 0;
+    } else if ((claim = response_cache_claim(response_cache, (struct sockaddr *)&td->client_addr, td->client_addr_len, req.request_id, response_buf, BUF_SIZE)) == RESPONSE_CACHE_HIT) {
+        cached = 1; // Retransmission of a request we already answered: resend the stored reply
+    } else if (claim == RESPONSE_CACHE_PENDING) {
+        pending = 1; // Retransmission of a request another thread is computing: its reply answers both
     } else {
-        // printf("Thread %lu: Op %d, op1 %.2f, op2 %.2f from %s:%d\n", pthread_self(), req.operation, req.op1, req.op2, client_ip_str, ntohs(td->client_addr.sin_port));
-        switch (req.operation) {
-            case OP_ADD:      calc_res = add(req.op1, req.op2); break;
-            case OP_SUBTRACT: calc_res = subtract(req.op1, req.op2); break;
-            case OP_MULTIPLY: calc_res = multiply(req.op1, req.op2); break;
-            case OP_DIVIDE:   calc_res = divide(req.op1, req.op2); break;
-            default:
-                snprintf(calc_res.error, sizeof(calc_res.error), "Invalid operation: %d", req.operation);
-                calc_res.value = 0;
-                break;
-        }
-        resp.result = calc_res.value;
-        strcpy(resp.error, calc_res.error);
+        // printf("Thread %lu: Op %d, op1 %.2f, op2 %.2f from %s\n", pthread_self(), req.operation, req.op1, req.op2, client);
+        priority_sched_dispatch(sched, &req, &resp);
     }
 
-    memset(response_buf, 0, BUF_SIZE);
-    if (marshal_response(&resp, response_buf, BUF_SIZE) != 0) {
-        fprintf(stderr, "Thread %lu: Failed to marshal response for %s:%d.\n", pthread_self(), client_ip_str, ntohs(td->client_addr.sin_port));
+    if (!cached) {
+        memset(response_buf, 0, BUF_SIZE);
+    }
+    if (pending) {
+        // Nothing to send
+    } else if (!cached && marshal_response(&resp, response_buf, BUF_SIZE) != 0) {
+        fprintf(stderr, "Thread %lu: Failed to marshal response for %s.\n", pthread_self(), client);
+        response_cache_release(response_cache, (struct sockaddr *)&td->client_addr, td->client_addr_len, resp.request_id);
     } else {
+        if (!cached) {
+            response_cache_store(response_cache, (struct sockaddr *)&td->client_addr, td->client_addr_len, resp.request_id, response_buf);
+        }
         ssize_t bytes_sent = sendto(td->server_sockfd, response_buf, strlen(response_buf), 0,
                                     (struct sockaddr *)&td->client_addr, td->client_addr_len);
         if (bytes_sent < 0) {
             perror("sendto error in thread");
         } else {
-            // printf("Thread %lu: Sent response: %s to %s:%d\n", pthread_self(), response_buf, client_ip_str, ntohs(td->client_addr.sin_port));
+            // printf("Thread %lu: Sent response: %s to %s\n", pthread_self(), response_buf, client);
         }
     }
 
-    free(td);
+    slab_free(td);
+    admission_leave(&admission);
     pthread_exit(NULL);
 }
 
-int main() {
+int concurrent_udp_threads_main(int argc, char* argv[]) {
+    int port = rpc_server_port(argc, argv, PORT);
     int sockfd;
     struct sockaddr_in server_addr;
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
+    // With --hot-restart, the sockets are taken over from the server running now
+    int listeners[2];
+    int listener_count = hot_restart_requested(argc, argv) ? hot_restart_inherit(port, listeners, 2) : 0;
+    if (listener_count < 0) perror("No server to take over from, starting fresh");
+    if (listener_count > 0) {
+        sockfd = listeners[0];
+    } else {
+        sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sockfd < 0) {
+            perror("Socket creation failed");
+            exit(EXIT_FAILURE);
+        }
 
-    int opt = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt SO_REUSEADDR failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+        int opt = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+            perror("setsockopt SO_REUSEADDR failed");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
+
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port);
+
+        if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("Bind failed");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
+
+        // Local clients can skip the UDP/IP stack through a Unix datagram socket
+        listeners[0] = sockfd;
+        listeners[1] = rpc_unix_listen(port, SOCK_DGRAM);
+        listener_count = listeners[1] >= 0 ? 2 : 1;
+        if (listeners[1] < 0) perror("Unix socket listener unavailable");
     }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    // Options from RPC_SOCKET_PROFILE (socket_profile.h), for inherited sockets too
+    if (rpc_tune_server_socket(sockfd, SOCK_DGRAM) < 0) perror("Socket profile not fully applied");
+
+    admission_init(&admission);
+    for (int i = 0; i < listener_count; i++) rpc_enable_arrival_time(listeners[i]);
 
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(sockfd);
+    response_cache = response_cache_create(0);
+    sched = priority_sched_create(0);
+    thread_data_slab = slab_create(sizeof(ThreadData)); // Owned by this thread, which runs the receive loop
+    if (!thread_data_slab) {
+        perror("Failed to create ThreadData slab");
         exit(EXIT_FAILURE);
     }
+    dispatch_init();
+
+    // Workers stay on the CPUs from RPC_CPU_LIST / RPC_CPU_NIC (cpu_affinity.h), each on one
+    CpuAffinity affinity;
+    if (cpu_affinity_init(&affinity) != 0) perror("CPU affinity ignored");
+    if (cpu_affinity_confine(&affinity) != 0) perror("CPU affinity not applied");
+    vector_ops_set_threads((int)sysconf(_SC_NPROCESSORS_ONLN)); // Large reductions may use every core
 
-    printf("Concurrent UDP Threads RPC Server listening on port %d...\n", PORT);
+    // A successor asks for the sockets through the control socket
+    int control_fd = hot_restart_listen(port);
+    int watched[3];
+    memcpy(watched, listeners, listener_count * sizeof(int));
+    watched[listener_count] = control_fd;
+    int watched_count = listener_count + (control_fd >= 0);
+
+    printf("Concurrent UDP Threads RPC Server listening on port %d...\n", port);
 
     while (1) {
-        ThreadData *td = malloc(sizeof(ThreadData));
+        int ready_fd = rpc_wait_readable(watched, watched_count);
+        if (ready_fd < 0) continue;
+        if (ready_fd == control_fd) {
+            // Datagrams still queued are the successor's to read; running threads still reply
+            if (hot_restart_handoff(control_fd, listeners, listener_count) == 0) break;
+            continue;
+        }
+
+        ThreadData *td = slab_alloc(thread_data_slab);
         if (!td) {
             perror("Failed to allocate memory for ThreadData");
             continue;
         }
 
-        td->server_sockfd = sockfd;
+        td->server_sockfd = ready_fd;
         td->client_addr_len = sizeof(td->client_addr);
         memset(&td->client_addr, 0, sizeof(td->client_addr)); // Clear client_addr
 
         // Receive into td->request_data, leaving space for null terminator if needed by sscanf in unmarshal
-        // MAX_REQUEST_DATA_SIZE is BUF_SIZE, ensure unmarshal_request is robust or data is null-terminated
-        ssize_t bytes_received = recvfrom(sockfd, td->request_data, MAX_REQUEST_DATA_SIZE, 0,
-                                          (struct sockaddr *)&td->client_addr, &td->client_addr_len);
+        // Ensure unmarshal_request is robust or data is null-terminated
+        long long arrival_us;
+        ssize_t bytes_received = rpc_recv_stamped(ready_fd, td->request_data, MAX_REQUEST_DATA_SIZE, 0,
+                                                  (struct sockaddr *)&td->client_addr, &td->client_addr_len, &arrival_us);
 
         if (bytes_received < 0) {
             perror("recvfrom error in main loop");
-            free(td);
+            slab_free(td);
             continue;
         }
         td->data_len = bytes_received;
-        // Null termination is handled in the thread by copying to a local buffer of size MAX_REQUEST_DATA_SIZE + 1
+        // Null termination is handled in the thread, in place
+
+        // Overloaded: answer BUSY from here rather than start another thread
+        if (admission_codel_shed(&admission, arrival_us) || !admission_enter(&admission)) {
+            rpc_send_busy(ready_fd, td->request_data, td->data_len, "concurrent_udp_threads",
+                          (struct sockaddr *)&td->client_addr, td->client_addr_len);
+            slab_free(td);
+            continue;
+        }
 
         pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_request_thread, td) != 0) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        mem_thread_stack(&attr); // A small stack in bounded-memory mode
+        cpu_affinity_pin_attr(&attr, cpu_affinity_pick(&affinity, ready_fd)); // Where the datagram arrived
+        if (pthread_create(&tid, &attr, handle_request_thread, td) != 0) {
             perror("Failed to create thread");
-            free(td);
+            slab_free(td);
+            admission_leave(&admission);
         } else {
             pthread_detach(tid);
         }
+        pthread_attr_destroy(&attr);
     }
 
+    printf("Handed the sockets over to the new server, draining.\n");
+    admission_drain(&admission);
     close(sockfd);
     return 0;
 }
+
+#ifndef RPC_SERVER_BUNDLE
+int main(int argc, char* argv[]) {
+    return concurrent_udp_threads_main(argc, argv);
+}
+#endif
@@ -0,0 +1,296 @@
+// conn_bench.c: server memory per open connection, for each TCP server model.
+// Starts every model from ./rpc_server on a spare port, once as it is and
+// once in bounded-memory mode (RPC_LOW_MEMORY=1, see rpc_core/mem_pool.h),
+// opens --conns connections to it and reports the server's memory per
+// connection in KiB at three points:
+//   idle    every connection accepted, nothing sent yet
+//   active  every connection in the middle of an array request
+//   after   every request answered, the connections open and idle again
+// Memory is the proportional set size (PSS) of the server and its child
+// processes, so pages that forked children share are counted once. Untouched
+// thread stacks take no resident memory, so the address space per idle
+// connection is shown as well (virt). Idle and request timeouts are turned
+// off (timer_wheel.h). The iterative server accepts one connection at a time
+// and is not measured.
+#define _GNU_SOURCE // For strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rpc_core/rpc_protocol.h"
+#include "rpc_core/admission.h" // For the limits turned off in the servers
+#include "rpc_core/mem_pool.h"  // For RPC_LOW_MEMORY_ENV
+#include "rpc_core/timer_wheel.h" // For the connection timeouts
+
+#define BENCH_DEFAULT_CONNS 10000
+#define BENCH_PORT 9100          // First port; each run takes the next one
+#define BENCH_VALUES 1000        // Values in the array request of an active connection
+#define BENCH_SETTLE_MS 250      // Memory is read again after this until it holds still
+#define BENCH_SETTLE_MAX_MS 60000
+#define BENCH_TIMEOUT_S 10       // For a connect() or a reply
+#define BENCH_SERVER_EXE "./rpc_server"
+
+static const char* models[] = {
+    "concurrent_tcp_threads",
+    "concurrent_tcp_processes",
+    "concurrent_tcp_async",
+    "concurrent_tcp_coroutines",
+    "concurrent_dual_async",
+};
+static const int num_models = sizeof(models) / sizeof(models[0]);
+
+static void sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+// A "Key:  123 kB" line from a /proc file of pid, in KiB; 0 if it is gone
+static long proc_kb(int pid, const char* file, const char* key) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+    FILE* f = fopen(path, "r");
+    if (!f) return 0;
+    size_t key_len = strlen(key);
+    long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, key_len) == 0) {
+            kb = atol(line + key_len);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+// Parent pid from /proc/<pid>/stat; the command may contain spaces, so read after its ')'
+static int parent_of(int pid) {
+    char path[64], stat[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+    size_t n = fread(stat, 1, sizeof(stat) - 1, f);
+    fclose(f);
+    stat[n] = '\0';
+    char* end = strrchr(stat, ')');
+    int ppid;
+    return end && sscanf(end + 1, " %*c %d", &ppid) == 1 ? ppid : -1;
+}
+
+typedef struct {
+    long pss_kb;  // Resident, with shared pages split between the processes sharing them
+    long virt_kb; // Address space, thread stacks included whether touched or not
+} Usage;
+
+// Memory of the server and its children
+static Usage server_usage(int server_pid) {
+    Usage u = { proc_kb(server_pid, "smaps_rollup", "Pss:"), proc_kb(server_pid, "status", "VmSize:") };
+    DIR* proc = opendir("/proc");
+    if (!proc) return u;
+    struct dirent* e;
+    while ((e = readdir(proc)) != NULL) {
+        int pid = atoi(e->d_name);
+        if (pid > 0 && pid != server_pid && parent_of(pid) == server_pid) {
+            u.pss_kb += proc_kb(pid, "smaps_rollup", "Pss:");
+            u.virt_kb += proc_kb(pid, "status", "VmSize:");
+        }
+    }
+    closedir(proc);
+    return u;
+}
+
+// Reads the memory until two readings in a row agree within 1%: threads and
+// processes are still being started while the server catches up
+static Usage settled_usage(int server_pid) {
+    Usage last = server_usage(server_pid);
+    for (long waited = 0; waited < BENCH_SETTLE_MAX_MS; waited += BENCH_SETTLE_MS) {
+        sleep_ms(BENCH_SETTLE_MS);
+        Usage now = server_usage(server_pid);
+        if (labs(now.pss_kb - last.pss_kb) * 100 <= last.pss_kb) return now;
+        last = now;
+    }
+    return last;
+}
+
+static int connect_to(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    // A server that stops keeping up ends the run with the connections it has
+    struct timeval tv = { BENCH_TIMEOUT_S, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int start_server(const char* model, int port, int low_memory) {
+    fflush(stdout); // Or the child writes out what is buffered too
+    int pid = fork();
+    if (pid != 0) return pid;
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    // Every connection must be let in and kept, whatever its wait
+    setenv(RPC_MAX_INFLIGHT_ENV, "0", 1);
+    setenv(RPC_MAX_QUEUE_ENV, "0", 1);
+    setenv(RPC_CODEL_TARGET_ENV, "0", 1);
+    setenv(RPC_IDLE_TIMEOUT_ENV, "0", 1);
+    setenv(RPC_REQUEST_TIMEOUT_ENV, "0", 1);
+    setenv(RPC_LOW_MEMORY_ENV, low_memory ? "1" : "0", 1);
+    setpgid(0, 0); // So the children of the processes model can be stopped together
+    if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr)) _exit(1);
+    execl(BENCH_SERVER_EXE, BENCH_SERVER_EXE, "--model", model, "--port", port_arg, (char*)NULL);
+    _exit(127);
+}
+
+static void stop_server(int pid) {
+    kill(-pid, SIGKILL);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+// Sends all but the last byte of request on every connection, measures, then
+// sends the rest and checks every reply. Returns the number of good replies.
+// A connection that fails is closed and set to -1.
+static int run_requests(int* socks, int conns, const char* request, int server_pid, Usage* active) {
+    size_t len = strlen(request);
+    for (int i = 0; i < conns; i++) {
+        if (send(socks[i], request, len - 1, MSG_NOSIGNAL) < 0) {
+            close(socks[i]);
+            socks[i] = -1;
+        }
+    }
+    *active = settled_usage(server_pid);
+    for (int i = 0; i < conns; i++) {
+        if (socks[i] >= 0 && send(socks[i], request + len - 1, 1, MSG_NOSIGNAL) < 0) {
+            close(socks[i]);
+            socks[i] = -1;
+        }
+    }
+    int good = 0;
+    for (int i = 0; i < conns; i++) {
+        char reply[RPC_BUFFER_SIZE];
+        if (socks[i] < 0) continue;
+        ssize_t n = recv(socks[i], reply, sizeof(reply) - 1, 0);
+        if (n <= 0) continue;
+        reply[n] = '\0';
+        RpcResponse resp;
+        if (unmarshal_response(reply, &resp) == 0 && resp.error[0] == '\0' && resp.result == BENCH_VALUES) good++;
+    }
+    return good;
+}
+
+static void bench_model(const char* model, int low_memory, int port, int conns, const char* request) {
+    int pid = start_server(model, port, low_memory);
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    int probe = -1;
+    for (int tries = 0; tries < 100 && (probe = connect_to(port)) < 0; tries++) sleep_ms(50);
+    if (probe < 0) {
+        fprintf(stderr, "%s did not start on port %d\n", model, port);
+        stop_server(pid);
+        return;
+    }
+    close(probe);
+    Usage base = settled_usage(pid);
+
+    int* socks = malloc(conns * sizeof(int));
+    int opened = 0;
+    while (opened < conns && (socks[opened] = connect_to(port)) >= 0) opened++;
+    Usage idle = settled_usage(pid);
+
+    Usage active;
+    int good = run_requests(socks, opened, request, pid, &active);
+    Usage after = settled_usage(pid);
+
+    double per = opened > 0 ? (double)opened : 1.0;
+    printf("%-26s %-8s %7d %9.1f %8.1f %8.1f %8.1f %9.1f", model, low_memory ? "bounded" : "default", opened,
+           base.pss_kb / 1024.0, (idle.pss_kb - base.pss_kb) / per, (active.pss_kb - base.pss_kb) / per,
+           (after.pss_kb - base.pss_kb) / per, (idle.virt_kb - base.virt_kb) / per);
+    if (good < opened) printf("  (%d of %d requests failed)", opened - good, opened);
+    printf("\n");
+    fflush(stdout);
+
+    for (int i = 0; i < opened; i++) {
+        if (socks[i] >= 0) close(socks[i]);
+    }
+    free(socks);
+    stop_server(pid);
+}
+
+int main(int argc, char* argv[]) {
+    int conns = BENCH_DEFAULT_CONNS;
+    const char* only = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--conns") == 0 && i + 1 < argc) {
+            conns = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--model") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--conns N] [--model NAME]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (conns < 1) conns = BENCH_DEFAULT_CONNS;
+    if (access(BENCH_SERVER_EXE, X_OK) != 0) {
+        fprintf(stderr, "%s not found; run conn_bench from the repository root after make\n", BENCH_SERVER_EXE);
+        return 1;
+    }
+
+    // One descriptor per connection here, and in the servers, which inherit the limit
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+        if (files.rlim_cur < (rlim_t)conns + 64) {
+            conns = (int)files.rlim_cur - 64;
+            fprintf(stderr, "Descriptor limit allows %d connections\n", conns);
+        }
+    }
+
+    double* values = malloc(BENCH_VALUES * sizeof(double));
+    for (int i = 0; i < BENCH_VALUES; i++) values[i] = 1;
+    RpcRequest req = {0};
+    req.operation = OP_SUM;
+    req.vec = values;
+    req.vec_len = BENCH_VALUES;
+    size_t size = rpc_request_size(OP_SUM, BENCH_VALUES);
+    char* request = malloc(size);
+    if (!request || marshal_request(&req, request, size) != 0) {
+        fprintf(stderr, "Failed to marshal the request\n");
+        return 1;
+    }
+
+    printf("%d connections per model; %zu-byte SUM requests; KiB per connection\n", conns,
+           strlen(request));
+    printf("%-26s %-8s %7s %9s %8s %8s %8s %9s\n", "model", "mode", "conns", "base_MiB", "idle_KiB", "actv_KiB",
+           "aftr_KiB", "virt_KiB");
+    int port = BENCH_PORT;
+    for (int m = 0; m < num_models; m++) {
+        if (only && !strcasestr(models[m], only)) continue;
+        bench_model(models[m], 0, port++, conns, request);
+        bench_model(models[m], 1, port++, conns, request);
+    }
+    free(request);
+    free(values);
+    return 0;
+}
@@ -0,0 +1,273 @@
+// conn_check.c: how the servers that keep connections open handle their
+// bytes. Starts each model from ./rpc_server on a spare port with short
+// timeouts and checks that
+//   pipelined  requests sent back to back in one segment are all answered, in order
+//   split      a request cut in the middle of a field gets one reply, once whole
+//   arrays     an array request with a scalar one behind it gets both replies
+// and, for concurrent_tcp_async, which has connection timers, that
+//   trickle    a request trickling in a byte at a time is cut off at the request timeout
+//   idle       a connection with nothing to send is closed at the idle timeout
+// Prints one line per check and model; exits with 1 if any failed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rpc_core/rpc_protocol.h"
+#include "rpc_core/admission.h"   // For the limits turned off in the server
+#include "rpc_core/timer_wheel.h" // For the connection timeouts
+
+#define CHECK_PORT 9190 // The first model's; each next model takes the port after
+#define CHECK_IDLE_MS 300
+#define CHECK_REQUEST_MS 500
+#define CHECK_PIPELINED 100     // Requests in the longer pipeline
+#define CHECK_VALUES 1000       // Values in the array request
+#define CHECK_REPLY_WAIT_MS 2000
+#define CHECK_QUIET_MS 200      // No further reply may arrive in this long
+#define CHECK_SERVER_EXE "./rpc_server"
+
+// The models checked, by directory name
+static const struct {
+    const char* name;
+    int timers; // Closes trickling and idle connections
+} models[] = {
+    { "concurrent_tcp_async", 1 },
+    { "concurrent_tcp_coroutines", 0 },
+    { "concurrent_dual_async", 0 },
+};
+static const int num_models = sizeof(models) / sizeof(models[0]);
+
+static const char* model; // The one being checked
+static int failures;
+
+static void sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int connect_to(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int send_all(int sock, const char* data, size_t len) {
+    for (size_t sent = 0; sent < len;) {
+        ssize_t n = send(sock, data + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        sent += (size_t)n;
+    }
+    return 0;
+}
+
+// Waits up to ms for data. Returns the bytes read, 0 at EOF, -1 on a timeout or an error.
+static ssize_t recv_within(int sock, char* buf, size_t cap, long ms) {
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return recv(sock, buf, cap, 0);
+}
+
+// Reads until want replies have arrived, then checks no further one follows.
+// Replies run together on the stream; each starts with its RES field. Their
+// results go to results. Returns the number of replies read.
+static int read_replies(int sock, double* results, int want) {
+    static char stream[256 * 1024];
+    size_t len = 0;
+    int got = 0;
+    long long until = now_ms() + CHECK_REPLY_WAIT_MS;
+    while (now_ms() < until) {
+        ssize_t n = recv_within(sock, stream + len, sizeof(stream) - 1 - len, got >= want ? CHECK_QUIET_MS : 100);
+        if (n <= 0) {
+            if (got >= want) break;
+            if (n == 0) break;
+            continue;
+        }
+        len += (size_t)n;
+        stream[len] = '\0';
+        // A reply is whole once the next one starts or the stream ends with its STYPE field
+        got = 0;
+        for (char* p = stream; (p = strstr(p, "RES:")) != NULL; p += 4) {
+            char* next = strstr(p + 4, "RES:");
+            char* stype = strstr(p, "STYPE:");
+            if (!stype || (next && stype > next) || !strchr(stype, ';')) break;
+            if (got < want) results[got] = strtod(p + 4, NULL);
+            got++;
+        }
+        if (got > want) break;
+    }
+    return got;
+}
+
+static void report(const char* check, int ok, const char* detail) {
+    printf("%-26s %-10s %s%s%s\n", model, check, ok ? "ok" : "FAILED", detail[0] ? ": " : "", detail);
+    if (!ok) failures++;
+}
+
+static void check_pipelined(int port) {
+    char detail[128] = "";
+    int sock = connect_to(port);
+    double results[CHECK_PIPELINED + 1];
+    const char* two = "OP:MUL;OP1:3;OP2:4;OP:ADD;OP1:1;OP2:1;";
+    int ok = sock >= 0 && send_all(sock, two, strlen(two)) == 0;
+    int got = ok ? read_replies(sock, results, 2) : 0;
+    ok = ok && got == 2 && results[0] == 12 && results[1] == 2;
+    if (!ok) snprintf(detail, sizeof(detail), "2 requests in one segment, %d replies", got);
+
+    // A longer pipeline through the same connection, each reply naming its request
+    static char many[CHECK_PIPELINED * 48];
+    size_t len = 0;
+    for (int i = 0; i < CHECK_PIPELINED; i++) {
+        len += (size_t)snprintf(many + len, sizeof(many) - len, "OP:ADD;OP1:%d;OP2:1000;ID:%d;", i, i + 1);
+    }
+    if (ok && send_all(sock, many, len) == 0) {
+        got = read_replies(sock, results, CHECK_PIPELINED);
+        for (int i = 0; i < CHECK_PIPELINED && i < got; i++) {
+            if (results[i] != i + 1000) ok = 0;
+        }
+        if (got != CHECK_PIPELINED) ok = 0;
+        if (!ok) snprintf(detail, sizeof(detail), "%d requests in a row, %d replies", CHECK_PIPELINED, got);
+    }
+    if (sock >= 0) close(sock);
+    report("pipelined", ok, detail);
+}
+
+static void check_split(int port) {
+    char detail[128] = "";
+    int sock = connect_to(port);
+    double result;
+    int ok = sock >= 0 && send_all(sock, "OP:MUL;O", 8) == 0;
+    sleep_ms(50);
+    ok = ok && send_all(sock, "P1:3;OP2:4;", 11) == 0;
+    int got = ok ? read_replies(sock, &result, 1) : 0;
+    ok = ok && got == 1 && result == 12;
+    if (!ok) snprintf(detail, sizeof(detail), "request in two segments, %d replies", got);
+    if (sock >= 0) close(sock);
+    report("split", ok, detail);
+}
+
+static void check_arrays(int port) {
+    char detail[128] = "";
+    double values[CHECK_VALUES];
+    for (int i = 0; i < CHECK_VALUES; i++) values[i] = 1;
+    RpcRequest req = {0};
+    req.operation = OP_SUM;
+    req.vec = values;
+    req.vec_len = CHECK_VALUES;
+    size_t size = rpc_request_size(OP_SUM, CHECK_VALUES) + 64;
+    char* request = malloc(size);
+    const char* add = "OP:ADD;OP1:2;OP2:3;";
+    int ok = request && marshal_request(&req, request, size) == 0;
+    if (ok) strcat(request, add);
+    int sock = ok ? connect_to(port) : -1;
+    double results[2];
+    ok = sock >= 0 && send_all(sock, request, strlen(request)) == 0;
+    int got = ok ? read_replies(sock, results, 2) : 0;
+    ok = ok && got == 2 && results[0] == CHECK_VALUES && results[1] == 5;
+    if (!ok) snprintf(detail, sizeof(detail), "SUM and ADD in one send, %d replies", got);
+    if (sock >= 0) close(sock);
+    free(request);
+    report("arrays", ok, detail);
+}
+
+// Sends one byte every step_ms until the server closes; returns the time it took, or -1
+static long long closed_after(int sock, const char* trickle, long step_ms) {
+    long long start = now_ms();
+    char buf[256];
+    for (size_t i = 0; now_ms() - start < 10 * CHECK_REQUEST_MS; i++) {
+        if (trickle && send(sock, trickle + i % strlen(trickle), 1, MSG_NOSIGNAL) < 0) return now_ms() - start;
+        if (recv_within(sock, buf, sizeof(buf), step_ms) == 0) return now_ms() - start;
+    }
+    return -1;
+}
+
+static void check_timeouts(int port) {
+    char detail[128];
+    int sock = connect_to(port);
+    long long ms = sock >= 0 ? closed_after(sock, "OP:ADD;OP1:1;OP2:", 100) : -1;
+    snprintf(detail, sizeof(detail), "closed after %lld ms, timeout %d ms", ms, CHECK_REQUEST_MS);
+    report("trickle", ms >= CHECK_REQUEST_MS - 50 && ms < 3 * CHECK_REQUEST_MS, detail);
+    if (sock >= 0) close(sock);
+
+    sock = connect_to(port);
+    ms = sock >= 0 ? closed_after(sock, NULL, 50) : -1;
+    snprintf(detail, sizeof(detail), "closed after %lld ms, timeout %d ms", ms, CHECK_IDLE_MS);
+    report("idle", ms >= CHECK_IDLE_MS - 50 && ms < 3 * CHECK_IDLE_MS, detail);
+    if (sock >= 0) close(sock);
+}
+
+// Starts the model on port; returns its pid, or -1 if it did not come up
+static int start_server(int port) {
+    fflush(stdout); // Or the child writes out what is buffered too
+    int pid = fork();
+    if (pid == 0) {
+        char port_arg[16], idle[16], request[16];
+        snprintf(port_arg, sizeof(port_arg), "%d", port);
+        snprintf(idle, sizeof(idle), "%d", CHECK_IDLE_MS);
+        snprintf(request, sizeof(request), "%d", CHECK_REQUEST_MS);
+        setenv(RPC_MAX_INFLIGHT_ENV, "0", 1);
+        setenv(RPC_CODEL_TARGET_ENV, "0", 1);
+        setenv(RPC_IDLE_TIMEOUT_ENV, idle, 1);
+        setenv(RPC_REQUEST_TIMEOUT_ENV, request, 1);
+        if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr)) _exit(1);
+        execl(CHECK_SERVER_EXE, CHECK_SERVER_EXE, "--model", model, "--port", port_arg, (char*)NULL);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    int probe = -1;
+    for (int tries = 0; tries < 100 && (probe = connect_to(port)) < 0; tries++) sleep_ms(50);
+    if (probe < 0) {
+        fprintf(stderr, "%s did not start on port %d\n", model, port);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    close(probe);
+    return pid;
+}
+
+int main(void) {
+    if (access(CHECK_SERVER_EXE, X_OK) != 0) {
+        fprintf(stderr, "%s not found; run conn_check from the repository root after make\n", CHECK_SERVER_EXE);
+        return 1;
+    }
+    for (int m = 0; m < num_models; m++) {
+        model = models[m].name;
+        int port = CHECK_PORT + m;
+        int pid = start_server(port);
+        if (pid < 0) {
+            failures++;
+            continue;
+        }
+        check_pipelined(port);
+        check_split(port);
+        check_arrays(port);
+        if (models[m].timers) check_timeouts(port);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    return failures ? 1 : 0;
+}
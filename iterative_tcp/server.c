@@ -8,84 +8,150 @@
 
 // Adjust relative paths as necessary if headers are at root
 #include "rpc_protocol.h"
-#include "calculator_ops.h"
+#include "rpc_dispatch.h"
+#include "rpc_stream.h"
+#include "unix_socket.h"
+#include "admission.h"
+#include "hot_restart.h"
+#include "socket_profile.h"
+#include "cpu_affinity.h"
+#include "server_main.h"
 
 #define PORT 9001 // Changed port
 #define BUF_SIZE RPC_BUFFER_SIZE // Use defined RPC buffer size
 
-int main() {
+int iterative_tcp_main(int argc, char* argv[]) {
+    int port = rpc_server_port(argc, argv, PORT);
     int server_fd, new_socket;
     struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
+    struct sockaddr_storage peer_addr;
+    socklen_t addrlen;
+    char peer[RPC_PEER_STRLEN];
     char buffer[BUF_SIZE];
+    char* request_buf = malloc(RPC_MAX_MESSAGE_SIZE); // Requests with operand arrays can be much larger than replies
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == 0) {
-        perror("Socket failed");
+    if (!request_buf) {
+        perror("Failed to allocate request buffer");
         exit(EXIT_FAILURE);
     }
 
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt SO_REUSEADDR failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
-    }
+    // With --hot-restart, the sockets are taken over from the server running now
+    int listeners[2];
+    int listener_count = hot_restart_requested(argc, argv) ? hot_restart_inherit(port, listeners, 2) : 0;
+    if (listener_count < 0) perror("No server to take over from, starting fresh");
+    if (listener_count > 0) {
+        server_fd = listeners[0];
+    } else {
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_fd == 0) {
+            perror("Socket failed");
+            exit(EXIT_FAILURE);
+        }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+        int opt = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+            perror("setsockopt SO_REUSEADDR failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("Bind failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
-    }
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
 
-    if (listen(server_fd, 5) < 0) {
-        perror("Listen failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+        if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            perror("Bind failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+
+        if (listen(server_fd, 5) < 0) {
+            perror("Listen failed");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+        }
+
+        // Local clients can skip the TCP/IP stack through a Unix socket
+        listeners[0] = server_fd;
+        listeners[1] = rpc_unix_listen(port, SOCK_STREAM);
+        listener_count = listeners[1] >= 0 ? 2 : 1;
+        if (listeners[1] < 0) perror("Unix socket listener unavailable");
     }
 
-    printf("Iterative TCP RPC Server listening on port %d...\n", PORT);
+    // Options from RPC_SOCKET_PROFILE (socket_profile.h), for inherited sockets too
+    if (rpc_tune_server_socket(server_fd, SOCK_STREAM) < 0) perror("Socket profile not fully applied");
+
+    // Connections queue in the kernel while one is served; stamps tell how long
+    Admission admission;
+    admission_init(&admission);
+    rpc_enable_arrival_time(server_fd);
+
+    dispatch_init();
+
+    // The one worker stays on one CPU from RPC_CPU_LIST / RPC_CPU_NIC (cpu_affinity.h)
+    CpuAffinity affinity;
+    if (cpu_affinity_init(&affinity) != 0) perror("CPU affinity ignored");
+    if (cpu_affinity_pin_self(cpu_affinity_pick(&affinity, -1)) != 0) perror("CPU affinity not applied");
+
+    // A successor asks for the sockets through the control socket
+    int control_fd = hot_restart_listen(port);
+    int watched[3];
+    memcpy(watched, listeners, listener_count * sizeof(int));
+    watched[listener_count] = control_fd;
+    int watched_count = listener_count + (control_fd >= 0);
+
+    printf("Iterative TCP RPC Server listening on port %d...\n", port);
 
     while (1) {
-        new_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen);
+        int ready_fd = rpc_wait_readable(watched, watched_count);
+        if (ready_fd < 0) continue;
+        if (ready_fd == control_fd) {
+            // Connections still queued are the successor's to accept
+            if (hot_restart_handoff(control_fd, listeners, listener_count) == 0) break;
+            continue;
+        }
+        addrlen = sizeof(peer_addr);
+        new_socket = accept(ready_fd, (struct sockaddr *)&peer_addr, &addrlen);
         if (new_socket < 0) {
             perror("Accept failed");
             continue; // Continue to accept other connections
         }
+        if (admission_queue_full(&admission, ready_fd)) {
+            rpc_reject_connection(new_socket, "iterative_tcp");
+            continue;
+        }
 
-        printf("Client connected to Iterative TCP RPC Server.\n");
+        printf("Client %s connected to Iterative TCP RPC Server.\n", rpc_peer_string((struct sockaddr *)&peer_addr, addrlen, peer, sizeof(peer)));
 
         // For iterative server, handle one client fully then loop for next.
         // If client sends multiple requests on same connection, this loop handles them.
         // The current client stub creates a new connection for each RPC call.
         // So this inner loop might run only once per accept if client disconnects after one RPC.
         while (1) {
-            memset(buffer, 0, BUF_SIZE);
-            int bytes_received = read(new_socket, buffer, BUF_SIZE - 1);
+            long long arrival_us;
+            ssize_t bytes_received = rpc_recv_request_at(new_socket, request_buf, RPC_MAX_MESSAGE_SIZE, &arrival_us);
 
             if (bytes_received <= 0) {
                 if (bytes_received == 0) printf("Client disconnected.\n");
                 else perror("Read error");
                 break; // Break inner loop, close client socket, wait for new connection
             }
-            buffer[bytes_received] = '\0'; // Null-terminate the received data
-
+            if (admission_codel_shed(&admission, arrival_us)) {
+                rpc_send_busy(new_socket, request_buf, bytes_received, "iterative_tcp", NULL, 0);
+                continue;
+            }
             RpcRequest req;
             RpcResponse resp;
-            CalcResult calc_res;
 
             // Set server type for the response
             strcpy(resp.server_type, "iterative_tcp");
 
-            if (unmarshal_request(buffer, &req) != 0) {
-                fprintf(stderr, "Failed to unmarshal request: %s\n", buffer);
+            if (unmarshal_request(request_buf, &req) != 0) {
+                fprintf(stderr, "Failed to unmarshal request: %.200s\n", request_buf);
                 // Send back an error response if possible
                 strcpy(resp.error, "Server error: Bad request format");
-                resp.result = 0; // Or some NaN/error indicator
+                resp.result = 0;
+                resp.request_id = 0; // Or some NaN/error indicator
             } else {
                 // Process OP_EXIT from client if needed, though client manages connection
                 if (req.operation == OP_EXIT) {
@@ -93,21 +159,15 @@ int main() {
                      // Optionally send a confirmation back, but not strictly required by current RPC design
                      break;
                 }
+                if (req.operation == OP_STREAM) {
+                    // The stream runs to completion here, replies included
+                    if (rpc_stream_serve(new_socket, &req, &resp) != 0) break;
+                    continue;
+                }
 
                 printf("Received operation %d, op1=%.2f, op2=%.2f\n", req.operation, req.op1, req.op2);
 
-                switch (req.operation) {
-                    case OP_ADD:      calc_res = add(req.op1, req.op2); break;
-                    case OP_SUBTRACT: calc_res = subtract(req.op1, req.op2); break;
-                    case OP_MULTIPLY: calc_res = multiply(req.op1, req.op2); break;
-                    case OP_DIVIDE:   calc_res = divide(req.op1, req.op2); break;
-                    default:
-                        snprintf(calc_res.error, sizeof(calc_res.error), "Invalid operation requested: %d", req.operation);
-                        calc_res.value = 0; // Or NaN
-                        break;
-                }
-                resp.result = calc_res.value;
-                strcpy(resp.error, calc_res.error);
+                dispatch_request(&req, &resp);
             }
 
             memset(buffer, 0, BUF_SIZE);
@@ -128,6 +188,13 @@ int main() {
         printf("Client connection closed.\n");
     }
 
+    printf("Handed the sockets over to the new server, exiting.\n");
     close(server_fd);
     return 0;
 }
+
+#ifndef RPC_SERVER_BUNDLE
+int main(int argc, char* argv[]) {
+    return iterative_tcp_main(argc, argv);
+}
+#endif
@@ -8,102 +8,168 @@
 #include <arpa/inet.h> // For inet_ntop (optional for logging)
 
 #include "rpc_protocol.h" // Headers from root via -I../
-#include "calculator_ops.h" // Headers from root via -I../
+#include "rpc_dispatch.h" // Headers from root via -I../
+#include "response_cache.h"
+#include "unix_socket.h"
+#include "admission.h"
+#include "hot_restart.h"
+#include "socket_profile.h"
+#include "cpu_affinity.h"
+#include "server_main.h"
 
 #define PORT 9005 // Changed port
 #define BUF_SIZE RPC_BUFFER_SIZE
+#define REQUEST_BUF_SIZE RPC_MAX_DATAGRAM_SIZE // Requests may carry operand arrays, replies never do
 
-int main() {
+int iterative_udp_main(int argc, char* argv[]) {
+    int port = rpc_server_port(argc, argv, PORT);
     int sockfd;
-    struct sockaddr_in server_addr, client_addr;
+    struct sockaddr_in server_addr;
+    struct sockaddr_storage client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
-    char request_buf[BUF_SIZE];
+    char request_buf[REQUEST_BUF_SIZE];
     char response_buf[BUF_SIZE];
     RpcRequest req;
     RpcResponse resp;
-    CalcResult calc_res;
+    ResponseCache* response_cache;
+    Admission admission;
+
+    // With --hot-restart, the sockets are taken over from the server running now
+    int listeners[2];
+    int listener_count = hot_restart_requested(argc, argv) ? hot_restart_inherit(port, listeners, 2) : 0;
+    if (listener_count < 0) perror("No server to take over from, starting fresh");
+    if (listener_count > 0) {
+        sockfd = listeners[0];
+    } else {
+        sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sockfd < 0) {
+            perror("Socket creation failed");
+            exit(EXIT_FAILURE);
+        }
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
+        int opt = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+            perror("setsockopt SO_REUSEADDR failed");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
 
-    int opt = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        perror("setsockopt SO_REUSEADDR failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
-    }
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port);
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+        if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("Bind failed");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
 
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+        // Local clients can skip the UDP/IP stack through a Unix datagram socket
+        listeners[0] = sockfd;
+        listeners[1] = rpc_unix_listen(port, SOCK_DGRAM);
+        listener_count = listeners[1] >= 0 ? 2 : 1;
+        if (listeners[1] < 0) perror("Unix socket listener unavailable");
     }
 
-    printf("Iterative UDP RPC Server listening on port %d...\n", PORT);
+    // Options from RPC_SOCKET_PROFILE (socket_profile.h), for inherited sockets too
+    if (rpc_tune_server_socket(sockfd, SOCK_DGRAM) < 0) perror("Socket profile not fully applied");
+
+    // Datagrams queue in the socket buffer while one is served; stamps tell how long
+    admission_init(&admission);
+    for (int i = 0; i < listener_count; i++) rpc_enable_arrival_time(listeners[i]);
+
+    response_cache = response_cache_create(0);
+    dispatch_init();
+
+    // The one worker stays on one CPU from RPC_CPU_LIST / RPC_CPU_NIC (cpu_affinity.h)
+    CpuAffinity affinity;
+    if (cpu_affinity_init(&affinity) != 0) perror("CPU affinity ignored");
+    if (cpu_affinity_pin_self(cpu_affinity_pick(&affinity, -1)) != 0) perror("CPU affinity not applied");
+
+    // A successor asks for the sockets through the control socket
+    int control_fd = hot_restart_listen(port);
+    int watched[3];
+    memcpy(watched, listeners, listener_count * sizeof(int));
+    watched[listener_count] = control_fd;
+    int watched_count = listener_count + (control_fd >= 0);
+
+    printf("Iterative UDP RPC Server listening on port %d...\n", port);
 
     while (1) {
-        memset(request_buf, 0, BUF_SIZE);
         memset(response_buf, 0, BUF_SIZE);
         memset(&client_addr, 0, sizeof(client_addr)); // Clear client_addr before recvfrom
         client_addr_len = sizeof(client_addr); // Reset client_addr_len
 
-        ssize_t bytes_received = recvfrom(sockfd, request_buf, BUF_SIZE - 1, 0,
-                                          (struct sockaddr *)&client_addr, &client_addr_len);
+        int ready_fd = rpc_wait_readable(watched, watched_count);
+        if (ready_fd < 0) continue;
+        if (ready_fd == control_fd) {
+            // Datagrams still queued are the successor's to read
+            if (hot_restart_handoff(control_fd, listeners, listener_count) == 0) break;
+            continue;
+        }
+        long long arrival_us;
+        ssize_t bytes_received = rpc_recv_stamped(ready_fd, request_buf, REQUEST_BUF_SIZE - 1, 0,
+                                                  (struct sockaddr *)&client_addr, &client_addr_len, &arrival_us);
         if (bytes_received < 0) {
             perror("recvfrom error");
             continue;
         }
         request_buf[bytes_received] = '\0';
+        if (admission_codel_shed(&admission, arrival_us)) {
+            // Not cached: a retransmission may find the queue shorter
+            rpc_send_busy(ready_fd, request_buf, bytes_received, "iterative_udp",
+                          (struct sockaddr *)&client_addr, client_addr_len);
+            continue;
+        }
 
-        char client_ip_str[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip_str, INET_ADDRSTRLEN);
-        printf("Received %zd bytes from %s:%d. Request: %s\n", bytes_received, client_ip_str, ntohs(client_addr.sin_port), request_buf);
+        char client[RPC_PEER_STRLEN];
+        rpc_peer_string((struct sockaddr *)&client_addr, client_addr_len, client, sizeof(client));
+        printf("Received %zd bytes from %s. Request: %.200s\n", bytes_received, client, request_buf);
 
 
         strcpy(resp.server_type, "iterative_udp");
+        int cached = 0;
 
         if (unmarshal_request(request_buf, &req) != 0) {
-            fprintf(stderr, "Failed to unmarshal request from %s:%d: %s\n", client_ip_str, ntohs(client_addr.sin_port), request_buf);
+            fprintf(stderr, "Failed to unmarshal request from %s: %.200s\n", client, request_buf);
             strcpy(resp.error, "Server error: Bad request format");
             resp.result = 0;
+            resp.request_id = 0;
+        } else if (response_cache_claim(response_cache, (struct sockaddr *)&client_addr, client_addr_len, req.request_id, response_buf, BUF_SIZE) == RESPONSE_CACHE_HIT) {
+            // Retransmission of a request we already answered: resend the stored reply
+            printf("Duplicate request %u from %s, replaying cached response\n", req.request_id, client);
+            cached = 1;
         } else {
-            printf("Op %d, op1 %.2f, op2 %.2f from %s:%d\n", req.operation, req.op1, req.op2, client_ip_str, ntohs(client_addr.sin_port));
-            switch (req.operation) {
-                case OP_ADD:      calc_res = add(req.op1, req.op2); break;
-                case OP_SUBTRACT: calc_res = subtract(req.op1, req.op2); break;
-                case OP_MULTIPLY: calc_res = multiply(req.op1, req.op2); break;
-                case OP_DIVIDE:   calc_res = divide(req.op1, req.op2); break;
-                default:
-                    snprintf(calc_res.error, sizeof(calc_res.error), "Invalid or unsupported operation: %d", req.operation);
-                    calc_res.value = 0;
-                    break;
-            }
-            resp.result = calc_res.value;
-            strcpy(resp.error, calc_res.error);
+            printf("Op %d, op1 %.2f, op2 %.2f from %s\n", req.operation, req.op1, req.op2, client);
+            dispatch_request(&req, &resp);
         }
 
-        if (marshal_response(&resp, response_buf, BUF_SIZE) != 0) {
-            fprintf(stderr, "Failed to marshal response for %s:%d.\n", client_ip_str, ntohs(client_addr.sin_port));
-            continue;
+        if (!cached) {
+            if (marshal_response(&resp, response_buf, BUF_SIZE) != 0) {
+                fprintf(stderr, "Failed to marshal response for %s.\n", client);
+                response_cache_release(response_cache, (struct sockaddr *)&client_addr, client_addr_len, resp.request_id);
+                continue;
+            }
+            response_cache_store(response_cache, (struct sockaddr *)&client_addr, client_addr_len, resp.request_id, response_buf);
         }
 
-        ssize_t bytes_sent = sendto(sockfd, response_buf, strlen(response_buf), 0,
+        ssize_t bytes_sent = sendto(ready_fd, response_buf, strlen(response_buf), 0,
                                     (struct sockaddr *)&client_addr, client_addr_len);
         if (bytes_sent < 0) {
             perror("sendto error");
         } else {
-            printf("Sent response: %s to %s:%d\n", response_buf, client_ip_str, ntohs(client_addr.sin_port));
+            printf("Sent response: %s to %s\n", response_buf, client);
         }
     }
 
+    printf("Handed the sockets over to the new server, exiting.\n");
     close(sockfd);
     return 0;
 }
+
+#ifndef RPC_SERVER_BUNDLE
+int main(int argc, char* argv[]) {
+    return iterative_udp_main(argc, argv);
+}
+#endif
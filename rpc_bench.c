@@ -0,0 +1,166 @@
+// rpc_bench.c: per-call latency of every transport each server model offers.
+// For each model the same sequence of ADD calls goes over loopback (TCP or UDP
+// to 127.0.0.1), over the model's Unix socket and, where the model has one,
+// over shared memory. Start the servers first; models that do not answer are
+// reported as unavailable. --profile both runs the TCP and UDP rows under
+// each socket profile (socket_profile.h), the "-lat" rows with the latency
+// one; start the servers with RPC_SOCKET_PROFILE=latency to compare them fully.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h> // For IPPROTO_TCP, IPPROTO_UDP
+
+#include "rpc_core/client_stubs.h"
+#include "rpc_core/shm_transport.h" // For RPC_PROTO_SHM
+#include "rpc_core/unix_socket.h"   // For rpc_unix_path
+#include "rpc_core/socket_profile.h"
+
+#define BENCH_DEFAULT_CALLS 2000
+#define BENCH_DEFAULT_WARMUP 50
+
+typedef struct {
+    const char* name;
+    int port;
+    int protocol; // IPPROTO_TCP, IPPROTO_UDP, or RPC_PROTO_AUTO for both on one port
+    int has_shm;  // Also serves RPC_PROTO_SHM
+} BenchModel;
+
+static const BenchModel models[] = {
+    {"iterative_tcp", 9001, IPPROTO_TCP, 0},
+    {"concurrent_tcp_threads", 9002, IPPROTO_TCP, 1},
+    {"concurrent_tcp_processes", 9003, IPPROTO_TCP, 0},
+    {"concurrent_tcp_async", 9004, IPPROTO_TCP, 1},
+    {"iterative_udp", 9005, IPPROTO_UDP, 0},
+    {"concurrent_udp_threads", 9006, IPPROTO_UDP, 0},
+    {"concurrent_udp_processes", 9007, IPPROTO_UDP, 0},
+    {"concurrent_udp_async", 9008, IPPROTO_UDP, 0},
+    {"concurrent_tcp_coroutines", 9009, IPPROTO_TCP, 0},
+    {"concurrent_dual_async", 9010, RPC_PROTO_AUTO, 0},
+};
+static const int num_models = sizeof(models) / sizeof(models[0]);
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Runs warmup + calls ADDs against one endpoint and prints one result row
+static void bench_transport(const BenchModel* m, const char* transport, const char* address, int protocol,
+                            int calls, int warmup) {
+    double* latencies = malloc((size_t)calls * sizeof(double));
+    if (!latencies) {
+        fprintf(stderr, "Out of memory for %d latencies\n", calls);
+        return;
+    }
+
+    for (int i = 0; i < warmup + calls; i++) {
+        double start = now_us();
+        RpcCallResult res = rpc_add(i, 1, address, m->port, protocol);
+        double elapsed = now_us() - start;
+        if (!res.call_success || res.result != i + 1) {
+            printf("%-26s %-10s unavailable: %s\n", m->name, transport, res.error);
+            free(latencies);
+            return;
+        }
+        if (i >= warmup) latencies[i - warmup] = elapsed;
+    }
+
+    double total = 0;
+    for (int i = 0; i < calls; i++) total += latencies[i];
+    qsort(latencies, calls, sizeof(double), compare_doubles);
+    printf("%-26s %-10s %8d %10.1f %10.1f %10.1f %12.0f\n", m->name, transport, calls, total / calls,
+           latencies[calls / 2], latencies[(int)(calls * 0.99)], calls / (total / 1e6));
+    free(latencies);
+}
+
+static const char* network_transport(int protocol, int profile) {
+    if (protocol == RPC_PROTO_AUTO) return profile == SOCKET_PROFILE_LATENCY ? "auto-lat" : "auto";
+    if (protocol == IPPROTO_TCP) return profile == SOCKET_PROFILE_LATENCY ? "tcp-lat" : "tcp";
+    return profile == SOCKET_PROFILE_LATENCY ? "udp-lat" : "udp";
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [--calls N] [--warmup N] [--model NAME [--port N]] [--profile default|latency|both]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    int calls = BENCH_DEFAULT_CALLS;
+    int warmup = BENCH_DEFAULT_WARMUP;
+    const char* only_model = NULL;
+    int port = 0; // The model's own unless --port says, e.g. for rpc_server --port
+    int profiles[2] = { rpc_socket_profile() }; // From RPC_SOCKET_PROFILE unless --profile says
+    int num_profiles = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--calls") == 0 && i + 1 < argc) {
+            calls = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--model") == 0 && i + 1 < argc) {
+            only_model = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            num_profiles = 1;
+            if (strcmp(name, "default") == 0) {
+                profiles[0] = SOCKET_PROFILE_DEFAULT;
+            } else if (strcmp(name, "latency") == 0) {
+                profiles[0] = SOCKET_PROFILE_LATENCY;
+            } else if (strcmp(name, "both") == 0) {
+                profiles[0] = SOCKET_PROFILE_DEFAULT;
+                profiles[1] = SOCKET_PROFILE_LATENCY;
+                num_profiles = 2;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (calls < 1 || warmup < 0 || port < 0 || (port && !only_model)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("%-26s %-10s %8s %10s %10s %10s %12s\n", "model", "transport", "calls", "mean_us", "p50_us", "p99_us", "calls/s");
+    for (int i = 0; i < num_models; i++) {
+        BenchModel model = models[i];
+        const BenchModel* m = &model;
+        if (only_model && strcmp(only_model, m->name) != 0) continue;
+        if (port) model.port = port;
+
+        char path[108];
+        rpc_unix_path(m->port, path, sizeof(path));
+        // A server of both protocols is measured over each, then as RPC_PROTO_AUTO picks
+        int protocols[3] = { m->protocol };
+        int num_protocols = 1;
+        if (m->protocol == RPC_PROTO_AUTO) {
+            protocols[0] = IPPROTO_TCP;
+            protocols[1] = IPPROTO_UDP;
+            protocols[2] = RPC_PROTO_AUTO;
+            num_protocols = 3;
+        }
+        for (int p = 0; p < num_profiles; p++) {
+            rpc_set_socket_profile(profiles[p]);
+            for (int k = 0; k < num_protocols; k++) {
+                bench_transport(m, network_transport(protocols[k], profiles[p]), "127.0.0.1", protocols[k], calls, warmup);
+            }
+        }
+        // Unix socket paths take one type; RPC_PROTO_AUTO uses the stream one
+        bench_transport(m, m->protocol == IPPROTO_UDP ? "unix-dgr" : "unix-str", path, m->protocol, calls, warmup);
+        if (m->has_shm) {
+            bench_transport(m, "shm", "127.0.0.1", RPC_PROTO_SHM, calls, warmup);
+        }
+    }
+    return 0;
+}
@@ -4,15 +4,23 @@
 #include <string.h>
 #include <netinet/in.h> // For IPPROTO_TCP, IPPROTO_UDP
 #include <unistd.h>     // For getpid()
+#include <stdint.h>     // For int32_t in binary batch records
+#include <strings.h>    // For strcasecmp
+#include <ctype.h>      // For isspace
+#include <pthread.h>
+#include <time.h>
 
 #include "rpc_core/client_stubs.h" // Contains RpcCallResult and stub functions
+#include "rpc_core/hedging.h"      // Hedged calls across two endpoints
+#include "rpc_core/rpc_stream.h"   // For RPC_ERR_STREAM_UNSUPPORTED
+#include "rpc_core/shm_transport.h" // For RPC_PROTO_SHM
 
 // Define server endpoint configurations
 typedef struct {
     const char* name;
-    const char* ip;
+    const char* ip; // IPv4 address, or the path of a Unix socket
     int port;
-    int protocol; // IPPROTO_TCP or IPPROTO_UDP
+    int protocol; // IPPROTO_TCP, IPPROTO_UDP, RPC_PROTO_AUTO or RPC_PROTO_SHM
 } ServerEndpoint;
 
 // List of known servers
@@ -24,7 +32,22 @@ ServerEndpoint known_servers[] = {
     {"Iterative UDP Server", "127.0.0.1", 9005, IPPROTO_UDP},
     {"Concurrent UDP Threads Server", "127.0.0.1", 9006, IPPROTO_UDP},
     {"Concurrent UDP Processes Server", "127.0.0.1", 9007, IPPROTO_UDP},
-    {"Concurrent UDP Async Server", "127.0.0.1", 9008, IPPROTO_UDP}
+    {"Concurrent UDP Async Server", "127.0.0.1", 9008, IPPROTO_UDP},
+    {"Concurrent TCP Coroutines Server", "127.0.0.1", 9009, IPPROTO_TCP},
+    {"Concurrent Dual TCP+UDP Server", "127.0.0.1", 9010, RPC_PROTO_AUTO}, // UDP, or TCP for large requests
+    {"Concurrent Threads Server (shared memory)", "127.0.0.1", 9002, RPC_PROTO_SHM},
+    {"Concurrent Async Server (shared memory)", "127.0.0.1", 9004, RPC_PROTO_SHM},
+    // Unix sockets, at the servers' default paths (see unix_socket.h)
+    {"Iterative TCP Server (unix)", "/tmp/rpc_9001.sock", 9001, IPPROTO_TCP},
+    {"Concurrent TCP Threads Server (unix)", "/tmp/rpc_9002.sock", 9002, IPPROTO_TCP},
+    {"Concurrent TCP Processes Server (unix)", "/tmp/rpc_9003.sock", 9003, IPPROTO_TCP},
+    {"Concurrent TCP Async Server (unix)", "/tmp/rpc_9004.sock", 9004, IPPROTO_TCP},
+    {"Iterative UDP Server (unix)", "/tmp/rpc_9005.sock", 9005, IPPROTO_UDP},
+    {"Concurrent UDP Threads Server (unix)", "/tmp/rpc_9006.sock", 9006, IPPROTO_UDP},
+    {"Concurrent UDP Processes Server (unix)", "/tmp/rpc_9007.sock", 9007, IPPROTO_UDP},
+    {"Concurrent UDP Async Server (unix)", "/tmp/rpc_9008.sock", 9008, IPPROTO_UDP},
+    {"Concurrent TCP Coroutines Server (unix)", "/tmp/rpc_9009.sock", 9009, IPPROTO_TCP},
+    {"Concurrent Dual TCP+UDP Server (unix)", "/tmp/rpc_9010.sock", 9010, IPPROTO_TCP}
 };
 int num_known_servers = sizeof(known_servers) / sizeof(known_servers[0]);
 
@@ -32,10 +55,333 @@ int num_known_servers = sizeof(known_servers) / sizeof(known_servers[0]);
 // Initialized to -1 to signal it needs to be set by PID on first run.
 static int next_server_index = -1;
 
-int main() {
+// ===== Batch mode =====
+// Reads operations from a file or stdin, keeps up to `inflight` calls
+// outstanding across the known servers, and writes one result line per
+// operation to stdout in input order. Input is processed in chunks of
+// BATCH_CHUNK_SIZE operations so memory stays bounded for endless streams.
+
+#define BATCH_CHUNK_SIZE 4096
+#define BATCH_DEFAULT_INFLIGHT 8
+#define BATCH_MAX_INFLIGHT 256
+
+// Binary input record: OperationType value (0=ADD .. 3=DIV) and two operands,
+// host byte order, 24 bytes each.
+typedef struct {
+    int32_t operation;
+    int32_t reserved;
+    double op1;
+    double op2;
+} BatchRecord;
+
+typedef struct {
+    OperationType operation;
+    double op1;
+    double op2;
+    char* expr;           // Set for EXPR lines, freed once the chunk is printed
+    char* bindings;
+    char parse_error[64]; // Non-empty if the input line could not be parsed
+    RpcCallResult res;
+    int answered;         // A server returned a response (which may still carry a server-side error)
+} BatchItem;
+
+typedef struct {
+    BatchItem* items;
+    int count;
+    int next;             // Next item index to claim, shared by the workers
+    long first_seq;       // Global sequence number of items[0], spreads load round-robin
+    int base_server;
+} BatchChunk;
+
+// Calls each server in round-robin order starting at start_idx until one answers.
+static void batch_call(BatchItem* item, int start_idx) {
+    item->answered = 0;
+    for (int j = 0; j < num_known_servers; ++j) {
+        ServerEndpoint server = known_servers[(start_idx + j) % num_known_servers];
+        if (item->expr) {
+            item->res = rpc_eval(item->expr, item->bindings, server.ip, server.port, server.protocol);
+        } else {
+            item->res = rpc_call(item->operation, item->op1, item->op2, server.ip, server.port, server.protocol);
+        }
+        // A BUSY server shed the request without running it; the next one may not
+        if (item->res.server_type_handled[0] != '\0' && strcmp(item->res.error, RPC_ERR_BUSY) != 0) {
+            item->answered = 1;
+            return;
+        }
+    }
+}
+
+static void* batch_worker(void* arg) {
+    BatchChunk* chunk = (BatchChunk*)arg;
+    while (1) {
+        int i = __atomic_fetch_add(&chunk->next, 1, __ATOMIC_RELAXED);
+        if (i >= chunk->count) break;
+        BatchItem* item = &chunk->items[i];
+        if (item->parse_error[0] != '\0') continue;
+        batch_call(item, (int)((chunk->base_server + chunk->first_seq + i) % num_known_servers));
+    }
+    return NULL;
+}
+
+// "EXPR <expression> name=value ..." - the expression itself must not contain spaces
+static int parse_expr_line(const char* line, BatchItem* item) {
+    char expr[RPC_EXPR_MAX_TEXT];
+    char bindings[RPC_EXPR_MAX_BINDINGS] = "";
+    int n = 0;
+    if (sscanf(line, "%*s %255s%n", expr, &n) != 1) {
+        return -1;
+    }
+    size_t used = 0;
+    char token[128];
+    int len;
+    for (const char* p = line + n; sscanf(p, "%127s%n", token, &len) == 1; p += len) {
+        int written = snprintf(bindings + used, sizeof(bindings) - used, "%s%s", used ? "," : "", token);
+        if (written < 0 || (size_t)written >= sizeof(bindings) - used) return -1;
+        used += (size_t)written;
+    }
+    item->operation = OP_EXPR;
+    item->expr = strdup(expr);
+    item->bindings = strdup(bindings);
+    return (item->expr && item->bindings) ? 0 : -1;
+}
+
+static int parse_batch_line(const char* line, BatchItem* item) {
+    char op_name[16];
+    if (strncasecmp(line, "EXPR", 4) == 0 && isspace((unsigned char)line[4])) {
+        return parse_expr_line(line, item);
+    }
+    if (sscanf(line, "%15s %lf %lf", op_name, &item->op1, &item->op2) != 3) {
+        return -1;
+    }
+    if (strcasecmp(op_name, "ADD") == 0) item->operation = OP_ADD;
+    else if (strcasecmp(op_name, "SUB") == 0 || strcasecmp(op_name, "SUBTRACT") == 0) item->operation = OP_SUBTRACT;
+    else if (strcasecmp(op_name, "MUL") == 0 || strcasecmp(op_name, "MULTIPLY") == 0) item->operation = OP_MULTIPLY;
+    else if (strcasecmp(op_name, "DIV") == 0 || strcasecmp(op_name, "DIVIDE") == 0) item->operation = OP_DIVIDE;
+    else return -1;
+    return 0;
+}
+
+// Fills up to BATCH_CHUNK_SIZE items from the input. Returns the number read.
+static int read_batch_chunk(FILE* in, int binary, BatchItem* items, long* line_no) {
+    int count = 0;
+    char line[1024];
+    while (count < BATCH_CHUNK_SIZE) {
+        BatchItem* item = &items[count];
+        memset(item, 0, sizeof(*item));
+        if (binary) {
+            BatchRecord rec;
+            if (fread(&rec, sizeof(rec), 1, in) != 1) break;
+            (*line_no)++;
+            item->op1 = rec.op1;
+            item->op2 = rec.op2;
+            if (rec.operation < OP_ADD || rec.operation > OP_DIVIDE) {
+                snprintf(item->parse_error, sizeof(item->parse_error), "bad operation %d in record %ld", rec.operation, *line_no);
+            } else {
+                item->operation = (OperationType)rec.operation;
+            }
+        } else {
+            if (!fgets(line, sizeof(line), in)) break;
+            (*line_no)++;
+            const char* p = line + strspn(line, " \t");
+            if (*p == '\n' || *p == '\0' || *p == '#') continue; // Blank line or comment
+            if (parse_batch_line(p, item) != 0) {
+                snprintf(item->parse_error, sizeof(item->parse_error), "cannot parse line %ld", *line_no);
+            }
+        }
+        count++;
+    }
+    return count;
+}
+
+static double seconds_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int run_batch(const char* path, int binary, int inflight) {
+    FILE* in = stdin;
+    if (path && strcmp(path, "-") != 0) {
+        in = fopen(path, binary ? "rb" : "r");
+        if (!in) {
+            perror("Failed to open batch input");
+            return 1;
+        }
+    }
+
+    BatchItem* items = malloc(sizeof(BatchItem) * BATCH_CHUNK_SIZE);
+    pthread_t* workers = malloc(sizeof(pthread_t) * inflight);
+    if (!items || !workers) {
+        perror("Failed to allocate batch buffers");
+        free(items);
+        free(workers);
+        if (in != stdin) fclose(in);
+        return 1;
+    }
+
+    long total = 0, failed = 0, server_errors = 0, line_no = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int count;
+    while ((count = read_batch_chunk(in, binary, items, &line_no)) > 0) {
+        BatchChunk chunk = { items, count, 0, total, next_server_index };
+        int nthreads = inflight < count ? inflight : count;
+        int started = 0;
+        for (; started < nthreads; started++) {
+            if (pthread_create(&workers[started], NULL, batch_worker, &chunk) != 0) {
+                perror("Failed to create batch worker");
+                break;
+            }
+        }
+        if (started == 0) {
+            batch_worker(&chunk); // Degrade to running the chunk on this thread
+        }
+        for (int t = 0; t < started; t++) {
+            pthread_join(workers[t], NULL);
+        }
+
+        for (int i = 0; i < count; i++) {
+            BatchItem* item = &items[i];
+            if (item->parse_error[0] != '\0') {
+                printf("ERROR %s\n", item->parse_error);
+                failed++;
+            } else if (!item->answered) {
+                printf("ERROR %s\n", item->res.error);
+                failed++;
+            } else if (item->res.error[0] != '\0') {
+                printf("ERROR %s\n", item->res.error);
+                server_errors++;
+            } else {
+                printf("%.10g\n", item->res.result);
+            }
+            free(item->expr);
+            free(item->bindings);
+        }
+        fflush(stdout);
+        total += count;
+    }
+
+    double elapsed = seconds_since(&start);
+    fprintf(stderr, "Batch complete: %ld operations in %.3f s (%.0f ops/s) with %d in flight; %ld failed, %ld server-reported errors\n",
+            total, elapsed, elapsed > 0 ? total / elapsed : 0.0, inflight, failed, server_errors);
+    CoalesceStats cs = rpc_coalesce_stats();
+    if (cs.calls > 0) {
+        fprintf(stderr, "Coalescing: %lu calls sent in %lu requests (%.1f calls per request)\n",
+                cs.calls, cs.requests, cs.requests ? (double)cs.calls / cs.requests : 0.0);
+    }
+
+    free(items);
+    free(workers);
+    if (in != stdin) fclose(in);
+    return failed == 0 ? 0 : 2;
+}
+
+// ===== Stream mode =====
+// Streams one or two files of raw doubles through a TCP server. Element-wise
+// results are written to stdout as raw doubles; a reduction prints its value.
+
+typedef struct {
+    size_t values_written;
+} StreamOutput;
+
+static void write_stream_results(size_t offset, const double* values, size_t count, void* arg) {
+    (void)offset; // Results arrive in order, so appending is enough
+    StreamOutput* output = (StreamOutput*)arg;
+    output->values_written += fwrite(values, sizeof(double), count, stdout);
+}
+
+static int run_stream(const char* op_name, const char* x_path, const char* y_path, size_t chunk) {
+    OperationType op = string_to_operation(op_name);
+    if (strcasecmp(op_name, "MEAN") == 0) op = OP_MEAN;
+    if (op == (OperationType)-1 || op == OP_EXIT || op == OP_EXPR || op == OP_STREAM || op == OP_BATCH) {
+        fprintf(stderr, "Unknown stream operation '%s' (use ADD, SUB, MUL, DIV, SUM, AVG, MIN, MAX or DOT)\n", op_name);
+        return 1;
+    }
+    int elementwise = !rpc_is_vector_op(op);
+    StreamOutput output = {0};
+    RpcCallResult res = {0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Fail over to the next TCP server only while nothing has been written,
+    // otherwise the output would contain a partial stream twice
+    for (int j = 0; j < num_known_servers && output.values_written == 0; ++j) {
+        ServerEndpoint server = known_servers[(next_server_index + j) % num_known_servers];
+        if (server.protocol != IPPROTO_TCP && server.protocol != RPC_PROTO_AUTO) continue; // Both take TCP
+        res = rpc_stream_file(op, x_path, y_path, chunk, elementwise ? write_stream_results : NULL, &output,
+                              server.ip, server.port);
+        if (res.call_success) {
+            fflush(stdout);
+            if (!elementwise) printf("%.17g\n", res.result);
+            fprintf(stderr, "Stream %s complete via %s in %.3f s\n", operation_to_string(op), server.name, seconds_since(&start));
+            return 0;
+        }
+        fprintf(stderr, "Stream via %s failed: %s\n", server.name, res.error);
+        // A server that accepted the stream and then reported an error (e.g. division
+        // by zero) would report it again anywhere else; one that was busy never started
+        if (res.server_type_handled[0] != '\0' && strcmp(res.error, RPC_ERR_STREAM_UNSUPPORTED) != 0 &&
+            strcmp(res.error, RPC_ERR_BUSY) != 0) break;
+    }
+    fflush(stdout);
+    return 2;
+}
+
+static void print_hedge_stats(void) {
+    HedgeStats hs = rpc_hedge_stats();
+    printf("Hedging: %lu calls, %lu hedges sent (%.1f%% extra load), %lu won by the backup, %lu denied by budget, "
+           "%lu failed over to the backup, current delay %.2f ms\n",
+           hs.calls, hs.hedges_sent, hs.calls ? 100.0 * hs.hedges_sent / hs.calls : 0.0,
+           hs.hedge_wins, hs.budget_denied, hs.failovers, hs.current_delay_ms);
+}
+
+int main(int argc, char* argv[]) {
     int choice;
     double a, b;
     RpcCallResult rpc_res;
+    int use_hedging = 0;
+    int batch_mode = 0, batch_binary = 0, batch_inflight = BATCH_DEFAULT_INFLIGHT;
+    const char* batch_path = NULL;
+    const char* stream_op = NULL;
+    const char* stream_files[2] = { NULL, NULL };
+    size_t stream_chunk = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--hedge") == 0) {
+            use_hedging = 1;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch_mode = 1;
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+                batch_path = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--stream") == 0 && i + 2 < argc) {
+            stream_op = argv[++i];
+            stream_files[0] = argv[++i];
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+                stream_files[1] = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc) {
+            stream_chunk = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            batch_binary = 1;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            rpc_set_vector_codec(RPC_VEC_XOR);
+        } else if (strcmp(argv[i], "--priority") == 0 && i + 1 < argc) {
+            const char* cls = argv[++i];
+            rpc_set_priority(strcmp(cls, "interactive") == 0 ? RPC_PRIORITY_INTERACTIVE
+                             : strcmp(cls, "batch") == 0     ? RPC_PRIORITY_BATCH
+                                                             : RPC_PRIORITY_AUTO);
+        } else if (strcmp(argv[i], "--coalesce") == 0 && i + 1 < argc) {
+            rpc_set_coalescing(atoi(argv[++i]), RPC_BATCH_MAX_CALLS);
+        } else if (strcmp(argv[i], "--inflight") == 0 && i + 1 < argc) {
+            batch_inflight = atoi(argv[++i]);
+            if (batch_inflight < 1) batch_inflight = 1;
+            if (batch_inflight > BATCH_MAX_INFLIGHT) batch_inflight = BATCH_MAX_INFLIGHT;
+        } else {
+            fprintf(stderr, "Usage: %s [--hedge] [--batch [FILE|-] [--binary] [--inflight N]] [--stream OP FILE [FILE2] [--chunk N]] [--compress] [--priority interactive|batch] [--coalesce US]\n", argv[0]);
+            return 1;
+        }
+    }
 
     // Initialize next_server_index based on PID if it's the first time (or for this process instance)
     if (next_server_index == -1) {
@@ -46,6 +392,13 @@ int main() {
         }
     }
 
+    if (batch_mode) {
+        return run_batch(batch_path, batch_binary, batch_inflight);
+    }
+    if (stream_op) {
+        return run_stream(stream_op, stream_files[0], stream_files[1], stream_chunk);
+    }
+
     while (1) {
         printf("\n===== RPC CALCULATOR CLIENT (PID-Randomized Round-Robin) =====\n");
         printf("1. Add\n");
@@ -63,6 +416,7 @@ int main() {
         while (getchar() != '\n'); // Clear trailing newline
 
         if (choice == 5) {
+            if (use_hedging) print_hedge_stats();
             printf("Exiting client. Goodbye!\n");
             break;
         }
@@ -90,19 +444,27 @@ int main() {
             printf("\nAttempting operation with %s (%s:%d)...\n",
                    current_server.name, current_server.ip, current_server.port);
 
-            switch (choice) {
-                case 1:
-                    rpc_res = rpc_add(a, b, current_server.ip, current_server.port, current_server.protocol);
-                    break;
-                case 2:
-                    rpc_res = rpc_subtract(a, b, current_server.ip, current_server.port, current_server.protocol);
-                    break;
-                case 3:
-                    rpc_res = rpc_multiply(a, b, current_server.ip, current_server.port, current_server.protocol);
-                    break;
-                case 4:
-                    rpc_res = rpc_divide(a, b, current_server.ip, current_server.port, current_server.protocol);
-                    break;
+            if (use_hedging && num_known_servers > 1) {
+                // Backup is the next server in round-robin order; menu choices 1-4 map onto OP_ADD..OP_DIVIDE
+                ServerEndpoint backup_server = known_servers[(current_server_idx_to_try + 1) % num_known_servers];
+                RpcTarget primary = { current_server.ip, current_server.port, current_server.protocol };
+                RpcTarget backup = { backup_server.ip, backup_server.port, backup_server.protocol };
+                rpc_res = rpc_call_hedged((OperationType)(OP_ADD + choice - 1), a, b, &primary, &backup);
+            } else {
+                switch (choice) {
+                    case 1:
+                        rpc_res = rpc_add(a, b, current_server.ip, current_server.port, current_server.protocol);
+                        break;
+                    case 2:
+                        rpc_res = rpc_subtract(a, b, current_server.ip, current_server.port, current_server.protocol);
+                        break;
+                    case 3:
+                        rpc_res = rpc_multiply(a, b, current_server.ip, current_server.port, current_server.protocol);
+                        break;
+                    case 4:
+                        rpc_res = rpc_divide(a, b, current_server.ip, current_server.port, current_server.protocol);
+                        break;
+                }
             }
 
             if (rpc_res.call_success) {
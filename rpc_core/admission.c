@@ -0,0 +1,140 @@
+#include "admission.h"
+#include "rpc_protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // For TCP_INFO
+
+// Kernel arrival stamps are wall-clock time, so delays are measured against it too
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long env_limit(const char* name, long fallback) {
+    const char* env = getenv(name);
+    return env && env[0] != '\0' ? atol(env) : fallback;
+}
+
+void admission_init(Admission* a) {
+    memset(a, 0, sizeof(*a));
+    a->max_inflight = (int)env_limit(RPC_MAX_INFLIGHT_ENV, ADMISSION_DEFAULT_MAX_INFLIGHT);
+    a->max_queue = (int)env_limit(RPC_MAX_QUEUE_ENV, ADMISSION_DEFAULT_MAX_QUEUE);
+    a->target_us = env_limit(RPC_CODEL_TARGET_ENV, CODEL_DEFAULT_TARGET_MS) * 1000LL;
+    a->interval_us = env_limit(RPC_CODEL_INTERVAL_ENV, CODEL_DEFAULT_INTERVAL_MS) * 1000LL;
+    if (a->interval_us < a->target_us) a->interval_us = a->target_us;
+}
+
+int admission_enter(Admission* a) {
+    int running = __atomic_add_fetch(&a->inflight, 1, __ATOMIC_RELAXED);
+    if (a->max_inflight > 0 && running > a->max_inflight) {
+        __atomic_sub_fetch(&a->inflight, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+void admission_leave(Admission* a) {
+    __atomic_sub_fetch(&a->inflight, 1, __ATOMIC_RELAXED);
+}
+
+void admission_drain(Admission* a) {
+    while (__atomic_load_n(&a->inflight, __ATOMIC_RELAXED) > 0) {
+        struct timespec pause = { 0, 10 * 1000000 };
+        nanosleep(&pause, NULL);
+    }
+}
+
+int admission_queue_full(const Admission* a, int listen_fd) {
+    if (a->max_queue <= 0) return 0;
+    // For a listening socket, Linux reports the accept queue length in tcpi_unacked
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(listen_fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) return 0;
+    return info.tcpi_state == TCP_LISTEN && (int)info.tcpi_unacked >= a->max_queue;
+}
+
+int admission_codel_shed(Admission* a, long long arrival_us) {
+    if (a->target_us <= 0 || arrival_us == 0) return 0;
+    long long now = now_us();
+    long long waited = now - arrival_us;
+    // A request that arrived after the previous one was taken found the queue empty
+    int drained = arrival_us > a->last_taken_us;
+    a->last_taken_us = now;
+    if (waited < a->target_us || drained) {
+        a->slow_since_us = 0;
+        return waited > a->interval_us;
+    }
+    if (a->slow_since_us == 0) a->slow_since_us = now;
+    // A burst may queue for up to an interval; a standing queue only up to target
+    long long limit = now - a->slow_since_us > a->interval_us ? a->target_us : a->interval_us;
+    return waited > limit;
+}
+
+int rpc_enable_arrival_time(int fd) {
+    int on = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+}
+
+ssize_t rpc_recv_stamped(int fd, void* buf, size_t len, int flags, struct sockaddr* from, socklen_t* from_len,
+                         long long* arrival_us) {
+    union {
+        char buf[CMSG_SPACE(sizeof(struct timespec))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = from;
+    msg.msg_namelen = from_len ? *from_len : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n = recvmsg(fd, &msg, flags);
+    *arrival_us = 0;
+    if (n < 0) return n;
+    if (from_len) *from_len = msg.msg_namelen;
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            *arrival_us = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        }
+    }
+    return n;
+}
+
+int rpc_send_busy(int fd, const char* request, size_t request_len, const char* server_type,
+                  const struct sockaddr* to, socklen_t to_len) {
+    RpcResponse resp;
+    char buffer[RPC_BUFFER_SIZE];
+    char head[RPC_BUFFER_SIZE];
+
+    // The ID comes right after the fixed fields, and ';' never appears inside a field
+    size_t head_len = request_len < sizeof(head) - 1 ? request_len : sizeof(head) - 1;
+    memcpy(head, request, head_len);
+    head[head_len] = '\0';
+    const char* id = strstr(head, ";ID:");
+
+    resp.result = 0;
+    resp.request_id = id ? (unsigned int)strtoul(id + 4, NULL, 10) : 0;
+    snprintf(resp.error, sizeof(resp.error), "%s", RPC_ERR_BUSY);
+    snprintf(resp.server_type, sizeof(resp.server_type), "%s", server_type);
+    if (marshal_response(&resp, buffer, sizeof(buffer)) != 0) return -1;
+    ssize_t sent = to ? sendto(fd, buffer, strlen(buffer), 0, to, to_len)
+                      : send(fd, buffer, strlen(buffer), MSG_NOSIGNAL);
+    return sent < 0 ? -1 : 0;
+}
+
+void rpc_reject_connection(int sock, const char* server_type) {
+    char request[RPC_BUFFER_SIZE];
+    ssize_t n = recv(sock, request, sizeof(request), MSG_DONTWAIT);
+    rpc_send_busy(sock, request, n > 0 ? (size_t)n : 0, server_type, NULL, 0);
+    close(sock);
+}
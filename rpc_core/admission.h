@@ -0,0 +1,88 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Overload protection for the servers. Rather than letting threads, child
+// processes or kernel queues pile up until clients time out, a server that is
+// over a limit answers at once with RPC_ERR_BUSY (rpc_protocol.h), a reply a
+// few dozen bytes long, and the client moves on to another server.
+//
+// Three limits, each read from the environment at startup (0 disables one):
+// - RPC_MAX_INFLIGHT: requests (or connections, for the TCP servers) being
+//   handled at once by the thread, process and event-loop servers.
+// - RPC_MAX_QUEUE: connections waiting in a TCP listening socket's accept queue.
+// - RPC_CODEL_TARGET_MS / RPC_CODEL_INTERVAL_MS: CoDel as adapted for RPC
+//   queues. The kernel stamps each request with its arrival time, so the
+//   server knows how long it queued. A burst may queue for up to interval.
+//   Once every request for a whole interval has queued for target or longer,
+//   the queue is standing rather than bursting, and requests are shed until
+//   one gets through in less than target or the queue empties.
+
+#define RPC_MAX_INFLIGHT_ENV "RPC_MAX_INFLIGHT"
+#define RPC_MAX_QUEUE_ENV "RPC_MAX_QUEUE"
+#define RPC_CODEL_TARGET_ENV "RPC_CODEL_TARGET_MS"
+#define RPC_CODEL_INTERVAL_ENV "RPC_CODEL_INTERVAL_MS"
+
+#define ADMISSION_DEFAULT_MAX_INFLIGHT 512
+#define ADMISSION_DEFAULT_MAX_QUEUE 64
+#define CODEL_DEFAULT_TARGET_MS 10
+#define CODEL_DEFAULT_INTERVAL_MS 100
+
+typedef struct {
+    int max_inflight;
+    int max_queue;
+    long long target_us;
+    long long interval_us;
+    int inflight;              // Handlers running now, updated atomically
+    long long slow_since_us;   // Since when every request has queued for target or longer, or 0
+    long long last_taken_us;   // When admission_codel_shed last saw a request
+} Admission;
+
+// Sets the limits from the environment, falling back to the defaults above
+void admission_init(Admission* a);
+
+// Counts a new handler in. Returns 1 if it may run, 0 if max_inflight
+// handlers are already running. Safe from any thread or signal handler.
+int admission_enter(Admission* a);
+
+// Counts a handler out. Every successful admission_enter needs one.
+void admission_leave(Admission* a);
+
+// Waits until no handler is running, for a server that has stopped admitting
+// new ones (see hot_restart.h)
+void admission_drain(Admission* a);
+
+// Returns 1 if listen_fd's accept queue holds max_queue or more connections.
+// Only TCP listeners report their queue; for others this is always 0.
+int admission_queue_full(const Admission* a, int listen_fd);
+
+// CoDel decision for a request that arrived at arrival_us (from
+// rpc_recv_stamped). Returns 1 if it should be shed. A request without an
+// arrival time is never shed. Not thread-safe: call it from the one thread
+// that takes requests off the socket.
+int admission_codel_shed(Admission* a, long long arrival_us);
+
+// Asks the kernel to stamp incoming data on fd with its arrival time.
+// Sockets accepted from a stamped listener inherit it.
+int rpc_enable_arrival_time(int fd);
+
+// recvfrom() that also reports when the data reached the host, in
+// microseconds since the epoch, or 0 if the socket gave no timestamp
+// (Unix stream sockets, or rpc_enable_arrival_time not called).
+ssize_t rpc_recv_stamped(int fd, void* buf, size_t len, int flags, struct sockaddr* from, socklen_t* from_len,
+                         long long* arrival_us);
+
+// Sends the BUSY reply for the request in request (request_len bytes, possibly
+// incomplete or empty), echoing its ID when it has one. to is the datagram
+// peer, or NULL for a connected socket. Returns 0 or -1.
+int rpc_send_busy(int fd, const char* request, size_t request_len, const char* server_type,
+                  const struct sockaddr* to, socklen_t to_len);
+
+// Answers a just-accepted connection BUSY and closes it, without waiting for
+// the client: its request is used for the ID only if it has already arrived.
+void rpc_reject_connection(int sock, const char* server_type);
+
+#endif // ADMISSION_H
@@ -1,5 +1,11 @@
 #include "client_stubs.h"
 #include "rpc_protocol.h"
+#include "endpoint_health.h"
+#include "rpc_transport.h"
+#include "expr_eval.h" // For expr_hash, EXPR_ERR_NOT_CACHED
+#include "shm_transport.h"
+#include "unix_socket.h"
+#include "socket_profile.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,34 +14,88 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h> // For errno
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 
-#define TIMEOUT_SECONDS 5
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-// Generic function to perform an RPC call
-static RpcCallResult perform_rpc_call(OperationType op_type, double a, double b, const char* server_ip, int server_port, int protocol) {
-    RpcCallResult call_res = {0};
-    call_res.call_success = 0; // Assume failure initially
-    strcpy(call_res.error, "RPC call failed"); // Default error
+unsigned int rpc_next_request_id(void) {
+    static unsigned int counter = 0;
+    unsigned int id;
+    // Seed from pid and time so retransmits from a restarted client don't hit stale cache entries
+    if (__atomic_load_n(&counter, __ATOMIC_RELAXED) == 0) {
+        unsigned int seed = ((unsigned int)getpid() << 16) ^ (unsigned int)time(NULL);
+        unsigned int expected = 0;
+        __atomic_compare_exchange_n(&counter, &expected, seed | 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    do {
+        id = __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+    } while (id == 0);
+    return id;
+}
 
-    RpcRequest req;
-    req.operation = op_type;
-    req.op1 = a;
-    req.op2 = b;
+static int vector_codec = RPC_VEC_RAW;
 
-    char request_buffer[RPC_BUFFER_SIZE];
-    if (marshal_request(&req, request_buffer, sizeof(request_buffer)) != 0) {
-        strcpy(call_res.error, "Failed to marshal request");
-        return call_res;
+void rpc_set_vector_codec(int codec) {
+    __atomic_store_n(&vector_codec, codec == RPC_VEC_XOR ? RPC_VEC_XOR : RPC_VEC_RAW, __ATOMIC_RELAXED);
+}
+
+int rpc_vector_codec(void) {
+    return __atomic_load_n(&vector_codec, __ATOMIC_RELAXED);
+}
+
+static int request_priority = RPC_PRIORITY_AUTO;
+
+void rpc_set_priority(int priority) {
+    if (priority != RPC_PRIORITY_INTERACTIVE && priority != RPC_PRIORITY_BATCH) priority = RPC_PRIORITY_AUTO;
+    __atomic_store_n(&request_priority, priority, __ATOMIC_RELAXED);
+}
+
+int rpc_priority(void) {
+    return __atomic_load_n(&request_priority, __ATOMIC_RELAXED);
+}
+
+// Bounds every send and receive on a client socket by TIMEOUT_SECONDS
+static void set_timeouts(int sock) {
+    struct timeval tv;
+    tv.tv_sec = TIMEOUT_SECONDS;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv);
+}
+
+// Connects a stream (IPPROTO_TCP) or datagram (IPPROTO_UDP) socket to the
+// Unix socket at path. Returns the socket, or -1 with err filled in.
+static int unix_transport_connect(const char* path, int protocol, char* err, size_t err_len) {
+    if (protocol != IPPROTO_TCP && protocol != IPPROTO_UDP) {
+        snprintf(err, err_len, "Invalid protocol specified");
+        return -1;
     }
+    int sock = rpc_unix_connect(path, protocol == IPPROTO_TCP ? SOCK_STREAM : SOCK_DGRAM);
+    if (sock < 0) {
+        snprintf(err, err_len, "Unix %s Connect failed to %s: %s", protocol == IPPROTO_TCP ? "stream" : "datagram",
+                 path, strerror(errno));
+        return -1;
+    }
+    set_timeouts(sock);
+    return sock;
+}
 
+static int inet_transport_connect(const char* server_ip, int server_port, int protocol, char* err, size_t err_len) {
     int sock = -1;
     struct sockaddr_in server_addr;
 
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(server_port);
     if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        strcpy(call_res.error, "Invalid server IP address");
-        return call_res;
+        snprintf(err, err_len, "Invalid server IP address");
+        return -1;
     }
 
     if (protocol == IPPROTO_TCP) {
@@ -43,68 +103,183 @@ static RpcCallResult perform_rpc_call(OperationType op_type, double a, double b,
     } else if (protocol == IPPROTO_UDP) {
         sock = socket(AF_INET, SOCK_DGRAM, 0);
     } else {
-        strcpy(call_res.error, "Invalid protocol specified");
-        return call_res;
+        snprintf(err, err_len, "Invalid protocol specified");
+        return -1;
     }
 
     if (sock < 0) {
-        snprintf(call_res.error, sizeof(call_res.error), "Socket creation failed: %s", strerror(errno));
-        return call_res;
+        snprintf(err, err_len, "Socket creation failed: %s", strerror(errno));
+        return -1;
     }
+    set_timeouts(sock); // Before connect(), which the send timeout also bounds
+    // Best effort: a socket the kernel would not tune still works
+    rpc_tune_client_socket(sock, protocol == IPPROTO_TCP ? SOCK_STREAM : SOCK_DGRAM);
 
-    // Set timeout for socket operations
-    struct timeval tv;
-    tv.tv_sec = TIMEOUT_SECONDS;
-    tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv);
+    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        snprintf(err, err_len, "%s Connect failed to %s:%d: %s", protocol == IPPROTO_TCP ? "TCP" : "UDP",
+                 server_ip, server_port, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
 
+int rpc_transport_pick(int protocol, const char* server_ip, size_t request_len) {
+    if (protocol != RPC_PROTO_AUTO) return protocol;
+    return !rpc_is_unix_address(server_ip) && request_len < RPC_AUTO_UDP_MAX_REQUEST ? IPPROTO_UDP : IPPROTO_TCP;
+}
 
-    char response_buffer[RPC_BUFFER_SIZE];
-    ssize_t bytes_sent, bytes_received;
+int rpc_transport_send(const char* request_buffer, const char* server_ip, int server_port, int protocol,
+                       char* err, size_t err_len) {
+    protocol = rpc_transport_pick(protocol, server_ip, strlen(request_buffer));
+    int sock = rpc_is_unix_address(server_ip) ? unix_transport_connect(server_ip, protocol, err, err_len)
+                                              : inet_transport_connect(server_ip, server_port, protocol, err, err_len);
+    if (sock < 0) return -1;
 
-    if (protocol == IPPROTO_TCP) {
-        if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-            snprintf(call_res.error, sizeof(call_res.error), "TCP Connect failed to %s:%d: %s", server_ip, server_port, strerror(errno));
-            close(sock);
-            return call_res;
-        }
-        bytes_sent = send(sock, request_buffer, strlen(request_buffer), 0);
+    // Requests with operand arrays can be large enough for TCP to take them in several pieces
+    size_t len = strlen(request_buffer), sent = 0;
+    while (sent < len) {
+        ssize_t bytes_sent = send(sock, request_buffer + sent, len - sent, 0);
+        if (bytes_sent < 0 && errno == EINTR) continue;
         if (bytes_sent < 0) {
-            snprintf(call_res.error, sizeof(call_res.error), "TCP Send failed: %s", strerror(errno));
+            snprintf(err, err_len, "%s Send failed: %s", protocol == IPPROTO_TCP ? "TCP" : "UDP", strerror(errno));
             close(sock);
-            return call_res;
+            return -1;
         }
-        bytes_received = recv(sock, response_buffer, sizeof(response_buffer) - 1, 0);
-        if (bytes_received <= 0) {
-            if (bytes_received == 0) strcpy(call_res.error, "TCP Recv failed: Server closed connection");
-            else snprintf(call_res.error, sizeof(call_res.error), "TCP Recv failed: %s", strerror(errno));
-            close(sock);
-            return call_res;
+        sent += (size_t)bytes_sent;
+    }
+    return sock;
+}
+
+int rpc_transport_recv(int sock, int protocol, unsigned int expected_id, RpcResponse* resp, char* err, size_t err_len) {
+    char response_buffer[RPC_BUFFER_SIZE];
+    ssize_t bytes_received = recv(sock, response_buffer, sizeof(response_buffer) - 1, 0);
+    if (bytes_received <= 0) {
+        if (bytes_received == 0 && protocol == IPPROTO_TCP) snprintf(err, err_len, "TCP Recv failed: Server closed connection");
+        else snprintf(err, err_len, "%s Recv failed: %s", protocol == IPPROTO_TCP ? "TCP" : "UDP", strerror(errno));
+        return -1;
+    }
+    response_buffer[bytes_received] = '\0';
+
+    if (unmarshal_response(response_buffer, resp) != 0) {
+        snprintf(err, err_len, "Failed to unmarshal response");
+        // Optionally, copy raw buffer for debugging: snprintf(err, err_len, "Unmarshal failed. Raw: %s", response_buffer);
+        return -1;
+    }
+    if (expected_id != 0 && resp->request_id != 0 && resp->request_id != expected_id) {
+        snprintf(err, err_len, "Discarded reply for request %u while waiting for %u", resp->request_id, expected_id);
+        return RPC_RECV_STALE;
+    }
+    return 0;
+}
+
+// Waits for the UDP reply to request_id, retransmitting the request whenever
+// the endpoint's RTO expires without an answer and doubling the RTO each time.
+// Gives up after TIMEOUT_SECONDS in total. The socket is connect()ed, so the
+// kernel already drops datagrams that do not come from the server's address.
+static int udp_exchange(int sock, const char* request_buffer, unsigned int request_id,
+                        const char* server_ip, int server_port, RpcResponse* resp, char* err, size_t err_len) {
+    long rto_ms = endpoint_health_rto_ms(server_ip, server_port, IPPROTO_UDP);
+    long long start_us = now_us();
+    long long deadline_us = start_us + (long long)TIMEOUT_SECONDS * 1000000;
+    long long retransmit_at_us = start_us + rto_ms * 1000;
+    int retransmits = 0;
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+    while (1) {
+        long long now = now_us();
+        if (now >= deadline_us) {
+            snprintf(err, err_len, "UDP request %u timed out after %d retransmissions", request_id, retransmits);
+            return -1;
         }
-    } else { // UDP
-        bytes_sent = sendto(sock, request_buffer, strlen(request_buffer), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
-        if (bytes_sent < 0) {
-            snprintf(call_res.error, sizeof(call_res.error), "UDP Sendto failed: %s", strerror(errno));
-            close(sock);
-            return call_res;
+        long long wake_us = retransmit_at_us < deadline_us ? retransmit_at_us : deadline_us;
+        int n = poll(&pfd, 1, (int)((wake_us - now + 999) / 1000));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            snprintf(err, err_len, "UDP poll failed: %s", strerror(errno));
+            return -1;
         }
-        socklen_t addr_len = sizeof(server_addr); // For recvfrom
-        bytes_received = recvfrom(sock, response_buffer, sizeof(response_buffer) - 1, 0, NULL, NULL); // Not checking source for UDP response here for simplicity
-        if (bytes_received <= 0) {
-            snprintf(call_res.error, sizeof(call_res.error), "UDP Recvfrom failed: %s", strerror(errno));
-            close(sock);
-            return call_res;
+        if (n == 0) {
+            if (now_us() < retransmit_at_us) continue;
+            if (send(sock, request_buffer, strlen(request_buffer), 0) < 0) {
+                snprintf(err, err_len, "UDP Send failed: %s", strerror(errno));
+                return -1;
+            }
+            retransmits++;
+            rto_ms = rto_ms * 2 < RTO_MAX_MS ? rto_ms * 2 : RTO_MAX_MS;
+            retransmit_at_us = now_us() + rto_ms * 1000;
+            continue;
+        }
+
+        int rc = rpc_transport_recv(sock, IPPROTO_UDP, request_id, resp, err, err_len);
+        if (rc == RPC_RECV_STALE) continue;
+        if (rc != 0) return -1;
+        // Karn's algorithm: a reply to a retransmitted request is ambiguous, so no RTT sample
+        if (retransmits == 0) {
+            endpoint_health_rtt_sample(server_ip, server_port, IPPROTO_UDP, (long)(now_us() - start_us));
         }
+        return 0;
     }
+}
 
-    response_buffer[bytes_received] = '\0';
+// Performs one request/response exchange with a single server.
+// Stamps req with a fresh request ID and deadline before sending it.
+// *attempted is set once the request is handed to the network, so requests
+// rejected locally (e.g. too large) do not count against the endpoint.
+// The whole reply is copied to resp_out, if given, once one was received.
+static RpcCallResult perform_rpc_exchange(RpcRequest* req_in, const char* server_ip, int server_port, int protocol,
+                                          int* attempted, RpcResponse* resp_out) {
+    RpcCallResult call_res = {0};
+    call_res.call_success = 0; // Assume failure initially
+    strcpy(call_res.error, "RPC call failed"); // Default error
 
+    RpcRequest req = *req_in;
+    req.request_id = rpc_next_request_id();
+    req.deadline_ms = rpc_now_ms() + TIMEOUT_SECONDS * 1000; // The caller stops waiting after this
+    req.priority = rpc_priority();
+
+    size_t request_size = rpc_request_size(req.operation, req.vec_len);
+    char* request_buffer = malloc(request_size);
+    if (!request_buffer) {
+        strcpy(call_res.error, "Failed to allocate request buffer");
+        return call_res;
+    }
+    if (marshal_request(&req, request_buffer, request_size) != 0) {
+        strcpy(call_res.error, "Failed to marshal request");
+        free(request_buffer);
+        return call_res;
+    }
+    size_t request_len = strlen(request_buffer);
+    protocol = rpc_transport_pick(protocol, server_ip, request_len);
+    if (request_len >= (protocol == IPPROTO_UDP ? RPC_MAX_DATAGRAM_SIZE : RPC_MAX_MESSAGE_SIZE) ||
+        (protocol == RPC_PROTO_SHM && request_len > SHM_MAX_REQUEST_SIZE)) {
+        snprintf(call_res.error, sizeof(call_res.error), "Request of %zu bytes is too large for %s", request_len,
+                 protocol == IPPROTO_UDP ? "UDP, use TCP" : protocol == RPC_PROTO_SHM ? "shared memory, use TCP" : "one message");
+        free(request_buffer);
+        return call_res;
+    }
+
+    *attempted = 1;
     RpcResponse resp;
-    if (unmarshal_response(response_buffer, &resp) != 0) {
-        strcpy(call_res.error, "Failed to unmarshal response");
-        // Optionally, copy raw buffer for debugging: snprintf(call_res.error, sizeof(call_res.error), "Unmarshal failed. Raw: %s", response_buffer);
-        close(sock);
+    int rc;
+    int sock = -1;
+    if (protocol == RPC_PROTO_SHM) {
+        rc = shm_transport_call(server_port, request_buffer, req.request_id, &resp, call_res.error, sizeof(call_res.error));
+    } else {
+        sock = rpc_transport_send(request_buffer, server_ip, server_port, protocol, call_res.error, sizeof(call_res.error));
+        if (sock < 0) {
+            free(request_buffer);
+            return call_res;
+        }
+        if (protocol == IPPROTO_UDP) {
+            rc = udp_exchange(sock, request_buffer, req.request_id, server_ip, server_port, &resp, call_res.error, sizeof(call_res.error));
+        } else {
+            rc = rpc_transport_recv(sock, protocol, req.request_id, &resp, call_res.error, sizeof(call_res.error));
+        }
+    }
+    free(request_buffer);
+    if (rc != 0) {
+        if (sock >= 0) close(sock);
         return call_res;
     }
 
@@ -112,23 +287,348 @@ static RpcCallResult perform_rpc_call(OperationType op_type, double a, double b,
     strcpy(call_res.error, resp.error); // Copy error from server, if any
     strcpy(call_res.server_type_handled, resp.server_type);
     call_res.call_success = (resp.error[0] == '\0'); // Success if server reported no error
+    if (resp_out) *resp_out = resp;
+
+    if (sock >= 0) close(sock);
+    return call_res;
+}
+
+// Generic function to perform an RPC call, guarded by the endpoint's circuit breaker
+static RpcCallResult perform_rpc_call(RpcRequest* req, const char* server_ip, int server_port, int protocol,
+                                      RpcResponse* resp_out) {
+    if (!endpoint_health_allow(server_ip, server_port, protocol)) {
+        RpcCallResult call_res = {0};
+        long retry_in_ms = 0;
+        endpoint_health_state(server_ip, server_port, protocol, &retry_in_ms);
+        snprintf(call_res.error, sizeof(call_res.error), "Circuit open for %s:%d, skipped (next probe in %ld ms)",
+                 server_ip, server_port, retry_in_ms);
+        return call_res;
+    }
+
+    int attempted = 0;
+    RpcCallResult call_res = perform_rpc_exchange(req, server_ip, server_port, protocol, &attempted, resp_out);
+    // server_type_handled is only filled once a response was unmarshalled, so a
+    // server-side error (e.g. division by zero) still marks the endpoint healthy.
+    if (attempted) {
+        endpoint_health_report(server_ip, server_port, protocol, call_res.server_type_handled[0] != '\0');
+    }
+    return call_res;
+}
+
+// Builds the request for one of the scalar operations
+static RpcCallResult perform_scalar_request(OperationType op_type, double a, double b, const char* server_ip, int server_port, int protocol) {
+    RpcRequest req = {0};
+    req.operation = op_type;
+    req.op1 = a;
+    req.op2 = b;
+    return perform_rpc_call(&req, server_ip, server_port, protocol, NULL);
+}
+
+// ===== Request coalescing =====
+// Scalar calls that threads make at the same time to the same endpoint and
+// operation share one OP_BATCH request. A call that finds nothing in flight to
+// its endpoint and operation is sent at once, so a lone caller never waits.
+// Otherwise it joins the open batch. The batch's first caller, its leader,
+// sends it when it is full, when the window has passed, or as soon as the
+// last request in flight is answered, whichever comes first; then it hands
+// every caller its own result.
+
+#define COALESCE_KEYS 64
+
+typedef struct {
+    int count;
+    int done;               // Results are in
+    int refs;               // Callers that have not taken their result yet
+    double a[RPC_BATCH_MAX_CALLS];
+    double b[RPC_BATCH_MAX_CALLS];
+    RpcCallResult results[RPC_BATCH_MAX_CALLS];
+    pthread_cond_t changed; // Joined, sent, or answered
+} CoalescedBatch;
+
+typedef struct {
+    char ip[64];
+    int port;
+    int protocol;
+    OperationType op;
+    int in_use;
+    int inflight;           // Requests sent and not answered yet
+    CoalescedBatch* open;   // Still taking calls
+} CoalesceKey;
+
+static CoalesceKey coalesce_keys[COALESCE_KEYS];
+static pthread_mutex_t coalesce_lock = PTHREAD_MUTEX_INITIALIZER;
+static int coalesce_window_us;
+static int coalesce_max_calls = RPC_BATCH_MAX_CALLS;
+static CoalesceStats coalesce_stats;
+
+void rpc_set_coalescing(int window_us, int max_calls) {
+    pthread_mutex_lock(&coalesce_lock);
+    coalesce_window_us = window_us > 0 ? window_us : 0;
+    coalesce_max_calls = max_calls < 2 || max_calls > RPC_BATCH_MAX_CALLS ? RPC_BATCH_MAX_CALLS : max_calls;
+    pthread_mutex_unlock(&coalesce_lock);
+}
+
+CoalesceStats rpc_coalesce_stats(void) {
+    pthread_mutex_lock(&coalesce_lock);
+    CoalesceStats stats = coalesce_stats;
+    pthread_mutex_unlock(&coalesce_lock);
+    return stats;
+}
+
+// Finds or adds the key; NULL once the table is full. Called with coalesce_lock held.
+static CoalesceKey* coalesce_key(OperationType op, const char* server_ip, int server_port, int protocol) {
+    CoalesceKey* free_key = NULL;
+    for (int i = 0; i < COALESCE_KEYS; i++) {
+        CoalesceKey* k = &coalesce_keys[i];
+        if (!k->in_use) {
+            if (!free_key) free_key = k;
+        } else if (k->op == op && k->port == server_port && k->protocol == protocol && strcmp(k->ip, server_ip) == 0) {
+            return k;
+        }
+    }
+    if (!free_key || strlen(server_ip) >= sizeof(free_key->ip)) return NULL;
+    strcpy(free_key->ip, server_ip);
+    free_key->port = server_port;
+    free_key->protocol = protocol;
+    free_key->op = op;
+    free_key->in_use = 1; // Kept for good: a client talks to a handful of endpoints
+    return free_key;
+}
+
+// Called with coalesce_lock held, after a request to k was answered
+static void coalesce_answered(CoalesceKey* k) {
+    k->inflight--;
+    coalesce_stats.requests++;
+    if (k->inflight == 0 && k->open) pthread_cond_broadcast(&k->open->changed); // Its leader need not wait any longer
+}
+
+// Sends a closed batch and fills in its results. The key's address fields
+// never change once set, so they are read without the lock.
+static void send_batch(const CoalesceKey* k, CoalescedBatch* batch) {
+    if (batch->count == 1) {
+        batch->results[0] = perform_scalar_request(k->op, batch->a[0], batch->b[0], k->ip, k->port, k->protocol);
+        return;
+    }
+    RpcRequest req = {0};
+    RpcResponse resp;
+    req.operation = OP_BATCH;
+    req.batch_op = k->op;
+    req.vec = batch->a;
+    req.vec2 = batch->b;
+    req.vec_len = (size_t)batch->count;
+    req.vec_codec = RPC_VEC_RAW; // Unrelated operands gain nothing from XOR
+    RpcCallResult call_res = perform_rpc_call(&req, k->ip, k->port, k->protocol, &resp);
+    if (call_res.call_success && resp.batch_len != (unsigned int)batch->count) {
+        snprintf(call_res.error, sizeof(call_res.error), "Batched reply has %u results for %d calls", resp.batch_len, batch->count);
+        call_res.call_success = 0;
+    }
+    // A failed batch fails every call in it, with the same error
+    for (int i = 0; i < batch->count; i++) {
+        batch->results[i] = call_res;
+        if (call_res.call_success) batch->results[i].result = resp.batch_results[i];
+    }
+}
+
+// A new, empty batch; NULL if it cannot be set up
+static CoalescedBatch* new_batch(void) {
+    CoalescedBatch* batch = calloc(1, sizeof(*batch));
+    pthread_condattr_t attr;
+    if (!batch || pthread_condattr_init(&attr) != 0) {
+        free(batch);
+        return NULL;
+    }
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // The window must not jump with the wall clock
+    int rc = pthread_cond_init(&batch->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    if (rc != 0) {
+        free(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+static RpcCallResult coalesced_call(OperationType op_type, double a, double b, const char* server_ip, int server_port, int protocol) {
+    pthread_mutex_lock(&coalesce_lock);
+    coalesce_stats.calls++;
+    CoalesceKey* k = coalesce_key(op_type, server_ip, server_port, protocol);
+    CoalescedBatch* batch = k ? k->open : NULL;
+    int leader = 0;
+    if (k && !batch && k->inflight > 0 && (batch = new_batch()) != NULL) {
+        k->open = batch;
+        leader = 1;
+    }
+    if (!batch) {
+        // Nothing to wait for: send it on its own, but count it so later calls batch up behind it
+        if (k) k->inflight++;
+        pthread_mutex_unlock(&coalesce_lock);
+        RpcCallResult call_res = perform_scalar_request(op_type, a, b, server_ip, server_port, protocol);
+        pthread_mutex_lock(&coalesce_lock);
+        if (k) coalesce_answered(k);
+        else coalesce_stats.requests++;
+        pthread_mutex_unlock(&coalesce_lock);
+        return call_res;
+    }
+
+    int slot = batch->count++;
+    batch->a[slot] = a;
+    batch->b[slot] = b;
+    batch->refs++;
+    if (batch->count >= coalesce_max_calls) {
+        k->open = NULL; // Full: its leader sends it now
+        pthread_cond_broadcast(&batch->changed);
+    }
+
+    if (leader) {
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_nsec += (long)coalesce_window_us * 1000;
+        until.tv_sec += until.tv_nsec / 1000000000;
+        until.tv_nsec %= 1000000000;
+        while (k->open == batch && k->inflight > 0) {
+            if (pthread_cond_timedwait(&batch->changed, &coalesce_lock, &until) == ETIMEDOUT) break;
+        }
+        if (k->open == batch) k->open = NULL;
+        k->inflight++;
+        pthread_mutex_unlock(&coalesce_lock);
+        send_batch(k, batch);
+        pthread_mutex_lock(&coalesce_lock);
+        coalesce_answered(k);
+        batch->done = 1;
+        pthread_cond_broadcast(&batch->changed);
+    } else {
+        while (!batch->done) pthread_cond_wait(&batch->changed, &coalesce_lock);
+    }
 
-    close(sock);
+    RpcCallResult call_res = batch->results[slot];
+    if (--batch->refs == 0) {
+        pthread_cond_destroy(&batch->changed);
+        free(batch);
+    }
+    pthread_mutex_unlock(&coalesce_lock);
     return call_res;
 }
 
+// Scalar calls go through the coalescing layer while it is on. A division by
+// zero would fail the whole batch, so it is always sent on its own.
+static RpcCallResult perform_scalar_call(OperationType op_type, double a, double b, const char* server_ip, int server_port, int protocol) {
+    int coalesce = __atomic_load_n(&coalesce_window_us, __ATOMIC_RELAXED) > 0 &&
+                   (op_type == OP_ADD || op_type == OP_SUBTRACT || op_type == OP_MULTIPLY ||
+                    (op_type == OP_DIVIDE && b != 0));
+    if (coalesce) return coalesced_call(op_type, a, b, server_ip, server_port, protocol);
+    return perform_scalar_request(op_type, a, b, server_ip, server_port, protocol);
+}
+
+RpcCallResult rpc_call(OperationType op_type, double a, double b, const char* server_ip, int server_port, int protocol) {
+    return perform_scalar_call(op_type, a, b, server_ip, server_port, protocol);
+}
+
 RpcCallResult rpc_add(double a, double b, const char* server_ip, int server_port, int protocol) {
-    return perform_rpc_call(OP_ADD, a, b, server_ip, server_port, protocol);
+    return perform_scalar_call(OP_ADD, a, b, server_ip, server_port, protocol);
 }
 
 RpcCallResult rpc_subtract(double a, double b, const char* server_ip, int server_port, int protocol) {
-    return perform_rpc_call(OP_SUBTRACT, a, b, server_ip, server_port, protocol);
+    return perform_scalar_call(OP_SUBTRACT, a, b, server_ip, server_port, protocol);
 }
 
 RpcCallResult rpc_multiply(double a, double b, const char* server_ip, int server_port, int protocol) {
-    return perform_rpc_call(OP_MULTIPLY, a, b, server_ip, server_port, protocol);
+    return perform_scalar_call(OP_MULTIPLY, a, b, server_ip, server_port, protocol);
 }
 
 RpcCallResult rpc_divide(double a, double b, const char* server_ip, int server_port, int protocol) {
-    return perform_rpc_call(OP_DIVIDE, a, b, server_ip, server_port, protocol);
+    return perform_scalar_call(OP_DIVIDE, a, b, server_ip, server_port, protocol);
+}
+
+// ===== Expression evaluation =====
+// Remembers which (endpoint, expression) pairs the server has already compiled,
+// so repeat calls send just the hash and the bindings. The table is only a hint:
+// a server that restarted or evicted the program answers EXPR_NOT_CACHED and
+// the call is simply repeated with the full text.
+
+#define EXPR_KNOWN_SLOTS 256
+
+typedef struct {
+    unsigned long long hash;
+    int port;
+    int protocol;
+    char ip[64];
+    int in_use;
+} KnownExpr;
+
+static KnownExpr known_exprs[EXPR_KNOWN_SLOTS];
+static pthread_mutex_t known_exprs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Mixes in the whole endpoint, so servers on different hosts but the same port do not share slots
+static KnownExpr* known_slot(unsigned long long hash, const char* server_ip, int server_port, int protocol) {
+    hash ^= expr_hash(server_ip); // FNV-1a of any text
+    unsigned int h = (unsigned int)(hash ^ (hash >> 32)) ^ (unsigned int)server_port * 2654435761u ^ (unsigned int)protocol;
+    return &known_exprs[h % EXPR_KNOWN_SLOTS];
+}
+
+static int expr_known(unsigned long long hash, const char* server_ip, int server_port, int protocol) {
+    pthread_mutex_lock(&known_exprs_lock);
+    KnownExpr* k = known_slot(hash, server_ip, server_port, protocol);
+    int known = k->in_use && k->hash == hash && k->port == server_port && k->protocol == protocol &&
+                strcmp(k->ip, server_ip) == 0;
+    pthread_mutex_unlock(&known_exprs_lock);
+    return known;
+}
+
+// Collisions just overwrite the slot; the loser pays one extra round trip with the text.
+static void set_expr_known(unsigned long long hash, const char* server_ip, int server_port, int protocol, int known) {
+    pthread_mutex_lock(&known_exprs_lock);
+    KnownExpr* k = known_slot(hash, server_ip, server_port, protocol);
+    if (known) {
+        k->hash = hash;
+        k->port = server_port;
+        k->protocol = protocol;
+        snprintf(k->ip, sizeof(k->ip), "%s", server_ip);
+        k->in_use = 1;
+    } else if (k->hash == hash) {
+        k->in_use = 0;
+    }
+    pthread_mutex_unlock(&known_exprs_lock);
+}
+
+RpcCallResult rpc_eval(const char* expression, const char* bindings, const char* server_ip, int server_port, int protocol) {
+    RpcRequest req = {0};
+    req.operation = OP_EXPR;
+    if (strlen(expression) >= sizeof(req.expr_text) || strlen(bindings) >= sizeof(req.expr_bindings)) {
+        RpcCallResult call_res = {0};
+        strcpy(call_res.error, "Expression or bindings too long");
+        return call_res;
+    }
+    req.expr_hash = expr_hash(expression);
+    strcpy(req.expr_bindings, bindings);
+
+    if (expr_known(req.expr_hash, server_ip, server_port, protocol)) {
+        RpcCallResult call_res = perform_rpc_call(&req, server_ip, server_port, protocol, NULL);
+        if (strcmp(call_res.error, EXPR_ERR_NOT_CACHED) != 0) {
+            return call_res;
+        }
+        set_expr_known(req.expr_hash, server_ip, server_port, protocol, 0);
+    }
+
+    strcpy(req.expr_text, expression);
+    RpcCallResult call_res = perform_rpc_call(&req, server_ip, server_port, protocol, NULL);
+    // Only a clean result proves the server compiled and cached the program
+    if (call_res.call_success) {
+        set_expr_known(req.expr_hash, server_ip, server_port, protocol, 1);
+    }
+    return call_res;
+}
+
+RpcCallResult rpc_reduce(OperationType op_type, const double* x, const double* y, size_t n,
+                         const char* server_ip, int server_port, int protocol) {
+    if (!rpc_is_vector_op(op_type) || (op_type == OP_DOT && !y)) {
+        RpcCallResult call_res = {0};
+        snprintf(call_res.error, sizeof(call_res.error), "Invalid reduction %s", operation_to_string(op_type));
+        return call_res;
+    }
+    RpcRequest req = {0};
+    req.operation = op_type;
+    req.vec = x;
+    req.vec2 = y;
+    req.vec_len = n;
+    req.vec_codec = rpc_vector_codec();
+    return perform_rpc_call(&req, server_ip, server_port, protocol, NULL);
 }
@@ -16,10 +16,85 @@ typedef struct {
 // we might need to define our own constants or include a more specific header.
 // For now, assume they are available or will be resolved during compilation.
 // Typically, these are standard.
+// protocol may also be RPC_PROTO_SHM (shm_transport.h) for a server on the
+// same host; server_ip is then ignored and server_port selects the server.
+// RPC_PROTO_AUTO is for servers that take both protocols on one port
+// (concurrent_dual_async): requests shorter than RPC_AUTO_UDP_MAX_REQUEST
+// bytes go over UDP, larger ones over TCP, and Unix socket paths always use
+// the stream socket.
+
+#define RPC_PROTO_AUTO 1001
+#define RPC_AUTO_UDP_MAX_REQUEST 1400 // Fits one Ethernet frame, so a datagram is never fragmented
 
 RpcCallResult rpc_add(double a, double b, const char* server_ip, int server_port, int protocol);
 RpcCallResult rpc_subtract(double a, double b, const char* server_ip, int server_port, int protocol);
 RpcCallResult rpc_multiply(double a, double b, const char* server_ip, int server_port, int protocol);
 RpcCallResult rpc_divide(double a, double b, const char* server_ip, int server_port, int protocol);
 
+// Generic form of the stubs above for callers that pick the operation at runtime
+RpcCallResult rpc_call(OperationType op_type, double a, double b, const char* server_ip, int server_port, int protocol);
+
+// Coalescing of the scalar calls above, off by default. When on, calls that
+// threads make at the same time to one endpoint and operation travel together
+// in one OP_BATCH request of up to max_calls calls (at most
+// RPC_BATCH_MAX_CALLS). A call waits at most window_us for others to join,
+// and only while an earlier request to that endpoint is still unanswered, so
+// a single caller sees no added latency. Every caller still gets its own
+// result; if the batch fails, they all get its error. Divisions by zero are
+// never batched. window_us 0 turns coalescing off again.
+void rpc_set_coalescing(int window_us, int max_calls);
+
+typedef struct {
+    unsigned long calls;    // Scalar calls made while coalescing was on
+    unsigned long requests; // Requests they were sent in
+} CoalesceStats;
+
+CoalesceStats rpc_coalesce_stats(void);
+
+// Evaluates an infix expression such as "((a+b)*c)/d" on the server with the
+// given bindings ("a=1,b=2,c=3,d=4"). The server compiles the expression once;
+// later calls to the same endpoint send only its hash and the new bindings.
+RpcCallResult rpc_eval(const char* expression, const char* bindings, const char* server_ip, int server_port, int protocol);
+
+// Reduces an array on the server: OP_SUM, OP_MEAN, OP_MIN, OP_MAX, or OP_DOT
+// (which also needs y, of the same length n). The array travels in a single
+// request, so over UDP it must fit one datagram (about 6000 values); TCP
+// takes up to RPC_MAX_MESSAGE_SIZE (about 98000 values). OP_DOT sends both
+// arrays, which halves these limits.
+RpcCallResult rpc_reduce(OperationType op_type, const double* x, const double* y, size_t n,
+                         const char* server_ip, int server_port, int protocol);
+
+// Selects how operand arrays are encoded from now on, for the whole process:
+// RPC_VEC_RAW (the default) or RPC_VEC_XOR, which compresses slowly changing
+// values such as time series and counters (see float_codec.h). Reductions
+// carry the encoding in the request; streams offer it when they open and fall
+// back to raw frames if the server does not agree.
+void rpc_set_vector_codec(int codec);
+
+// Marks the process's requests from now on as RPC_PRIORITY_INTERACTIVE or
+// RPC_PRIORITY_BATCH, for servers that schedule their compute by class (see
+// priority_sched.h). Anything else, and the default RPC_PRIORITY_AUTO, sends
+// no class and lets the server decide.
+void rpc_set_priority(int priority);
+
+// ===== Streaming calls (rpc_core/stream_client.c, protocol in rpc_stream.h) =====
+// For arrays of any length over TCP. The arrays are sent in chunks of up to
+// chunk values (0 picks RPC_STREAM_MAX_CHUNK) while results stream back, with
+// at most RPC_STREAM_CREDITS chunks in flight.
+
+// Called for every result frame in order. offset is the index of the first
+// element of the chunk; element-wise operations deliver one value per element,
+// reductions deliver the single reduction of that chunk.
+typedef void (*RpcStreamSink)(size_t offset, const double* values, size_t count, void* arg);
+
+// Streams x (and y for ADD/SUB/MUL/DIV/DOT) through op. On success, result is
+// the reduction of the whole stream, or the element count for element-wise ops.
+RpcCallResult rpc_stream_call(OperationType op_type, const double* x, const double* y, size_t n, size_t chunk,
+                              RpcStreamSink sink, void* sink_arg, const char* server_ip, int server_port);
+
+// Same, reading the arrays from files of raw host-order doubles. The files
+// are memory-mapped, so they are paged in as they are sent, never all at once.
+RpcCallResult rpc_stream_file(OperationType op_type, const char* x_path, const char* y_path, size_t chunk,
+                              RpcStreamSink sink, void* sink_arg, const char* server_ip, int server_port);
+
 #endif // CLIENT_STUBS_H
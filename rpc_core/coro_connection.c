@@ -0,0 +1,145 @@
+#define _GNU_SOURCE // For accept4
+#include "coro_connection.h"
+#include "coroutine.h"
+#include "rpc_protocol.h"
+#include "rpc_dispatch.h"
+#include "rpc_stream.h"
+#include "mem_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+// What a connection's coroutine is started with
+typedef struct {
+    int sock;
+    const CoroListener* listener;
+} CoroConnection;
+
+static __thread Slab* connection_slab; // Owned by the thread whose scheduler runs the coroutines
+
+int coro_set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Sends the whole reply, parking while the socket buffer is full
+static int send_reply(int sock, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN && coro_wait_fd(sock, POLLOUT) == 0) continue;
+        if (n < 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Drops the n bytes of an answered request; those sent behind it move to the front
+static void consume_request(char* buf, size_t* len, size_t n) {
+    *len -= n;
+    memmove(buf, buf + n, *len + 1); // With the terminator
+}
+
+// Serves one connection until the client closes it, one request at a time.
+// Requests the client sent before the last was answered stay buffered.
+static void handle_client(void* arg) {
+    CoroConnection* conn = (CoroConnection*)arg;
+    int sock = conn->sock;
+    const CoroListener* l = conn->listener;
+    slab_free(conn);
+    char response_buf[RPC_BUFFER_SIZE];
+    char* request_buf = NULL; // Grows with the requests; arrays can make them large
+    size_t request_cap = 0;
+    size_t buffered = 0;
+    long long arrival_us = 0;
+    RpcRequest req;
+    RpcResponse resp;
+
+    strcpy(resp.server_type, l->server_type);
+    while (1) {
+        ssize_t n = rpc_recv_request_next(sock, &request_buf, &request_cap, &buffered, &arrival_us);
+        if (n <= 0) break;
+        char next = request_buf[n];
+        request_buf[n] = '\0'; // Optional fields are looked up to the end of the string
+
+        if (admission_codel_shed(l->codel, arrival_us)) {
+            rpc_send_busy(sock, request_buf, (size_t)n, l->server_type, NULL, 0);
+            break;
+        }
+
+        if (unmarshal_request(request_buf, &req) != 0) {
+            fprintf(stderr, "Failed to unmarshal request: %.200s\n", request_buf);
+            strcpy(resp.error, "Server error: Bad request format");
+            resp.result = 0;
+            resp.request_id = 0;
+        } else {
+            if (req.operation == OP_EXIT) break;
+            if (req.operation == OP_STREAM) {
+                // The stream runs to completion here, replies included; the
+                // client waits for its accept reply before sending frames
+                if (rpc_stream_serve(sock, &req, &resp) != 0) break;
+                request_buf[n] = next;
+                consume_request(request_buf, &buffered, (size_t)n);
+                continue;
+            }
+            dispatch_request(&req, &resp);
+        }
+        request_buf[n] = next;
+        consume_request(request_buf, &buffered, (size_t)n);
+
+        memset(response_buf, 0, RPC_BUFFER_SIZE);
+        if (marshal_response(&resp, response_buf, RPC_BUFFER_SIZE) != 0) {
+            fprintf(stderr, "Failed to marshal response.\n");
+        } else if (send_reply(sock, response_buf, strlen(response_buf)) != 0) {
+            break;
+        }
+        // Bounded-memory mode: idle connections hold no large buffer
+        if (buffered == 0) mem_release_idle_buffer(&request_buf, &request_cap);
+    }
+
+    free(request_buf);
+    close(sock);
+    admission_leave(l->admission);
+}
+
+void coro_accept_connections(void* arg) {
+    const CoroListener* l = (const CoroListener*)arg;
+    if (!connection_slab && !(connection_slab = slab_create(sizeof(CoroConnection)))) {
+        perror("Failed to create connection slab");
+        return;
+    }
+    while (!__atomic_load_n(l->stop, __ATOMIC_ACQUIRE)) {
+        int client_fd = accept4(l->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            // EAGAIN also when another scheduler took the connection first
+            if (errno == EAGAIN) {
+                coro_wait_fd(l->listen_fd, POLLIN);
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                perror("Accept failed");
+                coro_wait_fd(l->listen_fd, POLLIN);
+            }
+            continue;
+        }
+        if (!admission_enter(l->admission)) {
+            rpc_reject_connection(client_fd, l->server_type);
+            continue;
+        }
+        CoroConnection* conn = slab_alloc(connection_slab);
+        if (conn) {
+            conn->sock = client_fd;
+            conn->listener = l;
+        }
+        if (!conn || coro_spawn(handle_client, conn) != 0) {
+            perror("Failed to create coroutine");
+            slab_free(conn);
+            close(client_fd);
+            admission_leave(l->admission);
+        }
+    }
+}
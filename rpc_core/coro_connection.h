@@ -0,0 +1,27 @@
+#ifndef CORO_CONNECTION_H
+#define CORO_CONNECTION_H
+
+#include "admission.h"
+
+// Connections served one coroutine each (coroutine.h), for the servers built
+// on the coroutine scheduler. An accepting coroutine per listening socket
+// parks until a connection is waiting, admits it, and spawns a coroutine that
+// answers its requests in order, streams included (rpc_stream.h), until the
+// client closes it or sends EXIT.
+
+typedef struct {
+    int listen_fd;           // Non-blocking
+    const char* server_type; // Named in every reply
+    Admission* admission;    // Caps the open connections: entered on accept, left on close
+    Admission* codel;        // Sheds requests that queued too long; may be admission itself
+    const int* stop;         // Accepting ends once this is set, from any thread
+} CoroListener;
+
+// Puts fd in non-blocking mode. Returns 0 or -1 with errno set.
+int coro_set_nonblocking(int fd);
+
+// Coroutine body taking a CoroListener, which must outlive it. Accepts
+// connections until *stop is set; those already open are served to the end.
+void coro_accept_connections(void* listener);
+
+#endif // CORO_CONNECTION_H
@@ -0,0 +1,232 @@
+#include "coroutine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
+#if !defined(__x86_64__) && !defined(CORO_USE_UCONTEXT)
+#define CORO_USE_UCONTEXT
+#endif
+#ifdef CORO_USE_UCONTEXT
+#include <ucontext.h>
+#endif
+
+#define CORO_CANARY 0x5AFEC0DE5AFEC0DEULL
+
+// Lives at the top of its own stack, so a coroutine is a single allocation
+typedef struct Coroutine {
+#ifdef CORO_USE_UCONTEXT
+    ucontext_t context;
+#else
+    void* sp;                   // Stack pointer saved while switched out
+#endif
+    CoroutineFn fn;
+    void* arg;
+    int done;
+    struct Coroutine* next;     // Run queue or pool of idle stacks
+} Coroutine;
+
+typedef struct {
+    int epoll_fd;
+#ifdef CORO_USE_UCONTEXT
+    ucontext_t context;
+#else
+    void* sp;                   // The scheduler's own stack while a coroutine runs
+#endif
+    Coroutine* current;         // Running coroutine, or NULL in the scheduler
+    Coroutine* ready_head;
+    Coroutine* ready_tail;
+    Coroutine* idle;            // Stacks of finished coroutines
+    int idle_count;
+    int alive;
+} Scheduler;
+
+static __thread Scheduler sched = { .epoll_fd = -1 };
+
+#ifndef CORO_USE_UCONTEXT
+// rpc_coro_switch(&save_sp, load_sp): pushes the callee-saved registers,
+// stores the stack pointer in save_sp, switches to load_sp and pops the
+// registers saved there. The ret then resumes whatever that stack was doing.
+void rpc_coro_switch(void** save_sp, void* load_sp);
+__asm__(
+    ".text\n"
+    ".globl rpc_coro_switch\n"
+    ".hidden rpc_coro_switch\n"
+    ".type rpc_coro_switch, @function\n"
+    "rpc_coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size rpc_coro_switch, .-rpc_coro_switch\n");
+#endif
+
+static uint64_t* stack_bottom(Coroutine* co) {
+    return (uint64_t*)((char*)co + sizeof(Coroutine) - CORO_STACK_SIZE);
+}
+
+static void check_canary(Coroutine* co) {
+    if (*stack_bottom(co) != CORO_CANARY) {
+        fprintf(stderr, "Coroutine stack overflow (more than %d bytes)\n", CORO_STACK_SIZE);
+        abort();
+    }
+}
+
+// First frame of every coroutine; never returns
+static void coro_entry(void) {
+    Coroutine* co = sched.current;
+    co->fn(co->arg);
+    co->done = 1;
+#ifdef CORO_USE_UCONTEXT
+    setcontext(&sched.context);
+#else
+    void* unused;
+    rpc_coro_switch(&unused, sched.sp);
+#endif
+}
+
+static void resume(Coroutine* co) {
+    sched.current = co;
+#ifdef CORO_USE_UCONTEXT
+    swapcontext(&sched.context, &co->context);
+#else
+    rpc_coro_switch(&sched.sp, co->sp);
+#endif
+    sched.current = NULL;
+    check_canary(co);
+    if (co->done) {
+        // Its pages stay resident while the pool is short of idle stacks
+        if (sched.idle_count >= CORO_STACK_POOL) {
+            long page = sysconf(_SC_PAGESIZE);
+            uintptr_t bottom = (uintptr_t)stack_bottom(co);
+            uintptr_t top = ((uintptr_t)co & ~(uintptr_t)(page - 1));
+            madvise((void*)bottom, top - bottom, MADV_DONTNEED);
+            *stack_bottom(co) = CORO_CANARY;
+        }
+        co->next = sched.idle;
+        sched.idle = co;
+        sched.idle_count++;
+        sched.alive--;
+    }
+}
+
+static void make_ready(Coroutine* co) {
+    co->next = NULL;
+    if (sched.ready_tail) sched.ready_tail->next = co;
+    else sched.ready_head = co;
+    sched.ready_tail = co;
+}
+
+static void run_ready(void) {
+    while (sched.ready_head) {
+        Coroutine* co = sched.ready_head;
+        sched.ready_head = co->next;
+        if (!sched.ready_head) sched.ready_tail = NULL;
+        resume(co);
+    }
+}
+
+// Takes an idle stack, mapping a new slab of them if there is none
+static Coroutine* take_stack(void) {
+    if (!sched.idle) {
+        size_t slab = (size_t)CORO_STACK_SIZE * CORO_STACKS_PER_SLAB;
+        char* base = mmap(NULL, slab, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) return NULL;
+        for (int i = 0; i < CORO_STACKS_PER_SLAB; i++) {
+            char* stack = base + (size_t)i * CORO_STACK_SIZE;
+            Coroutine* co = (Coroutine*)(stack + CORO_STACK_SIZE - sizeof(Coroutine));
+            *(uint64_t*)stack = CORO_CANARY;
+            co->next = sched.idle;
+            sched.idle = co;
+            sched.idle_count++;
+        }
+    }
+    Coroutine* co = sched.idle;
+    sched.idle = co->next;
+    sched.idle_count--;
+    return co;
+}
+
+int coro_init(void) {
+    if (sched.epoll_fd >= 0) return 0;
+    sched.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return sched.epoll_fd < 0 ? -1 : 0;
+}
+
+int coro_spawn(CoroutineFn fn, void* arg) {
+    Coroutine* co = take_stack();
+    if (!co) return -1;
+    co->fn = fn;
+    co->arg = arg;
+    co->done = 0;
+
+    // The stack grows down from just below the Coroutine, 16-byte aligned
+    uintptr_t top = (uintptr_t)co & ~(uintptr_t)15;
+#ifdef CORO_USE_UCONTEXT
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp = stack_bottom(co) + 1;
+    co->context.uc_stack.ss_size = top - (uintptr_t)(stack_bottom(co) + 1);
+    co->context.uc_link = NULL;
+    makecontext(&co->context, coro_entry, 0);
+#else
+    // As if rpc_coro_switch had been called from coro_entry's caller: the
+    // return address, then the six registers it pops. coro_entry then starts
+    // with the stack aligned as after a call.
+    void** sp = (void**)top;
+    *--sp = NULL;                 // coro_entry's own return address; it never returns
+    *--sp = (void*)coro_entry;
+    for (int i = 0; i < 6; i++) *--sp = NULL;
+    co->sp = sp;
+#endif
+    sched.alive++;
+    make_ready(co);
+    return 0;
+}
+
+int coro_run(int timeout_ms) {
+    run_ready();
+    if (sched.alive == 0) return 0;
+    struct epoll_event events[CORO_EVENTS_PER_WAIT];
+    int n = epoll_wait(sched.epoll_fd, events, CORO_EVENTS_PER_WAIT, timeout_ms);
+    if (n < 0) return errno == EINTR ? sched.alive : -1;
+    for (int i = 0; i < n; i++) make_ready(events[i].data.ptr);
+    run_ready();
+    return sched.alive;
+}
+
+int coro_wait_fd(int fd, int events) {
+    Coroutine* co = sched.current;
+    if (!co) return -1;
+
+    // One-shot, so the socket is reported once and then left alone until the next wait
+    struct epoll_event ev;
+    ev.events = EPOLLONESHOT | ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+    ev.data.ptr = co;
+    if (epoll_ctl(sched.epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0 &&
+        (errno != ENOENT || epoll_ctl(sched.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)) {
+        return -1;
+    }
+
+#ifdef CORO_USE_UCONTEXT
+    swapcontext(&co->context, &sched.context);
+#else
+    rpc_coro_switch(&co->sp, sched.sp);
+#endif
+    return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+// Stackful coroutines on an epoll scheduler, so a connection handler can be
+// written as straight-line blocking code (like the threads server's) while one
+// thread serves as many connections as the event-loop server.
+//
+// Sockets are non-blocking. When a read or write would block (EAGAIN), the
+// handler calls coro_wait_fd(). That parks its coroutine and lets the
+// scheduler run others until epoll reports the socket ready. The shared
+// socket helpers (rpc_recv_request, rpc_stream_serve) already do this, so
+// they work unchanged inside a coroutine. Outside one they behave as before.
+//
+// A switch saves only the callee-saved registers: hand-written assembly on
+// x86-64, ucontext elsewhere or with -DCORO_USE_UCONTEXT. Stacks are
+// CORO_STACK_SIZE bytes, carved from larger mappings so 100k coroutines do not
+// need 100k memory mappings. Only the pages a coroutine touches are resident.
+// A finished coroutine's stack is reused by the next one; beyond
+// CORO_STACK_POOL idle stacks, their pages are returned to the kernel.
+// Stacks have no guard page. A canary at the bottom of each stack is checked
+// on every switch, and an overflow aborts the process. Handlers must keep
+// large buffers on the heap.
+//
+// Each thread has its own scheduler, and a coroutine stays on the thread
+// that spawned it.
+
+#define CORO_STACK_SIZE (64 * 1024)
+#define CORO_STACKS_PER_SLAB 64 // Stacks per mmap()
+#define CORO_STACK_POOL 1024    // Idle stacks kept ready, pages and all
+#define CORO_EVENTS_PER_WAIT 256
+
+typedef void (*CoroutineFn)(void* arg);
+
+// Sets up the calling thread's scheduler. Returns 0 or -1 with errno set.
+int coro_init(void);
+
+// Creates a coroutine that runs fn(arg) on the next coro_run(). It ends when
+// fn returns. Returns 0 or -1 with errno set.
+int coro_spawn(CoroutineFn fn, void* arg);
+
+// Runs every runnable coroutine until it ends or parks. If none is left
+// runnable, waits up to timeout_ms (-1: no limit) for the sockets of parked
+// ones, then runs those that became ready. Returns the number of coroutines
+// alive, or -1 with errno set.
+int coro_run(int timeout_ms);
+
+// Inside a coroutine: parks it until fd is ready for events (POLLIN and/or
+// POLLOUT), or has an error or hangup. Returns 0 once ready.
+// Outside a coroutine: returns -1 at once without touching errno, so a caller
+// that got EAGAIN reports it as before.
+int coro_wait_fd(int fd, int events);
+
+#endif // COROUTINE_H
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE // For cpu_set_t and the pthread affinity calls
+#include "cpu_affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49 // Linux 3.19; older C libraries lack the name
+#endif
+
+#define SYSFS_PATH_MAX 256
+#define PROC_LINE_MAX 1024
+
+// Adds the CPUs of a kernel CPU list such as "0-3,8" to set. Returns 0, or -1 if malformed.
+static int parse_cpu_list(const char* list, cpu_set_t* set) {
+    const char* p = list;
+    while (*p != '\0') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) return -1;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) return -1;
+        }
+        if (last >= CPU_AFFINITY_MAX_CPUS) return -1;
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+        p = end;
+        if (*p == ',') p++;
+        else if (*p != '\0') return -1;
+    }
+    return 0;
+}
+
+// Reads the first line of a sysfs or procfs file, without its newline. Returns 0 or -1.
+static int read_line(const char* path, char* buf, size_t len) {
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+    int ok = fgets(buf, (int)len, f) != NULL;
+    fclose(f);
+    if (!ok) return -1;
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+// Drivers name queue interrupts after the interface ("eth0-rx-0", "eth0-TxRx-3")
+// or its device ("virtio3-input.0", "mlx5_comp2@pci:0000:3b:00.0")
+static int is_rx_irq(const char* name, const char* nic, const char* device) {
+    size_t nic_len = strlen(nic), device_len = strlen(device);
+    int ours = (strncmp(name, nic, nic_len) == 0 && name[nic_len] == '-') ||
+               (device_len > 0 && strncmp(name, device, device_len) == 0 && name[device_len] == '-') ||
+               (device_len > 0 && strstr(name, device) && strstr(name, "@pci:"));
+    return ours && (strcasestr(name, "rx") || strstr(name, "input") || strstr(name, "comp"));
+}
+
+// Adds the CPUs that nic's receive queue interrupts go to. Returns how many interrupts matched.
+static int nic_irq_cpus(const char* nic, cpu_set_t* set) {
+    char path[SYSFS_PATH_MAX], target[SYSFS_PATH_MAX], line[PROC_LINE_MAX];
+    const char* device = "";
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device", nic);
+    ssize_t n = readlink(path, target, sizeof(target) - 1);
+    if (n > 0) {
+        target[n] = '\0';
+        const char* slash = strrchr(target, '/');
+        device = slash ? slash + 1 : target;
+    }
+
+    FILE* f = fopen("/proc/interrupts", "r");
+    if (!f) return 0;
+    int matched = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char* end;
+        long irq = strtol(line, &end, 10);
+        if (end == line || *end != ':') continue; // Header, or NMI/LOC/... summaries
+        line[strcspn(line, "\n")] = '\0';
+        char* name = strrchr(line, ' ');
+        if (!name || !is_rx_irq(name + 1, nic, device)) continue;
+
+        char cpus[PROC_LINE_MAX];
+        snprintf(path, sizeof(path), "/proc/irq/%ld/effective_affinity_list", irq);
+        if (read_line(path, cpus, sizeof(cpus)) != 0 || cpus[0] == '\0') {
+            snprintf(path, sizeof(path), "/proc/irq/%ld/smp_affinity_list", irq);
+            if (read_line(path, cpus, sizeof(cpus)) != 0) continue;
+        }
+        if (parse_cpu_list(cpus, set) == 0) matched++;
+    }
+    fclose(f);
+    return matched;
+}
+
+// Adds the CPUs of nic's NUMA node. Returns 0, or -1 if the NIC reports no node.
+static int nic_node_cpus(const char* nic, cpu_set_t* set) {
+    char path[SYSFS_PATH_MAX], value[PROC_LINE_MAX];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", nic);
+    if (read_line(path, value, sizeof(value)) != 0 || atoi(value) < 0) return -1;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", atoi(value));
+    if (read_line(path, value, sizeof(value)) != 0) return -1;
+    return parse_cpu_list(value, set);
+}
+
+int cpu_affinity_init(CpuAffinity* a) {
+    a->count = 0;
+    a->next = 0;
+    const char* list = getenv(RPC_CPU_LIST_ENV);
+    const char* nic = getenv(RPC_CPU_NIC_ENV);
+    int have_list = list && list[0] != '\0', have_nic = nic && nic[0] != '\0';
+    if (!have_list && !have_nic) return 0;
+
+    cpu_set_t chosen, allowed;
+    CPU_ZERO(&chosen);
+    if (have_list && parse_cpu_list(list, &chosen) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (have_nic) {
+        cpu_set_t near_nic;
+        CPU_ZERO(&near_nic);
+        if (nic_irq_cpus(nic, &near_nic) == 0 && nic_node_cpus(nic, &near_nic) != 0) {
+            errno = ENODEV;
+            return -1;
+        }
+        if (have_list) CPU_AND(&chosen, &chosen, &near_nic);
+        else chosen = near_nic;
+    }
+    // Leave out CPUs that taskset or a cgroup already took away
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) CPU_AND(&chosen, &chosen, &allowed);
+
+    for (int cpu = 0; cpu < CPU_AFFINITY_MAX_CPUS; cpu++) {
+        if (CPU_ISSET(cpu, &chosen)) a->cpus[a->count++] = cpu;
+    }
+    if (a->count == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int cpu_affinity_confine(const CpuAffinity* a) {
+    if (a->count == 0) return 0;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < a->count; i++) CPU_SET(a->cpus[i], &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc == 0) return 0;
+    errno = rc;
+    return -1;
+}
+
+static int compare_ints(const void* x, const void* y) {
+    return *(const int*)x - *(const int*)y;
+}
+
+int cpu_affinity_pick(CpuAffinity* a, int fd) {
+    if (a->count == 0) return -1;
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (fd >= 0 && getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu >= 0 &&
+        bsearch(&cpu, a->cpus, a->count, sizeof(int), compare_ints)) {
+        return cpu;
+    }
+    unsigned int turn = __atomic_fetch_add(&a->next, 1, __ATOMIC_RELAXED);
+    return a->cpus[turn % (unsigned int)a->count];
+}
+
+int cpu_affinity_pin_self(int cpu) {
+    if (cpu < 0) return 0;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc == 0) return 0;
+    errno = rc;
+    return -1;
+}
+
+int cpu_affinity_pin_attr(pthread_attr_t* attr, int cpu) {
+    if (cpu < 0) return 0;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    if (rc == 0) return 0;
+    errno = rc;
+    return -1;
+}
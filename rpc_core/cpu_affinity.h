@@ -0,0 +1,55 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <pthread.h>
+
+// Worker placement for the servers. By default the scheduler places and moves
+// workers freely. The work per request is tiny, so a request often costs less
+// than the cache misses after a migration, or after a hop to another NUMA
+// node. Two environment variables, read at startup, restrict the servers to
+// a set of CPUs:
+// - RPC_CPU_LIST: a CPU list in the kernel's format, e.g. "0-3,8".
+// - RPC_CPU_NIC: a network interface, e.g. "eth0". The CPUs its receive
+//   queue interrupts are routed to (/proc/irq/<n>/smp_affinity_list), so
+//   requests are handled where their packets arrive. Falls back to the CPUs
+//   of the NIC's NUMA node if its queue interrupts cannot be identified.
+// Given both, the CPUs in both are used.
+//
+// The whole server is confined to the set, so helper threads (vector_ops,
+// shared memory) and memory it first touches stay on those CPUs' node. Each
+// worker is also pinned to one CPU of the set. A worker serving a socket
+// goes to the CPU that processed the socket's last packet (SO_INCOMING_CPU),
+// so it finds the data in that CPU's cache. If that CPU is outside the set,
+// workers take the CPUs in turn. Single-threaded servers run on the first
+// CPU of the set.
+
+#define RPC_CPU_LIST_ENV "RPC_CPU_LIST"
+#define RPC_CPU_NIC_ENV "RPC_CPU_NIC"
+#define CPU_AFFINITY_MAX_CPUS 1024 // As many as a cpu_set_t holds
+
+typedef struct {
+    int count;                       // CPUs in the set; 0 leaves placement to the scheduler
+    int cpus[CPU_AFFINITY_MAX_CPUS]; // In ascending order
+    unsigned int next;               // Next CPU in turn, updated atomically
+} CpuAffinity;
+
+// Reads the set from the environment. Returns 0, or -1 with errno set if a
+// variable is malformed or selects no CPU this process may use; the set is
+// then empty and the server runs unpinned.
+int cpu_affinity_init(CpuAffinity* a);
+
+// Restricts the calling thread, and the threads and processes it creates
+// later, to the set. Call early in main(). Returns 0 or -1 with errno set.
+int cpu_affinity_confine(const CpuAffinity* a);
+
+// The CPU for a worker serving fd (or -1 for no particular socket), or -1
+// if the set is empty. Safe from any thread.
+int cpu_affinity_pick(CpuAffinity* a, int fd);
+
+// Pins the calling thread to cpu; does nothing for cpu < 0. Returns 0 or -1.
+int cpu_affinity_pin_self(int cpu);
+
+// Same for a thread about to be created with attr
+int cpu_affinity_pin_attr(pthread_attr_t* attr, int cpu);
+
+#endif // CPU_AFFINITY_H
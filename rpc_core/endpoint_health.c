@@ -0,0 +1,158 @@
+#include "endpoint_health.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef struct {
+    char ip[64];
+    int port;
+    int protocol;
+    HealthState state;
+    int consecutive_failures;
+    int trip_count;          // Times reopened without a success in between, drives the backoff
+    long long open_until_ms; // When an OPEN breaker may send its next probe
+    long srtt_us;            // Smoothed round-trip time, 0 until the first sample
+    long rttvar_us;          // Round-trip time variation
+    int in_use;
+} EndpointHealth;
+
+static EndpointHealth health_table[HEALTH_MAX_ENDPOINTS];
+static pthread_mutex_t health_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Finds the entry for an endpoint, creating it on first use.
+// Returns NULL if the table is full; such endpoints are simply never tripped.
+// Caller must hold health_lock.
+static EndpointHealth* lookup_endpoint(const char* server_ip, int server_port, int protocol) {
+    EndpointHealth* free_slot = NULL;
+    for (int i = 0; i < HEALTH_MAX_ENDPOINTS; i++) {
+        EndpointHealth* e = &health_table[i];
+        if (!e->in_use) {
+            if (!free_slot) free_slot = e;
+            continue;
+        }
+        if (e->port == server_port && e->protocol == protocol && strcmp(e->ip, server_ip) == 0) {
+            return e;
+        }
+    }
+    if (free_slot) {
+        memset(free_slot, 0, sizeof(*free_slot));
+        snprintf(free_slot->ip, sizeof(free_slot->ip), "%s", server_ip);
+        free_slot->port = server_port;
+        free_slot->protocol = protocol;
+        free_slot->state = HEALTH_CLOSED;
+        free_slot->in_use = 1;
+    }
+    return free_slot;
+}
+
+static long backoff_ms(int trip_count) {
+    long backoff = HEALTH_BASE_BACKOFF_MS;
+    for (int i = 0; i < trip_count && backoff < HEALTH_MAX_BACKOFF_MS; i++) {
+        backoff *= 2;
+    }
+    return backoff < HEALTH_MAX_BACKOFF_MS ? backoff : HEALTH_MAX_BACKOFF_MS;
+}
+
+static void trip(EndpointHealth* e) {
+    e->state = HEALTH_OPEN;
+    e->open_until_ms = now_ms() + backoff_ms(e->trip_count);
+    e->trip_count++;
+}
+
+int endpoint_health_allow(const char* server_ip, int server_port, int protocol) {
+    int allowed = 1;
+    pthread_mutex_lock(&health_lock);
+    EndpointHealth* e = lookup_endpoint(server_ip, server_port, protocol);
+    if (e) {
+        switch (e->state) {
+            case HEALTH_CLOSED:
+                break;
+            case HEALTH_OPEN:
+                if (now_ms() >= e->open_until_ms) {
+                    e->state = HEALTH_HALF_OPEN; // This caller becomes the probe
+                } else {
+                    allowed = 0;
+                }
+                break;
+            case HEALTH_HALF_OPEN:
+                allowed = 0; // Someone else is already probing
+                break;
+        }
+    }
+    pthread_mutex_unlock(&health_lock);
+    return allowed;
+}
+
+void endpoint_health_report(const char* server_ip, int server_port, int protocol, int transport_ok) {
+    pthread_mutex_lock(&health_lock);
+    EndpointHealth* e = lookup_endpoint(server_ip, server_port, protocol);
+    if (e) {
+        if (transport_ok) {
+            e->state = HEALTH_CLOSED;
+            e->consecutive_failures = 0;
+            e->trip_count = 0;
+        } else {
+            e->consecutive_failures++;
+            if (e->state == HEALTH_HALF_OPEN ||
+                (e->state == HEALTH_CLOSED && e->consecutive_failures >= HEALTH_FAILURE_THRESHOLD)) {
+                trip(e);
+            }
+        }
+    }
+    pthread_mutex_unlock(&health_lock);
+}
+
+long endpoint_health_rto_ms(const char* server_ip, int server_port, int protocol) {
+    long rto_ms = RTO_INITIAL_MS;
+    pthread_mutex_lock(&health_lock);
+    EndpointHealth* e = lookup_endpoint(server_ip, server_port, protocol);
+    if (e && e->srtt_us > 0) {
+        rto_ms = (e->srtt_us + 4 * e->rttvar_us) / 1000;
+    }
+    pthread_mutex_unlock(&health_lock);
+    if (rto_ms < RTO_MIN_MS) rto_ms = RTO_MIN_MS;
+    if (rto_ms > RTO_MAX_MS) rto_ms = RTO_MAX_MS;
+    return rto_ms;
+}
+
+void endpoint_health_rtt_sample(const char* server_ip, int server_port, int protocol, long rtt_us) {
+    pthread_mutex_lock(&health_lock);
+    EndpointHealth* e = lookup_endpoint(server_ip, server_port, protocol);
+    if (e) {
+        if (e->srtt_us == 0) {
+            e->srtt_us = rtt_us > 0 ? rtt_us : 1;
+            e->rttvar_us = rtt_us / 2;
+        } else {
+            // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+            long delta = e->srtt_us > rtt_us ? e->srtt_us - rtt_us : rtt_us - e->srtt_us;
+            e->rttvar_us = (3 * e->rttvar_us + delta) / 4;
+            e->srtt_us = (7 * e->srtt_us + rtt_us) / 8;
+            if (e->srtt_us == 0) e->srtt_us = 1;
+        }
+    }
+    pthread_mutex_unlock(&health_lock);
+}
+
+HealthState endpoint_health_state(const char* server_ip, int server_port, int protocol, long* retry_in_ms) {
+    HealthState state = HEALTH_CLOSED;
+    long retry = 0;
+    pthread_mutex_lock(&health_lock);
+    EndpointHealth* e = lookup_endpoint(server_ip, server_port, protocol);
+    if (e) {
+        state = e->state;
+        if (state == HEALTH_OPEN) {
+            long long left = e->open_until_ms - now_ms();
+            retry = left > 0 ? (long)left : 0;
+        }
+    }
+    pthread_mutex_unlock(&health_lock);
+    if (retry_in_ms) *retry_in_ms = retry;
+    return state;
+}
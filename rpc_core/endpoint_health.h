@@ -0,0 +1,50 @@
+#ifndef ENDPOINT_HEALTH_H
+#define ENDPOINT_HEALTH_H
+
+// Per-endpoint circuit breaker shared by every caller in the process.
+// An endpoint trips OPEN after HEALTH_FAILURE_THRESHOLD consecutive transport
+// failures and is skipped without touching the network until its backoff
+// expires. It then goes HALF_OPEN and lets exactly one probe call through:
+// success closes the circuit, failure reopens it with a doubled backoff.
+// The same table keeps each endpoint's RTT estimate for UDP retransmissions.
+
+typedef enum {
+    HEALTH_CLOSED,    // Healthy, calls flow normally
+    HEALTH_OPEN,      // Tripped, calls are rejected until the backoff expires
+    HEALTH_HALF_OPEN  // One probe call is in flight
+} HealthState;
+
+#define HEALTH_FAILURE_THRESHOLD 2
+#define HEALTH_BASE_BACKOFF_MS 10000
+#define HEALTH_MAX_BACKOFF_MS 300000
+#define HEALTH_MAX_ENDPOINTS 64
+
+// Retransmission timeout bounds for reliable UDP. The RTO itself is computed
+// from each endpoint's smoothed RTT and variance as in RFC 6298, but with a
+// millisecond-scale floor since every server is on the local network. The floor
+// still covers a loaded server forking a child or starting a thread for the
+// request, which a few fast replies in a row would otherwise hide.
+#define RTO_INITIAL_MS 200
+#define RTO_MIN_MS 50
+#define RTO_MAX_MS 2000
+
+// Returns 1 if a call to the endpoint may proceed, 0 if it should be skipped.
+// A 1 returned while the breaker is OPEN/HALF_OPEN reserves the probe slot, so
+// every allowed call must be followed by endpoint_health_report().
+int endpoint_health_allow(const char* server_ip, int server_port, int protocol);
+
+// Records the outcome of a call. transport_ok is 1 when the server answered at
+// all; a server-reported error such as division by zero still counts as healthy.
+void endpoint_health_report(const char* server_ip, int server_port, int protocol, int transport_ok);
+
+// Current state and milliseconds left before the next probe (0 if CLOSED).
+HealthState endpoint_health_state(const char* server_ip, int server_port, int protocol, long* retry_in_ms);
+
+// Current retransmission timeout for the endpoint.
+long endpoint_health_rto_ms(const char* server_ip, int server_port, int protocol);
+
+// Feeds one round-trip measurement into the endpoint's RTT estimate. Callers
+// should only pass samples from requests that were not retransmitted (Karn).
+void endpoint_health_rtt_sample(const char* server_ip, int server_port, int protocol, long rtt_us);
+
+#endif // ENDPOINT_HEALTH_H
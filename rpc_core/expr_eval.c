@@ -0,0 +1,329 @@
+#include "expr_eval.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define CONST_BASE EXPR_MAX_VARS
+#define TEMP_BASE (EXPR_MAX_VARS + EXPR_MAX_CONSTS)
+
+// ===== Compiler =====
+// Recursive descent over the usual grammar:
+//   expr   := term (('+' | '-') term)*
+//   term   := factor (('*' | '/') factor)*
+//   factor := number | identifier | '(' expr ')' | ('-' | '+') factor
+// Each function returns the register holding its value, or -1 on error.
+
+typedef struct {
+    const char* p;
+    ExprProgram* prog;
+    char* err;
+    size_t err_len;
+} ExprParser;
+
+static void skip_spaces(ExprParser* ps) {
+    while (isspace((unsigned char)*ps->p)) ps->p++;
+}
+
+static int emit(ExprParser* ps, ExprOpcode opcode, int a, int b) {
+    ExprProgram* prog = ps->prog;
+    if (prog->num_instrs >= EXPR_MAX_INSTRS) {
+        snprintf(ps->err, ps->err_len, "Expression too long (more than %d operations)", EXPR_MAX_INSTRS);
+        return -1;
+    }
+    int dst = TEMP_BASE + prog->num_instrs;
+    ExprInstr* in = &prog->instrs[prog->num_instrs++];
+    in->opcode = (unsigned char)opcode;
+    in->dst = (unsigned char)dst;
+    in->a = (unsigned char)a;
+    in->b = (unsigned char)b;
+    return dst;
+}
+
+static int const_reg(ExprParser* ps, double value) {
+    ExprProgram* prog = ps->prog;
+    for (int i = 0; i < prog->num_consts; i++) {
+        if (prog->consts[i] == value) return CONST_BASE + i;
+    }
+    if (prog->num_consts >= EXPR_MAX_CONSTS) {
+        snprintf(ps->err, ps->err_len, "Too many constants (more than %d)", EXPR_MAX_CONSTS);
+        return -1;
+    }
+    prog->consts[prog->num_consts] = value;
+    return CONST_BASE + prog->num_consts++;
+}
+
+static int var_reg(ExprParser* ps, const char* name, size_t len) {
+    ExprProgram* prog = ps->prog;
+    if (len >= EXPR_MAX_VAR_NAME) {
+        snprintf(ps->err, ps->err_len, "Variable name too long (max %d characters)", EXPR_MAX_VAR_NAME - 1);
+        return -1;
+    }
+    for (int i = 0; i < prog->num_vars; i++) {
+        if (strlen(prog->var_names[i]) == len && strncmp(prog->var_names[i], name, len) == 0) return i;
+    }
+    if (prog->num_vars >= EXPR_MAX_VARS) {
+        snprintf(ps->err, ps->err_len, "Too many variables (more than %d)", EXPR_MAX_VARS);
+        return -1;
+    }
+    memcpy(prog->var_names[prog->num_vars], name, len);
+    prog->var_names[prog->num_vars][len] = '\0';
+    return prog->num_vars++;
+}
+
+static int parse_expr(ExprParser* ps);
+
+static int parse_factor(ExprParser* ps) {
+    skip_spaces(ps);
+    char c = *ps->p;
+    if (c == '(') {
+        ps->p++;
+        int reg = parse_expr(ps);
+        if (reg < 0) return -1;
+        skip_spaces(ps);
+        if (*ps->p != ')') {
+            snprintf(ps->err, ps->err_len, "Expected ')' in expression");
+            return -1;
+        }
+        ps->p++;
+        return reg;
+    }
+    if (c == '-' || c == '+') {
+        ps->p++;
+        int reg = parse_factor(ps);
+        if (reg < 0 || c == '+') return reg;
+        int zero = const_reg(ps, 0.0);
+        return zero < 0 ? -1 : emit(ps, EXPR_SUB, zero, reg);
+    }
+    if (isdigit((unsigned char)c) || c == '.') {
+        char* end;
+        double value = strtod(ps->p, &end);
+        if (end == ps->p) {
+            snprintf(ps->err, ps->err_len, "Bad number in expression");
+            return -1;
+        }
+        ps->p = end;
+        return const_reg(ps, value);
+    }
+    if (isalpha((unsigned char)c) || c == '_') {
+        const char* start = ps->p;
+        while (isalnum((unsigned char)*ps->p) || *ps->p == '_') ps->p++;
+        return var_reg(ps, start, (size_t)(ps->p - start));
+    }
+    snprintf(ps->err, ps->err_len, "Unexpected '%c' in expression", c ? c : '?');
+    return -1;
+}
+
+static int parse_term(ExprParser* ps) {
+    int left = parse_factor(ps);
+    while (left >= 0) {
+        skip_spaces(ps);
+        char c = *ps->p;
+        if (c != '*' && c != '/') break;
+        ps->p++;
+        int right = parse_factor(ps);
+        if (right < 0) return -1;
+        left = emit(ps, c == '*' ? EXPR_MUL : EXPR_DIV, left, right);
+    }
+    return left;
+}
+
+static int parse_expr(ExprParser* ps) {
+    int left = parse_term(ps);
+    while (left >= 0) {
+        skip_spaces(ps);
+        char c = *ps->p;
+        if (c != '+' && c != '-') break;
+        ps->p++;
+        int right = parse_term(ps);
+        if (right < 0) return -1;
+        left = emit(ps, c == '+' ? EXPR_ADD : EXPR_SUB, left, right);
+    }
+    return left;
+}
+
+int expr_compile(const char* text, ExprProgram* prog, char* err, size_t err_len) {
+    memset(prog, 0, sizeof(*prog));
+    if (strlen(text) >= EXPR_MAX_TEXT) {
+        snprintf(err, err_len, "Expression too long (max %d characters)", EXPR_MAX_TEXT - 1);
+        return -1;
+    }
+    ExprParser ps = { text, prog, err, err_len };
+    int reg = parse_expr(&ps);
+    if (reg < 0) return -1;
+    skip_spaces(&ps);
+    if (*ps.p != '\0') {
+        snprintf(err, err_len, "Unexpected '%c' in expression", *ps.p);
+        return -1;
+    }
+    prog->result_reg = reg;
+    return 0;
+}
+
+unsigned long long expr_hash(const char* text) {
+    unsigned long long h = 1469598103934665603ULL;
+    for (const unsigned char* p = (const unsigned char*)text; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// ===== Interpreter =====
+
+CalcResult expr_execute(const ExprProgram* prog, const char* bindings) {
+    CalcResult res;
+    double regs[EXPR_MAX_REGS];
+    int bound[EXPR_MAX_VARS] = {0};
+    res.value = 0;
+    res.error[0] = '\0';
+
+    memcpy(&regs[CONST_BASE], prog->consts, prog->num_consts * sizeof(double));
+
+    // Bindings look like "a=1.5,b=2"
+    for (const char* p = bindings; p && *p; ) {
+        const char* eq = strchr(p, '=');
+        if (!eq) break;
+        size_t len = (size_t)(eq - p);
+        char* end;
+        double value = strtod(eq + 1, &end);
+        for (int i = 0; i < prog->num_vars; i++) {
+            if (strlen(prog->var_names[i]) == len && strncmp(prog->var_names[i], p, len) == 0) {
+                regs[i] = value;
+                bound[i] = 1;
+                break;
+            }
+        }
+        p = (*end == ',') ? end + 1 : end;
+        if (end == eq + 1) break; // Malformed value, stop rather than loop forever
+    }
+    for (int i = 0; i < prog->num_vars; i++) {
+        if (!bound[i]) {
+            snprintf(res.error, sizeof(res.error), "Error: Unbound variable '%s'", prog->var_names[i]);
+            return res;
+        }
+    }
+
+    for (int i = 0; i < prog->num_instrs; i++) {
+        const ExprInstr* in = &prog->instrs[i];
+        CalcResult step;
+        switch (in->opcode) {
+            case EXPR_ADD: step = add(regs[in->a], regs[in->b]); break;
+            case EXPR_SUB: step = subtract(regs[in->a], regs[in->b]); break;
+            case EXPR_MUL: step = multiply(regs[in->a], regs[in->b]); break;
+            default:       step = divide(regs[in->a], regs[in->b]); break;
+        }
+        if (step.error[0] != '\0') {
+            return step;
+        }
+        regs[in->dst] = step.value;
+    }
+    res.value = regs[prog->result_reg];
+    return res;
+}
+
+// ===== Compiled-expression cache =====
+
+typedef struct {
+    int in_use;
+    unsigned long long hash;
+    unsigned long long last_used;
+    char text[EXPR_MAX_TEXT];
+    ExprProgram prog;
+} ExprCacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned long long clock; // Advances on every access, drives LRU eviction
+    ExprCacheEntry entries[EXPR_CACHE_ENTRIES];
+} ExprCache;
+
+static ExprCache* expr_cache;
+
+void expr_cache_init(void) {
+    if (expr_cache) return;
+    ExprCache* cache = mmap(NULL, sizeof(ExprCache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED) {
+        perror("mmap for expression cache failed");
+        return; // Expressions still work, they are just compiled on every call
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    expr_cache = cache;
+}
+
+// Copies the cached program for hash into prog. With text given, the stored
+// text must match too, so a hash collision is treated as a miss.
+static int cache_lookup(unsigned long long hash, const char* text, ExprProgram* prog) {
+    int hit = 0;
+    pthread_mutex_lock(&expr_cache->lock);
+    for (int i = 0; i < EXPR_CACHE_ENTRIES; i++) {
+        ExprCacheEntry* e = &expr_cache->entries[i];
+        if (e->in_use && e->hash == hash && (text[0] == '\0' || strcmp(e->text, text) == 0)) {
+            e->last_used = ++expr_cache->clock;
+            *prog = e->prog;
+            hit = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&expr_cache->lock);
+    return hit;
+}
+
+static void cache_insert(unsigned long long hash, const char* text, const ExprProgram* prog) {
+    pthread_mutex_lock(&expr_cache->lock);
+    ExprCacheEntry* victim = &expr_cache->entries[0];
+    for (int i = 0; i < EXPR_CACHE_ENTRIES; i++) {
+        ExprCacheEntry* e = &expr_cache->entries[i];
+        if (!e->in_use) {
+            victim = e;
+            break;
+        }
+        if (e->last_used < victim->last_used) victim = e;
+    }
+    victim->in_use = 1;
+    victim->hash = hash;
+    victim->last_used = ++expr_cache->clock;
+    snprintf(victim->text, sizeof(victim->text), "%s", text);
+    victim->prog = *prog;
+    pthread_mutex_unlock(&expr_cache->lock);
+}
+
+CalcResult expr_evaluate(unsigned long long hash, const char* text, const char* bindings) {
+    CalcResult res;
+    ExprProgram prog;
+    res.value = 0;
+    res.error[0] = '\0';
+
+    if (text[0] != '\0') {
+        unsigned long long computed = expr_hash(text);
+        if (hash != 0 && hash != computed) {
+            snprintf(res.error, sizeof(res.error), "Error: Expression hash mismatch");
+            return res;
+        }
+        hash = computed;
+    }
+
+    if (expr_cache && cache_lookup(hash, text, &prog)) {
+        return expr_execute(&prog, bindings);
+    }
+    if (text[0] == '\0') {
+        snprintf(res.error, sizeof(res.error), EXPR_ERR_NOT_CACHED);
+        return res;
+    }
+
+    char err[200];
+    if (expr_compile(text, &prog, err, sizeof(err)) != 0) {
+        snprintf(res.error, sizeof(res.error), "Error: %s", err);
+        return res;
+    }
+    if (expr_cache) {
+        cache_insert(hash, text, &prog);
+    }
+    return expr_execute(&prog, bindings);
+}
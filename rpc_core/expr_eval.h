@@ -0,0 +1,71 @@
+#ifndef EXPR_EVAL_H
+#define EXPR_EVAL_H
+
+#include "calculator_ops.h" // For CalcResult
+#include <stddef.h>         // For size_t
+
+// Server-side expression evaluation for OP_EXPR. An infix expression such as
+// "((a+b)*c)/d" is compiled once into a small register program and cached by
+// the hash of its text; later calls only send the hash and new bindings.
+// Every arithmetic step goes through calculator_ops, so errors such as
+// division by zero are reported exactly as for the scalar operations.
+
+#define EXPR_MAX_TEXT 256      // Longest expression accepted, including the terminator
+#define EXPR_MAX_VARS 16       // Distinct variables per expression
+#define EXPR_MAX_VAR_NAME 16   // Including the terminator
+#define EXPR_MAX_CONSTS 32     // Distinct numeric literals per expression
+#define EXPR_MAX_INSTRS 64     // Arithmetic steps per expression
+#define EXPR_CACHE_ENTRIES 64  // Compiled programs kept by each server
+
+// Error returned when a call sends only a hash the server has not compiled;
+// the client then retries with the full expression text.
+#define EXPR_ERR_NOT_CACHED "EXPR_NOT_CACHED"
+
+typedef enum {
+    EXPR_ADD,
+    EXPR_SUB,
+    EXPR_MUL,
+    EXPR_DIV
+} ExprOpcode;
+
+// One three-address instruction: regs[dst] = regs[a] <op> regs[b]
+typedef struct {
+    unsigned char opcode;
+    unsigned char dst;
+    unsigned char a;
+    unsigned char b;
+} ExprInstr;
+
+// Register layout: variables first, then constants, then temporaries.
+typedef struct {
+    int num_vars;
+    char var_names[EXPR_MAX_VARS][EXPR_MAX_VAR_NAME];
+    int num_consts;
+    double consts[EXPR_MAX_CONSTS];
+    int num_instrs;
+    ExprInstr instrs[EXPR_MAX_INSTRS];
+    int result_reg;
+} ExprProgram;
+
+#define EXPR_MAX_REGS (EXPR_MAX_VARS + EXPR_MAX_CONSTS + EXPR_MAX_INSTRS)
+
+// 64-bit FNV-1a hash of the expression text, used as the cache key on both sides
+unsigned long long expr_hash(const char* text);
+
+// Compiles text into prog. Returns 0 on success, -1 with err filled in.
+int expr_compile(const char* text, ExprProgram* prog, char* err, size_t err_len);
+
+// Runs a compiled program. bindings is "name=value,name=value" and must bind
+// every variable the program uses.
+CalcResult expr_execute(const ExprProgram* prog, const char* bindings);
+
+// Sets up the compiled-expression cache in shared memory so that forked
+// workers of the process-based servers share it. Call once at server startup;
+// without it every expression is compiled per call.
+void expr_cache_init(void);
+
+// Evaluates an OP_EXPR request. text may be empty, in which case the program
+// is looked up by hash alone and EXPR_ERR_NOT_CACHED is returned on a miss.
+CalcResult expr_evaluate(unsigned long long hash, const char* text, const char* bindings);
+
+#endif // EXPR_EVAL_H
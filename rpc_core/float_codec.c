@@ -0,0 +1,219 @@
+#include "float_codec.h"
+#include <string.h>
+#include <stdint.h>
+
+#define MODE_XOR 0
+#define MODE_DELTA 1
+#define MODE_RAW 2
+#define MAX_PACKED_WIDTH 56 // Every field plus its bit offset fits one 8-byte load
+#define MAX_PACKED_BYTES (FLOAT_CODEC_BLOCK * MAX_PACKED_WIDTH / 8)
+
+// Same 128-bit vectors as vector_ops.c: SSE2 on x86-64, NEON on arm64
+typedef uint64_t v2u __attribute__((vector_size(16)));
+typedef int64_t v2s __attribute__((vector_size(16)));
+
+static inline v2u load2(const void* p) {
+    v2u v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store2(void* p, v2u v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+size_t float_codec_bound(size_t n) {
+    size_t blocks = (n + FLOAT_CODEC_BLOCK - 1) / FLOAT_CODEC_BLOCK;
+    return n * sizeof(double) + 2 * blocks + sizeof(uint64_t);
+}
+
+// h holds the two values before the block followed by the block itself.
+// The residual kernels fill r and return the OR of all residuals, whose
+// highest and lowest set bits give the block's width and shift.
+
+static uint64_t xor_residuals(const uint64_t* h, size_t count, uint64_t* r) {
+    v2u acc = { 0, 0 };
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        v2u v = load2(h + i + 2) ^ load2(h + i + 1);
+        store2(r + i, v);
+        acc |= v;
+    }
+    uint64_t bits = acc[0] | acc[1];
+    for (; i < count; i++) {
+        r[i] = h[i + 2] ^ h[i + 1];
+        bits |= r[i];
+    }
+    return bits;
+}
+
+// Difference from the straight line through the previous two values
+static uint64_t delta_residuals(const uint64_t* h, size_t count, uint64_t* r) {
+    v2u acc = { 0, 0 };
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        v2u prev = load2(h + i + 1);
+        v2u d = load2(h + i + 2) - (prev + prev - load2(h + i));
+        store2(r + i, d);
+        acc |= d;
+    }
+    uint64_t bits = acc[0] | acc[1];
+    for (; i < count; i++) {
+        r[i] = h[i + 2] - (2 * h[i + 1] - h[i]);
+        bits |= r[i];
+    }
+    return bits;
+}
+
+// Drops the common trailing zeros of the differences, then zigzag encodes
+// them so small negative ones also have leading zeros. In place.
+static uint64_t zigzag(uint64_t* r, size_t count, int shift) {
+    v2u acc = { 0, 0 };
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        v2s d = (v2s)load2(r + i) >> shift;
+        v2u z = ((v2u)d << 1) ^ (v2u)(d >> 63);
+        store2(r + i, z);
+        acc |= z;
+    }
+    uint64_t bits = acc[0] | acc[1];
+    for (; i < count; i++) {
+        int64_t d = (int64_t)r[i] >> shift;
+        r[i] = (uint64_t)d << 1 ^ (uint64_t)(d >> 63);
+        bits |= r[i];
+    }
+    return bits;
+}
+
+static void window(uint64_t bits, int* width, int* shift) {
+    if (bits == 0) {
+        *width = *shift = 0;
+        return;
+    }
+    *shift = __builtin_ctzll(bits);
+    *width = 64 - __builtin_clzll(bits) - *shift;
+}
+
+// Appends count fields of width bits. Each step stores a whole 8-byte word and
+// advances past the completed bytes only, hence the slack in float_codec_bound.
+static unsigned char* pack(const uint64_t* r, size_t count, int width, int shift, unsigned char* out) {
+    uint64_t acc = 0;
+    int filled = 0;
+    if (width == 0) return out;
+    for (size_t i = 0; i < count; i++) {
+        acc |= (r[i] >> shift) << filled;
+        filled += width;
+        memcpy(out, &acc, sizeof(acc));
+        int bytes = filled / 8;
+        out += bytes;
+        acc = bytes == 8 ? 0 : acc >> (bytes * 8);
+        filled -= bytes * 8;
+    }
+    return out + (filled + 7) / 8;
+}
+
+// Extracts count fields of width bits, two at a time. packed must have 8
+// readable bytes past the last field.
+static void unpack(const unsigned char* packed, size_t count, int width, int shift, uint64_t* r) {
+    if (width == 0) {
+        memset(r, 0, count * sizeof(uint64_t));
+        return;
+    }
+    uint64_t mask = (1ULL << width) - 1;
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        size_t o0 = i * width, o1 = o0 + width;
+        uint64_t w0, w1;
+        memcpy(&w0, packed + o0 / 8, sizeof(w0));
+        memcpy(&w1, packed + o1 / 8, sizeof(w1));
+        v2u words = { w0, w1 };
+        v2u offsets = { o0 % 8, o1 % 8 };
+        store2(r + i, ((words >> offsets) & mask) << shift);
+    }
+    for (; i < count; i++) {
+        size_t o = i * width;
+        uint64_t w;
+        memcpy(&w, packed + o / 8, sizeof(w));
+        r[i] = ((w >> (o % 8)) & mask) << shift;
+    }
+}
+
+size_t float_codec_encode(const double* values, size_t n, unsigned char* out) {
+    uint64_t h[FLOAT_CODEC_BLOCK + 2] = { 0 };
+    uint64_t xr[FLOAT_CODEC_BLOCK], dr[FLOAT_CODEC_BLOCK];
+    unsigned char* start = out;
+
+    for (size_t first = 0; first < n; first += FLOAT_CODEC_BLOCK) {
+        size_t count = n - first < FLOAT_CODEC_BLOCK ? n - first : FLOAT_CODEC_BLOCK;
+        memcpy(h + 2, values + first, count * sizeof(double));
+
+        int xw, xs, dw, ds;
+        window(xor_residuals(h, count, xr), &xw, &xs);
+        window(delta_residuals(h, count, dr), &dw, &ds);
+        uint64_t zbits = zigzag(dr, count, ds);
+        dw = zbits ? 64 - __builtin_clzll(zbits) : 0; // The zigzag sign bit sits at the bottom
+        int mode = dw < xw ? MODE_DELTA : MODE_XOR;
+        int width = mode == MODE_DELTA ? dw : xw;
+        int shift = mode == MODE_DELTA ? ds : xs;
+
+        if (width > MAX_PACKED_WIDTH) {
+            *out++ = MODE_RAW << 6;
+            *out++ = 0;
+            memcpy(out, h + 2, count * sizeof(double));
+            out += count * sizeof(double);
+        } else {
+            *out++ = (unsigned char)(mode << 6 | width);
+            *out++ = (unsigned char)shift;
+            out = pack(mode == MODE_DELTA ? dr : xr, count, width, mode == MODE_DELTA ? 0 : shift, out);
+        }
+        h[0] = h[count];
+        h[1] = h[count + 1];
+    }
+    return (size_t)(out - start);
+}
+
+int float_codec_decode(const unsigned char* in, size_t len, double* values, size_t n) {
+    uint64_t h[FLOAT_CODEC_BLOCK + 2] = { 0 };
+    uint64_t r[FLOAT_CODEC_BLOCK];
+    unsigned char packed[MAX_PACKED_BYTES + sizeof(uint64_t)];
+    const unsigned char* end = in + len;
+
+    for (size_t first = 0; first < n; first += FLOAT_CODEC_BLOCK) {
+        size_t count = n - first < FLOAT_CODEC_BLOCK ? n - first : FLOAT_CODEC_BLOCK;
+        if (end - in < 2) return -1;
+        int mode = in[0] >> 6, width = in[0] & 63, shift = in[1];
+        in += 2;
+
+        if (mode == MODE_RAW) {
+            if (width != 0 || shift != 0 || (size_t)(end - in) < count * sizeof(double)) return -1;
+            memcpy(h + 2, in, count * sizeof(double));
+            in += count * sizeof(double);
+        } else {
+            size_t bytes = (count * width + 7) / 8;
+            if (mode > MODE_DELTA || width > MAX_PACKED_WIDTH || width + shift > 64 || (size_t)(end - in) < bytes) {
+                return -1;
+            }
+            // A padded copy lets unpack load whole words up to the last field
+            memcpy(packed, in, bytes);
+            memset(packed + bytes, 0, sizeof(uint64_t));
+            in += bytes;
+            unpack(packed, count, width, mode == MODE_DELTA ? 0 : shift, r);
+
+            // Undoing the prediction is a running dependency, one value at a time
+            if (mode == MODE_XOR) {
+                for (size_t i = 0; i < count; i++) {
+                    h[i + 2] = r[i] ^ h[i + 1];
+                }
+            } else {
+                for (size_t i = 0; i < count; i++) {
+                    uint64_t d = ((r[i] >> 1) ^ (0 - (r[i] & 1))) << shift;
+                    h[i + 2] = d + (2 * h[i + 1] - h[i]);
+                }
+            }
+        }
+        memcpy(values + first, h + 2, count * sizeof(double));
+        h[0] = h[count];
+        h[1] = h[count + 1];
+    }
+    return in == end ? 0 : -1;
+}
@@ -0,0 +1,41 @@
+#ifndef FLOAT_CODEC_H
+#define FLOAT_CODEC_H
+
+#include <stddef.h> // For size_t
+
+// Lossless compression for arrays of doubles that change slowly from one
+// element to the next, such as sensor readings, timestamps and counters.
+//
+// Like Gorilla, each value is stored as the XOR of its bit pattern with the
+// previous one, so the identical sign, exponent and high mantissa bits cost
+// nothing. Values that grow steadily (counters, timestamps) are stored instead
+// as the difference between the actual bits and a straight-line prediction
+// from the previous two, which is zero for a constant step.
+//
+// Unlike Gorilla, the bit window is chosen per block of FLOAT_CODEC_BLOCK
+// values rather than per value: every residual in a block is stored with the
+// same width and shift. That costs a few bits on uneven data but removes the
+// per-value control bits and branches, so both directions run on GCC/Clang
+// vector types two values at a time.
+//
+// Encoded form, per block of up to FLOAT_CODEC_BLOCK values:
+//   byte 0: mode (0 XOR, 1 prediction delta, 2 raw) << 6 | width in bits (0..56)
+//   byte 1: shift, the trailing zero bits dropped from every residual
+//   then count * width bits, little-endian, padded to a whole byte
+// RAW blocks, used when the residuals need more than 56 bits, hold the values as is.
+
+#define FLOAT_CODEC_BLOCK 64
+
+// Output buffer size float_codec_encode needs for n values (a little more
+// than the largest encoding, as the packer writes 8 bytes at a time)
+size_t float_codec_bound(size_t n);
+
+// Encodes n values into out, which must hold float_codec_bound(n) bytes.
+// Returns the number of bytes written.
+size_t float_codec_encode(const double* values, size_t n, unsigned char* out);
+
+// Decodes exactly n values from len bytes. Returns 0, or -1 if the input is
+// malformed or does not hold exactly n values.
+int float_codec_decode(const unsigned char* in, size_t len, double* values, size_t n);
+
+#endif // FLOAT_CODEC_H
@@ -0,0 +1,267 @@
+#include "hedging.h"
+#include "endpoint_health.h"
+#include "rpc_transport.h"
+#include "shm_transport.h" // For RPC_PROTO_SHM
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#define HEDGE_SAMPLE_WINDOW 128 // Recent latencies the hedge delay is computed from
+#define HEDGE_MIN_SAMPLES 20    // Below this the policy's default delay is used
+#define HEDGE_MAX_TOKENS 10.0   // Largest burst of hedges the budget can save up
+
+static HedgePolicy policy = HEDGE_DEFAULT_POLICY;
+static HedgeStats stats;
+static double budget_tokens;
+static long latency_samples_us[HEDGE_SAMPLE_WINDOW];
+static int sample_count;
+static int sample_next;
+static pthread_mutex_t hedge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int compare_long(const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return (x > y) - (x < y);
+}
+
+// Caller must hold hedge_lock.
+static double hedge_delay_ms_locked(void) {
+    if (sample_count < HEDGE_MIN_SAMPLES) {
+        return policy.default_delay_ms;
+    }
+    long sorted[HEDGE_SAMPLE_WINDOW];
+    memcpy(sorted, latency_samples_us, sample_count * sizeof(long));
+    qsort(sorted, sample_count, sizeof(long), compare_long);
+    int idx = (int)(policy.delay_percentile * (sample_count - 1));
+    double delay = sorted[idx] / 1000.0;
+    return delay < policy.min_delay_ms ? policy.min_delay_ms : delay;
+}
+
+static void record_latency(long long latency_us) {
+    pthread_mutex_lock(&hedge_lock);
+    latency_samples_us[sample_next] = (long)latency_us;
+    sample_next = (sample_next + 1) % HEDGE_SAMPLE_WINDOW;
+    if (sample_count < HEDGE_SAMPLE_WINDOW) sample_count++;
+    pthread_mutex_unlock(&hedge_lock);
+}
+
+// Every call earns max_extra_load tokens and a hedge spends one, so over time
+// hedges stay below max_extra_load * calls.
+static int take_hedge_budget(void) {
+    int granted = 0;
+    pthread_mutex_lock(&hedge_lock);
+    if (budget_tokens >= 1.0) {
+        budget_tokens -= 1.0;
+        stats.hedges_sent++;
+        granted = 1;
+    } else {
+        stats.budget_denied++;
+    }
+    pthread_mutex_unlock(&hedge_lock);
+    return granted;
+}
+
+void rpc_hedge_set_policy(const HedgePolicy* new_policy) {
+    pthread_mutex_lock(&hedge_lock);
+    policy = *new_policy;
+    pthread_mutex_unlock(&hedge_lock);
+}
+
+HedgeStats rpc_hedge_stats(void) {
+    pthread_mutex_lock(&hedge_lock);
+    HedgeStats snapshot = stats;
+    snapshot.current_delay_ms = hedge_delay_ms_locked();
+    pthread_mutex_unlock(&hedge_lock);
+    return snapshot;
+}
+
+static int is_idempotent(OperationType op_type) {
+    return op_type == OP_ADD || op_type == OP_SUBTRACT || op_type == OP_MULTIPLY || op_type == OP_DIVIDE;
+}
+
+static void count_failover(void) {
+    pthread_mutex_lock(&hedge_lock);
+    stats.failovers++;
+    pthread_mutex_unlock(&hedge_lock);
+}
+
+// Sends the request to the backup, returning its socket or -1
+static int send_to_backup(const char* request_buffer, const RpcTarget* backup) {
+    char err[256];
+    int fd = rpc_transport_send(request_buffer, backup->ip, backup->port, backup->protocol, err, sizeof(err));
+    if (fd < 0) {
+        endpoint_health_report(backup->ip, backup->port, backup->protocol, 0);
+    }
+    return fd;
+}
+
+// Sends the request to the backup in place of a primary that failed or was
+// BUSY. Such a send is outside the budget, so it counts as a failover.
+static int fail_over_to_backup(const char* request_buffer, const RpcTarget* backup) {
+    int fd = send_to_backup(request_buffer, backup);
+    if (fd >= 0) count_failover();
+    return fd;
+}
+
+static RpcCallResult plain_call(OperationType op_type, double a, double b, const RpcTarget* target) {
+    return rpc_call(op_type, a, b, target->ip, target->port, target->protocol);
+}
+
+RpcCallResult rpc_call_hedged(OperationType op_type, double a, double b,
+                              const RpcTarget* primary, const RpcTarget* backup) {
+    // Shared-memory calls have no socket to poll() alongside the other one
+    if (!backup || !is_idempotent(op_type) || primary->protocol == RPC_PROTO_SHM || backup->protocol == RPC_PROTO_SHM) {
+        return plain_call(op_type, a, b, primary);
+    }
+
+    pthread_mutex_lock(&hedge_lock);
+    stats.calls++;
+    budget_tokens += policy.max_extra_load;
+    if (budget_tokens > HEDGE_MAX_TOKENS) budget_tokens = HEDGE_MAX_TOKENS;
+    double delay_ms = hedge_delay_ms_locked();
+    pthread_mutex_unlock(&hedge_lock);
+
+    // A tripped primary is not worth waiting on; the backup takes the call alone
+    int primary_probing = endpoint_health_state(primary->ip, primary->port, primary->protocol, NULL) != HEALTH_CLOSED;
+    if (!endpoint_health_allow(primary->ip, primary->port, primary->protocol)) {
+        count_failover();
+        return plain_call(op_type, a, b, backup);
+    }
+
+    RpcCallResult call_res = {0};
+    strcpy(call_res.error, "RPC call failed");
+
+    RpcRequest req = {0};
+    req.operation = op_type;
+    req.op1 = a;
+    req.op2 = b;
+    req.request_id = rpc_next_request_id();
+    req.deadline_ms = rpc_now_ms() + TIMEOUT_SECONDS * 1000; // The caller stops waiting after this
+    req.priority = rpc_priority();
+    char request_buffer[RPC_BUFFER_SIZE];
+    if (marshal_request(&req, request_buffer, sizeof(request_buffer)) != 0) {
+        endpoint_health_report(primary->ip, primary->port, primary->protocol, 0);
+        strcpy(call_res.error, "Failed to marshal request");
+        return call_res;
+    }
+
+    const RpcTarget* targets[2] = { primary, backup };
+    struct pollfd fds[2] = { { .fd = -1, .events = POLLIN }, { .fd = -1, .events = POLLIN } };
+    int hedged = 0, budgeted = 0; // budgeted: the backup copy is a hedge paid from the budget
+
+    long long start_us = now_us();
+    fds[0].fd = rpc_transport_send(request_buffer, primary->ip, primary->port, primary->protocol,
+                                   call_res.error, sizeof(call_res.error));
+    if (fds[0].fd < 0) {
+        endpoint_health_report(primary->ip, primary->port, primary->protocol, 0);
+        count_failover();
+        return plain_call(op_type, a, b, backup);
+    }
+
+    long long deadline_us = start_us + (long long)TIMEOUT_SECONDS * 1000000;
+    long long hedge_at_us = start_us + (long long)(delay_ms * 1000);
+    int winner = -1;
+    RpcResponse resp;
+    char busy_server[sizeof(resp.server_type)] = ""; // Who said BUSY, reported if nobody answers
+
+    while (winner < 0 && (fds[0].fd >= 0 || fds[1].fd >= 0)) {
+        long long now = now_us();
+        if (now >= deadline_us) {
+            snprintf(call_res.error, sizeof(call_res.error), "Hedged call timed out after %d s", TIMEOUT_SECONDS);
+            break;
+        }
+        long long wake_us = (!hedged && hedge_at_us < deadline_us) ? hedge_at_us : deadline_us;
+        int timeout_ms = (int)((wake_us - now + 999) / 1000);
+        int n = poll(fds, 2, timeout_ms);
+
+        if (n == 0 && !hedged && now_us() >= hedge_at_us) {
+            hedged = 1; // Only ever decide once, whether or not the budget allows it
+            if (endpoint_health_state(backup->ip, backup->port, backup->protocol, NULL) == HEALTH_CLOSED &&
+                take_hedge_budget()) {
+                fds[1].fd = send_to_backup(request_buffer, backup);
+                budgeted = 1;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < 2 && winner < 0; i++) {
+            if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLERR | POLLHUP))) continue;
+            const RpcTarget* t = targets[i];
+            int rc = rpc_transport_recv(fds[i].fd, t->protocol, req.request_id, &resp, call_res.error, sizeof(call_res.error));
+            if (rc == 0 && strcmp(resp.error, RPC_ERR_BUSY) == 0) {
+                // Shed unrun by an overloaded server: the backup gets the call at once,
+                // outside the budget since the primary did no work
+                endpoint_health_report(t->ip, t->port, t->protocol, 1);
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                strcpy(busy_server, resp.server_type);
+                if (i == 0 && !hedged) {
+                    hedged = 1;
+                    if (endpoint_health_state(backup->ip, backup->port, backup->protocol, NULL) == HEALTH_CLOSED) {
+                        fds[1].fd = fail_over_to_backup(request_buffer, backup);
+                    }
+                }
+            } else if (rc == 0) {
+                winner = i;
+                endpoint_health_report(t->ip, t->port, t->protocol, 1);
+            } else if (rc == RPC_RECV_STALE) {
+                continue;
+            } else {
+                endpoint_health_report(t->ip, t->port, t->protocol, 0);
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                // A primary that failed before the hedge delay would otherwise end the
+                // call; like a BUSY one, it leaves the backup to answer
+                if (i == 0 && !hedged) {
+                    hedged = 1;
+                    if (endpoint_health_state(backup->ip, backup->port, backup->protocol, NULL) == HEALTH_CLOSED) {
+                        fds[1].fd = fail_over_to_backup(request_buffer, backup);
+                    }
+                }
+            }
+        }
+    }
+
+    // The loser is cancelled by closing its socket; a late reply is simply dropped by the kernel.
+    // Endpoints still silent at the timeout count as failures, as does a primary
+    // that was the breaker's half-open probe and lost the race.
+    for (int i = 0; i < 2; i++) {
+        if (fds[i].fd < 0) continue;
+        if (winner < 0 || (i == 0 && primary_probing)) {
+            endpoint_health_report(targets[i]->ip, targets[i]->port, targets[i]->protocol, 0);
+        }
+        close(fds[i].fd);
+    }
+
+    if (winner < 0) {
+        if (busy_server[0] != '\0') {
+            strcpy(call_res.error, RPC_ERR_BUSY);
+            strcpy(call_res.server_type_handled, busy_server);
+        }
+        return call_res;
+    }
+
+    // When the backup wins, the elapsed time is only a lower bound on the
+    // primary's latency, but it still pushes the percentile in the right direction.
+    record_latency(now_us() - start_us);
+    if (winner == 1 && budgeted) {
+        pthread_mutex_lock(&hedge_lock);
+        stats.hedge_wins++;
+        pthread_mutex_unlock(&hedge_lock);
+    }
+
+    call_res.result = resp.result;
+    strcpy(call_res.error, resp.error);
+    strcpy(call_res.server_type_handled, resp.server_type);
+    call_res.call_success = (resp.error[0] == '\0');
+    return call_res;
+}
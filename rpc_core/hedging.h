@@ -0,0 +1,46 @@
+#ifndef HEDGING_H
+#define HEDGING_H
+
+#include "client_stubs.h" // For RpcCallResult, OperationType
+
+// Hedged requests: send the call to a primary endpoint and, if it has not
+// answered within a percentile of recently observed latencies, send a backup
+// copy to a second endpoint. The first reply wins and the other socket is
+// closed. A primary that fails or answers BUSY before then gets the backup
+// copy sent at once; such a copy, like a call sent to the backup because the
+// primary's breaker is open, is a failover outside the hedge budget and is
+// counted apart from the hedges. Only idempotent operations (the four
+// arithmetic calls) are hedged; anything else goes to the primary alone.
+
+typedef struct {
+    const char* ip;
+    int port;
+    int protocol; // IPPROTO_TCP or IPPROTO_UDP
+} RpcTarget;
+
+typedef struct {
+    double delay_percentile; // Hedge once the primary is slower than this quantile, e.g. 0.95
+    double max_extra_load;   // Hedges allowed per call on average, e.g. 0.05 for at most 5% extra
+    int min_delay_ms;        // Lower bound on the hedge delay
+    int default_delay_ms;    // Delay used until enough latency samples are collected
+} HedgePolicy;
+
+typedef struct {
+    unsigned long calls;         // Calls that went through rpc_call_hedged
+    unsigned long hedges_sent;   // Backup requests sent as hedges, within the budget
+    unsigned long hedge_wins;    // Of those, the ones the backup answered before the primary
+    unsigned long budget_denied; // Hedge wanted but the extra-load budget was exhausted
+    unsigned long failovers;     // Calls sent to the backup outside the budget: primary tripped, failed or BUSY
+    double current_delay_ms;     // Hedge delay that the next call would use
+} HedgeStats;
+
+#define HEDGE_DEFAULT_POLICY { 0.95, 0.05, 1, 20 }
+
+void rpc_hedge_set_policy(const HedgePolicy* policy);
+HedgeStats rpc_hedge_stats(void);
+
+// backup may be NULL, in which case this behaves like a plain call to primary.
+RpcCallResult rpc_call_hedged(OperationType op_type, double a, double b,
+                              const RpcTarget* primary, const RpcTarget* backup);
+
+#endif // HEDGING_H
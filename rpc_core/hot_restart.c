@@ -0,0 +1,125 @@
+#include "hot_restart.h"
+#include "unix_socket.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CONTROL_PATH_MAX sizeof(((struct sockaddr_un*)0)->sun_path)
+
+static int predecessor = -1; // Connection to the old server until this one is ready
+
+typedef union {
+    char buf[CMSG_SPACE(sizeof(int) * HOT_RESTART_MAX_FDS)];
+    struct cmsghdr align;
+} FdControl;
+
+// <dir>/rpc_<port>.restart, beside the server's Unix socket
+static void control_path(int port, char* buf, size_t len) {
+    rpc_unix_path(port, buf, len);
+    char* ext = strrchr(buf, '.');
+    if (ext) snprintf(ext, len - (size_t)(ext - buf), ".restart");
+}
+
+int hot_restart_requested(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], HOT_RESTART_FLAG) == 0) return 1;
+    }
+    return 0;
+}
+
+int hot_restart_inherit(int port, int* fds, int max_fds) {
+    char path[CONTROL_PATH_MAX];
+    control_path(port, path, sizeof(path));
+    int sock = rpc_unix_connect(path, SOCK_STREAM);
+    if (sock < 0) return -1;
+
+    // One data byte carries the socket count, the control message the sockets
+    unsigned char count = 0;
+    FdControl control;
+    struct iovec iov = { &count, 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    struct cmsghdr* c = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+        close(sock);
+        errno = EPROTO;
+        return -1;
+    }
+
+    int received = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    int passed[HOT_RESTART_MAX_FDS];
+    memcpy(passed, CMSG_DATA(c), received * sizeof(int));
+    if (received != count || received > max_fds) {
+        for (int i = 0; i < received; i++) close(passed[i]);
+        close(sock);
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, passed, received * sizeof(int));
+    predecessor = sock;
+    return received;
+}
+
+int hot_restart_listen(int port) {
+    if (predecessor >= 0) {
+        char ready = 1;
+        send(predecessor, &ready, 1, MSG_NOSIGNAL);
+        close(predecessor);
+        predecessor = -1;
+    }
+    // Replaces the old server's control socket file; its socket stays open until it exits
+    char path[CONTROL_PATH_MAX];
+    control_path(port, path, sizeof(path));
+    return rpc_unix_listen_at(path, SOCK_STREAM);
+}
+
+int hot_restart_handoff(int control_fd, const int* fds, int count) {
+    if (count < 1 || count > HOT_RESTART_MAX_FDS) return -1;
+    int link = accept(control_fd, NULL, NULL);
+    if (link < 0) return -1;
+
+    unsigned char sent_count = (unsigned char)count;
+    FdControl control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { &sent_count, 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * count);
+
+    if (sendmsg(link, &msg, MSG_NOSIGNAL) != 1) {
+        close(link);
+        return -1;
+    }
+
+    // The successor answers once it serves; if it dies first, recv sees EOF
+    struct pollfd p = { link, POLLIN, 0 };
+    int ready;
+    do {
+        ready = poll(&p, 1, HOT_RESTART_TIMEOUT_MS);
+    } while (ready < 0 && errno == EINTR);
+    char byte = 0;
+    int took_over = ready == 1 && recv(link, &byte, 1, 0) == 1;
+    close(link);
+    return took_over ? 0 : -1;
+}
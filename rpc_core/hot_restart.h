@@ -0,0 +1,42 @@
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+// Zero-downtime restart. A server started with HOT_RESTART_FLAG does not bind
+// its port; it asks the running server for its sockets instead. The old
+// server passes its listening (TCP) or bound (UDP) sockets over a Unix socket
+// with SCM_RIGHTS, stops taking new work and exits once the requests it
+// already has are answered. Connections and datagrams that arrive meanwhile
+// wait in the shared sockets' queues for the new server, so none are refused.
+//
+// Every server listens for a successor on <dir>/rpc_<port>.restart, next to
+// its Unix socket (see unix_socket.h). The handoff:
+//   1. The new server connects and receives the sockets (hot_restart_inherit).
+//   2. Once it is ready to serve, it sends one byte back and takes over the
+//      control socket path (hot_restart_listen).
+//   3. The old server sees the byte and drains. Without it, the new server
+//      failed during startup, and the old one keeps serving.
+
+#define HOT_RESTART_FLAG "--hot-restart"
+#define HOT_RESTART_MAX_FDS 4
+#define HOT_RESTART_TIMEOUT_MS 10000 // How long the old server waits for its successor to start
+
+// Returns 1 if the command line asks for a hot restart
+int hot_restart_requested(int argc, char* argv[]);
+
+// New server: receives the sockets of the server running on port into fds,
+// in the order that server passed them. Returns their number, or -1 with
+// errno set if no server answered.
+int hot_restart_inherit(int port, int* fds, int max_fds);
+
+// Called by every server once it is ready to serve, right before its main
+// loop. Tells the old server (after hot_restart_inherit) to drain, then binds
+// the control socket for the next restart. Returns the control socket, or -1
+// if restarts are unavailable; the server works either way.
+int hot_restart_listen(int port);
+
+// Old server: call when the control socket is readable. Passes the count
+// sockets in fds to the connecting successor and waits for it to start.
+// Returns 0 if it took over (stop using the sockets and drain), -1 if not.
+int hot_restart_handoff(int control_fd, const int* fds, int count);
+
+#endif // HOT_RESTART_H
@@ -0,0 +1,219 @@
+#include "mem_pool.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <limits.h> // For PTHREAD_STACK_MIN
+
+#define POOL_ALIGN 16
+#define ALIGN_UP(n) (((n) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+static __thread MemPoolStats stats;
+
+// ===== Slabs =====
+// Every slot starts with a header naming its slab, so slab_free() needs only
+// the object. A free slot links to the next one through its first bytes.
+
+#define SLAB_HEADER ALIGN_UP(sizeof(Slab*))
+
+typedef struct SlabLink {
+    struct SlabLink* next;
+} SlabLink;
+
+struct Slab {
+    size_t slot_size;   // Header and object
+    size_t per_chunk;
+    SlabLink* free_list; // Owner only
+    SlabLink* remote;    // Freed by other threads; pushed with CAS, taken whole by the owner
+    pthread_t owner;
+};
+
+Slab* slab_create(size_t obj_size) {
+    Slab* slab = malloc(sizeof(Slab));
+    if (!slab) return NULL;
+    slab->slot_size = SLAB_HEADER + ALIGN_UP(obj_size < sizeof(SlabLink) ? sizeof(SlabLink) : obj_size);
+    slab->per_chunk = SLAB_CHUNK_BYTES / slab->slot_size;
+    if (slab->per_chunk == 0) slab->per_chunk = 1;
+    slab->free_list = NULL;
+    slab->remote = NULL;
+    slab->owner = pthread_self();
+    return slab;
+}
+
+// Adds a chunk of free slots; the chunk is never given back
+static int slab_grow(Slab* slab) {
+    char* chunk = aligned_alloc(POOL_ALIGN, slab->per_chunk * slab->slot_size);
+    if (!chunk) return -1;
+    stats.backing_mallocs++;
+    for (size_t i = 0; i < slab->per_chunk; i++) {
+        char* slot = chunk + i * slab->slot_size;
+        *(Slab**)slot = slab;
+        SlabLink* obj = (SlabLink*)(slot + SLAB_HEADER);
+        obj->next = slab->free_list;
+        slab->free_list = obj;
+    }
+    return 0;
+}
+
+void* slab_alloc(Slab* slab) {
+    if (!slab->free_list) {
+        slab->free_list = __atomic_exchange_n(&slab->remote, NULL, __ATOMIC_ACQUIRE);
+    }
+    if (!slab->free_list && slab_grow(slab) != 0) return NULL;
+    SlabLink* obj = slab->free_list;
+    slab->free_list = obj->next;
+    stats.slab_allocs++;
+    return obj;
+}
+
+void slab_free(void* obj) {
+    if (!obj) return;
+    Slab* slab = *(Slab**)((char*)obj - SLAB_HEADER);
+    SlabLink* link = (SlabLink*)obj;
+    if (pthread_equal(pthread_self(), slab->owner)) {
+        link->next = slab->free_list;
+        slab->free_list = link;
+        return;
+    }
+    // Only the owner takes from the list, and it takes all of it, so there is no ABA
+    SlabLink* head = __atomic_load_n(&slab->remote, __ATOMIC_RELAXED);
+    do {
+        link->next = head;
+    } while (!__atomic_compare_exchange_n(&slab->remote, &head, link, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// ===== Request arena =====
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* prev; // The block in use before this one, or the next spare
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+#define BLOCK_HEADER ALIGN_UP(sizeof(ArenaBlock))
+
+typedef struct {
+    ArenaBlock* current;
+    ArenaBlock* spare;
+    size_t spare_bytes;
+    int registered; // The exit destructor knows about this thread's blocks
+} Arena;
+
+static __thread Arena arena;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void free_chain(ArenaBlock* b) {
+    while (b) {
+        ArenaBlock* prev = b->prev;
+        free(b);
+        b = prev;
+    }
+}
+
+// Thread servers start a thread per request or connection; its blocks go with it
+static void arena_destroy(void* arg) {
+    Arena* a = (Arena*)arg;
+    free_chain(a->current);
+    free_chain(a->spare);
+    a->current = a->spare = NULL;
+    a->spare_bytes = 0;
+}
+
+static void make_arena_key(void) {
+    pthread_key_create(&arena_key, arena_destroy);
+}
+
+// A block of at least size bytes: the first spare that fits, or a new one
+static ArenaBlock* take_block(size_t size) {
+    for (ArenaBlock** link = &arena.spare; *link; link = &(*link)->prev) {
+        ArenaBlock* b = *link;
+        if (b->size >= size) {
+            *link = b->prev;
+            arena.spare_bytes -= b->size;
+            return b;
+        }
+    }
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    ArenaBlock* b = aligned_alloc(POOL_ALIGN, BLOCK_HEADER + block_size);
+    if (!b) return NULL;
+    stats.backing_mallocs++;
+    b->size = block_size;
+    if (!arena.registered) {
+        pthread_once(&arena_key_once, make_arena_key);
+        arena.registered = pthread_setspecific(arena_key, &arena) == 0;
+    }
+    return b;
+}
+
+ArenaMark arena_mark(void) {
+    ArenaMark mark = { arena.current, arena.current ? arena.current->used : 0 };
+    return mark;
+}
+
+void* arena_alloc(size_t size) {
+    size = size ? ALIGN_UP(size) : POOL_ALIGN;
+    ArenaBlock* b = arena.current;
+    if (!b || b->size - b->used < size) {
+        b = take_block(size);
+        if (!b) return NULL;
+        b->used = 0;
+        b->prev = arena.current;
+        arena.current = b;
+    }
+    void* p = (char*)b + BLOCK_HEADER + b->used;
+    b->used += size;
+    stats.arena_allocs++;
+    return p;
+}
+
+void arena_release(ArenaMark mark) {
+    while (arena.current && arena.current != (ArenaBlock*)mark.block) {
+        ArenaBlock* b = arena.current;
+        arena.current = b->prev;
+        if (arena.spare_bytes + b->size <= ARENA_RETAIN_BYTES) {
+            b->prev = arena.spare;
+            arena.spare = b;
+            arena.spare_bytes += b->size;
+        } else {
+            free(b);
+        }
+    }
+    if (arena.current) arena.current->used = mark.used;
+}
+
+void arena_trim(void) {
+    free_chain(arena.spare);
+    arena.spare = NULL;
+    arena.spare_bytes = 0;
+}
+
+MemPoolStats mem_pool_stats(void) {
+    return stats;
+}
+
+// ===== Bounded-memory mode =====
+
+int mem_low_memory(void) {
+    static int low = -1;
+    if (__atomic_load_n(&low, __ATOMIC_RELAXED) < 0) {
+        const char* env = getenv(RPC_LOW_MEMORY_ENV);
+        __atomic_store_n(&low, env && atoi(env) > 0, __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&low, __ATOMIC_RELAXED);
+}
+
+void mem_thread_stack(pthread_attr_t* attr) {
+    if (!mem_low_memory()) return;
+    const char* env = getenv(RPC_THREAD_STACK_ENV);
+    size_t kb = env && atol(env) > 0 ? (size_t)atol(env) : LOW_MEMORY_THREAD_STACK_KB;
+    size_t bytes = kb * 1024;
+    if (bytes < PTHREAD_STACK_MIN) bytes = PTHREAD_STACK_MIN;
+    pthread_attr_setstacksize(attr, bytes);
+}
+
+void mem_release_idle_buffer(char** buf, size_t* cap) {
+    if (*cap > LOW_MEMORY_IDLE_BUFFER && mem_low_memory()) {
+        free(*buf);
+        *buf = NULL;
+        *cap = 0;
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef MEM_POOL_H
+#define MEM_POOL_H
+
+#include <stddef.h> // For size_t
+#include <pthread.h> // For pthread_attr_t
+
+// Server-side allocation without malloc on the request path.
+//
+// A slab hands out objects of one fixed size, such as the per-request or
+// per-connection state of the thread servers. It belongs to the thread that
+// created it, the only one that may allocate from it. Any thread may free an
+// object back: the owner reuses it directly, and others push it onto the
+// slab's remote list with one compare-and-swap, which the owner takes over
+// whole when its own list runs dry. Memory is malloc()ed a chunk of objects
+// at a time and kept, so once the slab has grown to the peak number of live
+// objects it never calls malloc again.
+//
+// The request arena holds a request's scratch memory, such as decoded
+// operand arrays. Each thread has its own. Allocation bumps a pointer, and
+// arena_release() gives back everything allocated since arena_mark() at
+// once; dispatch_request() does so around every request. Blocks are reused
+// across requests, and up to ARENA_RETAIN_BYTES per thread are kept when
+// released, so a steady stream of requests allocates nothing. Memory must be
+// released before the thread can switch coroutines (coroutine.h), or two
+// connections would interleave on one arena.
+
+// Bounded-memory mode, for servers that hold many connections open. With
+// RPC_LOW_MEMORY=1, a thread started per connection or per request gets a
+// stack of RPC_THREAD_STACK_KB rather than the default (commonly 8 MiB), and
+// a connection's receive buffer that grew past LOW_MEMORY_IDLE_BUFFER for a
+// large request is freed once the request is answered, instead of being held
+// while the connection sits idle. So are the spare arena blocks of a thread
+// or process that serves a single connection.
+
+#define RPC_LOW_MEMORY_ENV "RPC_LOW_MEMORY"
+#define RPC_THREAD_STACK_ENV "RPC_THREAD_STACK_KB"
+#define LOW_MEMORY_THREAD_STACK_KB 128
+#define LOW_MEMORY_IDLE_BUFFER (4 * 1024)
+
+#define SLAB_CHUNK_BYTES (256 * 1024)  // Objects per malloc(): as many as fit, at least one
+#define ARENA_BLOCK_SIZE (64 * 1024)   // Smallest block; larger allocations get a block their size
+#define ARENA_RETAIN_BYTES (1024 * 1024) // Kept per thread; a larger request pays a malloc()
+
+typedef struct Slab Slab;
+
+typedef struct {
+    void* block;
+    size_t used;
+} ArenaMark;
+
+// Allocations made by the calling thread, for benchmarks
+typedef struct {
+    unsigned long slab_allocs;
+    unsigned long arena_allocs;
+    unsigned long backing_mallocs; // Chunks and blocks that had to come from malloc()
+} MemPoolStats;
+
+// Creates a slab of objects of obj_size bytes, owned by the calling thread.
+// Returns NULL on failure.
+Slab* slab_create(size_t obj_size);
+
+// An object aligned to 16 bytes, or NULL when out of memory. Owner only.
+void* slab_alloc(Slab* slab);
+
+// Returns obj to its slab, from any thread. NULL is ignored.
+void slab_free(void* obj);
+
+// The current end of the calling thread's arena
+ArenaMark arena_mark(void);
+
+// size bytes from the calling thread's arena, aligned to 16 bytes; NULL when
+// out of memory. Valid until the arena is released to an earlier mark.
+void* arena_alloc(size_t size);
+
+// Frees everything allocated since mark was taken
+void arena_release(ArenaMark mark);
+
+// Frees the calling thread's spare blocks, for a thread that serves one
+// connection and is about to sit idle with it
+void arena_trim(void);
+
+MemPoolStats mem_pool_stats(void);
+
+// 1 if RPC_LOW_MEMORY is set, read once
+int mem_low_memory(void);
+
+// Sets the stack size for a connection or request thread, in bounded-memory mode only
+void mem_thread_stack(pthread_attr_t* attr);
+
+// After a reply: frees a receive buffer from rpc_recv_request_grow() that grew
+// past LOW_MEMORY_IDLE_BUFFER, in bounded-memory mode only. The next request
+// starts a new one.
+void mem_release_idle_buffer(char** buf, size_t* cap);
+
+#endif // MEM_POOL_H
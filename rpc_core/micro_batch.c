@@ -0,0 +1,152 @@
+#define _GNU_SOURCE // For epoll_pwait2
+#include "micro_batch.h"
+#include "vector_ops.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+static volatile sig_atomic_t report_requested;
+
+static void request_report(int sig) {
+    (void)sig;
+    report_requested = 1;
+}
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long env_limit(const char* name, long fallback) {
+    const char* env = getenv(name);
+    return env && env[0] != '\0' ? atol(env) : fallback;
+}
+
+void micro_batch_init(MicroBatch* b, const char* server_type) {
+    memset(b, 0, sizeof(*b));
+    b->server_type = server_type;
+    b->max_size = (int)env_limit(RPC_BATCH_MAX_ENV, MICRO_BATCH_DEFAULT_MAX);
+    if (b->max_size < 1) b->max_size = 1;
+    if (b->max_size > MICRO_BATCH_MAX) b->max_size = MICRO_BATCH_MAX;
+    b->max_delay_us = env_limit(RPC_BATCH_DELAY_ENV, MICRO_BATCH_DEFAULT_DELAY_US);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_report;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+int micro_batch_accepts(const MicroBatch* b, const RpcRequest* req) {
+    if (b->max_size <= 1) return 0;
+    return req->operation == OP_ADD || req->operation == OP_SUBTRACT || req->operation == OP_MULTIPLY ||
+           req->operation == OP_DIVIDE;
+}
+
+int micro_batch_add(MicroBatch* b, const RpcRequest* req) {
+    if (b->count >= b->max_size) return -1;
+    if (b->count == 0) b->opened_us = now_us();
+    BatchEntry* e = &b->entries[b->count];
+    e->operation = req->operation;
+    e->op1 = req->op1;
+    e->op2 = req->op2;
+    e->request_id = req->request_id;
+    e->deadline_ms = req->deadline_ms;
+    return b->count++;
+}
+
+// Microseconds until the open batch is due: 0 if it is, -1 if it is empty
+static long long due_in_us(const MicroBatch* b) {
+    if (b->count == 0) return -1;
+    if (b->count >= b->max_size || b->max_delay_us <= 0 || b->last_size <= 1) return 0;
+    long long left = b->opened_us + b->max_delay_us - now_us();
+    return left > 0 ? left : 0;
+}
+
+int micro_batch_due(const MicroBatch* b) {
+    return due_in_us(b) == 0;
+}
+
+int micro_batch_run(MicroBatch* b) {
+    int n = b->count;
+    if (n == 0) return 0;
+    double x[MICRO_BATCH_MAX], y[MICRO_BATCH_MAX];
+    int index[MICRO_BATCH_MAX];
+    static const OperationType ops[] = { OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE };
+    long long now_ms = rpc_now_ms();
+
+    for (int i = 0; i < n; i++) {
+        RpcResponse* r = &b->responses[i];
+        r->request_id = b->entries[i].request_id;
+        r->result = 0;
+        r->error[0] = '\0';
+        r->batch_len = 0;
+        strcpy(r->server_type, b->server_type);
+    }
+
+    // Gather one operation's operands, compute them together, scatter the results
+    for (size_t k = 0; k < sizeof(ops) / sizeof(ops[0]); k++) {
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            const BatchEntry* e = &b->entries[i];
+            if (e->operation != ops[k]) continue;
+            if (e->deadline_ms != 0 && now_ms > e->deadline_ms) {
+                strcpy(b->responses[i].error, RPC_ERR_DEADLINE_EXCEEDED);
+                continue;
+            }
+            if (e->operation == OP_DIVIDE && e->op2 == 0) {
+                snprintf(b->responses[i].error, sizeof(b->responses[i].error), "Error: Division by zero!");
+                continue;
+            }
+            x[m] = e->op1;
+            y[m] = e->op2;
+            index[m++] = i;
+        }
+        if (m == 0) continue;
+        vector_elementwise(ops[k], x, y, x, (size_t)m);
+        for (int j = 0; j < m; j++) b->responses[index[j]].result = x[j];
+    }
+
+    int bucket = 0;
+    while (bucket < MICRO_BATCH_BUCKETS - 1 && (2 << bucket) <= n) bucket++;
+    b->histogram[bucket]++;
+    b->requests += (unsigned long long)n;
+    b->last_size = n;
+    b->count = 0;
+    return n;
+}
+
+int micro_batch_epoll_wait(MicroBatch* b, int epoll_fd, struct epoll_event* events, int max_events, long long limit_us) {
+    if (report_requested) {
+        report_requested = 0;
+        micro_batch_report(b, stderr);
+    }
+    long long wait_us = due_in_us(b);
+    if (limit_us >= 0 && (wait_us < 0 || limit_us < wait_us)) wait_us = limit_us;
+    if (wait_us < 0) return epoll_wait(epoll_fd, events, max_events, -1);
+
+    struct timespec timeout = { wait_us / 1000000, (wait_us % 1000000) * 1000 };
+    int n = epoll_pwait2(epoll_fd, events, max_events, &timeout, NULL);
+    if (n < 0 && errno == ENOSYS) {
+        // Before Linux 5.11: whole milliseconds, rounded up so the wait is never cut short
+        n = epoll_wait(epoll_fd, events, max_events, (int)((wait_us + 999) / 1000));
+    }
+    return n;
+}
+
+void micro_batch_report(const MicroBatch* b, FILE* out) {
+    unsigned long long batches = 0;
+    for (int i = 0; i < MICRO_BATCH_BUCKETS; i++) batches += b->histogram[i];
+    fprintf(out, "%s batch sizes:", b->server_type);
+    for (int i = 0; i < MICRO_BATCH_BUCKETS; i++) {
+        int lo = 1 << i, hi = (2 << i) - 1;
+        if (i == 0 || i == MICRO_BATCH_BUCKETS - 1) fprintf(out, " %d:%llu", lo, b->histogram[i]);
+        else fprintf(out, " %d-%d:%llu", lo, hi, b->histogram[i]);
+    }
+    fprintf(out, " (%llu requests in %llu batches, mean %.2f)\n", b->requests, batches,
+            batches ? (double)b->requests / (double)batches : 0.0);
+}
@@ -0,0 +1,84 @@
+#ifndef MICRO_BATCH_H
+#define MICRO_BATCH_H
+
+#include <stdio.h>
+#include <sys/epoll.h>
+
+#include "rpc_protocol.h"
+
+// Micro-batching for the event-loop servers. Under load one loop iteration
+// decodes requests from many clients; rather than computing them one at a
+// time, the server adds the scalar ones (ADD, SUB, MUL, DIV) to a batch. The
+// batch groups them by operation into operand arrays, computes each group
+// with vector_elementwise() (vector_ops.h), and scatters the results back
+// into one response per request, in the order they were added.
+//
+// The batch is adaptive. While the previous batch held a single request the
+// server is lightly loaded, and a batch is run at the end of the iteration
+// that filled it, adding no delay. Once batches hold several requests, the
+// loop waits up to RPC_BATCH_DELAY_US after a batch's first request for more
+// to arrive. Every batch is run as soon as it holds RPC_BATCH_MAX requests.
+//
+// Batch sizes are counted in a histogram of powers of two. Send the server
+// SIGUSR1 to print it to stderr.
+
+#define RPC_BATCH_MAX_ENV "RPC_BATCH_MAX"           // 1 turns batching off
+#define RPC_BATCH_DELAY_ENV "RPC_BATCH_DELAY_US"    // 0: batch only what one iteration decoded
+
+#define MICRO_BATCH_MAX 256
+#define MICRO_BATCH_DEFAULT_MAX 64
+#define MICRO_BATCH_DEFAULT_DELAY_US 50
+#define MICRO_BATCH_BUCKETS 9 // 1, 2-3, 4-7, ..., 128-255, 256
+
+typedef struct {
+    OperationType operation;
+    double op1;
+    double op2;
+    unsigned int request_id;
+    long long deadline_ms;
+} BatchEntry;
+
+typedef struct {
+    const char* server_type;   // Put into every response, and the report
+    int max_size;
+    long long max_delay_us;
+    int count;                 // Requests in the open batch
+    int last_size;             // Size of the batch run before it
+    long long opened_us;       // When the open batch got its first request
+    BatchEntry entries[MICRO_BATCH_MAX];
+    RpcResponse responses[MICRO_BATCH_MAX]; // Filled in by micro_batch_run()
+    unsigned long long histogram[MICRO_BATCH_BUCKETS];
+    unsigned long long requests; // Run through batches, all sizes
+} MicroBatch;
+
+// Reads the limits from the environment, falling back to the defaults above,
+// and installs the SIGUSR1 handler that asks for a report
+void micro_batch_init(MicroBatch* b, const char* server_type);
+
+// Returns 1 if req can be batched: a scalar operation, with batching on.
+// Other requests are dispatched as before.
+int micro_batch_accepts(const MicroBatch* b, const RpcRequest* req);
+
+// Adds req to the open batch. Returns its index, under which its response
+// will be, or -1 if the batch is full and must be run first.
+int micro_batch_add(MicroBatch* b, const RpcRequest* req);
+
+// Returns 1 if the open batch should be run now: it is full, or nothing may
+// be gained by waiting for more (see above)
+int micro_batch_due(const MicroBatch* b);
+
+// Computes every request of the open batch into responses[0..count-1], the
+// way dispatch_request() would. The batch is then empty again, but the
+// responses stay valid until the next add. Returns the number of responses.
+int micro_batch_run(MicroBatch* b);
+
+// epoll_wait() with a timeout that ends when the open batch is due, or none
+// while it is empty, and after limit_us at most unless it is negative (the
+// server's own timers, say). Microsecond precision where the kernel has
+// epoll_pwait2. Also prints the report when SIGUSR1 asked for it.
+int micro_batch_epoll_wait(MicroBatch* b, int epoll_fd, struct epoll_event* events, int max_events, long long limit_us);
+
+// Prints the batch-size histogram, e.g. "batch sizes: 1:120 2-3:40 ..."
+void micro_batch_report(const MicroBatch* b, FILE* out);
+
+#endif // MICRO_BATCH_H
@@ -0,0 +1,340 @@
+#include "priority_sched.h"
+#include "rpc_dispatch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+static const char* const class_names[SCHED_CLASSES] = { "interactive", "batch" };
+
+typedef struct {
+    pthread_cond_t cond;
+    int next, prev;        // Indexes in the class queue, or in the free list (next only); -1 ends it
+    int granted;           // Set by the thread that hands this waiter a slot
+    long long enqueued_us;
+} Waiter;
+
+typedef struct {
+    int head, tail, length;
+} WaitQueue;
+
+typedef struct {
+    unsigned long long requests;
+    unsigned long long expired; // Past their deadline on arrival or while they waited
+    unsigned long long aged;    // Given a slot for having waited RPC_SCHED_MAX_WAIT_MS
+    unsigned long long wait[SCHED_HISTOGRAM_BUCKETS];    // Until a slot was given
+    unsigned long long latency[SCHED_HISTOGRAM_BUCKETS]; // Waiting and computing
+    long long max_latency_us;
+} ClassStats;
+
+struct PrioritySched {
+    pthread_mutex_t lock;
+    int slots;     // 0: nothing waits
+    int reserved;  // Of the slots, never given to batch requests unless aged
+    int busy;
+    int weight[SCHED_CLASSES];
+    int credit[SCHED_CLASSES]; // Smooth weighted round robin
+    int batch_nice; // Added while a batch request computes; 0 if it could not be taken back
+    long long max_wait_us;
+    WaitQueue queue[SCHED_CLASSES];
+    int free_waiter;
+    volatile sig_atomic_t report_requested; // Set by SIGUSR1 in any process sharing this
+    ClassStats stats[SCHED_CLASSES];
+    Waiter waiters[SCHED_MAX_WAITERS];
+};
+
+static PrioritySched* report_target;
+
+static void request_report(int sig) {
+    (void)sig;
+    if (report_target) report_target->report_requested = 1;
+}
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long env_limit(const char* name, long fallback) {
+    const char* env = getenv(name);
+    return env && env[0] != '\0' ? atol(env) : fallback;
+}
+
+// Whether a thread may lower its nice value back after raising it, which
+// takes CAP_SYS_NICE or a large enough RLIMIT_NICE. Tried on a thread of its
+// own, since the nice value is per thread on Linux and a failed try sticks.
+static void* probe_nice(void* arg) {
+    int base = getpriority(PRIO_PROCESS, 0);
+    *(int*)arg = setpriority(PRIO_PROCESS, 0, base + 1) == 0 && setpriority(PRIO_PROCESS, 0, base) == 0;
+    return NULL;
+}
+
+static int nice_reversible(void) {
+    int ok = 0;
+    pthread_t probe;
+    if (pthread_create(&probe, NULL, probe_nice, &ok) != 0) return 0;
+    pthread_join(probe, NULL);
+    return ok;
+}
+
+PrioritySched* priority_sched_create(int shared_across_processes) {
+    int flags = MAP_ANONYMOUS | (shared_across_processes ? MAP_SHARED : MAP_PRIVATE);
+    PrioritySched* s = mmap(NULL, sizeof(PrioritySched), PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (s == MAP_FAILED) {
+        perror("mmap for priority scheduler failed");
+        return NULL;
+    }
+    // Anonymous mappings are zero-filled: no slot is busy and the statistics start empty
+
+    s->reserved = (int)env_limit(RPC_SCHED_RESERVED_ENV, SCHED_DEFAULT_RESERVED);
+    if (s->reserved < 0) s->reserved = 0;
+    s->slots = (int)env_limit(RPC_SCHED_SLOTS_ENV, sysconf(_SC_NPROCESSORS_ONLN) + s->reserved);
+    if (s->slots < 0) s->slots = 0;
+    if (s->slots > 0 && s->reserved >= s->slots) s->reserved = s->slots - 1;
+    s->weight[SCHED_CLASS_INTERACTIVE] = SCHED_DEFAULT_WEIGHT_INTERACTIVE;
+    s->weight[SCHED_CLASS_BATCH] = SCHED_DEFAULT_WEIGHT_BATCH;
+    const char* weights = getenv(RPC_SCHED_WEIGHTS_ENV);
+    if (weights) sscanf(weights, "%d,%d", &s->weight[SCHED_CLASS_INTERACTIVE], &s->weight[SCHED_CLASS_BATCH]);
+    for (int c = 0; c < SCHED_CLASSES; c++) {
+        if (s->weight[c] < 1) s->weight[c] = 1;
+        s->queue[c].head = s->queue[c].tail = -1;
+    }
+    s->max_wait_us = env_limit(RPC_SCHED_MAX_WAIT_ENV, SCHED_DEFAULT_MAX_WAIT_MS) * 1000LL;
+    s->batch_nice = s->slots > 0 ? (int)env_limit(RPC_SCHED_BATCH_NICE_ENV, SCHED_DEFAULT_BATCH_NICE) : 0;
+    if (s->batch_nice < 0) s->batch_nice = 0;
+    if (s->batch_nice > 0 && !nice_reversible()) {
+        fprintf(stderr, "priority_sched: cannot restore nice values, batch requests run at normal priority\n");
+        s->batch_nice = 0;
+    }
+
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    if (shared_across_processes) {
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    }
+    pthread_mutex_init(&s->lock, &mattr);
+    for (int i = 0; i < SCHED_MAX_WAITERS; i++) {
+        pthread_cond_init(&s->waiters[i].cond, &cattr);
+        s->waiters[i].next = i + 1 < SCHED_MAX_WAITERS ? i + 1 : -1;
+    }
+    s->free_waiter = 0;
+    pthread_condattr_destroy(&cattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    report_target = s;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_report;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    return s;
+}
+
+int priority_sched_class(const RpcRequest* req) {
+    if (req->priority == RPC_PRIORITY_INTERACTIVE) return SCHED_CLASS_INTERACTIVE;
+    if (req->priority == RPC_PRIORITY_BATCH) return SCHED_CLASS_BATCH;
+    return rpc_is_vector_op(req->operation) ? SCHED_CLASS_BATCH : SCHED_CLASS_INTERACTIVE;
+}
+
+// Whether a request of class c may take a free slot now. Caller holds the lock.
+static int may_run(const PrioritySched* s, int c, int aged) {
+    int limit = c == SCHED_CLASS_BATCH && !aged ? s->slots - s->reserved : s->slots;
+    return s->busy < limit;
+}
+
+static void unlink_waiter(PrioritySched* s, int c, int i) {
+    Waiter* w = &s->waiters[i];
+    WaitQueue* q = &s->queue[c];
+    if (w->prev >= 0) s->waiters[w->prev].next = w->next;
+    else q->head = w->next;
+    if (w->next >= 0) s->waiters[w->next].prev = w->prev;
+    else q->tail = w->prev;
+    q->length--;
+}
+
+static void free_waiter(PrioritySched* s, int i) {
+    s->waiters[i].next = s->free_waiter;
+    s->free_waiter = i;
+}
+
+// Hands free slots to waiting requests. Caller holds the lock.
+static void grant_slots(PrioritySched* s) {
+    long long now = now_us();
+    while (s->busy < s->slots) {
+        const WaitQueue* batch = &s->queue[SCHED_CLASS_BATCH];
+        int aged = batch->length > 0 && now - s->waiters[batch->head].enqueued_us >= s->max_wait_us;
+        int pick = -1;
+        if (aged) {
+            pick = SCHED_CLASS_BATCH;
+            s->stats[pick].aged++;
+        } else {
+            int total = 0;
+            for (int c = 0; c < SCHED_CLASSES; c++) {
+                if (s->queue[c].length == 0 || !may_run(s, c, 0)) continue;
+                s->credit[c] += s->weight[c];
+                total += s->weight[c];
+                if (pick < 0 || s->credit[c] > s->credit[pick]) pick = c;
+            }
+            if (pick < 0) break;
+            s->credit[pick] -= total;
+        }
+        int i = s->queue[pick].head;
+        unlink_waiter(s, pick, i);
+        s->waiters[i].granted = 1;
+        s->busy++;
+        pthread_cond_signal(&s->waiters[i].cond);
+    }
+}
+
+// Waits for a slot. Returns 0 with *slot set once the request may compute,
+// or with *slot 0 if it runs unscheduled, and -1 if its deadline passed first.
+static int enter(PrioritySched* s, int c, long long deadline_ms, int* slot) {
+    *slot = 0;
+    pthread_mutex_lock(&s->lock);
+    if (s->slots == 0) {
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    if (s->queue[c].length == 0 && may_run(s, c, 0)) {
+        s->busy++;
+        *slot = 1;
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    int i = s->free_waiter;
+    if (i < 0) {
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    s->free_waiter = s->waiters[i].next;
+    Waiter* w = &s->waiters[i];
+    WaitQueue* q = &s->queue[c];
+    w->granted = 0;
+    w->enqueued_us = now_us();
+    w->next = -1;
+    w->prev = q->tail;
+    if (q->tail >= 0) s->waiters[q->tail].next = i;
+    else q->head = i;
+    q->tail = i;
+    q->length++;
+    grant_slots(s); // An aged batch request may be let in past the reserve
+
+    // The deadline is wall-clock time; wait on the monotonic clock until just after it
+    struct timespec until;
+    if (deadline_ms != 0) {
+        long long at_us = w->enqueued_us + (deadline_ms + 1 - rpc_now_ms()) * 1000;
+        until.tv_sec = at_us / 1000000;
+        until.tv_nsec = (at_us % 1000000) * 1000;
+    }
+    while (!w->granted) {
+        int rc = deadline_ms != 0 ? pthread_cond_timedwait(&w->cond, &s->lock, &until)
+                                  : pthread_cond_wait(&w->cond, &s->lock);
+        if (rc == ETIMEDOUT && !w->granted) {
+            unlink_waiter(s, c, i);
+            free_waiter(s, i);
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+    }
+    free_waiter(s, i);
+    *slot = 1;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+static int bucket_of(long long us) {
+    int b = 0;
+    while (b < SCHED_HISTOGRAM_BUCKETS - 1 && (2LL << b) <= us) b++;
+    return b;
+}
+
+static void leave(PrioritySched* s, int c, int slot, int expired, long long start_us, long long granted_us) {
+    long long end_us = now_us();
+    pthread_mutex_lock(&s->lock);
+    if (slot) {
+        s->busy--;
+        grant_slots(s);
+    }
+    ClassStats* st = &s->stats[c];
+    st->requests++;
+    st->expired += (unsigned long long)expired;
+    st->wait[bucket_of(granted_us - start_us)]++;
+    st->latency[bucket_of(end_us - start_us)]++;
+    if (end_us - start_us > st->max_latency_us) st->max_latency_us = end_us - start_us;
+    pthread_mutex_unlock(&s->lock);
+
+    if (s->report_requested) {
+        s->report_requested = 0;
+        priority_sched_report(s, stderr);
+    }
+}
+
+void priority_sched_dispatch(PrioritySched* s, const RpcRequest* req, RpcResponse* resp) {
+    if (!s) {
+        dispatch_request(req, resp);
+        return;
+    }
+    int c = priority_sched_class(req);
+    long long start_us = now_us();
+    int slot = 0;
+    // A request past its deadline, now or after waiting, is answered without computing
+    int expired = rpc_deadline_expired(req) || enter(s, c, req->deadline_ms, &slot) != 0;
+    long long granted_us = now_us();
+    // A batch request that has a slot still shares the CPUs with the interactive
+    // ones; at a higher nice value it gives way to them when they arrive
+    int base_nice = 0, niced = slot && c == SCHED_CLASS_BATCH && s->batch_nice > 0;
+    if (niced) {
+        base_nice = getpriority(PRIO_PROCESS, 0); // On Linux, the calling thread
+        setpriority(PRIO_PROCESS, 0, base_nice + s->batch_nice);
+    }
+    dispatch_request(req, resp);
+    if (niced) setpriority(PRIO_PROCESS, 0, base_nice);
+    leave(s, c, slot, expired, start_us, granted_us);
+}
+
+// Upper bound, in microseconds, of the bucket holding the p-th fraction of the requests
+static long long percentile_us(const unsigned long long* histogram, unsigned long long count, double p) {
+    unsigned long long rank = (unsigned long long)(p * (double)count + 0.999999), seen = 0;
+    for (int b = 0; b < SCHED_HISTOGRAM_BUCKETS; b++) {
+        seen += histogram[b];
+        if (seen >= rank) return 2LL << b;
+    }
+    return 2LL << (SCHED_HISTOGRAM_BUCKETS - 1);
+}
+
+void priority_sched_report(PrioritySched* s, FILE* out) {
+    pthread_mutex_lock(&s->lock);
+    ClassStats stats[SCHED_CLASSES];
+    memcpy(stats, s->stats, sizeof(stats));
+    int slots = s->slots, reserved = s->reserved, busy = s->busy;
+    int queued[SCHED_CLASSES] = { s->queue[0].length, s->queue[1].length };
+    pthread_mutex_unlock(&s->lock);
+
+    fprintf(out, "priority_sched: %d slots (%d reserved), %d busy, weights %d:%d, batch nice +%d\n", slots, reserved,
+            busy, s->weight[SCHED_CLASS_INTERACTIVE], s->weight[SCHED_CLASS_BATCH], s->batch_nice);
+    for (int c = 0; c < SCHED_CLASSES; c++) {
+        const ClassStats* st = &stats[c];
+        if (st->requests == 0) {
+            fprintf(out, "  %-11s 0 requests, %d queued\n", class_names[c], queued[c]);
+            continue;
+        }
+        fprintf(out,
+                "  %-11s %llu requests, %d queued, %llu expired, %llu aged; wait p50<=%lldus p99<=%lldus; "
+                "latency p50<=%lldus p99<=%lldus max %lldus\n",
+                class_names[c], st->requests, queued[c], st->expired, st->aged,
+                percentile_us(st->wait, st->requests, 0.50), percentile_us(st->wait, st->requests, 0.99),
+                percentile_us(st->latency, st->requests, 0.50), percentile_us(st->latency, st->requests, 0.99),
+                st->max_latency_us);
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef PRIORITY_SCHED_H
+#define PRIORITY_SCHED_H
+
+#include <stdio.h>
+#include "rpc_protocol.h"
+
+// Class-aware scheduling of the compute in the thread and process servers.
+// Those servers start a thread or process per request or connection, so under
+// a flood of large reductions every short call shares the CPUs with all of
+// them. Here at most RPC_SCHED_SLOTS requests compute at once; the rest wait
+// in a FIFO queue per class (interactive, batch) and free slots go to the
+// queues by weighted round robin, RPC_SCHED_WEIGHTS ("interactive,batch").
+// RPC_SCHED_RESERVED of the slots are never given to batch requests, so a
+// short call finds one free even when batch work fills the others.
+//
+// Batch requests are not starved: the weights give them their share whenever
+// both queues wait, and one that has waited RPC_SCHED_MAX_WAIT_MS goes next
+// regardless, reserved slots included. A request whose deadline passes while
+// it waits leaves the queue and is answered RPC_ERR_DEADLINE_EXCEEDED without
+// being computed.
+//
+// A slot only bounds how many requests compute at once; the ones that do still
+// share the CPUs. So a batch request computes with RPC_SCHED_BATCH_NICE added
+// to its thread's nice value, and a short call that arrives meanwhile gets the
+// CPU first. Taking the nice value back needs CAP_SYS_NICE or RLIMIT_NICE;
+// without either, this part is left out. Threads of the task pool that a large
+// reduction fans out to (vector_ops.h) are not reniced.
+//
+// Requests name their class in the PRI field; without it, reductions are batch
+// and everything else is interactive. Per-class counts and wait and latency
+// percentiles are printed to stderr after SIGUSR1. RPC_SCHED_SLOTS=0 turns the
+// queueing off but keeps the statistics, for comparison.
+
+#define RPC_SCHED_SLOTS_ENV "RPC_SCHED_SLOTS"
+#define RPC_SCHED_RESERVED_ENV "RPC_SCHED_RESERVED"
+#define RPC_SCHED_WEIGHTS_ENV "RPC_SCHED_WEIGHTS"
+#define RPC_SCHED_MAX_WAIT_ENV "RPC_SCHED_MAX_WAIT_MS"
+#define RPC_SCHED_BATCH_NICE_ENV "RPC_SCHED_BATCH_NICE"
+
+#define SCHED_DEFAULT_RESERVED 1   // Default slots are the online CPUs plus these
+#define SCHED_DEFAULT_WEIGHT_INTERACTIVE 8
+#define SCHED_DEFAULT_WEIGHT_BATCH 1
+#define SCHED_DEFAULT_MAX_WAIT_MS 500
+#define SCHED_DEFAULT_BATCH_NICE 19 // The lowest priority: batch requests rarely wait on each other
+#define SCHED_MAX_WAITERS 1024     // Queued at once; beyond that a request runs unscheduled
+#define SCHED_HISTOGRAM_BUCKETS 32 // Powers of two of microseconds
+
+#define SCHED_CLASS_INTERACTIVE 0
+#define SCHED_CLASS_BATCH 1
+#define SCHED_CLASSES 2
+
+typedef struct PrioritySched PrioritySched;
+
+// Creates a scheduler configured from the environment. With
+// shared_across_processes set, it lives in MAP_SHARED memory with
+// process-shared locks, so children forked afterwards share its slots.
+// Installs the SIGUSR1 report handler. Returns NULL on failure.
+PrioritySched* priority_sched_create(int shared_across_processes);
+
+// The class a request is scheduled in
+int priority_sched_class(const RpcRequest* req);
+
+// dispatch_request() once the request's class is given a slot. A NULL
+// scheduler dispatches at once.
+void priority_sched_dispatch(PrioritySched* s, const RpcRequest* req, RpcResponse* resp);
+
+// Per-class requests, deadline expiries, and wait and latency percentiles
+void priority_sched_report(PrioritySched* s, FILE* out);
+
+#endif // PRIORITY_SCHED_H
@@ -0,0 +1,143 @@
+#include "response_cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+typedef struct {
+    unsigned int request_id;
+    int pending;          // Claimed, reply not stored yet
+    long long claimed_ms; // When it was claimed, on the monotonic clock
+    char response[RESPONSE_CACHE_MAX_RESPONSE];
+} CachedResponse;
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int in_use;
+    int next;  // Ring position of the next entry to overwrite
+    CachedResponse entries[RESPONSE_CACHE_PER_CLIENT];
+} ClientSlot;
+
+struct ResponseCache {
+    pthread_mutex_t lock;
+    ClientSlot slots[RESPONSE_CACHE_CLIENTS];
+};
+
+ResponseCache* response_cache_create(int shared_across_processes) {
+    int flags = MAP_ANONYMOUS | (shared_across_processes ? MAP_SHARED : MAP_PRIVATE);
+    ResponseCache* cache = mmap(NULL, sizeof(ResponseCache), PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (cache == MAP_FAILED) {
+        perror("mmap for response cache failed");
+        return NULL;
+    }
+    // Anonymous mappings are zero-filled, so every slot starts out unused
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (shared_across_processes) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return cache;
+}
+
+// FNV-1a over the address bytes
+static ClientSlot* slot_for(ResponseCache* cache, const struct sockaddr* client, socklen_t client_len) {
+    const unsigned char* p = (const unsigned char*)client;
+    unsigned int h = 2166136261u;
+    for (socklen_t i = 0; i < client_len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return &cache->slots[h % RESPONSE_CACHE_CLIENTS];
+}
+
+static int slot_matches(const ClientSlot* slot, const struct sockaddr* client, socklen_t client_len) {
+    return slot->in_use && slot->addr_len == client_len && memcmp(&slot->addr, client, client_len) == 0;
+}
+
+// The client's slot, taken over from whoever had it if necessary
+static ClientSlot* claim_slot(ResponseCache* cache, const struct sockaddr* client, socklen_t client_len) {
+    ClientSlot* slot = slot_for(cache, client, client_len);
+    if (!slot_matches(slot, client, client_len)) {
+        memset(slot, 0, sizeof(*slot)); // New client (or a collision): drop the previous one's history
+        memcpy(&slot->addr, client, client_len);
+        slot->addr_len = client_len;
+        slot->in_use = 1;
+    }
+    return slot;
+}
+
+static CachedResponse* find_entry(ClientSlot* slot, unsigned int request_id) {
+    for (int i = 0; i < RESPONSE_CACHE_PER_CLIENT; i++) {
+        if (slot->entries[i].request_id == request_id) return &slot->entries[i];
+    }
+    return NULL;
+}
+
+// Overwrites the client's oldest entry
+static CachedResponse* next_entry(ClientSlot* slot, unsigned int request_id) {
+    CachedResponse* entry = &slot->entries[slot->next];
+    slot->next = (slot->next + 1) % RESPONSE_CACHE_PER_CLIENT;
+    entry->request_id = request_id;
+    return entry;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int response_cache_claim(ResponseCache* cache, const struct sockaddr* client, socklen_t client_len, unsigned int request_id,
+                         char* out, size_t out_size) {
+    if (!cache || request_id == 0 || client_len > sizeof(struct sockaddr_storage)) return RESPONSE_CACHE_NEW;
+
+    int status = RESPONSE_CACHE_NEW;
+    long long now = now_ms();
+    pthread_mutex_lock(&cache->lock);
+    ClientSlot* slot = claim_slot(cache, client, client_len);
+    CachedResponse* entry = find_entry(slot, request_id);
+    if (entry && !entry->pending) {
+        snprintf(out, out_size, "%s", entry->response);
+        status = RESPONSE_CACHE_HIT;
+    } else if (entry && now - entry->claimed_ms < RESPONSE_CACHE_PENDING_MS) {
+        status = RESPONSE_CACHE_PENDING;
+    } else {
+        if (!entry) entry = next_entry(slot, request_id);
+        entry->pending = 1;
+        entry->claimed_ms = now;
+        entry->response[0] = '\0';
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return status;
+}
+
+void response_cache_store(ResponseCache* cache, const struct sockaddr* client, socklen_t client_len, unsigned int request_id,
+                          const char* response) {
+    if (!cache || request_id == 0 || client_len > sizeof(struct sockaddr_storage)) return;
+    if (strlen(response) >= RESPONSE_CACHE_MAX_RESPONSE) {
+        response_cache_release(cache, client, client_len, request_id);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    ClientSlot* slot = claim_slot(cache, client, client_len);
+    CachedResponse* entry = find_entry(slot, request_id);
+    if (!entry) entry = next_entry(slot, request_id); // The claim was evicted meanwhile
+    entry->pending = 0;
+    snprintf(entry->response, sizeof(entry->response), "%s", response);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void response_cache_release(ResponseCache* cache, const struct sockaddr* client, socklen_t client_len, unsigned int request_id) {
+    if (!cache || request_id == 0 || client_len > sizeof(struct sockaddr_storage)) return;
+
+    pthread_mutex_lock(&cache->lock);
+    ClientSlot* slot = slot_for(cache, client, client_len);
+    CachedResponse* entry = slot_matches(slot, client, client_len) ? find_entry(slot, request_id) : NULL;
+    if (entry && entry->pending) entry->request_id = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,52 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stddef.h>
+#include <sys/socket.h> // For struct sockaddr, socklen_t
+
+// Small recent-response cache for the UDP servers. A client that retransmits
+// a request (same source address and request ID) gets the stored reply back
+// instead of the server recomputing it. Addresses are compared byte for byte,
+// so IPv4 and Unix-domain clients are both keyed. Each client address keeps its last
+// RESPONSE_CACHE_PER_CLIENT replies; clients hash into RESPONSE_CACHE_CLIENTS
+// slots and a colliding client simply evicts the previous one.
+//
+// A request is claimed before it is dispatched, so a retransmission that
+// arrives while the original is still computing finds it pending and is
+// dropped; the original's reply answers both. A claim left pending for
+// RESPONSE_CACHE_PENDING_MS, say by a child process that died, is given to
+// the next retransmission.
+
+#define RESPONSE_CACHE_CLIENTS 128
+#define RESPONSE_CACHE_PER_CLIENT 4
+#define RESPONSE_CACHE_MAX_RESPONSE 512 // Longer responses are not cached
+#define RESPONSE_CACHE_PENDING_MS 10000
+
+#define RESPONSE_CACHE_NEW 0     // Claimed by the caller, who must store or release it
+#define RESPONSE_CACHE_HIT 1     // Answered before; the reply is in out
+#define RESPONSE_CACHE_PENDING 2 // Being computed by another caller; drop the duplicate
+
+typedef struct ResponseCache ResponseCache;
+
+// Allocates an empty cache. With shared_across_processes set, the cache lives
+// in MAP_SHARED memory with a process-shared lock so forked children see it.
+// Returns NULL on failure.
+ResponseCache* response_cache_create(int shared_across_processes);
+
+// Looks up (client, request_id) and claims it if it is not there. Returns
+// RESPONSE_CACHE_HIT with the cached response copied into out,
+// RESPONSE_CACHE_PENDING, or RESPONSE_CACHE_NEW. request_id 0 is always new
+// and needs no store or release.
+int response_cache_claim(ResponseCache* cache, const struct sockaddr* client, socklen_t client_len, unsigned int request_id,
+                         char* out, size_t out_size);
+
+// Remembers the marshalled response to a claimed request. request_id 0 is
+// ignored; a response too long to cache releases the claim.
+void response_cache_store(ResponseCache* cache, const struct sockaddr* client, socklen_t client_len, unsigned int request_id,
+                          const char* response);
+
+// Drops the claim on a request that will not be answered, so that a
+// retransmission is computed afresh
+void response_cache_release(ResponseCache* cache, const struct sockaddr* client, socklen_t client_len, unsigned int request_id);
+
+#endif // RESPONSE_CACHE_H
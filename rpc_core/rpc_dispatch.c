@@ -0,0 +1,167 @@
+#include "rpc_dispatch.h"
+#include "calculator_ops.h"
+#include "expr_eval.h"
+#include "vector_ops.h"
+#include "rpc_stream.h"
+#include "admission.h"
+#include "coroutine.h"
+#include "mem_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+void dispatch_init(void) {
+    expr_cache_init();
+}
+
+// Decodes the request's arrays and reduces them
+static CalcResult dispatch_vector(const RpcRequest* req) {
+    CalcResult res;
+    res.value = 0;
+    res.error[0] = '\0';
+    size_t n = req->vec_len;
+    double* x = arena_alloc(n * sizeof(double)); // Released by dispatch_request
+    double* y = req->operation == OP_DOT ? arena_alloc(n * sizeof(double)) : NULL;
+    if (!x || (req->operation == OP_DOT && !y)) {
+        snprintf(res.error, sizeof(res.error), "Server error: Out of memory for %zu operands", n);
+    } else if (rpc_decode_vector(req->vec_codec, req->vec_wire, n, x) != 0 ||
+               (y && rpc_decode_vector(req->vec_codec, req->vec2_wire, n, y) != 0)) {
+        snprintf(res.error, sizeof(res.error), "Server error: Bad operand array");
+    } else {
+        res = vector_reduce(req->operation, x, y, n);
+    }
+    return res;
+}
+
+// Runs the calls of an OP_BATCH request into resp->batch_results; the result is
+// their count. One zero divisor fails the whole batch, as it would a scalar call.
+static CalcResult dispatch_batch(const RpcRequest* req, RpcResponse* resp) {
+    CalcResult res;
+    res.value = 0;
+    res.error[0] = '\0';
+    size_t n = req->vec_len;
+    double y[RPC_BATCH_MAX_CALLS];
+    if (req->batch_op != OP_ADD && req->batch_op != OP_SUBTRACT && req->batch_op != OP_MULTIPLY &&
+        req->batch_op != OP_DIVIDE) {
+        snprintf(res.error, sizeof(res.error), "Error: Operation %d cannot be batched", req->batch_op);
+        return res;
+    }
+    if (n == 0 || n > RPC_BATCH_MAX_CALLS) {
+        snprintf(res.error, sizeof(res.error), "Error: Batch must hold 1 to %d calls", RPC_BATCH_MAX_CALLS);
+        return res;
+    }
+    if (rpc_decode_vector(req->vec_codec, req->vec_wire, n, resp->batch_results) != 0 ||
+        rpc_decode_vector(req->vec_codec, req->vec2_wire, n, y) != 0) {
+        snprintf(res.error, sizeof(res.error), "Server error: Bad operand array");
+        return res;
+    }
+    for (size_t i = 0; req->batch_op == OP_DIVIDE && i < n; i++) {
+        if (y[i] == 0) {
+            snprintf(res.error, sizeof(res.error), "Error: Division by zero! (call %zu)", i);
+            return res;
+        }
+    }
+    vector_elementwise(req->batch_op, resp->batch_results, y, resp->batch_results, n);
+    resp->batch_len = (unsigned int)n;
+    res.value = (double)n;
+    return res;
+}
+
+void dispatch_request(const RpcRequest* req, RpcResponse* resp) {
+    CalcResult calc_res;
+
+    resp->request_id = req->request_id;
+    resp->batch_len = 0;
+    // Nobody is waiting for an expired request any more, so skip the work and answer cheaply
+    if (rpc_deadline_expired(req)) {
+        resp->result = 0;
+        strcpy(resp->error, RPC_ERR_DEADLINE_EXCEEDED);
+        return;
+    }
+
+    // Scratch memory of the request comes from the thread's arena, all freed at the end
+    ArenaMark mark = arena_mark();
+    switch (req->operation) {
+        case OP_ADD:      calc_res = add(req->op1, req->op2); break;
+        case OP_SUBTRACT: calc_res = subtract(req->op1, req->op2); break;
+        case OP_MULTIPLY: calc_res = multiply(req->op1, req->op2); break;
+        case OP_DIVIDE:   calc_res = divide(req->op1, req->op2); break;
+        case OP_EXPR:     calc_res = expr_evaluate(req->expr_hash, req->expr_text, req->expr_bindings); break;
+        case OP_SUM:
+        case OP_MEAN:
+        case OP_MIN:
+        case OP_MAX:
+        case OP_DOT:      calc_res = dispatch_vector(req); break;
+        case OP_BATCH:    calc_res = dispatch_batch(req, resp); break;
+        case OP_STREAM:
+            // Servers that can stream intercept OP_STREAM before dispatching
+            snprintf(calc_res.error, sizeof(calc_res.error), RPC_ERR_STREAM_UNSUPPORTED);
+            calc_res.value = 0;
+            break;
+        default:
+            snprintf(calc_res.error, sizeof(calc_res.error), "Invalid operation: %d", req->operation);
+            calc_res.value = 0;
+            break;
+    }
+    arena_release(mark);
+    resp->result = calc_res.value;
+    strcpy(resp->error, calc_res.error);
+}
+
+ssize_t rpc_recv_request(int sock, char* buf, size_t cap) {
+    long long arrival_us;
+    return rpc_recv_request_at(sock, buf, cap, &arrival_us);
+}
+
+// Reads into *buf, of *cap bytes, after the len bytes already there. With
+// grow set, a full buffer is doubled, up to RPC_MAX_MESSAGE_SIZE, rather than
+// the request being cut short.
+static ssize_t recv_request(int sock, char** buf, size_t* cap, size_t len, int grow, long long* arrival_us) {
+    if (len == 0) *arrival_us = 0;
+    while (len == 0 || !rpc_request_complete(*buf, len)) {
+        if (len + 1 >= *cap) {
+            if (!grow || *cap >= RPC_MAX_MESSAGE_SIZE) break;
+            size_t bigger = *cap ? *cap * 2 : RPC_BUFFER_SIZE;
+            if (bigger > RPC_MAX_MESSAGE_SIZE) bigger = RPC_MAX_MESSAGE_SIZE;
+            char* grown = realloc(*buf, bigger);
+            if (!grown) return -1;
+            *buf = grown;
+            *cap = bigger;
+        }
+        long long stamp;
+        ssize_t n = rpc_recv_stamped(sock, *buf + len, *cap - 1 - len, 0, NULL, NULL, &stamp);
+        if (n > 0 && len == 0) *arrival_us = stamp; // The request queued from its first byte on
+        if (n < 0 && errno == EINTR) continue;
+        // In a coroutine, a non-blocking socket waits for the rest
+        if (n < 0 && errno == EAGAIN && coro_wait_fd(sock, POLLIN) == 0) continue;
+        if (n <= 0) {
+            if (len == 0) return n;
+            break; // Peer went away mid-request; hand over what arrived
+        }
+        len += (size_t)n;
+    }
+    (*buf)[len] = '\0';
+    return (ssize_t)len;
+}
+
+ssize_t rpc_recv_request_at(int sock, char* buf, size_t cap, long long* arrival_us) {
+    return recv_request(sock, &buf, &cap, 0, 0, arrival_us);
+}
+
+ssize_t rpc_recv_request_grow(int sock, char** buf, size_t* cap, long long* arrival_us) {
+    return recv_request(sock, buf, cap, 0, 1, arrival_us);
+}
+
+ssize_t rpc_recv_request_next(int sock, char** buf, size_t* cap, size_t* len, long long* arrival_us) {
+    ssize_t n = recv_request(sock, buf, cap, *len, 1, arrival_us);
+    if (n <= 0) {
+        *len = 0;
+        return n;
+    }
+    *len = (size_t)n;
+    size_t whole = rpc_request_length(*buf, *len);
+    return whole ? (ssize_t)whole : n; // Cut short or oversized: taken whole, it fails to unmarshal
+}
@@ -0,0 +1,44 @@
+#ifndef RPC_DISPATCH_H
+#define RPC_DISPATCH_H
+
+#include "rpc_protocol.h"
+#include <sys/types.h> // For ssize_t
+
+// Computes the response for an unmarshalled request: runs the calculator
+// operation and fills in result, error and request_id. A request whose
+// deadline has passed is not computed; it gets RPC_ERR_DEADLINE_EXCEEDED.
+// resp->server_type is left to the calling server.
+void dispatch_request(const RpcRequest* req, RpcResponse* resp);
+
+// One-time setup of state shared by all requests (the compiled-expression
+// cache). Servers call it at startup, before forking any workers.
+void dispatch_init(void);
+
+// Reads one request from a blocking stream socket into buf (capacity cap,
+// normally RPC_MAX_MESSAGE_SIZE) and null-terminates it. Keeps reading until
+// rpc_request_complete() is satisfied, so array requests larger than one
+// segment arrive whole. Returns the length, 0 on orderly shutdown before any
+// data, or -1 on error. An oversized request is returned truncated and then
+// fails to unmarshal. In a coroutine (coroutine.h), a non-blocking socket
+// works too.
+ssize_t rpc_recv_request(int sock, char* buf, size_t cap);
+
+// Same, also reporting when the request's first bytes reached the host (see
+// rpc_recv_stamped in admission.h), or 0 if the socket does not say.
+ssize_t rpc_recv_request_at(int sock, char* buf, size_t cap, long long* arrival_us);
+
+// Same, into a heap buffer (*buf, *cap bytes; NULL and 0 to start) that grows
+// as the request needs, up to RPC_MAX_MESSAGE_SIZE. For servers that keep
+// many connections open, where a largest-size buffer each would not do. The
+// caller frees *buf.
+ssize_t rpc_recv_request_grow(int sock, char** buf, size_t* cap, long long* arrival_us);
+
+// Same, for clients that send their next requests before the first is
+// answered. *len bytes (0 to start) are already in *buf, left from the last
+// call; no more is read if they hold a whole request. Returns the length of
+// the first request, which the caller drops from the front of *buf once it is
+// answered. *len then counts every buffered byte, those sent behind it too.
+// *arrival_us is only updated when no bytes were left.
+ssize_t rpc_recv_request_next(int sock, char** buf, size_t* cap, size_t* len, long long* arrival_us);
+
+#endif // RPC_DISPATCH_H
@@ -1,7 +1,10 @@
 #include "rpc_protocol.h"
+#include "float_codec.h"
+#include "mem_pool.h" // For the packed bytes of compressed arrays
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h> // For atof
+#include <time.h>
 
 // Helper to convert OperationType to string
 const char* operation_to_string(OperationType op) {
@@ -11,6 +14,14 @@ const char* operation_to_string(OperationType op) {
         case OP_MULTIPLY: return "MUL";
         case OP_DIVIDE: return "DIV";
         case OP_EXIT: return "EXT"; // Corrected from EXI to EXT for consistency
+        case OP_EXPR: return "EXP";
+        case OP_SUM: return "SUM";
+        case OP_MEAN: return "AVG";
+        case OP_MIN: return "MIN";
+        case OP_MAX: return "MAX";
+        case OP_DOT: return "DOT";
+        case OP_STREAM: return "STM";
+        case OP_BATCH: return "BAT";
         default: return "UNK"; // Unknown
     }
 }
@@ -22,14 +33,308 @@ OperationType string_to_operation(const char* str) {
     if (strcmp(str, "MUL") == 0) return OP_MULTIPLY;
     if (strcmp(str, "DIV") == 0) return OP_DIVIDE;
     if (strcmp(str, "EXT") == 0) return OP_EXIT;
+    if (strcmp(str, "EXP") == 0) return OP_EXPR;
+    if (strcmp(str, "SUM") == 0) return OP_SUM;
+    if (strcmp(str, "AVG") == 0) return OP_MEAN;
+    if (strcmp(str, "MIN") == 0) return OP_MIN;
+    if (strcmp(str, "MAX") == 0) return OP_MAX;
+    if (strcmp(str, "DOT") == 0) return OP_DOT;
+    if (strcmp(str, "STM") == 0) return OP_STREAM;
+    if (strcmp(str, "BAT") == 0) return OP_BATCH;
     return -1; // Invalid operation
 }
 
+// Finds an optional "KEY:value;" field in the part of a message after its fixed fields.
+// Returns a pointer to the value, or NULL if the field is absent.
+static const char* find_optional_field(const char* fields, const char* key) {
+    size_t key_len = strlen(key);
+    for (const char* p = fields; p && *p; p = strchr(p, ';')) {
+        if (*p == ';') p++;
+        if (strncmp(p, key, key_len) == 0 && p[key_len] == ':') {
+            return p + key_len + 1;
+        }
+    }
+    return NULL;
+}
+
+static unsigned int parse_request_id(const char* fields) {
+    const char* value = find_optional_field(fields, "ID");
+    return value ? (unsigned int)strtoul(value, NULL, 10) : 0;
+}
+
+static long long parse_deadline(const char* fields) {
+    const char* value = find_optional_field(fields, "DL");
+    return value ? strtoll(value, NULL, 10) : 0;
+}
+
+// Unknown classes are left to the server, like a missing field
+static int parse_priority(const char* fields) {
+    const char* value = find_optional_field(fields, "PRI");
+    int priority = value ? atoi(value) : RPC_PRIORITY_AUTO;
+    return priority == RPC_PRIORITY_INTERACTIVE || priority == RPC_PRIORITY_BATCH ? priority : RPC_PRIORITY_AUTO;
+}
+
+// Copies a string field's value (up to the next ';') into out, or "" if absent.
+static void parse_string_field(const char* fields, const char* key, char* out, size_t out_size) {
+    const char* value = find_optional_field(fields, key);
+    size_t len = value ? strcspn(value, ";") : 0;
+    if (len >= out_size) len = out_size - 1;
+    memcpy(out, value ? value : "", len);
+    out[len] = '\0';
+}
+
+// ===== Operand arrays =====
+// Arrays travel as "VEC:<count>:<base64>;" (and "VEC2:..." for the second
+// array of OP_DOT and OP_BATCH), always as the last fields of the request. The base64 text
+// holds the raw doubles in host byte order; every supported platform is
+// little-endian IEEE 754.
+// RPC_VEC_XOR arrays travel as "VECZ:<count>:<bytes>:<base64>;" (and "VEC2Z")
+// instead, the base64 text holding <bytes> bytes of float_codec output. Each
+// request names its own encoding, so servers need no per-client state.
+
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static size_t base64_len(size_t bytes) {
+    return (bytes + 2) / 3 * 4;
+}
+
+// Writes the base64 form of data into out, which must hold base64_len(len) bytes
+static void base64_encode(const unsigned char* data, size_t len, char* out) {
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3) {
+        unsigned int v = (unsigned int)data[i] << 16 | (unsigned int)data[i + 1] << 8 | data[i + 2];
+        *out++ = base64_chars[(v >> 18) & 63];
+        *out++ = base64_chars[(v >> 12) & 63];
+        *out++ = base64_chars[(v >> 6) & 63];
+        *out++ = base64_chars[v & 63];
+    }
+    if (i < len) {
+        unsigned int v = (unsigned int)data[i] << 16 | (i + 1 < len ? (unsigned int)data[i + 1] << 8 : 0);
+        *out++ = base64_chars[(v >> 18) & 63];
+        *out++ = base64_chars[(v >> 12) & 63];
+        *out++ = i + 1 < len ? base64_chars[(v >> 6) & 63] : '=';
+        *out++ = '=';
+    }
+}
+
+static int base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+// Decodes exactly len bytes from base64_len(len) characters of text
+static int base64_decode(const char* text, size_t len, unsigned char* out) {
+    for (size_t i = 0; i < len; i += 3, text += 4) {
+        int a = base64_value(text[0]), b = base64_value(text[1]);
+        int c = i + 1 < len ? base64_value(text[2]) : 0;
+        int d = i + 2 < len ? base64_value(text[3]) : 0;
+        if (a < 0 || b < 0 || c < 0 || d < 0) return -1;
+        unsigned int v = (unsigned int)a << 18 | (unsigned int)b << 12 | (unsigned int)c << 6 | (unsigned int)d;
+        out[i] = (unsigned char)(v >> 16);
+        if (i + 1 < len) out[i + 1] = (unsigned char)(v >> 8);
+        if (i + 2 < len) out[i + 2] = (unsigned char)v;
+    }
+    return 0;
+}
+
+int rpc_is_vector_op(OperationType op) {
+    return op == OP_SUM || op == OP_MEAN || op == OP_MIN || op == OP_MAX || op == OP_DOT;
+}
+
+// Number of operand arrays a request carries
+static int array_count(OperationType op) {
+    if (op == OP_DOT || op == OP_BATCH) return 2;
+    return rpc_is_vector_op(op) ? 1 : 0;
+}
+
+size_t rpc_request_size(OperationType op, size_t n) {
+    size_t size = RPC_BUFFER_SIZE + 2 * RPC_EXPR_MAX_BINDINGS; // Fixed fields and the expression fields
+    size += array_count(op) * (48 + base64_len(float_codec_bound(n))); // The larger of the two encodings
+    return size;
+}
+
+// Whether the field at p (n bytes available) has the given key
+static int field_is(const char* p, size_t n, const char* key) {
+    size_t key_len = strlen(key);
+    return n > key_len && memcmp(p, key, key_len) == 0 && p[key_len] == ':';
+}
+
+size_t rpc_request_length(const char* buf, size_t len) {
+    static const char prefix[] = "OP:";
+    if (len < 7) {
+        // Anything that is not the start of a request will never become one
+        return len == 0 || strncmp(buf, prefix, len < 3 ? len : 3) == 0 ? 0 : len;
+    }
+    if (strncmp(buf, prefix, 3) != 0) return len;
+    char op_name[4];
+    memcpy(op_name, buf + 3, 3);
+    op_name[3] = '\0';
+    OperationType op = string_to_operation(op_name);
+    if (op == (OperationType)-1) return len; // Fails to unmarshal whatever follows
+    // The field that always comes last but for optional ones (see marshal_request)
+    const char* last = "OP2";
+    const char* last_z = NULL;
+    if (op == OP_EXPR) last = "VARS";
+    else if (op == OP_STREAM) last = "CHUNK";
+    else if (array_count(op) == 2) last = "VEC2", last_z = "VEC2Z";
+    else if (array_count(op) == 1) last = "VEC", last_z = "VECZ";
+
+    // Walk the terminated fields; the request ends before the next one's OP field
+    size_t end = 0;
+    int seen_last = 0;
+    for (size_t p = 0; p < len;) {
+        if (p > 0 && field_is(buf + p, len - p, "OP")) break;
+        const char* semi = memchr(buf + p, ';', len - p);
+        if (!semi) return 0; // A field still arriving
+        if (field_is(buf + p, len - p, last) || (last_z && field_is(buf + p, len - p, last_z))) seen_last = 1;
+        p = (size_t)(semi - buf) + 1;
+        end = p;
+    }
+    return seen_last ? end : 0;
+}
+
+int rpc_request_complete(const char* buf, size_t len) {
+    return rpc_request_length(buf, len) != 0;
+}
+
+static int marshal_vector(const char* key, const double* values, size_t n, int codec, char* buffer, size_t buffer_size, int* written) {
+    const unsigned char* data = (const unsigned char*)values;
+    size_t bytes = n * sizeof(double);
+    int header;
+    ArenaMark mark = arena_mark(); // The packed bytes only live until they are encoded
+    if (codec == RPC_VEC_XOR) {
+        unsigned char* packed = arena_alloc(float_codec_bound(n));
+        if (!packed) return -1;
+        bytes = float_codec_encode(values, n, packed);
+        data = packed;
+        header = snprintf(buffer + *written, buffer_size - *written, "%sZ:%zu:%zu:", key, n, bytes);
+    } else {
+        header = snprintf(buffer + *written, buffer_size - *written, "%s:%zu:", key, n);
+    }
+    size_t encoded = base64_len(bytes);
+    if (header < 0 || (size_t)*written + header + encoded + 1 >= buffer_size) {
+        arena_release(mark);
+        return -1;
+    }
+    *written += header;
+    base64_encode(data, bytes, buffer + *written);
+    *written += (int)encoded;
+    buffer[(*written)++] = ';';
+    buffer[*written] = '\0';
+    arena_release(mark);
+    return 0;
+}
+
+// Locates an array field in either encoding and checks its count and encoded
+// length. Returns a pointer to the text after the count (for RPC_VEC_XOR
+// still starting with the byte length), or NULL if absent or malformed.
+static const char* parse_vector_field(const char* fields, const char* key, size_t* n, int* codec) {
+    char packed_key[8];
+    snprintf(packed_key, sizeof(packed_key), "%sZ", key);
+    const char* value = find_optional_field(fields, key);
+    *codec = RPC_VEC_RAW;
+    if (!value && (value = find_optional_field(fields, packed_key)) != NULL) {
+        *codec = RPC_VEC_XOR;
+    }
+    if (!value) return NULL;
+    char* end;
+    unsigned long long count = strtoull(value, &end, 10);
+    if (end == value || *end != ':' || count > RPC_MAX_MESSAGE_SIZE / sizeof(double)) return NULL;
+    const char* wire = end + 1;
+    const char* text = wire;
+    unsigned long long bytes = count * sizeof(double);
+    if (*codec == RPC_VEC_XOR) {
+        bytes = strtoull(wire, &end, 10);
+        if (end == wire || *end != ':' || bytes > float_codec_bound((size_t)count)) return NULL;
+        text = end + 1;
+    }
+    if (strcspn(text, ";") != base64_len((size_t)bytes)) return NULL;
+    *n = (size_t)count;
+    return wire;
+}
+
+int rpc_decode_vector(int codec, const char* wire, size_t n, double* out) {
+    if (codec != RPC_VEC_XOR) {
+        return base64_decode(wire, n * sizeof(double), (unsigned char*)out);
+    }
+    char* text;
+    size_t bytes = (size_t)strtoull(wire, &text, 10);
+    ArenaMark mark = arena_mark();
+    unsigned char* packed = arena_alloc(bytes ? bytes : 1);
+    if (!packed) return -1;
+    int rc = -1;
+    if (base64_decode(text + 1, bytes, packed) == 0) {
+        rc = float_codec_decode(packed, bytes, out, n);
+    }
+    arena_release(mark);
+    return rc;
+}
+
+long long rpc_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int rpc_deadline_expired(const RpcRequest* req) {
+    return req->deadline_ms != 0 && rpc_now_ms() > req->deadline_ms;
+}
+
 // Marshal RpcRequest to buffer
-// Format: OP:<OP_STR>;OP1:<VAL1>;OP2:<VAL2>;
+// Format: OP:<OP_STR>;OP1:<VAL1>;OP2:<VAL2>;[ID:<REQUEST_ID>;][DL:<DEADLINE_MS>;][PRI:<PRIORITY>;]
+// OP_EXPR adds: EH:<HASH_HEX>;[EXPR:<TEXT>;]VARS:<BINDINGS>;
+// Reductions add: VEC:<COUNT>:<BASE64>;[VEC2:<COUNT>:<BASE64>;]
+//   or, compressed: VECZ:<COUNT>:<BYTES>:<BASE64>;[VEC2Z:<COUNT>:<BYTES>:<BASE64>;]
+// OP_STREAM adds: SOP:<OP_STR>;CHUNK:<VALUES_PER_CHUNK>;[ENC:XOR;]
+// OP_BATCH adds: BOP:<OP_STR>; and then both arrays, like OP_DOT
+// Operands use %.17g so doubles survive the round trip exactly.
 int marshal_request(const RpcRequest* req, char* buffer, size_t buffer_size) {
-    int written = snprintf(buffer, buffer_size, "OP:%s;OP1:%.10g;OP2:%.10g;",
+    int written = snprintf(buffer, buffer_size, "OP:%s;OP1:%.17g;OP2:%.17g;",
                            operation_to_string(req->operation), req->op1, req->op2);
+    if (written >= 0 && (size_t)written < buffer_size && req->request_id != 0) {
+        written += snprintf(buffer + written, buffer_size - written, "ID:%u;", req->request_id);
+    }
+    if (written >= 0 && (size_t)written < buffer_size && req->deadline_ms != 0) {
+        written += snprintf(buffer + written, buffer_size - written, "DL:%lld;", req->deadline_ms);
+    }
+    if (written >= 0 && (size_t)written < buffer_size && req->priority != RPC_PRIORITY_AUTO) {
+        written += snprintf(buffer + written, buffer_size - written, "PRI:%d;", req->priority);
+    }
+    if (req->operation == OP_EXPR && written >= 0 && (size_t)written < buffer_size) {
+        if (strchr(req->expr_text, ';') || strchr(req->expr_bindings, ';')) {
+            return -1; // ';' is the field separator
+        }
+        written += snprintf(buffer + written, buffer_size - written, "EH:%llx;", req->expr_hash);
+        if (req->expr_text[0] != '\0' && (size_t)written < buffer_size) {
+            written += snprintf(buffer + written, buffer_size - written, "EXPR:%s;", req->expr_text);
+        }
+        if ((size_t)written < buffer_size) {
+            written += snprintf(buffer + written, buffer_size - written, "VARS:%s;", req->expr_bindings);
+        }
+    }
+    if (req->operation == OP_STREAM && written >= 0 && (size_t)written < buffer_size) {
+        written += snprintf(buffer + written, buffer_size - written, "SOP:%s;CHUNK:%u;",
+                            operation_to_string(req->stream_op), req->stream_chunk);
+        if (req->vec_codec == RPC_VEC_XOR && (size_t)written < buffer_size) {
+            written += snprintf(buffer + written, buffer_size - written, "ENC:XOR;");
+        }
+    }
+    if (req->operation == OP_BATCH && written >= 0 && (size_t)written < buffer_size) {
+        written += snprintf(buffer + written, buffer_size - written, "BOP:%s;", operation_to_string(req->batch_op));
+    }
+    if (array_count(req->operation) > 0 && written >= 0 && (size_t)written < buffer_size) {
+        if (marshal_vector("VEC", req->vec, req->vec_len, req->vec_codec, buffer, buffer_size, &written) != 0) {
+            return -1;
+        }
+        if (array_count(req->operation) == 2 &&
+            marshal_vector("VEC2", req->vec2, req->vec_len, req->vec_codec, buffer, buffer_size, &written) != 0) {
+            return -1;
+        }
+    }
     if (written < 0 || (size_t)written >= buffer_size) {
         return -1; // Error or buffer too small
     }
@@ -41,23 +346,76 @@ int unmarshal_request(const char* buffer, RpcRequest* req) {
     char op_str[10];
     // Using sscanf to parse. For robustness, more complex parsing might be needed.
     // Example: OP:ADD;OP1:10.5;OP2:5.2;
-    if (sscanf(buffer, "OP:%3s;OP1:%lf;OP2:%lf;", op_str, &req->op1, &req->op2) == 3) {
+    int fixed_len = 0;
+    if (sscanf(buffer, "OP:%3s;OP1:%lf;OP2:%lf;%n", op_str, &req->op1, &req->op2, &fixed_len) == 3) {
         req->operation = string_to_operation(op_str);
         if (req->operation == (OperationType)-1) { // Check if string_to_operation returned an error
             return -1; // Invalid operation string
         }
+        req->request_id = fixed_len > 0 ? parse_request_id(buffer + fixed_len) : 0;
+        req->deadline_ms = fixed_len > 0 ? parse_deadline(buffer + fixed_len) : 0;
+        req->priority = fixed_len > 0 ? parse_priority(buffer + fixed_len) : RPC_PRIORITY_AUTO;
+        req->expr_hash = 0;
+        req->expr_text[0] = '\0';
+        req->expr_bindings[0] = '\0';
+        if (req->operation == OP_EXPR && fixed_len > 0) {
+            const char* hash = find_optional_field(buffer + fixed_len, "EH");
+            req->expr_hash = hash ? strtoull(hash, NULL, 16) : 0;
+            parse_string_field(buffer + fixed_len, "EXPR", req->expr_text, sizeof(req->expr_text));
+            parse_string_field(buffer + fixed_len, "VARS", req->expr_bindings, sizeof(req->expr_bindings));
+        }
+        req->stream_op = (OperationType)-1;
+        req->stream_chunk = 0;
+        req->vec_codec = RPC_VEC_RAW;
+        if (req->operation == OP_STREAM && fixed_len > 0) {
+            char stream_op[8], codec[8];
+            const char* chunk = find_optional_field(buffer + fixed_len, "CHUNK");
+            parse_string_field(buffer + fixed_len, "SOP", stream_op, sizeof(stream_op));
+            parse_string_field(buffer + fixed_len, "ENC", codec, sizeof(codec));
+            req->stream_op = string_to_operation(stream_op);
+            req->stream_chunk = chunk ? (unsigned int)strtoul(chunk, NULL, 10) : 0;
+            req->vec_codec = strcmp(codec, "XOR") == 0 ? RPC_VEC_XOR : RPC_VEC_RAW; // Unknown offers fall back to raw
+        }
+        req->batch_op = (OperationType)-1;
+        if (req->operation == OP_BATCH && fixed_len > 0) {
+            char batch_op[8];
+            parse_string_field(buffer + fixed_len, "BOP", batch_op, sizeof(batch_op));
+            req->batch_op = string_to_operation(batch_op);
+        }
+        req->vec_len = 0;
+        req->vec = req->vec2 = NULL;
+        req->vec_wire = req->vec2_wire = NULL;
+        if (array_count(req->operation) > 0) {
+            size_t n2 = 0;
+            int codec2;
+            req->vec_wire = parse_vector_field(buffer + fixed_len, "VEC", &req->vec_len, &req->vec_codec);
+            if (!req->vec_wire) return -1;
+            if (array_count(req->operation) == 2) {
+                req->vec2_wire = parse_vector_field(buffer + fixed_len, "VEC2", &n2, &codec2);
+                if (!req->vec2_wire || n2 != req->vec_len || codec2 != req->vec_codec) return -1;
+            }
+        }
         return 0; // Success
     }
     return -1; // Parsing failed
 }
 
 // Marshal RpcResponse to buffer
-// Format: RES:<VAL>;ERR:<ERROR_STR>;STYPE:<SERVER_TYPE_STR>;
+// Format: RES:<VAL>;ERR:<ERROR_STR>;STYPE:<SERVER_TYPE_STR>;[ID:<REQUEST_ID>;]
+// OP_BATCH replies add their results as an array: VEC:<COUNT>:<BASE64>;
 int marshal_response(const RpcResponse* res, char* buffer, size_t buffer_size) {
     // Replace NULL or empty error strings with a placeholder for consistent parsing
     const char* err_str = (res->error[0] == '\0') ? "NULL" : res->error;
-    int written = snprintf(buffer, buffer_size, "RES:%.10g;ERR:%s;STYPE:%s;",
+    int written = snprintf(buffer, buffer_size, "RES:%.17g;ERR:%s;STYPE:%s;",
                            res->result, err_str, res->server_type);
+    if (written >= 0 && (size_t)written < buffer_size && res->request_id != 0) {
+        written += snprintf(buffer + written, buffer_size - written, "ID:%u;", res->request_id);
+    }
+    if (written >= 0 && (size_t)written < buffer_size && res->error[0] == '\0' && res->batch_len > 0 &&
+        res->batch_len <= RPC_BATCH_MAX_CALLS &&
+        marshal_vector("VEC", res->batch_results, res->batch_len, RPC_VEC_RAW, buffer, buffer_size, &written) != 0) {
+        return -1;
+    }
     if (written < 0 || (size_t)written >= buffer_size) {
         return -1; // Error or buffer too small
     }
@@ -71,11 +429,21 @@ int unmarshal_response(const char* buffer, RpcResponse* res) {
     // Using a format that reads up to ';' for string fields.
     // %[A-Za-z0-9_ ] matches alphanumeric, underscore, and space.
     // %[^;] matches everything until a semicolon.
-    if (sscanf(buffer, "RES:%lf;ERR:%255[^;];STYPE:%127[^;];",
-               &res->result, res->error, res->server_type) == 3) {
+    int fixed_len = 0;
+    if (sscanf(buffer, "RES:%lf;ERR:%255[^;];STYPE:%127[^;];%n",
+               &res->result, res->error, res->server_type, &fixed_len) == 3) {
         if (strcmp(res->error, "NULL") == 0) {
             res->error[0] = '\0'; // Convert "NULL" placeholder back to empty string
         }
+        res->request_id = fixed_len > 0 ? parse_request_id(buffer + fixed_len) : 0;
+        res->batch_len = 0;
+        size_t n;
+        int codec;
+        const char* results = fixed_len > 0 ? parse_vector_field(buffer + fixed_len, "VEC", &n, &codec) : NULL;
+        if (results) {
+            if (n > RPC_BATCH_MAX_CALLS || rpc_decode_vector(codec, results, n, res->batch_results) != 0) return -1;
+            res->batch_len = (unsigned int)n;
+        }
         return 0; // Success
     }
     return -1; // Parsing failed
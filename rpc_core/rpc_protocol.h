@@ -9,14 +9,48 @@ typedef enum {
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
-    OP_EXIT
+    OP_EXIT,
+    OP_EXPR, // Evaluate an expression over variable bindings in one call
+    // Reductions over the operand array(s) carried in the request
+    OP_SUM,
+    OP_MEAN,
+    OP_MIN,
+    OP_MAX,
+    OP_DOT,  // Needs two arrays of the same length
+    OP_STREAM, // Opens a streaming call over TCP, see rpc_stream.h
+    OP_BATCH   // Several scalar calls in one request: batch_op over two arrays
 } OperationType;
 
+#define RPC_EXPR_MAX_TEXT 256      // Must match EXPR_MAX_TEXT in expr_eval.h
+#define RPC_EXPR_MAX_BINDINGS 512
+#define RPC_BATCH_MAX_CALLS 64 // Calls per OP_BATCH request; their results fit one reply
+
 // Structure for RPC requests
 typedef struct {
     OperationType operation;
     double op1;
     double op2;
+    unsigned int request_id; // Client-chosen ID echoed in the response, 0 if unused
+    long long deadline_ms;   // Wall-clock time (ms since the epoch) after which the caller has given up, 0 if none
+    int priority;            // RPC_PRIORITY_*; RPC_PRIORITY_AUTO (0) leaves it to the server
+    // OP_EXPR only
+    unsigned long long expr_hash;               // Hash of the expression text, lets repeat calls omit the text
+    char expr_text[RPC_EXPR_MAX_TEXT];          // Empty when the server is expected to have it compiled already
+    char expr_bindings[RPC_EXPR_MAX_BINDINGS];  // "name=value,name=value"
+    // Reductions and OP_BATCH. marshal_request encodes vec (and vec2 for OP_DOT and OP_BATCH);
+    // unmarshal_request leaves them NULL and points vec_wire/vec2_wire at the
+    // encoded arrays inside the message buffer, which must outlive the request.
+    size_t vec_len;
+    const double* vec;
+    const double* vec2;
+    const char* vec_wire;
+    const char* vec2_wire;
+    int vec_codec; // RPC_VEC_RAW or RPC_VEC_XOR; for OP_STREAM, the encoding offered for the frames
+    // OP_STREAM only
+    OperationType stream_op;   // Operation applied to the streamed arrays
+    unsigned int stream_chunk; // Values per DATA frame the client will send
+    // OP_BATCH only: call i is batch_op(vec[i], vec2[i])
+    OperationType batch_op;    // OP_ADD, OP_SUBTRACT, OP_MULTIPLY or OP_DIVIDE
 } RpcRequest;
 
 // Structure for RPC responses
@@ -24,10 +58,74 @@ typedef struct {
     double result;
     char error[256];
     char server_type[128];
+    unsigned int request_id; // Copied from the request so the client can match replies
+    // OP_BATCH replies only: one result per call, in order. marshal_response
+    // sends them only with an empty error; dispatch_request sets batch_len.
+    unsigned int batch_len;
+    double batch_results[RPC_BATCH_MAX_CALLS];
 } RpcResponse;
 
 #define RPC_BUFFER_SIZE 1024
 
+// Encodings of operand arrays
+#define RPC_VEC_RAW 0 // The doubles as they are in memory
+#define RPC_VEC_XOR 1 // Compressed by float_codec.h, for slowly changing values
+
+// Requests carrying operand arrays may exceed RPC_BUFFER_SIZE. Over TCP they
+// are read until rpc_request_complete() says so, up to RPC_MAX_MESSAGE_SIZE;
+// over UDP they must fit in one datagram. Responses always fit RPC_BUFFER_SIZE.
+#define RPC_MAX_MESSAGE_SIZE (1024 * 1024)
+#define RPC_MAX_DATAGRAM_SIZE 65000
+
+// Scheduling classes a request may ask for (the PRI field). Servers that
+// schedule their compute (priority_sched.h) serve interactive requests ahead
+// of batch ones; without a class, reductions count as batch.
+#define RPC_PRIORITY_AUTO 0
+#define RPC_PRIORITY_INTERACTIVE 1
+#define RPC_PRIORITY_BATCH 2
+
+// Error string returned instead of a result when a request arrives after its deadline
+#define RPC_ERR_DEADLINE_EXCEEDED "DEADLINE_EXCEEDED"
+
+// Error string of the reply an overloaded server sends instead of computing
+// (see admission.h). The request was not run; another server may take it.
+#define RPC_ERR_BUSY "BUSY"
+
+// Operation names as used on the wire ("ADD", "SUB", "MUL", "DIV", "EXT", "EXP",
+// "SUM", "AVG", "MIN", "MAX", "DOT", "STM", "BAT").
+// string_to_operation returns (OperationType)-1 for an unknown name.
+const char* operation_to_string(OperationType op);
+OperationType string_to_operation(const char* str);
+
+// Current wall-clock time in milliseconds since the epoch, the clock deadlines are expressed in
+long long rpc_now_ms(void);
+
+// Returns 1 if the request carries a deadline that has already passed
+int rpc_deadline_expired(const RpcRequest* req);
+
+// Returns 1 for the reductions, which carry operand arrays
+int rpc_is_vector_op(OperationType op);
+
+// Buffer size marshal_request needs for a request with n-element arrays
+size_t rpc_request_size(OperationType op, size_t n);
+
+// Returns 1 once buf (len bytes, not necessarily terminated) holds a whole
+// request: its last required field (OP2, VARS, CHUNK or the last array) and
+// any optional fields after it are terminated.
+int rpc_request_complete(const char* buf, size_t len);
+
+// Length of the first whole request in buf, 0 while it is incomplete. A
+// client may send several requests back to back; the first ends where the
+// next one's OP field starts. Bytes that cannot start a request count as one
+// (bad) request. A request split exactly after a terminated field is taken as
+// ending there, so its optional fields must not trail in a later segment.
+size_t rpc_request_length(const char* buf, size_t len);
+
+// Decodes an array from an unmarshalled request (vec_wire or vec2_wire, in
+// encoding req->vec_codec) into out, which must hold req->vec_len doubles.
+// Returns 0, or -1 if malformed.
+int rpc_decode_vector(int codec, const char* wire, size_t n, double* out);
+
 // Function prototypes for marshalling/unmarshalling
 int marshal_request(const RpcRequest* req, char* buffer, size_t buffer_size);
 int unmarshal_request(const char* buffer, RpcRequest* req);
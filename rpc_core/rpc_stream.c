@@ -0,0 +1,278 @@
+#include "rpc_stream.h"
+#include "vector_ops.h"
+#include "float_codec.h"
+#include "coroutine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+int rpc_stream_op_supported(OperationType op) {
+    return op == OP_ADD || op == OP_SUBTRACT || op == OP_MULTIPLY || op == OP_DIVIDE || rpc_is_vector_op(op);
+}
+
+int rpc_stream_op_two_arrays(OperationType op) {
+    return op == OP_ADD || op == OP_SUBTRACT || op == OP_MULTIPLY || op == OP_DIVIDE || op == OP_DOT;
+}
+
+// Both wait in a coroutine (coroutine.h) when a non-blocking socket is not ready
+static int send_all(int sock, const void* buf, size_t len, int flags) {
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL | flags);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN && coro_wait_fd(sock, POLLOUT) == 0) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int recv_all(int sock, void* buf, size_t len) {
+    char* p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN && coro_wait_fd(sock, POLLIN) == 0) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Header and payload go out in one send: as two, Nagle's algorithm holds the
+// payload back until the header is acknowledged, costing a delayed ACK per frame.
+static int send_frame(int sock, StreamFrameType type, uint32_t count, const void* payload, size_t payload_bytes) {
+    StreamFrameHeader header = { type, count };
+    if (payload_bytes <= RPC_BUFFER_SIZE) {
+        char frame[sizeof(header) + RPC_BUFFER_SIZE];
+        memcpy(frame, &header, sizeof(header));
+        memcpy(frame + sizeof(header), payload, payload_bytes);
+        return send_all(sock, frame, sizeof(header) + payload_bytes, 0);
+    }
+    if (send_all(sock, &header, sizeof(header), MSG_MORE) != 0) return -1;
+    return send_all(sock, payload, payload_bytes, 0);
+}
+
+static int send_error(int sock, const char* message) {
+    return send_frame(sock, STREAM_ERROR, (uint32_t)strlen(message), message, strlen(message));
+}
+
+// Sends the text reply that accepts (credits > 0) or refuses the stream
+static int send_reply(int sock, const RpcResponse* resp, unsigned int credits, int codec) {
+    char buffer[RPC_BUFFER_SIZE];
+    if (marshal_response(resp, buffer, sizeof(buffer)) != 0) return -1;
+    size_t len = strlen(buffer);
+    if (credits > 0) {
+        snprintf(buffer + len, sizeof(buffer) - len, codec == RPC_VEC_XOR ? "CR:%u;ENC:XOR;" : "CR:%u;", credits);
+    }
+    return send_all(sock, buffer, strlen(buffer), 0);
+}
+
+// Reads the payload of a DATA_XOR frame into packed and decodes it into x and y.
+// Returns the number of values, or -1 with err filled in.
+static int recv_packed(int sock, size_t bytes, unsigned char* packed, size_t chunk, double* x, double* y,
+                       char* err, size_t err_len) {
+    StreamPackedHeader ph;
+    if (recv_all(sock, packed, bytes) != 0) {
+        snprintf(err, err_len, "Stream broken");
+        return -1;
+    }
+    memcpy(&ph, packed, sizeof(ph));
+    size_t rest = bytes - sizeof(ph);
+    if (ph.values == 0 || ph.values > chunk || ph.x_bytes > rest ||
+        float_codec_decode(packed + sizeof(ph), ph.x_bytes, x, ph.values) != 0 ||
+        (y ? float_codec_decode(packed + sizeof(ph) + ph.x_bytes, rest - ph.x_bytes, y, ph.values) != 0
+           : rest != ph.x_bytes)) {
+        snprintf(err, err_len, "Error: Malformed compressed stream frame");
+        return -1;
+    }
+    return (int)ph.values;
+}
+
+// Sends n results as one RESULT_XOR frame, encoded in packed
+static int send_packed(int sock, const double* out, size_t n, unsigned char* packed) {
+    StreamPackedHeader ph = { (uint32_t)n, 0 };
+    ph.x_bytes = (uint32_t)float_codec_encode(out, n, packed + sizeof(ph));
+    memcpy(packed, &ph, sizeof(ph));
+    size_t bytes = sizeof(ph) + ph.x_bytes;
+    return send_frame(sock, STREAM_RESULT_XOR, (uint32_t)bytes, packed, bytes);
+}
+
+// Running reduction over all chunks so far
+typedef struct {
+    double sum;
+    double comp; // Compensation (vector_compensated_add), the total is sum + comp
+    double min;
+    double max;
+    size_t count;
+} StreamTotal;
+
+static void total_add(StreamTotal* t, OperationType op, double chunk_value, size_t chunk_count) {
+    if (op == OP_MIN || op == OP_MAX) {
+        if (t->count == 0 || isnan(chunk_value)) {
+            t->min = t->max = chunk_value;
+        } else if (!isnan(t->min)) {
+            if (chunk_value < t->min) t->min = chunk_value;
+            if (chunk_value > t->max) t->max = chunk_value;
+        }
+    } else {
+        vector_compensated_add(&t->sum, &t->comp, chunk_value);
+    }
+    t->count += chunk_count;
+}
+
+// Computes the results of one chunk into out. Returns the number of values, or -1 with err filled in.
+static int compute_chunk(OperationType op, const double* x, const double* y, size_t n, double* out,
+                         StreamTotal* total, char* err, size_t err_len) {
+    if (!rpc_is_vector_op(op)) {
+        for (size_t i = 0; i < n; i++) {
+            switch (op) {
+                case OP_ADD:      out[i] = x[i] + y[i]; break;
+                case OP_SUBTRACT: out[i] = x[i] - y[i]; break;
+                case OP_MULTIPLY: out[i] = x[i] * y[i]; break;
+                default:
+                    if (y[i] == 0) {
+                        snprintf(err, err_len, "Error: Division by zero! (element %zu)", total->count + i);
+                        return -1;
+                    }
+                    out[i] = x[i] / y[i];
+                    break;
+            }
+        }
+        total->count += n;
+        return (int)n;
+    }
+
+    // The mean of the whole stream is built from chunk sums, not chunk means
+    CalcResult res = vector_reduce(op == OP_MEAN ? OP_SUM : op, x, y, n);
+    if (res.error[0] != '\0') {
+        snprintf(err, err_len, "%s", res.error);
+        return -1;
+    }
+    total_add(total, op, res.value, n);
+    out[0] = op == OP_MEAN ? res.value / (double)n : res.value;
+    return 1;
+}
+
+int rpc_stream_serve(int sock, const RpcRequest* req, RpcResponse* resp) {
+    OperationType op = req->stream_op;
+    resp->request_id = req->request_id;
+    resp->result = 0;
+    resp->error[0] = '\0';
+    resp->batch_len = 0;
+
+    if (rpc_deadline_expired(req)) {
+        strcpy(resp->error, RPC_ERR_DEADLINE_EXCEEDED);
+    } else if (!rpc_stream_op_supported(op)) {
+        snprintf(resp->error, sizeof(resp->error), "Error: Operation %s cannot be streamed", operation_to_string(op));
+    } else if (req->stream_chunk == 0 || req->stream_chunk > RPC_STREAM_MAX_CHUNK) {
+        snprintf(resp->error, sizeof(resp->error), "Error: Stream chunk must be 1 to %d values", RPC_STREAM_MAX_CHUNK);
+    }
+    if (resp->error[0] != '\0') {
+        return send_reply(sock, resp, 0, RPC_VEC_RAW); // Refused, but the connection is still in sync
+    }
+
+    size_t chunk = req->stream_chunk;
+    int two_arrays = rpc_stream_op_two_arrays(op);
+    int codec = req->vec_codec == RPC_VEC_XOR ? RPC_VEC_XOR : RPC_VEC_RAW;
+    // Compressed frames are decoded from, and results encoded into, one buffer
+    size_t packed_cap = sizeof(StreamPackedHeader) + 2 * float_codec_bound(chunk);
+    double* x = malloc(chunk * sizeof(double));
+    double* y = two_arrays ? malloc(chunk * sizeof(double)) : NULL;
+    double* out = malloc(chunk * sizeof(double));
+    unsigned char* packed = codec == RPC_VEC_XOR ? malloc(packed_cap) : NULL;
+    if (!x || !out || (two_arrays && !y) || (codec == RPC_VEC_XOR && !packed)) {
+        free(x);
+        free(y);
+        free(out);
+        free(packed);
+        snprintf(resp->error, sizeof(resp->error), "Server error: Out of memory for stream buffers");
+        return send_reply(sock, resp, 0, RPC_VEC_RAW);
+    }
+    if (send_reply(sock, resp, RPC_STREAM_CREDITS, codec) != 0) {
+        free(x);
+        free(y);
+        free(out);
+        free(packed);
+        return -1;
+    }
+
+    // Once frames have been exchanged, any error leaves unread frames in
+    // flight, so the connection is closed after the ERROR frame.
+    StreamTotal total = { 0, 0, 0, 0, 0 };
+    char err[256];
+    int rc = -1;
+    while (1) {
+        StreamFrameHeader header;
+        if (recv_all(sock, &header, sizeof(header)) != 0) break;
+
+        if (header.type == STREAM_END) {
+            double final_value;
+            if (rpc_is_vector_op(op) && total.count == 0 && op != OP_SUM && op != OP_DOT) {
+                snprintf(err, sizeof(err), "Error: %s of an empty stream", operation_to_string(op));
+                send_error(sock, err);
+                break;
+            }
+            switch (op) {
+                case OP_MIN:  final_value = total.min; break;
+                case OP_MAX:  final_value = total.max; break;
+                case OP_MEAN: final_value = (total.sum + total.comp) / (double)total.count; break;
+                case OP_SUM:
+                case OP_DOT:  final_value = total.sum + total.comp; break;
+                default:      final_value = (double)total.count; break;
+            }
+            rc = send_frame(sock, STREAM_DONE, 1, &final_value, sizeof(final_value));
+            break;
+        }
+        size_t n = header.count;
+        if (header.type == STREAM_DATA_XOR && packed && n > sizeof(StreamPackedHeader) && n <= packed_cap) {
+            int values = recv_packed(sock, n, packed, chunk, x, two_arrays ? y : NULL, err, sizeof(err));
+            if (values < 0) {
+                send_error(sock, err);
+                break;
+            }
+            n = (size_t)values;
+        } else if (header.type == STREAM_DATA && n > 0 && n <= chunk) {
+            if (recv_all(sock, x, n * sizeof(double)) != 0) break;
+            if (two_arrays && recv_all(sock, y, n * sizeof(double)) != 0) break;
+        } else {
+            send_error(sock, "Error: Unexpected stream frame");
+            break;
+        }
+
+        int results = compute_chunk(op, x, y, n, out, &total, err, sizeof(err));
+        if (results < 0) {
+            send_error(sock, err);
+            break;
+        }
+        // Reduction chunks return a single value, which compression would only enlarge
+        if (packed && results > 1) {
+            if (send_packed(sock, out, (size_t)results, packed) != 0) break;
+        } else if (send_frame(sock, STREAM_RESULT, (uint32_t)results, out, results * sizeof(double)) != 0) {
+            break;
+        }
+    }
+
+    free(x);
+    free(y);
+    free(out);
+    free(packed);
+    if (rc != 0) {
+        // Let the ERROR frame reach the client before the close: closing with
+        // its remaining frames unread would reset the connection instead
+        char discard[4096];
+        shutdown(sock, SHUT_WR);
+        while (1) {
+            ssize_t n = recv(sock, discard, sizeof(discard), 0);
+            if (n < 0 && errno == EAGAIN && coro_wait_fd(sock, POLLIN) == 0) continue;
+            if (n <= 0) break;
+        }
+    }
+    return rc;
+}
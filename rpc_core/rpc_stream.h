@@ -0,0 +1,71 @@
+#ifndef RPC_STREAM_H
+#define RPC_STREAM_H
+
+#include "rpc_protocol.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming calls over TCP, for operand arrays too large for one message.
+//
+// The call starts as a normal text request with operation OP_STREAM:
+//   OP:STM;OP1:0;OP2:0;ID:<id>;SOP:<op>;CHUNK:<values per chunk>;
+// The server accepts with a normal response plus "CR:<credits>;" (or refuses
+// with an error), and both sides then switch to binary frames on the same
+// connection. Frames are a StreamFrameHeader followed by its payload, in host
+// byte order like the batch-mode binary records.
+//
+// The client may have at most <credits> DATA frames the server has not yet
+// answered. The server answers every DATA frame with one RESULT frame, which
+// returns one credit. So neither side ever holds more than a window of chunks,
+// however long the stream is.
+//
+// A client may offer compressed frames with "ENC:XOR;" in the request. A
+// server that agrees adds "ENC:XOR;" to its accept reply; from then on the
+// client sends DATA_XOR instead of DATA frames and the server answers
+// element-wise chunks with RESULT_XOR frames. Either side that does not know
+// the field ignores it, and the stream runs uncompressed.
+
+#define RPC_STREAM_MAX_CHUNK 65536 // Values per DATA frame the server accepts
+#define RPC_STREAM_CREDITS 4       // DATA frames the client may have outstanding
+
+// Error returned by servers that cannot stream (UDP and event-loop models);
+// the client can try another server
+#define RPC_ERR_STREAM_UNSUPPORTED "STREAM_UNSUPPORTED"
+
+typedef enum {
+    STREAM_DATA = 1, // Client -> server: count values of x, then count of y for two-array ops
+    STREAM_END,      // Client -> server: no more data, count is 0
+    STREAM_RESULT,   // Server -> client: results for one DATA frame, returns one credit
+    STREAM_DONE,     // Server -> client: final value (reduction result, or element count), count is 1
+    STREAM_ERROR,    // Server -> client: count bytes of error text; the stream is over
+    STREAM_DATA_XOR,  // DATA compressed by float_codec.h: count bytes, a StreamPackedHeader then x then y
+    STREAM_RESULT_XOR // RESULT compressed the same way
+} StreamFrameType;
+
+typedef struct {
+    uint32_t type;  // StreamFrameType
+    uint32_t count; // Number of values (or bytes, for STREAM_ERROR and the _XOR frames) in each payload array
+} StreamFrameHeader;
+
+// Start of the payload of a compressed frame; y, if any, fills the rest
+typedef struct {
+    uint32_t values;  // Values in each array
+    uint32_t x_bytes; // Encoded size of x
+} StreamPackedHeader;
+
+// Operations a stream can carry: element-wise ADD/SUB/MUL/DIV over pairs
+// x[i], y[i], whose RESULT frames hold one value per pair; and the reductions
+// SUM/AVG/MIN/MAX over x or DOT over x and y, whose RESULT frames hold the
+// reduction of that chunk alone while DONE carries the reduction of everything.
+int rpc_stream_op_supported(OperationType op);
+
+// Returns 1 if op reads a second array y
+int rpc_stream_op_two_arrays(OperationType op);
+
+// Server side: answers an OP_STREAM request received on a blocking TCP socket
+// and runs the stream to completion. resp provides server_type; the function
+// sends the accept or refusal reply itself. Returns 0 if the connection can be
+// used for further requests, -1 if it should be closed.
+int rpc_stream_serve(int sock, const RpcRequest* req, RpcResponse* resp);
+
+#endif // RPC_STREAM_H
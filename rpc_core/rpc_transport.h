@@ -0,0 +1,44 @@
+#ifndef RPC_TRANSPORT_H
+#define RPC_TRANSPORT_H
+
+#include "rpc_protocol.h"
+#include <stddef.h>
+
+// Low-level building blocks shared by the client stubs and the hedging policy.
+// They split one RPC into "send" and "receive" halves so callers can keep
+// several requests outstanding and poll() for whichever answers first.
+
+#define TIMEOUT_SECONDS 5
+
+// Creates a socket to the server and sends the marshalled request on it.
+// UDP sockets are connect()ed too, so only the server's replies are delivered
+// and an ICMP port-unreachable surfaces as ECONNREFUSED on the next receive.
+// A server_ip starting with '/' is the path of a Unix socket (see unix_socket.h).
+// protocol may be RPC_PROTO_AUTO (client_stubs.h).
+// Returns the socket, or -1 with err filled in.
+int rpc_transport_send(const char* request_buffer, const char* server_ip, int server_port, int protocol,
+                       char* err, size_t err_len);
+
+// The protocol a request of request_len bytes travels over: protocol itself,
+// or for RPC_PROTO_AUTO, UDP or TCP by size
+int rpc_transport_pick(int protocol, const char* server_ip, size_t request_len);
+
+#define RPC_RECV_STALE -2 // A reply arrived but carries another request's ID
+
+// Receives and unmarshals the response on a socket from rpc_transport_send().
+// Blocks for at most TIMEOUT_SECONDS. A reply whose ID differs from a non-zero
+// expected_id is rejected with RPC_RECV_STALE so the caller can keep waiting;
+// replies with ID 0 come from servers that do not echo IDs and are accepted.
+// Returns 0 on success, -1 with err filled in. Does not close the socket.
+int rpc_transport_recv(int sock, int protocol, unsigned int expected_id, RpcResponse* resp, char* err, size_t err_len);
+
+// Returns a fresh, non-zero request ID, unique within the process.
+unsigned int rpc_next_request_id(void);
+
+// Encoding set by rpc_set_vector_codec()
+int rpc_vector_codec(void);
+
+// Class set by rpc_set_priority()
+int rpc_priority(void);
+
+#endif // RPC_TRANSPORT_H
@@ -0,0 +1,28 @@
+#include "server_main.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PORT_MAX 65535
+
+int rpc_server_port(int argc, char* argv[], int default_port) {
+    size_t flag_len = strlen(RPC_PORT_FLAG);
+    for (int i = 1; i < argc; i++) {
+        const char* value = NULL;
+        if (strcmp(argv[i], RPC_PORT_FLAG) == 0 && i + 1 < argc) {
+            value = argv[i + 1];
+        } else if (strncmp(argv[i], RPC_PORT_FLAG, flag_len) == 0 && argv[i][flag_len] == '=') {
+            value = argv[i] + flag_len + 1;
+        } else {
+            continue;
+        }
+        char* end;
+        long port = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || port < 1 || port > PORT_MAX) {
+            fprintf(stderr, "Invalid port '%s'\n", value);
+            exit(EXIT_FAILURE);
+        }
+        return (int)port;
+    }
+    return default_port;
+}
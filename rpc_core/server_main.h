@@ -0,0 +1,32 @@
+#ifndef SERVER_MAIN_H
+#define SERVER_MAIN_H
+
+// Every server model can run from its own directory's server binary or from
+// rpc_server, which links them all with the same flags and the same
+// rpc_core objects (rpc_server.c). Built into rpc_server, a server.c is
+// compiled with -DRPC_SERVER_BUNDLE and leaves out its main().
+//
+// Both accept the same options:
+// --port N      Listen on N instead of the model's own port. The Unix socket,
+//               shared-memory segment and hot-restart socket follow it.
+// --hot-restart Take over from the server running on that port (hot_restart.h).
+
+#define RPC_PORT_FLAG "--port"
+
+// The port from --port N or --port=N, or default_port without one. Exits
+// with a message if the value is not a valid port.
+int rpc_server_port(int argc, char* argv[], int default_port);
+
+// Entry points of the server models
+int iterative_tcp_main(int argc, char* argv[]);
+int concurrent_tcp_threads_main(int argc, char* argv[]);
+int concurrent_tcp_processes_main(int argc, char* argv[]);
+int concurrent_tcp_async_main(int argc, char* argv[]);
+int concurrent_tcp_coroutines_main(int argc, char* argv[]);
+int concurrent_dual_async_main(int argc, char* argv[]);
+int iterative_udp_main(int argc, char* argv[]);
+int concurrent_udp_threads_main(int argc, char* argv[]);
+int concurrent_udp_processes_main(int argc, char* argv[]);
+int concurrent_udp_async_main(int argc, char* argv[]);
+
+#endif // SERVER_MAIN_H
@@ -0,0 +1,473 @@
+#include "shm_transport.h"
+#include "rpc_dispatch.h"
+#include "rpc_transport.h" // For TIMEOUT_SECONDS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h> // For kill(pid, 0)
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHM_MAGIC 0x52504353u // "RPCS"
+#define SHM_SLOT_FREE 0
+#define SHM_SLOT_CLAIMED 1
+#define SHM_WAIT_SLICE_MS 100 // How often a sleeping client checks that the server still exists
+#define SHM_MAX_SEGMENTS 16   // Servers one client process keeps mapped
+
+// Byte ring with one producer and one consumer. Positions count bytes since
+// creation and wrap at 2^32, which the power-of-two capacities divide evenly.
+// Each record is a 4-byte length and the message, padded to 4 bytes, so a
+// length never straddles the end of the ring.
+typedef struct {
+    uint32_t tail __attribute__((aligned(64))); // Written by the producer
+    uint32_t head __attribute__((aligned(64))); // Written by the consumer
+} ShmRing;
+
+// Sleep/wake pair for one waiter: the producer bumps seq after every push and
+// issues FUTEX_WAKE only if the waiter announced itself in sleeping.
+typedef struct {
+    uint32_t seq __attribute__((aligned(64)));
+    uint32_t sleeping;
+} ShmWaitWord;
+
+typedef struct {
+    uint32_t state;    // SHM_SLOT_FREE or SHM_SLOT_CLAIMED
+    int32_t owner_pid; // Lets a client reclaim slots of processes that died mid-call
+    ShmWaitWord reply; // The client waits here for the server's reply
+    ShmRing req;
+    ShmRing resp;
+    char req_data[SHM_REQ_RING_BYTES];
+    char resp_data[SHM_RESP_RING_BYTES];
+} ShmSlot;
+
+typedef struct {
+    uint32_t magic; // Written last, once the rest is initialized
+    int32_t server_pid;
+    uint32_t service_threads;
+    ShmWaitWord doorbell[SHM_MAX_SERVICE_THREADS]; // Service thread t waits on doorbell[t]
+    ShmSlot slots[SHM_MAX_CLIENTS];
+} ShmSegment;
+
+static long busy_poll_us = -1; // -1 until read from the environment
+
+void shm_transport_set_busy_poll(long us) {
+    __atomic_store_n(&busy_poll_us, us < 0 ? 0 : us, __ATOMIC_RELAXED);
+}
+
+static long busy_poll(void) {
+    long us = __atomic_load_n(&busy_poll_us, __ATOMIC_RELAXED);
+    if (us < 0) {
+        const char* env = getenv(SHM_BUSY_POLL_ENV);
+        us = env ? atol(env) : 0;
+        shm_transport_set_busy_poll(us);
+        us = __atomic_load_n(&busy_poll_us, __ATOMIC_RELAXED);
+    }
+    return us;
+}
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+static void segment_name(int port, char* name, size_t len) {
+    snprintf(name, len, "/rpc_shm_%d", port);
+}
+
+// Not FUTEX_PRIVATE: the word is shared with another process
+static void futex_wait(uint32_t* word, uint32_t expected, long timeout_ms) {
+    struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+    syscall(SYS_futex, word, FUTEX_WAIT, expected, timeout_ms >= 0 ? &ts : NULL, NULL, 0);
+}
+
+static void wake(ShmWaitWord* w) {
+    __atomic_add_fetch(&w->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &w->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+// Sleeps until w->seq moves past seen (or the timeout), unless it already has
+static void sleep_on(ShmWaitWord* w, uint32_t seen, long timeout_ms) {
+    __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+    futex_wait(&w->seq, seen, timeout_ms); // Returns at once if seq != seen
+    __atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void ring_copy_in(char* data, uint32_t cap, uint32_t pos, const void* src, uint32_t len) {
+    uint32_t off = pos & (cap - 1);
+    uint32_t first = len < cap - off ? len : cap - off;
+    memcpy(data + off, src, first);
+    memcpy(data, (const char*)src + first, len - first);
+}
+
+static void ring_copy_out(const char* data, uint32_t cap, uint32_t pos, void* dst, uint32_t len) {
+    uint32_t off = pos & (cap - 1);
+    uint32_t first = len < cap - off ? len : cap - off;
+    memcpy(dst, data + off, first);
+    memcpy((char*)dst + first, data, len - first);
+}
+
+// Returns 0, or -1 if the ring lacks room for the message
+static int ring_push(ShmRing* r, char* data, uint32_t cap, const char* msg, uint32_t len) {
+    uint32_t tail = r->tail; // Only this side writes it
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint32_t need = 4 + ((len + 3) & ~3u);
+    if (need > cap - (tail - head)) return -1;
+    ring_copy_in(data, cap, tail, &len, 4);
+    ring_copy_in(data, cap, tail + 4, msg, len);
+    __atomic_store_n(&r->tail, tail + need, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Copies the next message into buf (capacity cap_out, null-terminated) and
+// returns its length, or -1 if the ring is empty. Oversized messages are
+// truncated, which makes them fail to unmarshal.
+static long ring_pop(ShmRing* r, const char* data, uint32_t cap, char* buf, size_t cap_out) {
+    uint32_t head = r->head;
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) return -1;
+    uint32_t len;
+    ring_copy_out(data, cap, head, &len, 4);
+    uint32_t copy = len < cap_out - 1 ? len : (uint32_t)(cap_out - 1);
+    ring_copy_out(data, cap, head + 4, buf, copy);
+    buf[copy] = '\0';
+    __atomic_store_n(&r->head, head + 4 + ((len + 3) & ~3u), __ATOMIC_RELEASE);
+    return copy;
+}
+
+// ===== Server side =====
+
+typedef struct {
+    ShmSegment* seg;
+    int thread_index;
+    char server_type[128];
+} ShmServiceArg;
+
+// Answers every request waiting in the slots owned by this thread. Returns the number answered.
+static int serve_pending(ShmServiceArg* a, char* request_buf) {
+    ShmSegment* seg = a->seg;
+    int served = 0;
+    for (int i = a->thread_index; i < SHM_MAX_CLIENTS; i += (int)seg->service_threads) {
+        ShmSlot* slot = &seg->slots[i];
+        while (ring_pop(&slot->req, slot->req_data, SHM_REQ_RING_BYTES, request_buf, SHM_MAX_REQUEST_SIZE + 1) >= 0) {
+            RpcRequest req;
+            RpcResponse resp;
+            char response_buf[RPC_BUFFER_SIZE];
+            strcpy(resp.server_type, a->server_type);
+            if (unmarshal_request(request_buf, &req) != 0 || req.operation == OP_EXIT || req.operation == OP_STREAM) {
+                resp.result = 0;
+                resp.request_id = 0;
+                strcpy(resp.error, "Server error: Bad request format");
+            } else {
+                dispatch_request(&req, &resp);
+            }
+            served++;
+            // A full reply ring means its client stopped reading; it has timed out already
+            if (marshal_response(&resp, response_buf, sizeof(response_buf)) == 0 &&
+                ring_push(&slot->resp, slot->resp_data, SHM_RESP_RING_BYTES, response_buf, (uint32_t)strlen(response_buf)) == 0) {
+                wake(&slot->reply);
+            }
+        }
+    }
+    return served;
+}
+
+static void* service_thread(void* arg) {
+    ShmServiceArg* a = (ShmServiceArg*)arg;
+    ShmWaitWord* bell = &a->seg->doorbell[a->thread_index];
+    char* request_buf = malloc(SHM_MAX_REQUEST_SIZE + 1);
+    if (!request_buf) {
+        perror("Failed to allocate shared-memory request buffer");
+        return NULL;
+    }
+
+    while (1) {
+        // Read the doorbell before scanning: a request pushed after the scan
+        // has also rung it, so the wait below returns at once
+        uint32_t seen = __atomic_load_n(&bell->seq, __ATOMIC_SEQ_CST);
+        if (serve_pending(a, request_buf) > 0) continue;
+
+        long spin_us = busy_poll();
+        if (spin_us > 0) {
+            long long until = now_us() + spin_us;
+            while (__atomic_load_n(&bell->seq, __ATOMIC_ACQUIRE) == seen && now_us() < until) cpu_relax();
+            if (__atomic_load_n(&bell->seq, __ATOMIC_ACQUIRE) != seen) continue;
+        }
+        sleep_on(bell, seen, -1);
+    }
+    return NULL;
+}
+
+static ShmSegment* served_segment; // The segment this process serves, for shm_server_retire
+
+int shm_server_start(int port, int threads, const char* server_type) {
+    char name[64];
+    segment_name(port, name, sizeof(name));
+    if (threads < 1) threads = 1;
+    if (threads > SHM_MAX_SERVICE_THREADS) threads = SHM_MAX_SERVICE_THREADS;
+
+    // A segment left by an earlier run is replaced; its clients notice its server is gone
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, sizeof(ShmSegment)) != 0) {
+        int saved = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = saved;
+        return -1;
+    }
+    ShmSegment* seg = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        shm_unlink(name);
+        return -1;
+    }
+
+    // ftruncate zero-filled the segment: every slot is free and every ring empty
+    seg->server_pid = (int32_t)getpid();
+    seg->service_threads = (uint32_t)threads;
+    __atomic_store_n(&seg->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    served_segment = seg;
+
+    for (int t = 0; t < threads; t++) {
+        ShmServiceArg* a = malloc(sizeof(ShmServiceArg));
+        pthread_t tid;
+        if (!a) return -1;
+        a->seg = seg;
+        a->thread_index = t;
+        snprintf(a->server_type, sizeof(a->server_type), "%s", server_type);
+        if (pthread_create(&tid, NULL, service_thread, a) != 0) {
+            free(a);
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+void shm_server_retire(void) {
+    ShmSegment* seg = served_segment;
+    if (!seg) return;
+    __atomic_store_n(&seg->magic, 0, __ATOMIC_RELAXED);
+    // Pairs with the fence in shm_transport_call: a client that claimed a slot
+    // before this point is waited for, any later one sees the segment retired
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    long long deadline = now_us() + (long long)TIMEOUT_SECONDS * 1000000;
+    for (int i = 0; i < SHM_MAX_CLIENTS && now_us() < deadline; i++) {
+        ShmSlot* slot = &seg->slots[i];
+        while (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == SHM_SLOT_CLAIMED && now_us() < deadline) {
+            int32_t owner = __atomic_load_n(&slot->owner_pid, __ATOMIC_RELAXED);
+            if (owner != 0 && kill(owner, 0) != 0 && errno == ESRCH) break; // Died mid-call
+            struct timespec pause = { 0, 1000000 };
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+// ===== Client side =====
+// Segments stay mapped for the life of the process. One whose server has
+// exited is marked stale and replaced by a fresh mapping on the next call,
+// once no call is still using it.
+
+typedef struct {
+    int port;
+    ShmSegment* seg;
+    int users; // Calls currently using seg
+    int stale;
+} MappedSegment;
+
+static MappedSegment mapped[SHM_MAX_SEGMENTS];
+static pthread_mutex_t mapped_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int server_alive(const ShmSegment* seg) {
+    return kill(seg->server_pid, 0) == 0 || errno == EPERM;
+}
+
+static ShmSegment* map_segment(int port, char* err, size_t err_len) {
+    char name[64];
+    segment_name(port, name, sizeof(name));
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        snprintf(err, err_len, "SHM Connect failed to %s: %s", name, strerror(errno));
+        return NULL;
+    }
+    ShmSegment* seg = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        snprintf(err, err_len, "SHM mmap of %s failed: %s", name, strerror(errno));
+        return NULL;
+    }
+    if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || !server_alive(seg)) {
+        snprintf(err, err_len, "SHM Connect failed to %s: Server not running", name);
+        munmap(seg, sizeof(ShmSegment));
+        return NULL;
+    }
+    return seg;
+}
+
+static MappedSegment* acquire_segment(int port, char* err, size_t err_len) {
+    MappedSegment* found = NULL;
+    MappedSegment* unused = NULL;
+    pthread_mutex_lock(&mapped_lock);
+    for (int i = 0; i < SHM_MAX_SEGMENTS; i++) {
+        MappedSegment* m = &mapped[i];
+        if (m->seg && __atomic_load_n(&m->seg->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+            m->stale = 1; // Retired by a server handing over to its successor
+        }
+        if (m->seg && m->stale && m->users == 0) {
+            munmap(m->seg, sizeof(ShmSegment));
+            m->seg = NULL;
+        }
+        if (m->seg && !m->stale && m->port == port) found = m;
+        if (!m->seg && !unused) unused = m;
+    }
+    if (!found && unused) {
+        unused->seg = map_segment(port, err, err_len);
+        if (unused->seg) {
+            unused->port = port;
+            unused->stale = 0;
+            found = unused;
+        }
+    } else if (!found) {
+        snprintf(err, err_len, "SHM Connect failed: More than %d shared-memory servers in use", SHM_MAX_SEGMENTS);
+    }
+    if (found) found->users++;
+    pthread_mutex_unlock(&mapped_lock);
+    return found;
+}
+
+static void release_segment(MappedSegment* m, int stale) {
+    pthread_mutex_lock(&mapped_lock);
+    m->users--;
+    if (stale) m->stale = 1;
+    pthread_mutex_unlock(&mapped_lock);
+}
+
+// Claims a free slot, starting at a per-thread offset to keep threads apart.
+// Slots held by processes that no longer exist are taken over.
+static ShmSlot* claim_slot(ShmSegment* seg) {
+    unsigned int start = (unsigned int)((uintptr_t)pthread_self() >> 6) ^ (unsigned int)getpid();
+    int32_t self = (int32_t)getpid();
+    for (int pass = 0; pass < 2; pass++) {
+        for (int k = 0; k < SHM_MAX_CLIENTS; k++) {
+            ShmSlot* slot = &seg->slots[(start + k) % SHM_MAX_CLIENTS];
+            uint32_t expected = SHM_SLOT_FREE;
+            if (pass == 1) {
+                int32_t owner = __atomic_load_n(&slot->owner_pid, __ATOMIC_RELAXED);
+                if (owner == self || kill(owner, 0) == 0 || errno != ESRCH) continue;
+                expected = SHM_SLOT_CLAIMED;
+            }
+            if (__atomic_compare_exchange_n(&slot->state, &expected, SHM_SLOT_CLAIMED, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&slot->owner_pid, self, __ATOMIC_RELAXED);
+                return slot;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void release_slot(ShmSlot* slot) {
+    __atomic_store_n(&slot->state, SHM_SLOT_FREE, __ATOMIC_RELEASE);
+}
+
+// Waits for the reply to expected_id on a claimed slot. Returns 0, or -1 with
+// err filled in and *server_gone set if the server exited.
+static int await_reply(ShmSegment* seg, ShmSlot* slot, unsigned int expected_id, RpcResponse* resp,
+                       int* server_gone, char* err, size_t err_len) {
+    char response_buf[RPC_BUFFER_SIZE];
+    long long start = now_us();
+    long long deadline = start + (long long)TIMEOUT_SECONDS * 1000000;
+    long long spin_until = start + busy_poll();
+
+    while (1) {
+        uint32_t seen = __atomic_load_n(&slot->reply.seq, __ATOMIC_SEQ_CST);
+        while (ring_pop(&slot->resp, slot->resp_data, SHM_RESP_RING_BYTES, response_buf, sizeof(response_buf)) >= 0) {
+            if (unmarshal_response(response_buf, resp) != 0) {
+                snprintf(err, err_len, "Failed to unmarshal response");
+                return -1;
+            }
+            // Anything else is the late reply to a call that timed out on this slot
+            if (resp->request_id == 0 || resp->request_id == expected_id) return 0;
+        }
+
+        long long now = now_us();
+        if (now < spin_until) {
+            cpu_relax();
+            continue;
+        }
+        if (now >= deadline) {
+            snprintf(err, err_len, "SHM request %u timed out", expected_id);
+            return -1;
+        }
+        long slice_ms = (long)((deadline - now + 999) / 1000);
+        if (slice_ms > SHM_WAIT_SLICE_MS) slice_ms = SHM_WAIT_SLICE_MS;
+        sleep_on(&slot->reply, seen, slice_ms);
+        if (__atomic_load_n(&slot->reply.seq, __ATOMIC_ACQUIRE) == seen && !server_alive(seg)) {
+            *server_gone = 1;
+            snprintf(err, err_len, "SHM Recv failed: Server exited");
+            return -1;
+        }
+    }
+}
+
+int shm_transport_call(int port, const char* request, unsigned int expected_id, RpcResponse* resp,
+                       char* err, size_t err_len) {
+    size_t len = strlen(request);
+    if (len > SHM_MAX_REQUEST_SIZE) {
+        snprintf(err, err_len, "Request of %zu bytes is too large for shared memory, use TCP", len);
+        return -1;
+    }
+    MappedSegment* m = acquire_segment(port, err, err_len);
+    if (!m) return -1;
+    ShmSegment* seg = m->seg;
+
+    ShmSlot* slot = claim_slot(seg);
+    if (!slot) {
+        snprintf(err, err_len, "SHM Send failed: All %d slots busy", SHM_MAX_CLIENTS);
+        release_segment(m, 0);
+        return -1;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&seg->magic, __ATOMIC_RELAXED) != SHM_MAGIC) {
+        // Retired since it was mapped: the restarted server has a new segment
+        release_slot(slot);
+        release_segment(m, 1);
+        return shm_transport_call(port, request, expected_id, resp, err, err_len);
+    }
+
+    int server_gone = 0;
+    int rc = -1;
+    if (ring_push(&slot->req, slot->req_data, SHM_REQ_RING_BYTES, request, (uint32_t)len) != 0) {
+        // Requests of earlier callers are still unread
+        server_gone = !server_alive(seg);
+        snprintf(err, err_len, "SHM Send failed: %s", server_gone ? "Server exited" : "Request ring full");
+    } else {
+        int owner = (int)((slot - seg->slots) % seg->service_threads);
+        wake(&seg->doorbell[owner]);
+        rc = await_reply(seg, slot, expected_id, resp, &server_gone, err, err_len);
+    }
+
+    release_slot(slot);
+    release_segment(m, server_gone);
+    return rc;
+}
@@ -0,0 +1,53 @@
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include "rpc_protocol.h"
+#include <stddef.h>
+
+// Shared-memory transport for clients on the same host as the server.
+//
+// A server listening on port P also creates the POSIX shared-memory object
+// "/rpc_shm_<P>" (under /dev/shm). It holds SHM_MAX_CLIENTS slots; a client
+// call claims a free slot and owns it until the reply is in. Each slot has two
+// single-producer/single-consumer byte rings carrying the usual text messages:
+// requests from the client, replies from the server. Nothing crosses the
+// kernel on the data path; futexes in the segment only wake a side that has
+// gone to sleep, and with busy-polling enabled a waiting side spins briefly
+// first, so a call between two awake processes needs no system call at all.
+//
+// The server answers slots with a few service threads; slot i belongs to
+// thread i % threads, so each ring keeps exactly one consumer.
+
+// Protocol value selecting this transport in the client stubs, next to
+// IPPROTO_TCP and IPPROTO_UDP. The server IP is ignored; the port names the segment.
+#define RPC_PROTO_SHM 1000
+
+#define SHM_MAX_CLIENTS 32          // Slots, i.e. calls in flight at once, per server
+#define SHM_MAX_SERVICE_THREADS 16
+#define SHM_REQ_RING_BYTES (128 * 1024)
+#define SHM_RESP_RING_BYTES (16 * 1024)
+#define SHM_MAX_REQUEST_SIZE (SHM_REQ_RING_BYTES / 2) // Largest request the client will send
+
+// Microseconds a waiting side spins before sleeping on its futex (default 0).
+// Both clients and servers start from the RPC_SHM_BUSY_POLL_US environment variable.
+#define SHM_BUSY_POLL_ENV "RPC_SHM_BUSY_POLL_US"
+void shm_transport_set_busy_poll(long us);
+
+// Server side: creates the segment for port and starts `threads` service
+// threads answering its requests with dispatch_request(). Call after
+// dispatch_init(). Returns 0, or -1 with errno set; the server's sockets work
+// either way.
+int shm_server_start(int port, int threads, const char* server_type);
+
+// Server side, on hot restart (hot_restart.h): marks the segment retired so
+// clients move to the successor's segment, then waits up to TIMEOUT_SECONDS
+// for calls already in it to finish. The service threads keep answering.
+void shm_server_retire(void);
+
+// Client side: sends the marshalled request to the server on port and waits
+// up to TIMEOUT_SECONDS for the reply to expected_id, discarding stale replies
+// left in the slot by an earlier caller. Returns 0, or -1 with err filled in.
+int shm_transport_call(int port, const char* request, unsigned int expected_id, RpcResponse* resp,
+                       char* err, size_t err_len);
+
+#endif // SHM_TRANSPORT_H
@@ -0,0 +1,76 @@
+#include "socket_profile.h"
+#include "rpc_protocol.h" // For RPC_MAX_MESSAGE_SIZE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // For TCP_NODELAY, TCP_FASTOPEN, TCP_FASTOPEN_CONNECT
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30 // Linux 4.11; older C libraries lack the name
+#endif
+
+static int profile = -1; // -1 until read from the environment or set
+
+static long env_value(const char* name, long fallback) {
+    const char* env = getenv(name);
+    return env && env[0] != '\0' ? atol(env) : fallback;
+}
+
+int rpc_socket_profile(void) {
+    int current = __atomic_load_n(&profile, __ATOMIC_RELAXED);
+    if (current < 0) {
+        const char* env = getenv(RPC_SOCKET_PROFILE_ENV);
+        current = env && strcmp(env, "latency") == 0 ? SOCKET_PROFILE_LATENCY : SOCKET_PROFILE_DEFAULT;
+        int unset = -1;
+        __atomic_compare_exchange_n(&profile, &unset, current, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        current = __atomic_load_n(&profile, __ATOMIC_RELAXED);
+    }
+    return current;
+}
+
+void rpc_set_socket_profile(int profile_id) {
+    int value = profile_id == SOCKET_PROFILE_LATENCY ? SOCKET_PROFILE_LATENCY : SOCKET_PROFILE_DEFAULT;
+    __atomic_store_n(&profile, value, __ATOMIC_RELAXED);
+}
+
+// Sets one int option, keeping the first failure's errno in *first_errno
+static void set_option(int fd, int level, int name, int value, int* first_errno) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) != 0 && *first_errno == 0) *first_errno = errno;
+}
+
+// Options the latency profile sets on every socket, listening or connecting
+static void tune_common(int fd, int type, int* first_errno) {
+    if (type == SOCK_STREAM) set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, first_errno);
+
+    int buffer = (int)env_value(RPC_SOCKET_BUFFER_ENV, RPC_MAX_MESSAGE_SIZE);
+    if (buffer > 0) {
+        set_option(fd, SOL_SOCKET, SO_RCVBUF, buffer, first_errno);
+        set_option(fd, SOL_SOCKET, SO_SNDBUF, buffer, first_errno);
+    }
+
+    int busy_poll_us = (int)env_value(RPC_SOCKET_BUSY_POLL_ENV, 0);
+    if (busy_poll_us > 0) set_option(fd, SOL_SOCKET, SO_BUSY_POLL, busy_poll_us, first_errno);
+}
+
+int rpc_tune_server_socket(int fd, int type) {
+    if (rpc_socket_profile() != SOCKET_PROFILE_LATENCY) return 0;
+    int first_errno = 0;
+    tune_common(fd, type, &first_errno);
+    if (type == SOCK_STREAM) set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, SOCKET_PROFILE_FASTOPEN_QUEUE, &first_errno);
+    if (first_errno == 0) return 0;
+    errno = first_errno;
+    return -1;
+}
+
+int rpc_tune_client_socket(int fd, int type) {
+    if (rpc_socket_profile() != SOCKET_PROFILE_LATENCY) return 0;
+    int first_errno = 0;
+    tune_common(fd, type, &first_errno);
+    // connect() returns at once; the SYN leaves with the first send() and carries its data
+    if (type == SOCK_STREAM) set_option(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, &first_errno);
+    if (first_errno == 0) return 0;
+    errno = first_errno;
+    return -1;
+}
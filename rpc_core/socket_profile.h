@@ -0,0 +1,55 @@
+#ifndef SOCKET_PROFILE_H
+#define SOCKET_PROFILE_H
+
+// Socket options for the IPv4 sockets of the servers and the client stubs.
+// RPC_SOCKET_PROFILE in the environment selects them, for servers and
+// clients alike:
+// - "default" (or unset) leaves every socket as the kernel creates it.
+// - "latency" trades a little memory and CPU for fewer round trips and stalls:
+//   - TCP Fast Open. Servers accept data in the SYN, and clients send the
+//     request in their SYN. Once a client holds the server's cookie, a
+//     connection costs no extra round trip. This needs net.ipv4.tcp_fastopen
+//     to include 1 on clients and 2 on servers; otherwise the kernel falls
+//     back to a normal handshake.
+//   - TCP_NODELAY, so a request or reply written in pieces is not held back
+//     by Nagle's algorithm waiting for an ACK.
+//   - SO_RCVBUF and SO_SNDBUF of RPC_SOCKET_BUFFER_BYTES, by default
+//     RPC_MAX_MESSAGE_SIZE. The largest request then fits in flight at once,
+//     and bursts of datagrams are not dropped. The kernel caps the size at
+//     net.core.rmem_max and wmem_max. 0 keeps the kernel's autotuning.
+//   - SO_BUSY_POLL of RPC_SOCKET_BUSY_POLL_US microseconds if set: a blocking
+//     receive spins on the device queue for that long before sleeping. Only
+//     NICs with busy-poll support benefit (not loopback). Raising it above
+//     net.core.busy_read needs CAP_NET_ADMIN.
+// Unix sockets and shared memory are left alone. Sockets a server inherits
+// on a hot restart are tuned again with the new server's profile.
+
+#define RPC_SOCKET_PROFILE_ENV "RPC_SOCKET_PROFILE"
+#define RPC_SOCKET_BUFFER_ENV "RPC_SOCKET_BUFFER_BYTES"
+#define RPC_SOCKET_BUSY_POLL_ENV "RPC_SOCKET_BUSY_POLL_US"
+
+#define SOCKET_PROFILE_DEFAULT 0
+#define SOCKET_PROFILE_LATENCY 1
+
+#define SOCKET_PROFILE_FASTOPEN_QUEUE 256 // SYNs with data a listener holds before falling back to a handshake
+
+// Returns the profile in force: the one from rpc_set_socket_profile(), else
+// the environment's
+int rpc_socket_profile(void);
+
+// Overrides RPC_SOCKET_PROFILE for the rest of the process, e.g. for a client
+// that compares profiles. Affects sockets created afterwards.
+void rpc_set_socket_profile(int profile);
+
+// Server side: tunes a listening (SOCK_STREAM) or bound (SOCK_DGRAM) socket.
+// Connections accepted from a listener inherit its options. Returns 0, or -1
+// with errno set from the first option the kernel refused; the others are
+// still applied and the socket works either way.
+int rpc_tune_server_socket(int fd, int type);
+
+// Client side: tunes a socket before connect(). For SOCK_STREAM, Fast Open
+// defers the handshake to the first send(), so a refused connection shows up
+// there instead of in connect(). Returns as rpc_tune_server_socket().
+int rpc_tune_client_socket(int fd, int type);
+
+#endif // SOCKET_PROFILE_H
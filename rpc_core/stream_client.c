@@ -0,0 +1,346 @@
+#include "client_stubs.h"
+#include "rpc_stream.h"
+#include "rpc_transport.h"
+#include "float_codec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Client half of the streaming protocol described in rpc_stream.h. The socket
+// is non-blocking and driven by poll(), so results are drained while data is
+// still being written; with blocking writes, a server stuck sending results
+// to a client stuck sending data would deadlock.
+
+// Frame currently being written
+typedef struct {
+    StreamFrameHeader header;
+    struct iovec iov[3];
+    int iov_count;
+    int active;
+    unsigned char* packed; // Payload of DATA_XOR frames, NULL unless compression was agreed
+} OutFrame;
+
+// Frame currently being read
+typedef struct {
+    StreamFrameHeader header;
+    size_t header_got;
+    char* payload;
+    size_t payload_cap;
+    size_t payload_got;
+} InFrame;
+
+static void prepare_frame(OutFrame* out, StreamFrameType type, const double* x, const double* y, size_t count) {
+    out->header.type = type;
+    out->header.count = (uint32_t)count;
+    out->iov[0] = (struct iovec){ &out->header, sizeof(out->header) };
+    out->iov_count = 1;
+    out->active = 1;
+    if (count > 0 && out->packed) {
+        // Encoding happens here, once the previous frame has been written out of the buffer
+        StreamPackedHeader ph = { (uint32_t)count, 0 };
+        unsigned char* p = out->packed + sizeof(ph);
+        ph.x_bytes = (uint32_t)float_codec_encode(x, count, p);
+        p += ph.x_bytes;
+        if (y) p += float_codec_encode(y, count, p);
+        memcpy(out->packed, &ph, sizeof(ph));
+        out->header.type = STREAM_DATA_XOR;
+        out->header.count = (uint32_t)(p - out->packed);
+        out->iov[out->iov_count++] = (struct iovec){ out->packed, out->header.count };
+        return;
+    }
+    if (count > 0) {
+        out->iov[out->iov_count++] = (struct iovec){ (void*)x, count * sizeof(double) };
+        if (y) out->iov[out->iov_count++] = (struct iovec){ (void*)y, count * sizeof(double) };
+    }
+}
+
+// Writes as much of the frame as the socket takes. Returns 1 when it is all sent, 0 if not yet, -1 on error.
+static int write_frame(int sock, OutFrame* out) {
+    int first = 0;
+    while (first < out->iov_count && out->iov[first].iov_len == 0) first++;
+    if (first == out->iov_count) return 1;
+    ssize_t n = writev(sock, out->iov + first, out->iov_count - first);
+    if (n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    for (int i = first; i < out->iov_count && n > 0; i++) {
+        size_t step = (size_t)n < out->iov[i].iov_len ? (size_t)n : out->iov[i].iov_len;
+        out->iov[i].iov_base = (char*)out->iov[i].iov_base + step;
+        out->iov[i].iov_len -= step;
+        n -= (ssize_t)step;
+    }
+    return out->iov[out->iov_count - 1].iov_len == 0 ? 1 : 0;
+}
+
+// Reads what is available of the next frame. Returns 1 when a whole frame is in, 0 if not yet, -1 on error or EOF.
+static int read_frame(int sock, InFrame* in, char* err, size_t err_len) {
+    while (in->header_got < sizeof(in->header)) {
+        ssize_t n = recv(sock, (char*)&in->header + in->header_got, sizeof(in->header) - in->header_got, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+        if (n <= 0) {
+            snprintf(err, err_len, "Stream broken: %s", n == 0 ? "server closed connection" : strerror(errno));
+            return -1;
+        }
+        in->header_got += (size_t)n;
+    }
+    int bytes = in->header.type == STREAM_ERROR || in->header.type == STREAM_RESULT_XOR;
+    size_t need = bytes ? in->header.count : in->header.count * sizeof(double);
+    if (need > in->payload_cap) {
+        snprintf(err, err_len, "Stream broken: frame of %zu bytes exceeds the chunk size", need);
+        return -1;
+    }
+    while (in->payload_got < need) {
+        ssize_t n = recv(sock, in->payload + in->payload_got, need - in->payload_got, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+        if (n <= 0) {
+            snprintf(err, err_len, "Stream broken: %s", n == 0 ? "server closed connection" : strerror(errno));
+            return -1;
+        }
+        in->payload_got += (size_t)n;
+    }
+    return 1;
+}
+
+// Sends the OP_STREAM request and waits for the server's verdict.
+// Returns the socket with the granted credits and the agreed frame encoding,
+// or -1 with call_res filled in.
+static int open_stream(OperationType op, size_t chunk, const char* server_ip, int server_port,
+                       RpcCallResult* call_res, unsigned int* credits, int* codec) {
+    RpcRequest req = {0};
+    req.operation = OP_STREAM;
+    req.stream_op = op;
+    req.stream_chunk = (unsigned int)chunk;
+    req.request_id = rpc_next_request_id();
+    req.vec_codec = rpc_vector_codec();
+    char buffer[RPC_BUFFER_SIZE];
+    if (marshal_request(&req, buffer, sizeof(buffer)) != 0) {
+        strcpy(call_res->error, "Failed to marshal request");
+        return -1;
+    }
+    int sock = rpc_transport_send(buffer, server_ip, server_port, IPPROTO_TCP, call_res->error, sizeof(call_res->error));
+    if (sock < 0) return -1;
+
+    // Nothing follows the reply until we send a frame, so one read sees exactly the reply
+    ssize_t n = recv(sock, buffer, sizeof(buffer) - 1, 0);
+    RpcResponse resp;
+    if (n <= 0) {
+        snprintf(call_res->error, sizeof(call_res->error), "TCP Recv failed: %s", n == 0 ? "Server closed connection" : strerror(errno));
+        close(sock);
+        return -1;
+    }
+    buffer[n] = '\0';
+    if (unmarshal_response(buffer, &resp) != 0) {
+        strcpy(call_res->error, "Failed to unmarshal response");
+        close(sock);
+        return -1;
+    }
+    strcpy(call_res->server_type_handled, resp.server_type);
+    const char* cr = strstr(buffer, ";CR:");
+    *credits = cr ? (unsigned int)strtoul(cr + 4, NULL, 10) : 0;
+    *codec = req.vec_codec == RPC_VEC_XOR && strstr(buffer, ";ENC:XOR;") ? RPC_VEC_XOR : RPC_VEC_RAW;
+    if (resp.error[0] != '\0' || *credits == 0) {
+        snprintf(call_res->error, sizeof(call_res->error), "%s", resp.error[0] ? resp.error : "Server did not accept the stream");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+RpcCallResult rpc_stream_call(OperationType op, const double* x, const double* y, size_t n, size_t chunk,
+                              RpcStreamSink sink, void* sink_arg, const char* server_ip, int server_port) {
+    RpcCallResult call_res = {0};
+    strcpy(call_res.error, "RPC call failed");
+    int two_arrays = rpc_stream_op_two_arrays(op);
+    if (!rpc_stream_op_supported(op) || (two_arrays && n > 0 && !y)) {
+        snprintf(call_res.error, sizeof(call_res.error), "Operation %s cannot be streamed with these arrays", operation_to_string(op));
+        return call_res;
+    }
+    if (chunk == 0 || chunk > RPC_STREAM_MAX_CHUNK) chunk = RPC_STREAM_MAX_CHUNK;
+
+    unsigned int credits;
+    int codec;
+    int sock = open_stream(op, chunk, server_ip, server_port, &call_res, &credits, &codec);
+    if (sock < 0) return call_res;
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    InFrame in = {0};
+    OutFrame out = {0};
+    double* results = NULL; // Decoded RESULT_XOR frames
+    size_t packed_cap = sizeof(StreamPackedHeader) + 2 * float_codec_bound(chunk);
+    in.payload_cap = chunk * sizeof(double) > sizeof(call_res.error) ? chunk * sizeof(double) : sizeof(call_res.error);
+    if (codec == RPC_VEC_XOR) {
+        if (packed_cap > in.payload_cap) in.payload_cap = packed_cap;
+        out.packed = malloc(packed_cap);
+        results = malloc(chunk * sizeof(double));
+    }
+    in.payload = malloc(in.payload_cap);
+    size_t* offsets = malloc(credits * sizeof(size_t)); // Start of each unanswered chunk, oldest first
+    if (!in.payload || !offsets || (codec == RPC_VEC_XOR && (!out.packed || !results))) {
+        strcpy(call_res.error, "Failed to allocate stream buffers");
+        free(in.payload);
+        free(offsets);
+        free(out.packed);
+        free(results);
+        close(sock);
+        return call_res;
+    }
+
+    size_t next = 0;         // First element not yet put in a DATA frame
+    unsigned int head = 0, outstanding = 0;
+    int end_sent = 0, done = 0;
+
+    while (!done) {
+        if (!out.active && !end_sent) {
+            if (next < n && outstanding < credits) {
+                size_t count = n - next < chunk ? n - next : chunk;
+                prepare_frame(&out, STREAM_DATA, x + next, two_arrays ? y + next : NULL, count);
+                offsets[(head + outstanding++) % credits] = next;
+                next += count;
+            } else if (next >= n) {
+                prepare_frame(&out, STREAM_END, NULL, NULL, 0);
+            }
+        }
+
+        struct pollfd pfd = { sock, POLLIN | (out.active ? POLLOUT : 0), 0 };
+        int ready = poll(&pfd, 1, TIMEOUT_SECONDS * 1000);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) {
+            snprintf(call_res.error, sizeof(call_res.error), "Stream stalled: no progress for %d s", TIMEOUT_SECONDS);
+            break;
+        }
+
+        if (out.active && (pfd.revents & POLLOUT)) {
+            int rc = write_frame(sock, &out);
+            if (rc < 0) {
+                snprintf(call_res.error, sizeof(call_res.error), "Stream broken: %s", strerror(errno));
+                break;
+            }
+            if (rc == 1) {
+                out.active = 0;
+                if (out.header.type == STREAM_END) end_sent = 1;
+            }
+        }
+        if (!(pfd.revents & (POLLIN | POLLERR | POLLHUP))) continue;
+
+        int rc = read_frame(sock, &in, call_res.error, sizeof(call_res.error));
+        if (rc < 0) break;
+        if (rc == 0) continue;
+        const double* values = (const double*)in.payload;
+        size_t count = in.header.count;
+        if (in.header.type == STREAM_RESULT_XOR) {
+            StreamPackedHeader ph;
+            if (!results || count < sizeof(ph)) {
+                strcpy(call_res.error, "Stream broken: unexpected compressed frame");
+                break;
+            }
+            memcpy(&ph, in.payload, sizeof(ph));
+            if (ph.values > chunk || ph.x_bytes != count - sizeof(ph) ||
+                float_codec_decode((unsigned char*)in.payload + sizeof(ph), ph.x_bytes, results, ph.values) != 0) {
+                strcpy(call_res.error, "Stream broken: malformed compressed frame");
+                break;
+            }
+            values = results;
+            count = ph.values;
+        }
+        switch (in.header.type) {
+            case STREAM_RESULT:
+            case STREAM_RESULT_XOR:
+                if (outstanding == 0) {
+                    strcpy(call_res.error, "Stream broken: result for a chunk that was never sent");
+                    done = 1;
+                    break;
+                }
+                if (sink) sink(offsets[head], values, count, sink_arg);
+                head = (head + 1) % credits;
+                outstanding--;
+                break;
+            case STREAM_DONE:
+                memcpy(&call_res.result, in.payload, sizeof(double));
+                call_res.error[0] = '\0';
+                call_res.call_success = 1;
+                done = 1;
+                break;
+            case STREAM_ERROR:
+                snprintf(call_res.error, sizeof(call_res.error), "%.*s", (int)in.header.count, in.payload);
+                done = 1;
+                break;
+            default:
+                snprintf(call_res.error, sizeof(call_res.error), "Stream broken: unexpected frame type %u", in.header.type);
+                done = 1;
+                break;
+        }
+        in.header_got = 0;
+        in.payload_got = 0;
+    }
+
+    free(in.payload);
+    free(offsets);
+    free(out.packed);
+    free(results);
+    close(sock);
+    return call_res;
+}
+
+// Maps a file of raw doubles read-only. Returns NULL for an empty file, with *n = 0.
+static const double* map_doubles(const char* path, size_t* n, size_t* map_len, char* err, size_t err_len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(err, err_len, "Cannot open %s: %s", path, strerror(errno));
+        return MAP_FAILED;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size % sizeof(double) != 0) {
+        snprintf(err, err_len, "%s is not a whole number of doubles", path);
+        close(fd);
+        return MAP_FAILED;
+    }
+    *n = (size_t)st.st_size / sizeof(double);
+    *map_len = (size_t)st.st_size;
+    if (*n == 0) {
+        close(fd);
+        return NULL;
+    }
+    void* data = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        snprintf(err, err_len, "Cannot map %s: %s", path, strerror(errno));
+        return MAP_FAILED;
+    }
+    madvise(data, *map_len, MADV_SEQUENTIAL); // Pages are read once, front to back
+    return data;
+}
+
+RpcCallResult rpc_stream_file(OperationType op, const char* x_path, const char* y_path, size_t chunk,
+                              RpcStreamSink sink, void* sink_arg, const char* server_ip, int server_port) {
+    RpcCallResult call_res = {0};
+    size_t nx = 0, ny = 0, x_len = 0, y_len = 0;
+    const double* x = map_doubles(x_path, &nx, &x_len, call_res.error, sizeof(call_res.error));
+    if (x == MAP_FAILED) return call_res;
+    const double* y = NULL;
+    if (rpc_stream_op_two_arrays(op)) {
+        if (!y_path) {
+            snprintf(call_res.error, sizeof(call_res.error), "%s needs a second input file", operation_to_string(op));
+        } else {
+            y = map_doubles(y_path, &ny, &y_len, call_res.error, sizeof(call_res.error));
+            if (y != MAP_FAILED && ny != nx) {
+                snprintf(call_res.error, sizeof(call_res.error), "%s and %s hold different numbers of values", x_path, y_path);
+                if (y) munmap((void*)y, y_len);
+                y = MAP_FAILED;
+            }
+        }
+        if (!y_path || y == MAP_FAILED) {
+            if (x) munmap((void*)x, x_len);
+            return call_res;
+        }
+    }
+
+    call_res = rpc_stream_call(op, x, y, nx, chunk, sink, sink_arg, server_ip, server_port);
+    if (x) munmap((void*)x, x_len);
+    if (y) munmap((void*)y, y_len);
+    return call_res;
+}
@@ -0,0 +1,241 @@
+#include "task_pool.h"
+#include "mem_pool.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define CACHE_LINE 64
+#define DEQUE_MASK (TASK_DEQUE_SIZE - 1)
+
+typedef struct Job Job;
+
+// A range of chunk indices [lo, hi) of one loop
+typedef struct {
+    Job* job;
+    size_t lo;
+    size_t hi;
+} Task;
+
+struct Job {
+    TaskChunkFn fn;
+    void* ctx;
+    size_t n;
+    size_t grain;
+    size_t pending;   // Chunks not yet run; the loop is done at 0
+    size_t next_task; // Next free entry of tasks
+    Task* tasks;      // Every range that is split off needs one
+};
+
+// top and bottom on separate cache lines, so thieves do not slow the owner down
+typedef struct {
+    long top;                         // Thieves take from here
+    char pad[CACHE_LINE - sizeof(long)];
+    long bottom;                      // The owner pushes and pops here
+    int claimed;                      // Caller deques: in use by a running loop
+    Task* slots[TASK_DEQUE_SIZE];
+} __attribute__((aligned(CACHE_LINE))) TaskDeque;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int running_loops; // Workers sleep while it is 0
+    int workers;
+    int callers_seen;  // Caller deques ever claimed, so thieves scan only those
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 };
+
+// Workers' deques first, then one per calling thread with a loop running
+static TaskDeque deques[TASK_POOL_MAX_WORKERS + TASK_POOL_MAX_CALLERS];
+
+// Owner only. Returns 0, or -1 if the deque is full.
+static int deque_push(TaskDeque* d, Task* t) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - top >= TASK_DEQUE_SIZE) return -1;
+    __atomic_store_n(&d->slots[b & DEQUE_MASK], t, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Owner only: the newest range, or NULL if none is left
+static Task* deque_pop(TaskDeque* d) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    Task* t = NULL;
+    if (top <= b) {
+        t = __atomic_load_n(&d->slots[b & DEQUE_MASK], __ATOMIC_RELAXED);
+        if (top == b) {
+            // The last one; a thief may be taking it at the same time
+            if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                t = NULL;
+            }
+            __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return t;
+}
+
+// Any thread: the oldest range, or NULL if there is none or another thread won it
+static Task* deque_steal(TaskDeque* d) {
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (top >= b) return NULL;
+    Task* t = __atomic_load_n(&d->slots[top & DEQUE_MASK], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return t;
+}
+
+static void run_chunks(TaskChunkFn fn, void* ctx, size_t n, size_t grain, size_t lo, size_t hi) {
+    for (size_t c = lo; c < hi; c++) {
+        size_t begin = c * grain;
+        fn(ctx, c, begin, n - begin < grain ? n : begin + grain);
+    }
+}
+
+// Splits off upper halves for thieves until one chunk is left, then runs it
+static void run_task(TaskDeque* d, Task* t) {
+    Job* job = t->job;
+    size_t lo = t->lo, hi = t->hi;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        Task* rest = &job->tasks[__atomic_fetch_add(&job->next_task, 1, __ATOMIC_RELAXED)];
+        rest->job = job;
+        rest->lo = mid;
+        rest->hi = hi;
+        if (deque_push(d, rest) != 0) break; // Full: run the whole range here
+        hi = mid;
+    }
+    run_chunks(job->fn, job->ctx, job->n, job->grain, lo, hi);
+    __atomic_sub_fetch(&job->pending, hi - lo, __ATOMIC_RELEASE);
+}
+
+// Tries every deque but self's once, starting at a random one
+static Task* steal_any(int self, unsigned int* seed) {
+    int workers = __atomic_load_n(&pool.workers, __ATOMIC_ACQUIRE);
+    int total = workers + __atomic_load_n(&pool.callers_seen, __ATOMIC_ACQUIRE);
+    if (total == 0) return NULL; // Started before the pool's size was published
+    *seed ^= *seed << 13; // xorshift32
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    int start = (int)(*seed % (unsigned int)total);
+    for (int i = 0; i < total; i++) {
+        int k = (start + i) % total;
+        int index = k < workers ? k : TASK_POOL_MAX_WORKERS + (k - workers);
+        if (index == self) continue;
+        Task* t = deque_steal(&deques[index]);
+        if (t) return t;
+    }
+    return NULL;
+}
+
+static void* worker_main(void* arg) {
+    int self = (int)(intptr_t)arg;
+    TaskDeque* d = &deques[self];
+    unsigned int seed = 2654435761u * (unsigned int)(self + 1);
+    while (1) {
+        Task* t = deque_pop(d);
+        if (!t) t = steal_any(self, &seed);
+        if (t) {
+            run_task(d, t);
+        } else if (__atomic_load_n(&pool.running_loops, __ATOMIC_RELAXED) > 0) {
+            sched_yield(); // Ranges may still be split off; look again soon
+        } else {
+            pthread_mutex_lock(&pool.lock);
+            while (pool.running_loops == 0) pthread_cond_wait(&pool.wake, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+        }
+    }
+    return NULL;
+}
+
+int task_pool_start(int workers) {
+    pthread_mutex_lock(&pool.lock);
+    if (pool.workers > 0 || workers < 1) {
+        pthread_mutex_unlock(&pool.lock);
+        return 0;
+    }
+    if (workers > TASK_POOL_MAX_WORKERS) workers = TASK_POOL_MAX_WORKERS;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int started = 0, rc = 0;
+    while (started < workers) {
+        pthread_t tid;
+        rc = pthread_create(&tid, &attr, worker_main, (void*)(intptr_t)started);
+        if (rc != 0) break;
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+    __atomic_store_n(&pool.workers, started, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool.lock);
+    if (rc == 0) return 0;
+    errno = rc;
+    return -1;
+}
+
+int task_pool_workers(void) {
+    return __atomic_load_n(&pool.workers, __ATOMIC_ACQUIRE);
+}
+
+size_t task_pool_chunks(size_t n, size_t grain) {
+    if (grain == 0) grain = 1;
+    return (n + grain - 1) / grain;
+}
+
+static TaskDeque* claim_caller_deque(void) {
+    for (int i = 0; i < TASK_POOL_MAX_CALLERS; i++) {
+        TaskDeque* d = &deques[TASK_POOL_MAX_WORKERS + i];
+        int expected = 0;
+        if (!__atomic_compare_exchange_n(&d->claimed, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+        int seen = __atomic_load_n(&pool.callers_seen, __ATOMIC_RELAXED);
+        while (seen <= i && !__atomic_compare_exchange_n(&pool.callers_seen, &seen, i + 1, 0,
+                                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        return d;
+    }
+    return NULL;
+}
+
+static void count_loop(int delta) {
+    pthread_mutex_lock(&pool.lock);
+    __atomic_add_fetch(&pool.running_loops, delta, __ATOMIC_RELAXED);
+    if (delta > 0) pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void task_pool_for(size_t n, size_t grain, TaskChunkFn fn, void* ctx) {
+    if (grain == 0) grain = 1;
+    size_t chunks = task_pool_chunks(n, grain);
+    TaskDeque* d = chunks > 1 && task_pool_workers() > 0 ? claim_caller_deque() : NULL;
+    // Every split takes a task, and every run ends with at most one unpushed one
+    ArenaMark mark = arena_mark();
+    Task* tasks = d ? arena_alloc(2 * chunks * sizeof(Task)) : NULL;
+    if (!tasks) {
+        if (d) __atomic_store_n(&d->claimed, 0, __ATOMIC_RELEASE);
+        run_chunks(fn, ctx, n, grain, 0, chunks);
+        return;
+    }
+
+    Job job = { fn, ctx, n, grain, chunks, 1, tasks };
+    tasks[0] = (Task){ &job, 0, chunks };
+    count_loop(1);
+    run_task(d, &tasks[0]);
+    while (__atomic_load_n(&job.pending, __ATOMIC_ACQUIRE) > 0) {
+        Task* t = deque_pop(d);
+        if (t) run_task(d, t);
+        else sched_yield(); // The rest is running on workers
+    }
+    count_loop(-1);
+
+    __atomic_store_n(&d->claimed, 0, __ATOMIC_RELEASE);
+    arena_release(mark);
+}
@@ -0,0 +1,46 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <stddef.h> // For size_t
+
+// Work-stealing pool for splitting one large computation across cores.
+//
+// task_pool_for() covers a range of n items in chunks of grain items. The
+// calling thread starts with the whole range. It pushes the upper half onto
+// its own deque and keeps halving the lower half until one chunk is left,
+// then runs that chunk and takes the next range back from its deque. Idle
+// workers steal the oldest, and therefore largest, range from any deque and
+// split it the same way on their own. A core that gets no work never holds
+// anyone up, and a core that finishes early helps with the rest.
+//
+// The deques follow Chase and Lev: the owner pushes and pops at the bottom
+// without locking, and thieves take from the top with one compare-and-swap.
+// Workers sleep on a condition variable while no loop is running.
+//
+// Up to TASK_POOL_MAX_CALLERS threads may run loops at the same time; further
+// callers, and every caller before task_pool_start(), run the loop inline. A
+// chunk function must not call task_pool_for() itself.
+
+#define TASK_POOL_MAX_WORKERS 64
+#define TASK_POOL_MAX_CALLERS 64 // Threads with a loop running at once
+#define TASK_DEQUE_SIZE 64       // Ranges per deque, a power of two; halving keeps far fewer
+
+// Runs one chunk: items [begin, end), the chunk'th of the loop
+typedef void (*TaskChunkFn)(void* ctx, size_t chunk, size_t begin, size_t end);
+
+// Starts the worker threads, once per process; later calls change nothing.
+// Threads inherit the caller's CPU affinity. Returns 0 or -1 with errno set.
+int task_pool_start(int workers);
+
+// Number of worker threads running, 0 before task_pool_start()
+int task_pool_workers(void);
+
+// Number of chunks task_pool_for() splits n items into
+size_t task_pool_chunks(size_t n, size_t grain);
+
+// Calls fn once for each chunk of [0, n) and returns when all have run.
+// Chunks may run on any thread and in any order; fn can store its result
+// under the chunk index and the caller combine them in order afterwards.
+void task_pool_for(size_t n, size_t grain, TaskChunkFn fn, void* ctx);
+
+#endif // TASK_POOL_H
@@ -0,0 +1,147 @@
+#include "timer_wheel.h"
+#include <string.h>
+#include <time.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_BITS)
+#define WHEEL_SPAN (1LL << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) // Ticks the top level reaches
+
+long long timer_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(TimerWheel* w) {
+    memset(w, 0, sizeof(*w));
+    w->now = timer_now_ms();
+}
+
+void timer_init(Timer* t, TimerCallback fire, void* arg) {
+    memset(t, 0, sizeof(*t));
+    t->fire = fire;
+    t->arg = arg;
+}
+
+int timer_pending(const Timer* t) {
+    return t->pprev != NULL;
+}
+
+static void link_timer(Timer** head, Timer* t) {
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+// Puts t into the level its distance from now falls in
+static void place(TimerWheel* w, Timer* t) {
+    long long at = t->expires;
+    long long delta = at - w->now;
+    if (delta < 0) at = w->now; // Overdue: the next tick run
+    if (delta >= WHEEL_SPAN) at = w->now + WHEEL_SPAN - 1; // Placed again once it comes near
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && at - w->now >= (1LL << LEVEL_SHIFT(level + 1))) level++;
+    int index = (int)((at >> LEVEL_SHIFT(level)) & SLOT_MASK);
+    t->slot = level * TIMER_WHEEL_SLOTS + index;
+    link_timer(&w->slots[level][index], t);
+    w->occupied[level] |= 1ULL << index;
+}
+
+void timer_cancel(TimerWheel* w, Timer* t) {
+    if (!t->pprev) return;
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    if (t->slot >= 0) {
+        int level = t->slot / TIMER_WHEEL_SLOTS, index = t->slot % TIMER_WHEEL_SLOTS;
+        if (!w->slots[level][index]) w->occupied[level] &= ~(1ULL << index);
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+void timer_schedule(TimerWheel* w, Timer* t, long long expires_ms) {
+    timer_cancel(w, t);
+    t->expires = expires_ms;
+    place(w, t);
+}
+
+// Takes every timer out of a slot, leaving their links to each other
+static Timer* take_slot(TimerWheel* w, int level, int index) {
+    Timer* list = w->slots[level][index];
+    w->slots[level][index] = NULL;
+    w->occupied[level] &= ~(1ULL << index);
+    return list;
+}
+
+// Spreads the slot of level that now has reached into the levels below, and
+// the level above's slot too when this level has wrapped around
+static void cascade(TimerWheel* w, int level) {
+    int index = (int)((w->now >> LEVEL_SHIFT(level)) & SLOT_MASK);
+    Timer* list = take_slot(w, level, index);
+    while (list) {
+        Timer* t = list;
+        list = t->next;
+        place(w, t);
+    }
+    if (index == 0 && level + 1 < TIMER_WHEEL_LEVELS) cascade(w, level + 1);
+}
+
+int timer_wheel_run(TimerWheel* w) {
+    long long target = timer_now_ms();
+    int fired = 0;
+    while (w->now <= target) {
+        int index = (int)(w->now & SLOT_MASK);
+        if (index == 0) cascade(w, 1);
+        if (!w->occupied[0]) {
+            // Nothing due before level 0 wraps and the next slot above comes down
+            long long next = (w->now | SLOT_MASK) + 1;
+            w->now = next <= target ? next : target + 1;
+            continue;
+        }
+        // The slot's timers move to a list of their own, so a callback that
+        // cancels one of them still takes it out before it fires
+        w->firing = take_slot(w, 0, index);
+        if (w->firing) w->firing->pprev = &w->firing;
+        for (Timer* t = w->firing; t; t = t->next) t->slot = -1;
+        w->now++; // Timers scheduled by the callbacks go after this tick
+        while (w->firing) {
+            Timer* t = w->firing;
+            timer_cancel(w, t);
+            t->fire(t, t->arg);
+            fired++;
+        }
+    }
+    w->fired += (unsigned long long)fired;
+    return fired;
+}
+
+// Distance, in slots from index, to the first occupied slot; 64 if only
+// index itself is occupied and skip_index is set
+static int slots_ahead(unsigned long long occupied, int index, int skip_index) {
+    unsigned long long rotated = index ? (occupied >> index) | (occupied << (TIMER_WHEEL_SLOTS - index)) : occupied;
+    if (skip_index) rotated &= ~1ULL;
+    return rotated ? __builtin_ctzll(rotated) : TIMER_WHEEL_SLOTS;
+}
+
+long long timer_wheel_next_ms(const TimerWheel* w) {
+    long long due = -1;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (!w->occupied[level]) continue;
+        int shift = LEVEL_SHIFT(level);
+        int index = (int)((w->now >> shift) & SLOT_MASK);
+        long long at;
+        if (level == 0) {
+            at = w->now + slots_ahead(w->occupied[0], index, 0);
+        } else {
+            // A slot above comes down when the levels below wrap into it. The
+            // current slot has already, unless now is exactly where it starts.
+            int aligned = (w->now & ((1LL << shift) - 1)) == 0;
+            at = ((w->now >> shift) + slots_ahead(w->occupied[level], index, !aligned)) << shift;
+        }
+        if (due < 0 || at < due) due = at;
+    }
+    if (due < 0) return -1;
+    long long wait = due - timer_now_ms();
+    return wait > 0 ? wait : 0;
+}
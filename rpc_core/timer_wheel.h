@@ -0,0 +1,86 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+// Hierarchical timer wheel for the event-loop servers: idle-connection
+// eviction, request timeouts and periodic work, with O(1) schedule and
+// cancel however many timers are pending.
+//
+// Time is in milliseconds of CLOCK_MONOTONIC (timer_now_ms), one tick per
+// millisecond. Level 0 has a slot per tick for the next 64 ms; each level
+// above has 64 slots, each 64 times wider than a slot of the level below.
+// A timer goes into the level its distance falls in, and each time a level
+// below wraps around, the next slot of the level above is spread into it.
+// A timer is therefore moved at most once per level, and timers that are
+// cancelled before they come near, like an idle timeout pushed back by every
+// request, are never moved at all. Timers further out than the top level
+// (about 4.6 hours) wait in its farthest slot and are placed again from there.
+//
+// Timers are intrusive: the caller embeds a Timer in its own state, which
+// must stay at the same address while the timer is scheduled. A wheel and
+// its timers belong to one thread. The loop waits at most
+// timer_wheel_next_ms() (as an epoll_wait timeout, say) and then calls
+// timer_wheel_run(), which fires the callbacks of the timers that are due.
+
+// Connection timeouts in the event-loop servers, read from the environment at
+// startup (0 disables one)
+#define RPC_IDLE_TIMEOUT_ENV "RPC_IDLE_TIMEOUT_MS"       // A connection with no request under way is closed
+#define RPC_REQUEST_TIMEOUT_ENV "RPC_REQUEST_TIMEOUT_MS" // A request must arrive whole this soon after its first bytes
+#define RPC_STATS_INTERVAL_ENV "RPC_STATS_INTERVAL_MS"   // Connection and batch statistics to stderr
+
+#define DEFAULT_IDLE_TIMEOUT_MS 60000
+#define DEFAULT_REQUEST_TIMEOUT_MS 10000
+#define DEFAULT_STATS_INTERVAL_MS 0
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef struct Timer Timer;
+typedef void (*TimerCallback)(Timer* t, void* arg);
+
+struct Timer {
+    Timer* next;
+    Timer** pprev;      // The link that points to this timer; NULL while not scheduled
+    int slot;           // level * TIMER_WHEEL_SLOTS + index, or -1 once taken off to fire
+    long long expires;  // In timer_now_ms() time
+    TimerCallback fire;
+    void* arg;
+};
+
+typedef struct {
+    long long now; // Next tick to run; every tick before it has been
+    unsigned long long occupied[TIMER_WHEEL_LEVELS]; // A bit per slot that holds timers
+    Timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    Timer* firing; // Timers due in the tick being run, while their callbacks are called
+    unsigned long long fired;
+} TimerWheel;
+
+// Milliseconds of CLOCK_MONOTONIC
+long long timer_now_ms(void);
+
+// An empty wheel starting at the current time
+void timer_wheel_init(TimerWheel* w);
+
+// Sets the callback of a timer that is not scheduled yet
+void timer_init(Timer* t, TimerCallback fire, void* arg);
+
+// Schedules t to fire at expires_ms (timer_now_ms() time), moving it if it is
+// already scheduled. A time already past fires in the next timer_wheel_run().
+void timer_schedule(TimerWheel* w, Timer* t, long long expires_ms);
+
+// Stops t from firing. Does nothing if it is not scheduled; safe from a
+// callback, for any timer.
+void timer_cancel(TimerWheel* w, Timer* t);
+
+// 1 if t is scheduled and has not fired yet
+int timer_pending(const Timer* t);
+
+// Fires every timer due by now, in order of ticks. Callbacks may schedule and
+// cancel timers, including their own. Returns the number fired.
+int timer_wheel_run(TimerWheel* w);
+
+// Milliseconds until timer_wheel_run() may have a timer to fire or one to move
+// down a level: 0 if one is due, -1 if the wheel is empty
+long long timer_wheel_next_ms(const TimerWheel* w);
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,123 @@
+#include "unix_socket.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define WAIT_MAX_FDS 8
+
+void rpc_unix_path(int port, char* buf, size_t len) {
+    const char* dir = getenv(RPC_UNIX_DIR_ENV);
+    if (!dir || dir[0] == '\0') dir = RPC_UNIX_DEFAULT_DIR;
+    snprintf(buf, len, "%s/rpc_%d.sock", dir, port);
+}
+
+int rpc_is_unix_address(const char* server_address) {
+    return server_address[0] == '/';
+}
+
+static int fill_address(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int rpc_unix_listen(int port, int type) {
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    rpc_unix_path(port, path, sizeof(path));
+    return rpc_unix_listen_at(path, type);
+}
+
+int rpc_unix_listen_at(const char* path, int type) {
+    struct sockaddr_un addr;
+    if (fill_address(path, &addr) != 0) return -1;
+
+    int sock = socket(AF_UNIX, type, 0);
+    if (sock < 0) return -1;
+
+    // The socket file outlives the server; only ever remove a socket, never a regular file
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        (type == SOCK_STREAM && listen(sock, SOMAXCONN) < 0)) {
+        int saved = errno;
+        close(sock);
+        errno = saved;
+        return -1;
+    }
+    return sock;
+}
+
+int rpc_unix_connect(const char* path, int type) {
+    struct sockaddr_un addr;
+    if (fill_address(path, &addr) != 0) return -1;
+
+    int sock = socket(AF_UNIX, type, 0);
+    if (sock < 0) return -1;
+
+    // Binding just the family makes Linux pick a unique abstract name
+    sa_family_t family = AF_UNIX;
+    if ((type == SOCK_DGRAM && bind(sock, (struct sockaddr*)&family, sizeof(family)) < 0) ||
+        connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int saved = errno;
+        close(sock);
+        errno = saved;
+        return -1;
+    }
+    return sock;
+}
+
+int rpc_wait_readable(const int* fds, int count) {
+    struct pollfd pfds[WAIT_MAX_FDS];
+    if (count > WAIT_MAX_FDS) count = WAIT_MAX_FDS;
+    for (int i = 0; i < count; i++) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+    }
+    if (poll(pfds, count, -1) < 0) return -1;
+    // Start after the socket served last time, so a busy one cannot starve the others
+    static int rotate;
+    for (int k = 0; k < count; k++) {
+        int i = (rotate + 1 + k) % count;
+        if (pfds[i].revents) {
+            rotate = i;
+            return fds[i];
+        }
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+const char* rpc_peer_string(const struct sockaddr* addr, socklen_t len, char* buf, size_t buf_len) {
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+        snprintf(buf, buf_len, "%s:%d", ip, ntohs(in->sin_port));
+    } else if (addr->sa_family == AF_UNIX) {
+        const struct sockaddr_un* un = (const struct sockaddr_un*)addr;
+        size_t path_len = len > offsetof(struct sockaddr_un, sun_path) ? len - offsetof(struct sockaddr_un, sun_path) : 0;
+        if (path_len == 0) {
+            snprintf(buf, buf_len, "unix:-");
+        } else if (un->sun_path[0] == '\0') {
+            snprintf(buf, buf_len, "unix:@%.*s", (int)path_len - 1, un->sun_path + 1);
+        } else {
+            snprintf(buf, buf_len, "unix:%.*s", (int)path_len, un->sun_path);
+        }
+    } else {
+        snprintf(buf, buf_len, "family %d", addr->sa_family);
+    }
+    return buf;
+}
@@ -0,0 +1,45 @@
+#ifndef UNIX_SOCKET_H
+#define UNIX_SOCKET_H
+
+#include <stddef.h>
+#include <sys/socket.h> // For struct sockaddr, socklen_t
+
+// Unix domain sockets for callers on the same host. Besides its port, every
+// server listens on <dir>/rpc_<port>.sock, as SOCK_STREAM for the TCP servers
+// and SOCK_DGRAM for the UDP servers, where <dir> comes from RPC_UNIX_DIR in the
+// environment (default /tmp). Clients select it by passing the path as the
+// server address; IPPROTO_TCP then means the stream socket and IPPROTO_UDP the
+// datagram one. The request and response format is unchanged.
+
+#define RPC_UNIX_DIR_ENV "RPC_UNIX_DIR"
+#define RPC_UNIX_DEFAULT_DIR "/tmp"
+#define RPC_PEER_STRLEN 128 // Enough for any string from rpc_peer_string()
+
+// Writes the socket path of the server on port into buf
+void rpc_unix_path(int port, char* buf, size_t len);
+
+// Returns 1 if the server address is a socket path (absolute) rather than an IP
+int rpc_is_unix_address(const char* server_address);
+
+// Server side: binds a socket of the given type at port's path, replacing a
+// socket file left by an earlier run, and listens on it for SOCK_STREAM.
+// Returns the socket, or -1 with errno set.
+int rpc_unix_listen(int port, int type);
+
+// Same for a socket at an arbitrary path
+int rpc_unix_listen_at(const char* path, int type);
+
+// Client side: connects a socket of the given type to path. Datagram sockets
+// are first bound to an autobound abstract address so the server can reply.
+// Returns the socket, or -1 with errno set.
+int rpc_unix_connect(const char* path, int type);
+
+// Blocks until one of the count sockets is readable and returns it, or -1
+// with errno set (e.g. EINTR). Used by servers that listen on a port and a path.
+int rpc_wait_readable(const int* fds, int count);
+
+// Formats a peer address for logs: "ip:port" for IPv4, "unix:<path>" for
+// local peers ("unix:@..." for abstract addresses, "unix:-" for unnamed ones).
+const char* rpc_peer_string(const struct sockaddr* addr, socklen_t len, char* buf, size_t buf_len);
+
+#endif // UNIX_SOCKET_H
@@ -0,0 +1,232 @@
+#include "vector_ops.h"
+#include "task_pool.h"
+#include "mem_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// 128-bit vectors are native on every x86-64 (SSE2) and arm64 (NEON) CPU;
+// each loop step works on two of them so four doubles are in flight.
+typedef double v2d __attribute__((vector_size(16)));
+typedef long long v2i __attribute__((vector_size(16)));
+
+void vector_ops_set_threads(int threads) {
+    // The thread that asks for a reduction works on it too
+    if (task_pool_start(threads - 1) != 0) perror("Reduction workers not all started");
+}
+
+// Loads two doubles without assuming 16-byte alignment
+static inline v2d load2(const double* p) {
+    v2d v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Stores two doubles without assuming 16-byte alignment
+static inline void store2(double* p, v2d v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+// Partial result of one chunk. For sums the value is sum + comp.
+typedef struct {
+    double sum;
+    double comp;
+    double min;
+    double max;
+} VecPartial;
+
+void vector_compensated_add(double* sum, double* comp, double v) {
+    double t = *sum + v;
+    if (!isfinite(t)) {
+        // Nothing to compensate
+    } else if (fabs(*sum) >= fabs(v)) {
+        *comp += (*sum - t) + v;
+    } else {
+        *comp += (v - t) + *sum;
+    }
+    *sum = t;
+}
+
+static inline void neumaier_add(VecPartial* p, double v) {
+    vector_compensated_add(&p->sum, &p->comp, v);
+}
+
+// |v| on both lanes
+static inline v2d abs2(v2d v) {
+    const v2i magnitude = { 0x7fffffffffffffffLL, 0x7fffffffffffffffLL };
+    return (v2d)((v2i)v & magnitude);
+}
+
+// vector_compensated_add() on every lane of s/c. A lane whose sum is no longer finite
+// adds nothing to its compensation; t - t is 0 only for finite t.
+#define NEUMAIER_STEP(s, c, v) do {                                                 \
+        v2d t = (s) + (v);                                                          \
+        v2i big = (v2i)(abs2(s) >= abs2(v));                                        \
+        v2i err = ((v2i)(((s) - t) + (v)) & big) | ((v2i)(((v) - t) + (s)) & ~big); \
+        v2i finite = (v2i)((t - t) == 0);                                           \
+        (c) += (v2d)(err & finite);                                                 \
+        (s) = t;                                                                    \
+    } while (0)
+
+// Compensated sum of x[i] (or x[i] * y[i] when y is given), four lanes at a time
+static VecPartial sum_kernel(const double* x, const double* y, size_t n) {
+    v2d s0 = {0, 0}, c0 = {0, 0}, s1 = {0, 0}, c1 = {0, 0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        v2d v0 = y ? load2(x + i) * load2(y + i) : load2(x + i);
+        v2d v1 = y ? load2(x + i + 2) * load2(y + i + 2) : load2(x + i + 2);
+        NEUMAIER_STEP(s0, c0, v0);
+        NEUMAIER_STEP(s1, c1, v1);
+    }
+    VecPartial p = {0, 0, 0, 0};
+    for (int lane = 0; lane < 2; lane++) {
+        neumaier_add(&p, s0[lane]);
+        neumaier_add(&p, c0[lane]);
+        neumaier_add(&p, s1[lane]);
+        neumaier_add(&p, c1[lane]);
+    }
+    for (; i < n; i++) {
+        neumaier_add(&p, y ? x[i] * y[i] : x[i]);
+    }
+    return p;
+}
+
+// Minimum and maximum; any NaN in the input makes both NaN. Requires n > 0.
+static VecPartial minmax_kernel(const double* x, size_t n) {
+    VecPartial p = {0, 0, x[0], x[0]};
+    size_t i = 0;
+    if (n >= 4) {
+        v2d mn[2] = { load2(x), load2(x + 2) };
+        v2d mx[2] = { mn[0], mn[1] };
+        v2i nan_seen = (v2i)(mn[0] != mn[0]) | (v2i)(mn[1] != mn[1]);
+        for (i = 4; i + 4 <= n; i += 4) {
+            for (int k = 0; k < 2; k++) {
+                v2d v = load2(x + i + 2 * k);
+                v2i lt = (v2i)(v < mn[k]);
+                v2i gt = (v2i)(v > mx[k]);
+                mn[k] = (v2d)(((v2i)v & lt) | ((v2i)mn[k] & ~lt));
+                mx[k] = (v2d)(((v2i)v & gt) | ((v2i)mx[k] & ~gt));
+                nan_seen |= (v2i)(v != v);
+            }
+        }
+        if (nan_seen[0] || nan_seen[1]) {
+            p.min = p.max = NAN;
+            return p;
+        }
+        for (int k = 0; k < 2; k++) {
+            for (int lane = 0; lane < 2; lane++) {
+                if (mn[k][lane] < p.min) p.min = mn[k][lane];
+                if (mx[k][lane] > p.max) p.max = mx[k][lane];
+            }
+        }
+    }
+    for (; i < n; i++) {
+        if (isnan(x[i])) {
+            p.min = p.max = NAN;
+            return p;
+        }
+        if (x[i] < p.min) p.min = x[i];
+        if (x[i] > p.max) p.max = x[i];
+    }
+    return p;
+}
+
+static VecPartial run_kernel(OperationType op, const double* x, const double* y, size_t n) {
+    if (op == OP_MIN || op == OP_MAX) {
+        return minmax_kernel(x, n);
+    }
+    return sum_kernel(x, op == OP_DOT ? y : NULL, n);
+}
+
+typedef struct {
+    OperationType op;
+    const double* x;
+    const double* y;
+    VecPartial* partials; // One per chunk
+} VecJob;
+
+static void reduce_chunk(void* ctx, size_t chunk, size_t begin, size_t end) {
+    VecJob* job = (VecJob*)ctx;
+    job->partials[chunk] = run_kernel(job->op, job->x + begin, job->y ? job->y + begin : NULL, end - begin);
+}
+
+// Reduces VEC_CHUNK values at a time on the task pool, then combines the
+// chunks in order, so the result does not depend on which thread ran what
+static VecPartial reduce_parallel(OperationType op, const double* x, const double* y, size_t n) {
+    size_t chunks = task_pool_chunks(n, VEC_CHUNK);
+    ArenaMark mark = arena_mark();
+    VecPartial* partials = arena_alloc(chunks * sizeof(VecPartial));
+    if (!partials) return run_kernel(op, x, y, n);
+    VecJob job = { op, x, op == OP_DOT ? y : NULL, partials };
+    task_pool_for(n, VEC_CHUNK, reduce_chunk, &job);
+
+    VecPartial total = partials[0];
+    for (size_t c = 1; c < chunks; c++) {
+        VecPartial* p = &partials[c];
+        neumaier_add(&total, p->sum);
+        neumaier_add(&total, p->comp);
+        if (isnan(p->min) || isnan(total.min)) {
+            total.min = total.max = NAN;
+        } else {
+            if (p->min < total.min) total.min = p->min;
+            if (p->max > total.max) total.max = p->max;
+        }
+    }
+    arena_release(mark);
+    return total;
+}
+
+CalcResult vector_reduce(OperationType op, const double* x, const double* y, size_t n) {
+    CalcResult res;
+    res.value = 0;
+    res.error[0] = '\0';
+
+    if (op != OP_SUM && op != OP_MEAN && op != OP_MIN && op != OP_MAX && op != OP_DOT) {
+        snprintf(res.error, sizeof(res.error), "Invalid vector operation: %d", op);
+        return res;
+    }
+    if (n == 0) {
+        if (op == OP_MEAN || op == OP_MIN || op == OP_MAX) {
+            snprintf(res.error, sizeof(res.error), "Error: %s of an empty array", operation_to_string(op));
+        }
+        return res; // The empty sum and dot product are 0
+    }
+    if (op == OP_DOT && !y) {
+        snprintf(res.error, sizeof(res.error), "Error: Dot product needs two arrays");
+        return res;
+    }
+
+    // Small arrays take the inline path; splitting them would cost more than it saves
+    VecPartial p = n >= VEC_PARALLEL_MIN && task_pool_workers() > 0 ? reduce_parallel(op, x, y, n)
+                                                                     : run_kernel(op, x, y, n);
+
+    switch (op) {
+        case OP_MIN:  res.value = p.min; break;
+        case OP_MAX:  res.value = p.max; break;
+        case OP_MEAN: res.value = (p.sum + p.comp) / (double)n; break;
+        default:      res.value = p.sum + p.comp; break;
+    }
+    return res;
+}
+
+// One loop per operator, so each compiles to packed arithmetic without a branch per element
+#define ELEMENTWISE_LOOP(OP) do {                                            \
+        for (; i + 4 <= n; i += 4) {                                         \
+            store2(out + i, load2(x + i) OP load2(y + i));                   \
+            store2(out + i + 2, load2(x + i + 2) OP load2(y + i + 2));       \
+        }                                                                    \
+        for (; i < n; i++) out[i] = x[i] OP y[i];                            \
+    } while (0)
+
+int vector_elementwise(OperationType op, const double* x, const double* y, double* out, size_t n) {
+    size_t i = 0;
+    switch (op) {
+        case OP_ADD:      ELEMENTWISE_LOOP(+); break;
+        case OP_SUBTRACT: ELEMENTWISE_LOOP(-); break;
+        case OP_MULTIPLY: ELEMENTWISE_LOOP(*); break;
+        case OP_DIVIDE:   ELEMENTWISE_LOOP(/); break;
+        default:          return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef VECTOR_OPS_H
+#define VECTOR_OPS_H
+
+#include "calculator_ops.h" // For CalcResult
+#include "rpc_protocol.h"   // For OperationType
+#include <stddef.h>         // For size_t
+
+// Reductions over operand arrays: OP_SUM, OP_MEAN, OP_MIN, OP_MAX and OP_DOT.
+// The kernels process four doubles per step using GCC/Clang vector types, so
+// they compile to SSE2 (or NEON) without intrinsics. Sums and dot products carry a
+// Neumaier (Kahan) compensation term per lane, which keeps the error independent
+// of the array length instead of growing with it. With an infinity or NaN among
+// the values the result is what a plain sum gives: inf, -inf or NaN.
+
+// Inputs at least this long are split into chunks for the task pool
+// (task_pool.h), whose workers steal the chunks while the caller runs some too
+#define VEC_PARALLEL_MIN 32768
+#define VEC_CHUNK 8192 // Values per chunk: 64 KiB of each array, so a chunk stays in L2
+
+// Sets how many threads a single large reduction may use (default 1), by
+// starting threads - 1 pool workers. Only the first call has an effect.
+// The multi-threaded and epoll TCP servers pass the number of online CPUs.
+void vector_ops_set_threads(int threads);
+
+// Reduces x (and y, for OP_DOT) of length n. Errors are reported the same way
+// as the scalar operations, e.g. the mean or minimum of an empty array.
+CalcResult vector_reduce(OperationType op, const double* x, const double* y, size_t n);
+
+// Adds v to the compensated sum *sum + *comp, by Neumaier's variant of Kahan
+// summation, which stays correct when v outweighs the running sum. Once the
+// sum is inf or NaN the compensation is left as it was, rather than turning
+// into inf - inf = NaN, so *sum + *comp is what a plain sum would give. For
+// callers that combine partial sums, such as streams.
+void vector_compensated_add(double* sum, double* comp, double v);
+
+// out[i] = x[i] op y[i] for OP_ADD, OP_SUBTRACT, OP_MULTIPLY or OP_DIVIDE,
+// with the same IEEE results as the scalar operations. Division by zero gives
+// an infinity or NaN; callers that report it as an error check y themselves.
+// out may be x or y. Returns 0, or -1 for any other op.
+int vector_elementwise(OperationType op, const double* x, const double* y, double* out, size_t n);
+
+#endif // VECTOR_OPS_H
@@ -0,0 +1,102 @@
+// rpc_server.c: every server model in one binary, chosen on the command line:
+//   ./rpc_server --model threads --proto tcp [--port N] [--hot-restart]
+//   ./rpc_server --model coroutines --proto both   (TCP and UDP on one port)
+// Each model is the server from its own directory (concurrent_tcp_threads/ for
+// threads over TCP, ...). Here they are all built with the same flags and share
+// the rpc_core codec and dispatch objects, so they can be compared
+// like-for-like. Without --port a model listens on its usual port, where
+// rpc_client and rpc_bench look for it.
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h> // For IPPROTO_TCP, IPPROTO_UDP
+
+#include "rpc_core/server_main.h"
+#include "rpc_core/hot_restart.h" // For HOT_RESTART_FLAG
+#include "rpc_core/client_stubs.h" // For RPC_PROTO_AUTO, both protocols on one port
+
+typedef struct {
+    const char* model;
+    int protocol;
+    const char* name; // Directory, also the model's server type in replies
+    int (*run)(int argc, char* argv[]);
+} ServerModel;
+
+static const ServerModel models[] = {
+    {"iterative", IPPROTO_TCP, "iterative_tcp", iterative_tcp_main},
+    {"threads", IPPROTO_TCP, "concurrent_tcp_threads", concurrent_tcp_threads_main},
+    {"processes", IPPROTO_TCP, "concurrent_tcp_processes", concurrent_tcp_processes_main},
+    {"epoll", IPPROTO_TCP, "concurrent_tcp_async", concurrent_tcp_async_main},
+    {"coroutines", IPPROTO_TCP, "concurrent_tcp_coroutines", concurrent_tcp_coroutines_main},
+    {"iterative", IPPROTO_UDP, "iterative_udp", iterative_udp_main},
+    {"threads", IPPROTO_UDP, "concurrent_udp_threads", concurrent_udp_threads_main},
+    {"processes", IPPROTO_UDP, "concurrent_udp_processes", concurrent_udp_processes_main},
+    {"epoll", IPPROTO_UDP, "concurrent_udp_async", concurrent_udp_async_main},
+    {"coroutines", RPC_PROTO_AUTO, "concurrent_dual_async", concurrent_dual_async_main},
+};
+static const int num_models = sizeof(models) / sizeof(models[0]);
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s --model MODEL [--proto tcp|udp|both] [--port N] [--hot-restart]\n", prog);
+    fprintf(stderr, "Models (--model also takes the directory name, then --proto is not needed):\n");
+    for (int i = 0; i < num_models; i++) {
+        const char* proto = models[i].protocol == IPPROTO_TCP ? "tcp" : models[i].protocol == IPPROTO_UDP ? "udp" : "both";
+        fprintf(stderr, "  %-11s %-4s  %s\n", models[i].model, proto, models[i].name);
+    }
+}
+
+// The value of "--flag value" or "--flag=value" at argv[*i], advancing *i past
+// it; NULL if argv[*i] is another option
+static const char* option_value(int argc, char* argv[], int* i, const char* flag) {
+    size_t len = strlen(flag);
+    if (strncmp(argv[*i], flag, len) != 0) return NULL;
+    if (argv[*i][len] == '=') return argv[*i] + len + 1;
+    if (argv[*i][len] == '\0' && *i + 1 < argc) return argv[++*i];
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    const char* model = NULL;
+    const char* proto = "tcp";
+
+    // --port and --hot-restart are left to the model, which reads them itself
+    for (int i = 1; i < argc; i++) {
+        const char* value;
+        if ((value = option_value(argc, argv, &i, "--model")) != NULL) {
+            model = value;
+        } else if ((value = option_value(argc, argv, &i, "--proto")) != NULL) {
+            proto = value;
+        } else if (strncmp(argv[i], RPC_PORT_FLAG, strlen(RPC_PORT_FLAG)) == 0) {
+            if (argv[i][strlen(RPC_PORT_FLAG)] == '\0') i++; // Skip the value too
+        } else if (strcmp(argv[i], HOT_RESTART_FLAG) != 0) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!model) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int protocol;
+    if (strcmp(proto, "tcp") == 0) {
+        protocol = IPPROTO_TCP;
+    } else if (strcmp(proto, "udp") == 0) {
+        protocol = IPPROTO_UDP;
+    } else if (strcmp(proto, "both") == 0) {
+        protocol = RPC_PROTO_AUTO;
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+    if (strcmp(model, "async") == 0) model = "epoll"; // The directories' name for it
+
+    for (int i = 0; i < num_models; i++) {
+        if ((strcmp(model, models[i].model) == 0 && protocol == models[i].protocol) ||
+            strcmp(model, models[i].name) == 0) {
+            return models[i].run(argc, argv);
+        }
+    }
+    fprintf(stderr, "No %s model over %s\n", model, proto);
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,238 @@
+// sched_bench.c: latency of short calls while batch work saturates a server,
+// with and without class-aware scheduling (rpc_core/priority_sched.h). Starts
+// the thread and process TCP models from ./rpc_server on a spare port, once
+// with RPC_SCHED_SLOTS=0 and once with the default slots. --batch connections
+// each send large SUM requests back to back; meanwhile one connection sends
+// --calls ADD requests, one at a time, and times them. Reports the ADD latency
+// percentiles in microseconds and the SUM requests answered per second.
+#define _GNU_SOURCE // For strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rpc_core/rpc_protocol.h"
+#include "rpc_core/admission.h" // For the limits turned off in the servers
+#include "rpc_core/priority_sched.h"
+
+#define BENCH_DEFAULT_BATCH 8
+#define BENCH_DEFAULT_CALLS 500
+#define BENCH_BATCH_VALUES 60000 // Values per SUM request
+#define BENCH_PORT 9150          // First port; each run takes the next one
+#define BENCH_WARMUP_MS 300      // Batch load runs this long before the calls start
+#define BENCH_CALL_GAP_MS 2      // Between two calls
+#define BENCH_TIMEOUT_S 10       // For a connect() or a reply
+#define BENCH_SERVER_EXE "./rpc_server"
+
+static const char* models[] = {
+    "concurrent_tcp_threads",
+    "concurrent_tcp_processes",
+};
+static const int num_models = sizeof(models) / sizeof(models[0]);
+
+typedef struct {
+    int port;
+    const char* request;
+    volatile int* stop;
+    unsigned long answered;
+} BatchLoad;
+
+static void sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int connect_to(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    struct timeval tv = { BENCH_TIMEOUT_S, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Sends request whole and reads one reply. Returns 0 if it carries no error.
+static int call(int sock, const char* request, size_t len) {
+    for (size_t sent = 0; sent < len;) {
+        ssize_t n = send(sock, request + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        sent += (size_t)n;
+    }
+    char reply[RPC_BUFFER_SIZE];
+    ssize_t n = recv(sock, reply, sizeof(reply) - 1, 0);
+    if (n <= 0) return -1;
+    reply[n] = '\0';
+    RpcResponse resp;
+    return unmarshal_response(reply, &resp) == 0 && resp.error[0] == '\0' ? 0 : -1;
+}
+
+static void* batch_load(void* arg) {
+    BatchLoad* b = (BatchLoad*)arg;
+    int sock = connect_to(b->port);
+    if (sock < 0) return NULL;
+    size_t len = strlen(b->request);
+    while (!*b->stop && call(sock, b->request, len) == 0) b->answered++;
+    close(sock);
+    return NULL;
+}
+
+static int start_server(const char* model, int port, int scheduled) {
+    fflush(stdout); // Or the child writes out what is buffered too
+    int pid = fork();
+    if (pid != 0) return pid;
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    // Every connection is let in; only the scheduler decides who computes
+    setenv(RPC_MAX_INFLIGHT_ENV, "0", 1);
+    setenv(RPC_MAX_QUEUE_ENV, "0", 1);
+    setenv(RPC_CODEL_TARGET_ENV, "0", 1);
+    if (!scheduled) setenv(RPC_SCHED_SLOTS_ENV, "0", 1);
+    setpgid(0, 0); // So the children of the processes model can be stopped together
+    if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr)) _exit(1);
+    execl(BENCH_SERVER_EXE, BENCH_SERVER_EXE, "--model", model, "--port", port_arg, (char*)NULL);
+    _exit(127);
+}
+
+static void stop_server(int pid) {
+    kill(-pid, SIGKILL);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+static int compare_ll(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_model(const char* model, int scheduled, int port, int batch, int calls, const char* request) {
+    int pid = start_server(model, port, scheduled);
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    int sock = -1;
+    for (int tries = 0; tries < 100 && (sock = connect_to(port)) < 0; tries++) sleep_ms(50);
+    if (sock < 0) {
+        fprintf(stderr, "%s did not start on port %d\n", model, port);
+        stop_server(pid);
+        return;
+    }
+
+    volatile int stop = 0;
+    BatchLoad* loads = calloc(batch, sizeof(BatchLoad));
+    pthread_t* threads = malloc(batch * sizeof(pthread_t));
+    for (int i = 0; i < batch; i++) {
+        loads[i].port = port;
+        loads[i].request = request;
+        loads[i].stop = &stop;
+        pthread_create(&threads[i], NULL, batch_load, &loads[i]);
+    }
+    sleep_ms(BENCH_WARMUP_MS);
+
+    char add[RPC_BUFFER_SIZE];
+    RpcRequest req = {0};
+    req.operation = OP_ADD;
+    req.op1 = 3;
+    req.op2 = 4;
+    marshal_request(&req, add, sizeof(add));
+    long long* latency = malloc(calls * sizeof(long long));
+    int done = 0, failed = 0;
+    long long start = now_us();
+    for (int i = 0; i < calls; i++) {
+        long long t = now_us();
+        if (call(sock, add, strlen(add)) != 0) {
+            failed++;
+            continue;
+        }
+        latency[done++] = now_us() - t;
+        sleep_ms(BENCH_CALL_GAP_MS);
+    }
+    double elapsed = (now_us() - start) / 1e6;
+    unsigned long answered = 0;
+    for (int i = 0; i < batch; i++) answered += loads[i].answered;
+    stop = 1;
+    close(sock);
+    stop_server(pid); // Also ends the SUM calls still waiting for a reply
+    for (int i = 0; i < batch; i++) pthread_join(threads[i], NULL);
+
+    qsort(latency, done, sizeof(long long), compare_ll);
+    printf("%-26s %-5s %8lld %8lld %8lld %9.1f", model, scheduled ? "on" : "off", done ? latency[done / 2] : 0,
+           done ? latency[done * 99 / 100] : 0, done ? latency[done - 1] : 0, answered / elapsed);
+    if (failed) printf("  (%d of %d calls failed)", failed, calls);
+    printf("\n");
+    fflush(stdout);
+    free(latency);
+    free(threads);
+    free(loads);
+}
+
+int main(int argc, char* argv[]) {
+    int batch = BENCH_DEFAULT_BATCH, calls = BENCH_DEFAULT_CALLS;
+    const char* only = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--calls") == 0 && i + 1 < argc) {
+            calls = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--model") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--batch N] [--calls N] [--model NAME]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (batch < 1) batch = BENCH_DEFAULT_BATCH;
+    if (calls < 1) calls = BENCH_DEFAULT_CALLS;
+    if (access(BENCH_SERVER_EXE, X_OK) != 0) {
+        fprintf(stderr, "%s not found; run sched_bench from the repository root after make\n", BENCH_SERVER_EXE);
+        return 1;
+    }
+
+    double* values = malloc(BENCH_BATCH_VALUES * sizeof(double));
+    for (int i = 0; i < BENCH_BATCH_VALUES; i++) values[i] = i % 100;
+    RpcRequest req = {0};
+    req.operation = OP_SUM;
+    req.vec = values;
+    req.vec_len = BENCH_BATCH_VALUES;
+    size_t size = rpc_request_size(OP_SUM, BENCH_BATCH_VALUES);
+    char* request = malloc(size);
+    if (!request || marshal_request(&req, request, size) != 0) {
+        fprintf(stderr, "Failed to marshal the request\n");
+        return 1;
+    }
+
+    printf("%d connections of %d-value SUM requests; %d ADD calls; microseconds\n", batch, BENCH_BATCH_VALUES, calls);
+    printf("%-26s %-5s %8s %8s %8s %9s\n", "model", "sched", "add_p50", "add_p99", "add_max", "sum_per_s");
+    int port = BENCH_PORT;
+    for (int m = 0; m < num_models; m++) {
+        if (only && !strcasestr(models[m], only)) continue;
+        bench_model(models[m], 0, port++, batch, calls, request);
+        bench_model(models[m], 1, port++, batch, calls, request);
+    }
+    free(request);
+    free(values);
+    return 0;
+}
@@ -0,0 +1,155 @@
+// vector_check.c: results of the array reductions (rpc_core/vector_ops.h).
+// Needs no servers. Each reduction runs on short arrays, which take the
+// scalar tail, on longer ones, which take the four-lane kernel, and on arrays
+// past VEC_PARALLEL_MIN, which are split across the task pool. It also runs a
+// chunk at a time with the chunk results added up as a stream adds them
+// (vector_compensated_add). Checks that
+//   exact      sums of small integers come out exact and cancellation is compensated
+//   inf        an infinity anywhere makes SUM, AVG and DOT that infinity
+//   inf-inf    infinities of both signs make them NaN
+//   nan        a NaN anywhere makes every reduction NaN
+//   overflow   a sum past the largest double is inf
+// Prints one line per check; exits with 1 if any failed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "rpc_core/vector_ops.h"
+
+#define CHECK_THREADS 2 // So the long arrays take the parallel path even on one CPU
+#define CHECK_STREAM_CHUNK 1000 // Values per chunk when reducing the way a stream does
+
+static const size_t lengths[] = { 3, 1000, VEC_PARALLEL_MIN * 3 + 5 };
+static const int num_lengths = sizeof(lengths) / sizeof(lengths[0]);
+
+static int failures;
+
+// A result that does not match is reported with its inputs; returns 1 if it matched
+static int expect_value(const char* check, const char* what, size_t n, const CalcResult* res, double want,
+                        const char* inputs) {
+    int ok = res->error[0] == '\0' && (isnan(want) ? isnan(res->value) : res->value == want);
+    if (!ok) {
+        printf("%-10s FAILED: %s of %zu values, %s: got %g%s%s, want %g\n", check, what, n, inputs, res->value,
+               res->error[0] ? ", " : "", res->error, want);
+        failures++;
+    }
+    return ok;
+}
+
+static int expect(const char* check, OperationType op, const double* x, const double* y, size_t n, double want,
+                  const char* inputs) {
+    CalcResult res = vector_reduce(op, x, y, n);
+    return expect_value(check, operation_to_string(op), n, &res, want, inputs);
+}
+
+// op reduced a chunk at a time, the chunk results added up the way a stream
+// (rpc_stream.h) adds them up
+static CalcResult reduce_in_chunks(OperationType op, const double* x, const double* y, size_t n) {
+    CalcResult res = { 0, "" };
+    double sum = 0, comp = 0;
+    for (size_t begin = 0; begin < n; begin += CHECK_STREAM_CHUNK) {
+        size_t len = n - begin < CHECK_STREAM_CHUNK ? n - begin : CHECK_STREAM_CHUNK;
+        CalcResult chunk = vector_reduce(op == OP_MEAN ? OP_SUM : op, x + begin, y + begin, len);
+        if (chunk.error[0] != '\0') return chunk;
+        vector_compensated_add(&sum, &comp, chunk.value);
+    }
+    res.value = op == OP_MEAN ? (sum + comp) / (double)n : sum + comp;
+    return res;
+}
+
+static int expect_in_chunks(const char* check, OperationType op, const double* x, const double* y, size_t n,
+                            double want, const char* inputs) {
+    char what[32];
+    snprintf(what, sizeof(what), "%s in chunks", operation_to_string(op));
+    CalcResult res = reduce_in_chunks(op, x, y, n);
+    return expect_value(check, what, n, &res, want, inputs);
+}
+
+static void report(const char* check, int ok) {
+    if (ok) printf("%-10s ok\n", check);
+}
+
+// x is all ones but for special at positions, y all ones
+static void fill(double* x, double* y, size_t n, const size_t* positions, const double* special, int count) {
+    for (size_t i = 0; i < n; i++) x[i] = y[i] = 1;
+    for (int k = 0; k < count; k++) x[positions[k] % n] = special[k];
+}
+
+static void check_exact(double* x, double* y) {
+    int ok = 1;
+    for (int l = 0; l < num_lengths; l++) {
+        size_t n = lengths[l];
+        for (size_t i = 0; i < n; i++) {
+            x[i] = (double)(i % 100);
+            y[i] = 2;
+        }
+        double sum = 0;
+        for (size_t i = 0; i < n; i++) sum += x[i]; // Exact: every partial sum is a small integer
+        ok &= expect("exact", OP_SUM, x, y, n, sum, "0..99 repeated");
+        ok &= expect("exact", OP_DOT, x, y, n, 2 * sum, "0..99 repeated times 2");
+        ok &= expect("exact", OP_MAX, x, y, n, n < 100 ? (double)(n - 1) : 99, "0..99 repeated");
+
+        // A large value and its negation around many small ones; a plain sum loses the small ones
+        size_t positions[] = { 0, n - 1 };
+        double special[] = { 1e17, -1e17 };
+        fill(x, y, n, positions, special, 2);
+        ok &= expect("exact", OP_SUM, x, y, n, (double)(n - 2), "1e17, ones, -1e17");
+    }
+    report("exact", ok);
+}
+
+static void check_special(const char* check, const double* special, int count, double want, int minmax,
+                          double* x, double* y) {
+    int ok = 1;
+    char inputs[64];
+    for (int l = 0; l < num_lengths; l++) {
+        size_t n = lengths[l];
+        // At the start, in the middle of a four-lane step, and in the tail
+        size_t starts[] = { 0, n / 2 + 1, n - 1 };
+        for (int s = 0; s < 3; s++) {
+            size_t positions[2] = { starts[s], starts[s] + n / 3 + 1 };
+            fill(x, y, n, positions, special, count);
+            snprintf(inputs, sizeof(inputs), "%g at %zu%s", special[0], positions[0] % n, count > 1 ? " and more" : "");
+            ok &= expect(check, OP_SUM, x, y, n, want, inputs);
+            ok &= expect(check, OP_MEAN, x, y, n, isnan(want) || isinf(want) ? want : want / n, inputs);
+            ok &= expect(check, OP_DOT, x, y, n, want, inputs);
+            ok &= expect_in_chunks(check, OP_SUM, x, y, n, want, inputs);
+            ok &= expect_in_chunks(check, OP_MEAN, x, y, n, isnan(want) || isinf(want) ? want : want / n, inputs);
+            ok &= expect_in_chunks(check, OP_DOT, x, y, n, want, inputs);
+            if (minmax) {
+                ok &= expect(check, OP_MIN, x, y, n, want, inputs);
+                ok &= expect(check, OP_MAX, x, y, n, want, inputs);
+            }
+        }
+    }
+    report(check, ok);
+}
+
+int main(void) {
+    size_t most = lengths[num_lengths - 1];
+    double* x = malloc(most * sizeof(double));
+    double* y = malloc(most * sizeof(double));
+    if (!x || !y) {
+        fprintf(stderr, "Out of memory for %zu values\n", most);
+        return 1;
+    }
+    vector_ops_set_threads(CHECK_THREADS);
+
+    check_exact(x, y);
+    const double inf[] = { INFINITY };
+    const double minus_inf[] = { -INFINITY };
+    const double both[] = { INFINITY, -INFINITY };
+    const double nan[] = { NAN };
+    const double huge[] = { DBL_MAX, DBL_MAX };
+    check_special("inf", inf, 1, INFINITY, 0, x, y);
+    check_special("-inf", minus_inf, 1, -INFINITY, 0, x, y);
+    check_special("inf-inf", both, 2, NAN, 0, x, y);
+    check_special("nan", nan, 1, NAN, 1, x, y);
+    check_special("overflow", huge, 2, INFINITY, 0, x, y);
+
+    free(x);
+    free(y);
+    return failures ? 1 : 0;
+}